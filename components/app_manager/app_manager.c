@@ -14,20 +14,80 @@
 #include "app_manager.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <nvs_flash.h>
 #include <string.h>
 
+#include "device_clock.h"
 #include "gate.h"
+#include "local_ctrl.h"
+#include "metrics.h"
 #include "motor.h"
 #include "mqtt5_secrets.h"
+#include "power_manager.h"
 #include "wifi_secrets.h"
 
+// The local control endpoint is optional, it only starts with a key
+#if __has_include("local_ctrl_secrets.h")
+#include "local_ctrl_secrets.h"
+#endif
+#ifndef LOCAL_CTRL_PORT
+#define LOCAL_CTRL_PORT LOCAL_CTRL_DEFAULT_PORT
+#endif
+
+// mqtts checks the broker against the certificate bundle, unless
+// mqtt5_secrets.h pins a CA (MQTT5_TLS_CA_PEM) or sets a pre-shared key
+// (MQTT5_TLS_PSK, an array, and MQTT5_TLS_PSK_IDENTITY)
+#ifdef MQTT5_TLS_PSK
+static const uint8_t s_mqtt5_psk[] = MQTT5_TLS_PSK;
+#endif
+
+// A site-local broker may be set in the secrets (MQTT5_LOCAL_URL, and
+// optionally MQTT5_LOCAL_PORT, MQTT5_LOCAL_TLS, MQTT5_LOCAL_USERNAME,
+// MQTT5_LOCAL_PASSWORD). It is preferred, MQTT5_URL is the fallback.
+#ifdef MQTT5_LOCAL_URL
+#ifndef MQTT5_LOCAL_PORT
+#define MQTT5_LOCAL_PORT 1883
+#endif
+#ifndef MQTT5_LOCAL_TLS
+#define MQTT5_LOCAL_TLS false
+#endif
+#ifndef MQTT5_LOCAL_USERNAME
+#define MQTT5_LOCAL_USERNAME NULL
+#endif
+#ifndef MQTT5_LOCAL_PASSWORD
+#define MQTT5_LOCAL_PASSWORD NULL
+#endif
+#endif
+
+// SNTP server of the device clock, may be set in the secrets to a LAN server
+#ifndef NTP_SERVER
+#define NTP_SERVER DEVICE_CLOCK_DEFAULT_SERVER
+#endif
+
 #define WIFI_CONNECTED_BIT BIT0
 #define MQTT_CONNECTED_BIT BIT1
 
 #define TOPIC_TO_FIRST_MESSAGE "first_message"
 
+// Full clock while busy, the XTAL clock and light sleep while idle
+#define POWER_MAX_FREQ_MHZ 240
+#define POWER_MIN_FREQ_MHZ 40
+
+// Battery installs sleep deeply between events, mains ones stay connected
+#ifndef DEEP_SLEEP_MODE
+#define DEEP_SLEEP_MODE 0
+#endif
+// Timer wake to check in with the broker
+#define DEEP_SLEEP_CHECK_IN_S (15 * 60)
+// Idle time awake before going back to sleep, for commands to come in
+#define DEEP_SLEEP_IDLE_S 20
+// Longest wait for the broker on a check-in
+#define DEEP_SLEEP_CONNECT_TIMEOUT_S 30
+
 #define FREERTOS_ERR_CHECK(x)                                       \
   do                                                                \
   {                                                                 \
@@ -50,6 +110,64 @@ static TaskHandle_t gate_task_handle = NULL;
 static EventGroupHandle_t wifi_connected_bit = NULL;
 static EventGroupHandle_t mqtt5_connected_bit = NULL;
 
+// TODO: Implement the motor in another way or array of motors
+static motor_t s_motor;
+static gate_t s_gate;
+static bool s_gate_started = false;
+
+static int64_t app_manager_read_heap(void *arg)
+{
+  return arg ? esp_get_minimum_free_heap_size() : esp_get_free_heap_size();
+}
+
+static int64_t app_manager_read_rssi(void *arg)
+{
+  wifi_ap_record_t ap;
+  return esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+}
+
+static int64_t app_manager_read_wifi(void *arg)
+{
+  wifi_api_metrics_t metrics;
+  wifi_api_get_metrics(&metrics);
+  return arg ? metrics.disconnect_count : metrics.connect_count;
+}
+
+static metrics_metric_t s_device_metrics[] = {
+  {
+    .name = "heap_free_bytes",
+    .help = "Free heap.",
+    .type = METRICS_GAUGE,
+    .read = app_manager_read_heap,
+  },
+  {
+    .name = "heap_min_free_bytes",
+    .help = "Lowest free heap since boot.",
+    .type = METRICS_GAUGE,
+    .read = app_manager_read_heap,
+    .read_arg = (void *)1,
+  },
+  {
+    .name = "wifi_rssi_dbm",
+    .help = "Signal strength of the AP, 0 when not associated.",
+    .type = METRICS_GAUGE,
+    .read = app_manager_read_rssi,
+  },
+  {
+    .name = "wifi_connects_total",
+    .help = "Connections of the station.",
+    .type = METRICS_COUNTER,
+    .read = app_manager_read_wifi,
+  },
+  {
+    .name = "wifi_disconnects_total",
+    .help = "Links of the station lost.",
+    .type = METRICS_COUNTER,
+    .read = app_manager_read_wifi,
+    .read_arg = (void *)1,
+  },
+};
+
 //* For interrupt debugging
 static void app_manager_task(void *pvParameters)
 {
@@ -59,6 +177,14 @@ static void app_manager_task(void *pvParameters)
   {
     vTaskDelay(2000 / portTICK_PERIOD_MS);
     ESP_LOGI(TAG, "Motor Interrupt Count: %d", motor_interrupt_count);
+    ESP_LOGD(TAG,
+             "Stack free (bytes): wifi %u, mqtt5 %u, gate %u, gate_work %lu, "
+             "motor %lu",
+             uxTaskGetStackHighWaterMark(wifi_task_handle),
+             uxTaskGetStackHighWaterMark(mqtt5_task_handle),
+             uxTaskGetStackHighWaterMark(gate_task_handle),
+             (unsigned long)gate_work_stack_free(),
+             (unsigned long)motor_task_stack_free());
   }
 }
 
@@ -75,10 +201,34 @@ static void wifi_task(void *pvParameters)
 {
   ESP_LOGI(TAG, "Starting Wi-Fi Task...");
 
-  if (wifi_api_configure(WIFI_SSID, WIFI_PASSWORD) == ESP_OK)
+  esp_err_t ret = wifi_api_configure(WIFI_SSID, WIFI_PASSWORD);
+  // The Wi-Fi supervisor keeps retrying in background, so just wait for it
+  while (ret == ESP_ERR_TIMEOUT)
   {
-    ESP_LOGI(TAG, "Wi-Fi configured.");
+    ESP_LOGW(TAG, "Wi-Fi not connected yet, waiting...");
+    ret = wifi_api_wait_connected(portMAX_DELAY);
+  }
+
+  if (ret == ESP_OK)
+  {
+    wifi_api_metrics_t metrics;
+    wifi_api_get_metrics(&metrics);
+    ESP_LOGI(TAG, "Wi-Fi configured in %lu ms (%s).",
+             (unsigned long)metrics.last_connect_ms,
+             metrics.last_fast_path ? "cached link" : "full scan");
     xEventGroupSetBits(wifi_connected_bit, WIFI_CONNECTED_BIT);
+
+    size_t count = sizeof(s_device_metrics) / sizeof(s_device_metrics[0]);
+    for (size_t i = 0; i < count; i++)
+      metrics_register(&s_device_metrics[i]);
+    if (metrics_http_start(METRICS_HTTP_DEFAULT_PORT) != ESP_OK)
+      ESP_LOGW(TAG, "Metrics endpoint not started.");
+
+    device_clock_config_t clock_config = {
+      .server = NTP_SERVER,
+    };
+    if (device_clock_start(&clock_config) != ESP_OK)
+      ESP_LOGW(TAG, "Device clock not started.");
   }
 
   while (1)
@@ -107,7 +257,39 @@ static void mqtt5_task(void *pvParameters)
   if (bits & WIFI_CONNECTED_BIT)
   {
     ESP_LOGI(TAG, "Wi-Fi connected, starting MQTT5...");
-    mqtt5_api_start(MQTT5_URL, MQTT5_USERNAME, MQTT5_PASSWORD, MQTT5_PORT);
+    mqtt5_api_tls_t tls = {0};
+#ifdef MQTT5_TLS_CA_PEM
+    tls.ca_pem = MQTT5_TLS_CA_PEM;
+#endif
+#ifdef MQTT5_TLS_PSK
+    tls.psk = s_mqtt5_psk;
+    tls.psk_len = sizeof(s_mqtt5_psk);
+    tls.psk_identity = MQTT5_TLS_PSK_IDENTITY;
+#endif
+    mqtt5_api_set_tls(&tls);
+    // The link probes go under the topic of the gate, one topic per device
+    mqtt5_api_set_base_topic(BASE_MQTT_TOPIC);
+
+    static const mqtt5_api_broker_t brokers[] = {
+#ifdef MQTT5_LOCAL_URL
+      {
+        .host = MQTT5_LOCAL_URL,
+        .port = MQTT5_LOCAL_PORT,
+        .tls = MQTT5_LOCAL_TLS,
+        .username = MQTT5_LOCAL_USERNAME,
+        .password = MQTT5_LOCAL_PASSWORD,
+      },
+#endif
+      {
+        .host = MQTT5_URL,
+        .port = MQTT5_PORT,
+        .tls = MQTT5_PORT != 1883,
+        .username = MQTT5_USERNAME,
+        .password = MQTT5_PASSWORD,
+      },
+    };
+    ESP_ERROR_CHECK(mqtt5_api_start_brokers(
+      brokers, sizeof(brokers) / sizeof(brokers[0])));
 
     const char *msg = "MQTT5 connected!";
 
@@ -129,22 +311,50 @@ static void mqtt5_task(void *pvParameters)
   }
 }
 
+/**
+ * @brief Start the gate and the motor.
+ *
+ * Needs no network: the subscriptions of the gate are sent once the broker is
+ * connected.
+ */
+static void app_manager_start_gate(void)
+{
+  esp_err_t ret = gate_init_impl(&s_gate, &s_motor);
+  if (ret != ESP_OK)
+    ESP_LOGE(TAG, "Gate not initialized: %s", esp_err_to_name(ret));
+  s_gate_started = true;
+}
+
 static void gate_task(void *pvParameters)
 {
   ESP_LOGI(TAG, "Starting gate task...");
 
-  // Wait for Wi-Fi to connect
+  // Wait for the broker, without taking the bit from the sleep task
   EventBits_t bits = xEventGroupWaitBits(
-    mqtt5_connected_bit, MQTT_CONNECTED_BIT, pdTRUE, pdFALSE, portMAX_DELAY);
+    mqtt5_connected_bit, MQTT_CONNECTED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
 
   if (bits & MQTT_CONNECTED_BIT)
   {
-    ESP_LOGI(TAG, "MQTT5 connected, starting gate and motor...");
-
-    motor_t motor;
-    gate_t gate;
-    // TODO: Implement the motor in another way or array of motors
-    gate_init_impl(&gate, &motor);
+    // Already started before the network on a deep sleep install
+    if (!s_gate_started)
+    {
+      ESP_LOGI(TAG, "MQTT5 connected, starting gate and motor...");
+      app_manager_start_gate();
+      motor_enable_wakeup();
+    }
+
+#ifdef LOCAL_CTRL_KEY
+    // After the gate, so its subscriptions are there for the requests
+    static const uint8_t key[] = LOCAL_CTRL_KEY;
+    local_ctrl_config_t config = {
+      .port = LOCAL_CTRL_PORT,
+      .key = key,
+      .key_len = sizeof(key) - 1,
+    };
+    esp_err_t ret = local_ctrl_start(&config);
+    if (ret != ESP_OK)
+      ESP_LOGE(TAG, "Local control not started: %s", esp_err_to_name(ret));
+#endif
   }
 
   while (1)
@@ -153,6 +363,66 @@ static void gate_task(void *pvParameters)
   }
 }
 
+/**
+ * @brief Put the controller in deep sleep once the gate is idle.
+ *
+ * Each wake checks in with the broker, then stays up while commands come in
+ * and goes back to sleep after `DEEP_SLEEP_IDLE_S` with the gate idle. The
+ * sleep ends on the control button, the check-in timer, or the next WEEKLY
+ * schedule.
+ *
+ * @param pvParameters Parameters passed to the task (not used).
+ */
+static void sleep_task(void *pvParameters)
+{
+  ESP_LOGI(TAG, "Starting sleep task...");
+
+  // Check in, or give up on an unreachable broker and sleep anyway
+  TickType_t timeout = pdMS_TO_TICKS(DEEP_SLEEP_CONNECT_TIMEOUT_S * 1000);
+  xEventGroupWaitBits(mqtt5_connected_bit, MQTT_CONNECTED_BIT, pdFALSE,
+                      pdFALSE, timeout);
+
+  uint32_t idle_s = 0;
+  uint32_t acquisitions = 0;
+  while (1)
+  {
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+
+    // Any command or motion since the last check restarts the idle time
+    power_manager_stats_t stats;
+    power_manager_get_stats(&stats);
+    if (power_manager_is_busy() || stats.acquisitions != acquisitions)
+    {
+      acquisitions = stats.acquisitions;
+      idle_s = 0;
+      continue;
+    }
+    if (++idle_s < DEEP_SLEEP_IDLE_S)
+      continue;
+
+    uint32_t wake_in_s;
+    if (gate_prepare_sleep(&wake_in_s) != ESP_OK)
+    {
+      idle_s = 0;
+      continue;
+    }
+
+    esp_err_t ret = motor_enable_deep_wakeup();
+    if (ret != ESP_OK)
+      ESP_LOGW(TAG, "Button wake not armed: %s", esp_err_to_name(ret));
+
+    mqtt5_api_stop();
+    esp_wifi_stop();
+    ret = power_manager_deep_sleep(wake_in_s < DEEP_SLEEP_CHECK_IN_S
+                                     ? wake_in_s
+                                     : DEEP_SLEEP_CHECK_IN_S);
+
+    // Busy again between the check and the sleep, with the network down
+    ESP_LOGW(TAG, "Deep sleep aborted: %s", esp_err_to_name(ret));
+    esp_restart();
+  }
+}
+
 void application_manager_init()
 {
   wifi_connected_bit = xEventGroupCreate();
@@ -162,6 +432,29 @@ void application_manager_init()
   xEventGroupClearBits(mqtt5_connected_bit, MQTT_CONNECTED_BIT);
 
   ESP_LOGI(TAG, "Initializing Application Manager...");
+
+  // Before the gate, so its busy lock exists when the first command comes
+  power_manager_config_t power = {
+    .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+    .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+    .light_sleep = true,
+  };
+  esp_err_t ret = power_manager_init(&power);
+  if (ret != ESP_OK)
+    ESP_LOGW(TAG, "Power management off: %s", esp_err_to_name(ret));
+
+  // Before the network: after a button wake, the gate resumes from RTC memory
+  // and the press is handled before Wi-Fi starts
+  power_manager_wake_t wake = power_manager_get_wake();
+  if (DEEP_SLEEP_MODE || wake == POWER_WAKE_BUTTON)
+  {
+    ESP_ERROR_CHECK(nvs_flash_init());
+    app_manager_start_gate();
+    if (wake == POWER_WAKE_BUTTON)
+      motor_replay_button();
+    motor_enable_wakeup();
+  }
+
   FREERTOS_ERR_CHECK(xTaskCreate(&wifi_task, "WiFi Task", 4096, NULL,
                                  tskIDLE_PRIORITY + 1, &wifi_task_handle));
 
@@ -171,6 +464,10 @@ void application_manager_init()
   FREERTOS_ERR_CHECK(xTaskCreate(&gate_task, "Gate Task", 4096, NULL,
                                  tskIDLE_PRIORITY + 1, &gate_task_handle));
 
+  if (DEEP_SLEEP_MODE)
+    FREERTOS_ERR_CHECK(xTaskCreate(&sleep_task, "Sleep Task", 4096, NULL,
+                                   tskIDLE_PRIORITY + 1, NULL));
+
   FREERTOS_ERR_CHECK(xTaskCreate(&app_manager_task, "App Manager Task", 4096,
                                  NULL, tskIDLE_PRIORITY + 1, NULL));
 
@@ -0,0 +1,378 @@
+/**
+ * @file device_clock.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Wall clock of the device, synchronized with SNTP
+ *
+ * A minimal SNTP client (RFC 4330) on plain BSD sockets: lwIP on the chip, the
+ * host sockets on the Linux target, so it can be tried against a local server
+ * (`tools/ntp_standin.py`).
+ *
+ * @version 0.1
+ * @date 2024-12-12
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "device_clock.h"
+
+#include <errno.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "gpio_drivers.h"
+#include "metrics.h"
+
+#define DEVICE_CLOCK_SERVER_LEN 64
+
+// Time to the next sync after a failed one
+#define DEVICE_CLOCK_RETRY_S 30
+// Requests sent per sync, each waits this long for its reply
+#define DEVICE_CLOCK_ATTEMPTS 3
+#define DEVICE_CLOCK_TIMEOUT_MS 2000
+
+// Shortest time between two syncs to measure the drift over
+#define DEVICE_CLOCK_DRIFT_MIN_S 600
+
+// 2024-01-01, an earlier system time was not set yet
+#define DEVICE_CLOCK_VALID_S 1704067200
+
+// Seconds from the NTP epoch (1900) to the Unix epoch (1970)
+#define NTP_UNIX_OFFSET_S 2208988800LL
+#define NTP_PACKET_LEN 48
+#define NTP_VERSION 4
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_LEAP_UNSYNCHRONIZED 3
+
+static const char *TAG = "CLOCK";
+
+static char s_server[DEVICE_CLOCK_SERVER_LEN];
+static uint16_t s_port = 0;
+static uint32_t s_interval_s = 0;
+static bool s_started = false;
+
+// Wall clock = mono + offset + (mono - sync mono) * drift
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_synced = false;
+static bool s_measured = false;  ///< The offset comes from SNTP, not the RTC.
+static bool s_drift_known = false;
+static int64_t s_offset_us = 0;     ///< Wall minus mono, at the last sync.
+static int64_t s_sync_mono_us = 0;  ///< Mono time of the last sync.
+static int32_t s_drift_ppb = 0;
+static device_clock_stats_t s_stats = {0};
+
+static metrics_metric_t s_syncs = {
+  .name = "clock_syncs_total",
+  .help = "SNTP exchanges that set the clock.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_failures = {
+  .name = "clock_sync_failures_total",
+  .help = "SNTP exchanges that failed.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_offset = {
+  .name = "clock_offset_us",
+  .help = "Correction of the last sync, the error of the clock before it.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_drift = {
+  .name = "clock_drift_ppb",
+  .help = "Rate of the server clock against the local one, corrected.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_rtt = {
+  .name = "clock_rtt_us",
+  .help = "Round trip of the last sync, twice its uncertainty.",
+  .type = METRICS_GAUGE,
+};
+
+static inline uint32_t device_clock_get_u32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void device_clock_put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// NTP timestamp, seconds and a 32 bits fraction, to us since the Unix epoch
+static int64_t device_clock_get_ntp(const uint8_t *p)
+{
+  int64_t seconds = (int64_t)device_clock_get_u32(p) - NTP_UNIX_OFFSET_S;
+  uint64_t fraction = device_clock_get_u32(p + 4);
+  return seconds * 1000000 + (int64_t)((fraction * 1000000) >> 32);
+}
+
+/**
+ * @brief Send a request and wait for its reply.
+ *
+ * @param offset_us Wall minus mono time measured.
+ * @param rtt_us Round trip, without the time spent in the server.
+ * @return true on a valid reply.
+ */
+static bool device_clock_exchange(int sock, const struct addrinfo *server,
+                                  int64_t *offset_us, uint32_t *rtt_us)
+{
+  uint8_t packet[NTP_PACKET_LEN] = {0};
+  packet[0] = (NTP_VERSION << 3) | NTP_MODE_CLIENT;
+
+  // The transmit timestamp only identifies the request, the server echoes it
+  int64_t t1 = device_clock_mono_us();
+  uint8_t origin[8];
+  device_clock_put_u32(origin, (uint64_t)t1 >> 32);
+  device_clock_put_u32(origin + 4, (uint32_t)t1);
+  memcpy(packet + 40, origin, sizeof(origin));
+
+  if (sendto(sock, packet, sizeof(packet), 0, server->ai_addr,
+             server->ai_addrlen) != sizeof(packet))
+  {
+    ESP_LOGW(TAG, "Failed to send: errno %d", errno);
+    return false;
+  }
+
+  // Late replies to an earlier request are skipped
+  int len;
+  do
+    len = recv(sock, packet, sizeof(packet), 0);
+  while (len == sizeof(packet) && memcmp(packet + 24, origin, 8) != 0);
+  int64_t t4 = device_clock_mono_us();
+  if (len != sizeof(packet))
+    return false;
+
+  // Stratum 0 is a kiss-o'-death, e.g. a rate limit
+  if ((packet[0] & 0x07) != NTP_MODE_SERVER || packet[1] == 0 ||
+      (packet[0] >> 6) == NTP_LEAP_UNSYNCHRONIZED)
+  {
+    ESP_LOGW(TAG, "Reply rejected: mode %d, stratum %d", packet[0] & 0x07,
+             packet[1]);
+    return false;
+  }
+
+  int64_t t2 = device_clock_get_ntp(packet + 32);
+  int64_t t3 = device_clock_get_ntp(packet + 40);
+  *offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+  int64_t rtt = (t4 - t1) - (t3 - t2);
+  *rtt_us = rtt > 0 ? (uint32_t)rtt : 0;
+  return true;
+}
+
+// Move the clock to a measured offset, and learn the drift
+static void device_clock_apply(int64_t offset_us, uint32_t rtt_us)
+{
+  int64_t mono_us = device_clock_mono_us();
+
+  taskENTER_CRITICAL(&s_lock);
+  int64_t elapsed_us = mono_us - s_sync_mono_us;
+  int64_t correction_us = 0;
+  if (s_synced)
+    correction_us =
+      offset_us - (s_offset_us + elapsed_us * s_drift_ppb / 1000000000);
+
+  // A step of a second or more is the server, not the local oscillator
+  int64_t step_us = offset_us - s_offset_us;
+  if (s_measured && elapsed_us >= DEVICE_CLOCK_DRIFT_MIN_S * 1000000LL &&
+      step_us > -1000000 && step_us < 1000000)
+  {
+    int32_t drift = step_us * 1000000000 / elapsed_us;
+    s_drift_ppb = s_drift_known ? (s_drift_ppb + drift) / 2 : drift;
+    s_drift_known = true;
+  }
+
+  s_offset_us = offset_us;
+  s_sync_mono_us = mono_us;
+  s_synced = true;
+  s_measured = true;
+
+  s_stats.syncs++;
+  s_stats.offset_us = correction_us > INT32_MAX   ? INT32_MAX
+                      : correction_us < INT32_MIN ? INT32_MIN
+                                                  : correction_us;
+  s_stats.drift_ppb = s_drift_ppb;
+  s_stats.rtt_us = rtt_us;
+  device_clock_stats_t stats = s_stats;
+  taskEXIT_CRITICAL(&s_lock);
+
+  metrics_counter_add(&s_syncs, 1);
+  metrics_gauge_set(&s_offset, stats.offset_us);
+  metrics_gauge_set(&s_drift, stats.drift_ppb);
+  metrics_gauge_set(&s_rtt, stats.rtt_us);
+
+  ESP_LOGI(TAG, "Synced with %s: offset %ld us, drift %ld ppb, rtt %lu us",
+           s_server, (long)stats.offset_us, (long)stats.drift_ppb,
+           (unsigned long)stats.rtt_us);
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+  // For the calendar of the scheduler, and kept by the RTC in deep sleep. The
+  // host keeps its own clock.
+  int64_t wall_us = device_clock_now_us();
+  struct timeval now = {
+    .tv_sec = wall_us / 1000000,
+    .tv_usec = wall_us % 1000000,
+  };
+  settimeofday(&now, NULL);
+#endif
+}
+
+static bool device_clock_sync(void)
+{
+  char service[8];
+  snprintf(service, sizeof(service), "%u", s_port);
+  struct addrinfo hints = {
+    .ai_family = AF_INET,
+    .ai_socktype = SOCK_DGRAM,
+  };
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(s_server, service, &hints, &res) != 0 || !res)
+  {
+    ESP_LOGW(TAG, "Failed to resolve %s", s_server);
+    return false;
+  }
+
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0)
+  {
+    ESP_LOGE(TAG, "Failed to create the socket: errno %d", errno);
+    freeaddrinfo(res);
+    return false;
+  }
+  struct timeval timeout = {
+    .tv_sec = DEVICE_CLOCK_TIMEOUT_MS / 1000,
+    .tv_usec = (DEVICE_CLOCK_TIMEOUT_MS % 1000) * 1000,
+  };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int64_t offset_us = 0;
+  uint32_t rtt_us = 0;
+  bool synced = false;
+  for (int i = 0; i < DEVICE_CLOCK_ATTEMPTS && !synced; i++)
+    synced = device_clock_exchange(sock, res, &offset_us, &rtt_us);
+
+  close(sock);
+  freeaddrinfo(res);
+
+  if (synced)
+    device_clock_apply(offset_us, rtt_us);
+  return synced;
+}
+
+static void device_clock_task(void *pvParameters)
+{
+  while (1)
+  {
+    uint32_t wait_s = s_interval_s;
+    if (!device_clock_sync())
+    {
+      taskENTER_CRITICAL(&s_lock);
+      s_stats.failures++;
+      taskEXIT_CRITICAL(&s_lock);
+      metrics_counter_add(&s_failures, 1);
+      ESP_LOGW(TAG, "No reply from %s, retrying in %d s", s_server,
+               DEVICE_CLOCK_RETRY_S);
+      wait_s = DEVICE_CLOCK_RETRY_S;
+    }
+    vTaskDelay(pdMS_TO_TICKS(wait_s * 1000ULL));
+  }
+}
+
+esp_err_t device_clock_start(const device_clock_config_t *config)
+{
+  if (s_started)
+    return ESP_ERR_INVALID_STATE;
+
+  const char *server = config->server ? config->server
+                                      : DEVICE_CLOCK_DEFAULT_SERVER;
+  if (strlen(server) >= sizeof(s_server))
+    return ESP_ERR_INVALID_ARG;
+  strcpy(s_server, server);
+  s_port = config->port ? config->port : DEVICE_CLOCK_DEFAULT_PORT;
+  s_interval_s =
+    config->interval_s ? config->interval_s : DEVICE_CLOCK_DEFAULT_INTERVAL_S;
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+  // Set by an earlier sync and kept by the RTC, until the first exchange
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec >= DEVICE_CLOCK_VALID_S)
+  {
+    int64_t mono_us = device_clock_mono_us();
+    taskENTER_CRITICAL(&s_lock);
+    s_offset_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec - mono_us;
+    s_sync_mono_us = mono_us;
+    s_synced = true;
+    taskEXIT_CRITICAL(&s_lock);
+  }
+#endif
+
+  metrics_register(&s_syncs);
+  metrics_register(&s_failures);
+  metrics_register(&s_offset);
+  metrics_register(&s_drift);
+  metrics_register(&s_rtt);
+
+  if (xTaskCreate(device_clock_task, "device_clock", 3072, NULL,
+                  tskIDLE_PRIORITY + 1, NULL) != pdPASS)
+    return ESP_ERR_NO_MEM;
+
+  s_started = true;
+  ESP_LOGI(TAG, "Syncing with %s:%u every %lu s", s_server, s_port,
+           (unsigned long)s_interval_s);
+  return ESP_OK;
+}
+
+int64_t device_clock_mono_us(void)
+{
+  return gpio_now_us();
+}
+
+bool device_clock_is_synced(void)
+{
+  taskENTER_CRITICAL(&s_lock);
+  bool synced = s_synced;
+  taskEXIT_CRITICAL(&s_lock);
+  return synced;
+}
+
+int64_t device_clock_wall_us(int64_t mono_us)
+{
+  taskENTER_CRITICAL(&s_lock);
+  bool synced = s_synced;
+  int64_t offset_us = s_offset_us;
+  int64_t sync_mono_us = s_sync_mono_us;
+  int32_t drift_ppb = s_drift_ppb;
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!synced)
+    return 0;
+  int64_t drift_us = (mono_us - sync_mono_us) * drift_ppb / 1000000000;
+  return mono_us + offset_us + drift_us;
+}
+
+int64_t device_clock_now_us(void)
+{
+  return device_clock_wall_us(device_clock_mono_us());
+}
+
+void device_clock_get_stats(device_clock_stats_t *stats)
+{
+  taskENTER_CRITICAL(&s_lock);
+  *stats = s_stats;
+  stats->synced = s_synced;
+  taskEXIT_CRITICAL(&s_lock);
+}
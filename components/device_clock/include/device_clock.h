@@ -0,0 +1,108 @@
+/**
+ * @file device_clock.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Wall clock of the device, synchronized with SNTP
+ *
+ * Events are stamped with the monotonic clock (`device_clock_mono_us`, the
+ * same as `gpio_now_us`) and turned into wall clock time when published, as
+ * the monotonic time plus the offset measured by the last SNTP exchange,
+ * corrected by the drift measured between exchanges. A stamp taken before a
+ * sync is still converted right, and the wall clock never depends on when the
+ * payload is formatted.
+ *
+ * On the chip, each sync also sets the system time, which the RTC keeps
+ * through deep sleep, so a woken device has a wall clock before its first
+ * exchange.
+ *
+ * @version 0.1
+ * @date 2024-12-12
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef DEVICE_CLOCK_H
+#define DEVICE_CLOCK_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEVICE_CLOCK_DEFAULT_SERVER "pool.ntp.org"
+#define DEVICE_CLOCK_DEFAULT_PORT 123
+
+/**
+ * @brief Time between two syncs when none is given.
+ */
+#define DEVICE_CLOCK_DEFAULT_INTERVAL_S 3600
+
+/**
+ * @brief Configuration of the synchronization.
+ */
+typedef struct
+{
+  const char *server;   ///< SNTP server, `DEVICE_CLOCK_DEFAULT_SERVER` if NULL.
+  uint16_t port;        ///< UDP port, `DEVICE_CLOCK_DEFAULT_PORT` if 0.
+  uint32_t interval_s;  ///< Time between syncs, the default if 0.
+} device_clock_config_t;
+
+/**
+ * @brief Quality of the clock, for the consumers of its timestamps.
+ */
+typedef struct
+{
+  uint32_t syncs;     ///< SNTP exchanges that set the clock.
+  uint32_t failures;  ///< SNTP exchanges that failed.
+  int32_t offset_us;  ///< Correction of the last sync, the error it removed.
+  int32_t drift_ppb;  ///< Rate of the server clock against the local one.
+  uint32_t rtt_us;    ///< Round trip of the last sync, twice its uncertainty.
+  bool synced;        ///< The wall clock is set.
+} device_clock_stats_t;
+
+/**
+ * @brief Start the synchronization task.
+ *
+ * The first exchange is made at once, and retried every 30 s until it
+ * succeeds. The server name is copied.
+ *
+ * @param config Configuration of the synchronization.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if already started,
+ * ESP_ERR_INVALID_ARG for a server name too long, ESP_ERR_NO_MEM if the task
+ * could not be created.
+ */
+esp_err_t device_clock_start(const device_clock_config_t *config);
+
+/**
+ * @brief Monotonic clock of the device in us, the time base of every stamp.
+ */
+int64_t device_clock_mono_us(void);
+
+/**
+ * @brief Whether the wall clock is set.
+ */
+bool device_clock_is_synced(void);
+
+/**
+ * @brief Wall clock time of a monotonic stamp.
+ *
+ * Cheap, any task.
+ *
+ * @param mono_us Stamp taken with `device_clock_mono_us`.
+ * @return Microseconds since the Unix epoch, 0 while the clock is not set.
+ */
+int64_t device_clock_wall_us(int64_t mono_us);
+
+/**
+ * @brief Wall clock time now, see `device_clock_wall_us`.
+ */
+int64_t device_clock_now_us(void);
+
+/**
+ * @brief Get the quality of the clock.
+ *
+ * @param stats Where to copy it.
+ */
+void device_clock_get_stats(device_clock_stats_t *stats);
+
+#endif  // DEVICE_CLOCK_H
@@ -21,86 +21,496 @@
 
 #include "gate.h"
 
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <math.h>
 #include <string.h>
 
+#include "device_clock.h"
+#include "gate_admission.h"
+#include "gate_journal.h"
+#include "gate_scheduler.h"
+#include "gate_travel.h"
 #include "mqtt5_api.h"
-
-#define OBJECTIVE_STATE_OF_ACTION_ALREADY_ACHIEVED(action, act_state) \
-  (((uint8_t)(action)) == ((uint8_t)(act_state)))
+#include "mqtt5_dedup.h"
+#include "power_manager.h"
 
 static const char *TAG = "GATE";
 
+// Shortest partial travel worth moving the motor for
+#define GATE_PARTIAL_MIN_MS 250
+
+// Work waiting for the gate work task, and the longest payload it takes
+#define GATE_QUEUE_LEN 16
+#define GATE_PAYLOAD_MAX_LEN 64
+
+/**
+ * @brief Command being carried out, followed from acceptance to completion.
+ */
+typedef struct
+{
+  bool active;                ///< The command has not finished yet.
+  bool in_motion;             ///< The motor started moving for it.
+  uint32_t id;                ///< Correlation ID from the client, 0 if none.
+  gate_mqtt_action_t action;  ///< Action run for it.
+  int64_t accepted_us;        ///< When it was accepted, `gpio_now_us`.
+  uint32_t stop_after_ms;     ///< Partial opening: travel before the stop.
+  uint32_t seq;               ///< Number of the command, for the timer.
+} gate_tracked_command_t;
+
+/**
+ * @brief Kinds of work for the gate work task.
+ */
+typedef enum
+{
+  GATE_WORK_MQTT = 0,     ///< A payload for one of the gate handlers.
+  GATE_WORK_MOTOR_EVENT,  ///< An event of the motor task.
+  GATE_WORK_SCHEDULED,    ///< An action of the scheduler.
+  GATE_WORK_TRAVEL,       ///< The travel timer of command `seq` expired.
+} gate_work_type_t;
+
+/**
+ * @brief Work handed to the gate work task.
+ */
+typedef struct
+{
+  gate_work_type_t type;
+  union
+  {
+    struct
+    {
+      mqtt5_api_callback_t handler;
+      uint32_t source;
+      int len;  ///< Length received, rejected above `GATE_PAYLOAD_MAX_LEN`.
+      char data[GATE_PAYLOAD_MAX_LEN];
+    } mqtt;
+    motor_event_t event;
+    gate_mqtt_action_t action;
+    uint32_t seq;
+  };
+} gate_work_t;
+
+static const char *const s_stage_names[] = {
+  [GATE_COMMAND_ACCEPTED] = "accepted",
+  [GATE_COMMAND_IN_MOTION] = "in_motion",
+  [GATE_COMMAND_COMPLETED] = "completed",
+  [GATE_COMMAND_FAILED] = "failed",
+  [GATE_COMMAND_TIMEOUT] = "timeout",
+};
+
+static const char *const s_source_names[] = {
+  [MOTOR_SOURCE_REMOTE] = "remote",
+  [MOTOR_SOURCE_BUTTON] = "button",
+  [MOTOR_SOURCE_SENSOR] = "sensor",
+};
+
 static gate_t *s_gate_instance = NULL;
 static motor_t *s_motor_instance = NULL;
 
+// Topics published by the gate, formatted once on init
+static char s_state_answer_topic[MAX_MQTT_TOPIC_LEN];
+static char s_state_event_topic[MAX_MQTT_TOPIC_LEN];
+static char s_action_answer_topic[MAX_MQTT_TOPIC_LEN];
+static char s_action_status_topic[MAX_MQTT_TOPIC_LEN];
+static char s_stats_answer_topic[MAX_MQTT_TOPIC_LEN];
+static char s_schedule_answer_topic[MAX_MQTT_TOPIC_LEN];
+static char s_health_answer_topic[MAX_MQTT_TOPIC_LEN];
+
+// Only the gate work task changes the state of the gate and the statistics, see
+// `gate_work_task`
+static QueueHandle_t s_work_queue = NULL;
+static TaskHandle_t s_work_task_handle = NULL;
+
+static gate_stats_t s_gate_stats = {0};
+
+// Command in progress, also read by the timer task and `gate_prepare_sleep`
+static gate_tracked_command_t s_command = {0};
+static portMUX_TYPE s_command_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t s_travel_timer = NULL;
+
+// IDs of the commands handled, only used by the gate work task. Kept through
+// deep sleep, the broker may send a command again on wake.
+RTC_DATA_ATTR static mqtt5_dedup_t s_command_ids;
+
+// Last state published on the event topic
+static gate_state_t s_published_state = GATE_CLOSED;
+
 /* Forward declaration */
 static void gate_init_instances(gate_t *self);
 
-static void motor_state_to_gate_state()
+// Publish an answer, counting the result
+static void gate_publish(const char *topic, const char *data)
+{
+  if (mqtt5_api_publish(topic, data, strlen(data)) == ESP_OK)
+    s_gate_stats.answers_sent++;
+  else
+    s_gate_stats.answers_failed++;
+}
+
+/**
+ * @brief Move the gate to the state reached by the motor.
+ *
+ * A stop only ends a movement: stopping the motor at an endline leaves the gate
+ * opened or closed.
+ */
+static void gate_set_state(gate_state_t reached)
+{
+  gate_state_t state = s_gate_instance->_act_state;
+  if (reached == GATE_STOPPED && state != GATE_OPENING && state != GATE_CLOSING)
+    return;
+
+  s_gate_instance->_act_state = reached;
+
+  // Stopped halfway is still open
+  gate_scheduler_notify_open(s_gate_instance,
+                             reached != GATE_CLOSED && reached != GATE_CLOSING);
+}
+
+static bool gate_action_achieved(gate_mqtt_action_t action, gate_state_t state)
 {
-  ESP_LOGI(TAG, "Motor state BEFORE update it: %d",
-           s_motor_instance->_act_state);
-  motor_action_t motor_state = s_motor_instance->get_state(s_motor_instance);
-  ESP_LOGI(TAG, "Motor state AFTER update it: %d",
-           s_motor_instance->_act_state);
-  switch (motor_state)
+  switch (action)
   {
-    case ACTION_CLOCKWISE_MOTOR:
-      s_gate_instance->_act_state = GATE_OPENED;
+    case GATE_MQTT_OPEN:
+      return state == GATE_OPENED;
+    case GATE_MQTT_CLOSE:
+      return state == GATE_CLOSED;
+    case GATE_MQTT_STOP:
+      return state != GATE_OPENING && state != GATE_CLOSING;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Publish a stage of a command, e.g.
+ * "id=42,stage=completed,state=0,pct=100,ms=11873,time_ms=1733050000123".
+ *
+ * `time_ms` is the wall clock time of the stage, `stamp_us` on the device
+ * clock, only present once the clock is set. For `in_motion`, it is when the
+ * outputs were driven, to compare with the publish time of the client.
+ */
+static void gate_publish_stage(const gate_tracked_command_t *command,
+                               gate_command_stage_t stage, const char *reason,
+                               int64_t stamp_us)
+{
+  char status[144];
+  int len = snprintf(status, sizeof(status), "id=%lu,stage=%s,state=%d,pct=%d",
+                     (unsigned long)command->id, s_stage_names[stage],
+                     s_gate_instance->_act_state,
+                     gate_travel_position(gpio_now_us()) / 10);
+
+  if (stage >= GATE_COMMAND_COMPLETED)
+    len += snprintf(status + len, sizeof(status) - len, ",ms=%lld",
+                    (long long)(gpio_now_us() - command->accepted_us) / 1000);
+
+  if (reason)
+    len += snprintf(status + len, sizeof(status) - len, ",reason=%s", reason);
+
+  int64_t time_us = device_clock_wall_us(stamp_us);
+  if (time_us)
+    snprintf(status + len, sizeof(status) - len, ",time_ms=%lld",
+             (long long)time_us / 1000);
+
+  ESP_LOGI(TAG, "Command %s", status);
+  gate_publish(s_action_status_topic, status);
+}
+
+/**
+ * @brief Start following a command, failing the one still in progress.
+ *
+ * Called before the motor is driven, so its events find the command. The
+ * travel timer stops a partial opening after `stop_after_ms`, and any other
+ * command after `GATE_TRAVEL_TIMEOUT_MS`.
+ */
+static void gate_command_begin(uint32_t id, gate_mqtt_action_t action,
+                               uint32_t stop_after_ms)
+{
+  gate_tracked_command_t command = {
+    .active = true,
+    .id = id,
+    .action = action,
+    .accepted_us = device_clock_mono_us(),
+    .stop_after_ms = stop_after_ms,
+  };
+  gate_tracked_command_t previous;
+
+  taskENTER_CRITICAL(&s_command_lock);
+  previous = s_command;
+  command.seq = previous.seq + 1;
+  s_command = command;
+  taskEXIT_CRITICAL(&s_command_lock);
+
+  // Held until the command finishes, the superseded one hands it over
+  if (!previous.active)
+    power_manager_acquire();
+
+  // Also (re)starts the timer
+  uint32_t period_ms = stop_after_ms ? stop_after_ms : GATE_TRAVEL_TIMEOUT_MS;
+  xTimerChangePeriod(s_travel_timer, pdMS_TO_TICKS(period_ms), 0);
+
+  if (previous.active)
+    gate_publish_stage(&previous, GATE_COMMAND_FAILED, "superseded",
+                       command.accepted_us);
+  gate_publish_stage(&command, GATE_COMMAND_ACCEPTED, NULL,
+                     command.accepted_us);
+}
+
+/**
+ * @brief End the command `seq` if it is still in progress: it is no longer
+ * followed, its travel timer is stopped and its power lock released.
+ *
+ * @param seq Sequence number of the command.
+ * @param[out] command The command, as it was when ended.
+ * @return true if it was ended.
+ */
+static bool gate_command_end(uint32_t seq, gate_tracked_command_t *command)
+{
+  taskENTER_CRITICAL(&s_command_lock);
+  *command = s_command;
+  bool ended = command->active && command->seq == seq;
+  if (ended)
+    s_command.active = false;
+  taskEXIT_CRITICAL(&s_command_lock);
+
+  if (!ended)
+    return false;
+
+  xTimerStop(s_travel_timer, 0);
+  power_manager_release();
+  return true;
+}
+
+/**
+ * @brief Finish the command in progress, if any.
+ *
+ * @return true if a command was finished.
+ */
+static bool gate_command_finish(gate_command_stage_t stage, const char *reason)
+{
+  gate_tracked_command_t command;
+
+  // Only the gate work task begins commands, the sequence cannot change here
+  if (!gate_command_end(s_command.seq, &command))
+    return false;
+
+  gate_publish_stage(&command, stage, reason, device_clock_mono_us());
+  return true;
+}
+
+/**
+ * @brief Advance the command in progress with the state the motor reached.
+ *
+ * Reaching the objective state completes it, the first movement towards it
+ * puts it in motion, anything else (e.g. the button) interrupts it.
+ *
+ * @param reached State reached.
+ * @param stamp_us When it was reached, on the device clock.
+ */
+static void gate_command_advance(gate_state_t reached, int64_t stamp_us)
+{
+  gate_tracked_command_t command;
+  gate_command_stage_t stage = GATE_COMMAND_IN_MOTION;
+  bool publish = true;
+
+  taskENTER_CRITICAL(&s_command_lock);
+  command = s_command;
+  gate_state_t moving = (command.action == GATE_MQTT_OPEN)    ? GATE_OPENING
+                        : (command.action == GATE_MQTT_CLOSE) ? GATE_CLOSING
+                                                              : GATE_STOPPED;
+  if (!command.active)
+    publish = false;
+  else if (gate_action_achieved(command.action, reached))
+    stage = GATE_COMMAND_COMPLETED;
+  else if (reached == moving)
+    publish = !command.in_motion;
+  else
+    stage = GATE_COMMAND_FAILED;
+
+  if (publish && stage == GATE_COMMAND_IN_MOTION)
+    s_command.in_motion = true;
+  taskEXIT_CRITICAL(&s_command_lock);
+
+  if (!publish)
+    return;
+
+  if (stage == GATE_COMMAND_IN_MOTION)
+    xTimerReset(s_travel_timer, 0);
+  else
+    gate_command_end(command.seq, &command);
+
+  gate_publish_stage(&command, stage,
+                     stage == GATE_COMMAND_FAILED ? "interrupted" : NULL,
+                     stamp_us);
+}
+
+/**
+ * @brief Publish a change of state, e.g.
+ * "state=0,source=sensor,pct=100,up_ms=12034,time_ms=1733050000123".
+ *
+ * `pct` is the estimated opening, `up_ms` the uptime of the event and
+ * `time_ms` the wall clock time of the change (of the outputs driven, for an
+ * action), only present once the clock is set.
+ */
+static void gate_publish_state_event(const motor_event_t *event,
+                                     int64_t stamp_us)
+{
+  char state_str[112];
+  int len = snprintf(state_str, sizeof(state_str),
+                     "state=%d,source=%s,pct=%d,up_ms=%lld",
+                     s_gate_instance->_act_state, s_source_names[event->source],
+                     gate_travel_position(event->timestamp_us) / 10,
+                     (long long)event->timestamp_us / 1000);
+
+  int64_t time_us = device_clock_wall_us(stamp_us);
+  if (time_us)
+    snprintf(state_str + len, sizeof(state_str) - len, ",time_ms=%lld",
+             (long long)time_us / 1000);
+
+  gate_publish(s_state_event_topic, state_str);
+}
+
+/**
+ * @brief Handle an event of the motor.
+ *
+ * Each change of state is published once on the event topic, whatever caused
+ * it, so clients need not poll `GATE_STATE_TOPIC`.
+ */
+static void gate_handle_motor_event(const motor_event_t *event)
+{
+  gate_state_t reached;
+  switch (event->type)
+  {
+    case MOTOR_EVENT_OPENED:
+      reached = GATE_OPENED;
+      break;
+    case MOTOR_EVENT_CLOSED:
+      reached = GATE_CLOSED;
       break;
-    case ACTION_COUNTERCLOCKWISE_MOTOR:
-      s_gate_instance->_act_state = GATE_CLOSED;
+    default:
+      reached = (event->action == ACTION_CLOCKWISE_MOTOR) ? GATE_OPENING
+                : (event->action == ACTION_COUNTERCLOCKWISE_MOTOR)
+                  ? GATE_CLOSING
+                  : GATE_STOPPED;
+      break;
+  }
+
+  switch (reached)
+  {
+    case GATE_OPENING:
+      gate_travel_start(GATE_TRAVEL_OPENING, event->timestamp_us);
+      gate_admission_moved(GATE_TRAVEL_OPENING, event->timestamp_us);
+      break;
+    case GATE_CLOSING:
+      gate_travel_start(GATE_TRAVEL_CLOSING, event->timestamp_us);
+      gate_admission_moved(GATE_TRAVEL_CLOSING, event->timestamp_us);
       break;
-    case ACTION_STOP_MOTOR:
-      s_gate_instance->_act_state = GATE_STOPPED;
+    case GATE_OPENED:
+      gate_travel_endline(GATE_TRAVEL_OPENING, event->timestamp_us);
+      break;
+    case GATE_CLOSED:
+      gate_travel_endline(GATE_TRAVEL_CLOSING, event->timestamp_us);
       break;
     default:
+      gate_travel_stop(event->timestamp_us);
       break;
   }
+
+  gate_set_state(reached);
+
+  // Actions take effect when the outputs are driven, not when requested
+  int64_t stamp_us = event->actuated_us ? event->actuated_us
+                                        : event->timestamp_us;
+
+  gate_state_t state = s_gate_instance->_act_state;
+  if (state != s_published_state)
+  {
+    s_published_state = state;
+    gate_publish_state_event(event, stamp_us);
+  }
+
+  gate_command_advance(reached, stamp_us);
+  gate_journal_touch();
 }
 
-static void update_gate_state()
+// A partial opening is in position, or the endline was not hit in time
+static void gate_travel_expired(uint32_t seq)
 {
-  motor_state_to_gate_state();
+  gate_tracked_command_t command;
+
+  // Finished first so the stop does not count as an interruption. A newer
+  // command may have begun while the expiry waited in the queue
+  if (!gate_command_end(seq, &command))
+    return;
+
+  if (!command.stop_after_ms)
+  {
+    ESP_LOGE(TAG, "No endline after %d ms, stopping", GATE_TRAVEL_TIMEOUT_MS);
+    motor_count_endline_timeout();
+  }
+
+  s_gate_instance->stop(s_gate_instance);
+  gate_publish_stage(&command,
+                     command.stop_after_ms ? GATE_COMMAND_COMPLETED
+                                           : GATE_COMMAND_TIMEOUT,
+                     NULL, device_clock_mono_us());
 }
 
 /**
- * @brief Handler to MQTT subscription
+ * @brief Run a gate action and publish its answer.
  *
+ * Run on the gate work task, for the MQTT handler and the scheduler. The rest
+ * of the command's lifecycle is published from the motor events.
+ *
+ * An open below 100 % moves the gate towards that opening, either way, for
+ * the time given by the travel model. 0 % is a close.
  */
-static void gate_mqtt_handler(char *data, int len)
+static void gate_execute_action(uint32_t id, gate_mqtt_action_t action,
+                                uint8_t pct)
 {
-  if (!s_gate_instance)
+  ESP_LOGI(TAG, "Action: %d %u%% (id %lu)", action, pct, (unsigned long)id);
+
+  // A stop also drops the delayed actions still pending
+  if (action == GATE_MQTT_STOP)
   {
-    ESP_LOGE(TAG, "Gate instance is not initialized");
-    return;
+    int cancelled = gate_scheduler_cancel_once(s_gate_instance);
+    if (cancelled)
+      ESP_LOGI(TAG, "%d delayed actions cancelled", cancelled);
   }
 
-  uint8_t action = atoi(data);
-  ESP_LOGI(TAG, "Action: %d", action);
-  update_gate_state();
   ESP_LOGI(TAG, "State: %d", s_gate_instance->_act_state);
 
-  if (action > (GATE_MQTT_INVALID_ACTION - 1))
+  bool partial = (action == GATE_MQTT_OPEN && pct > 0 && pct < 100);
+  uint32_t stop_after_ms = 0;
+  if (action == GATE_MQTT_OPEN && pct == 0)
+    action = GATE_MQTT_CLOSE;
+  else if (partial)
   {
-    ESP_LOGE(TAG, "Invalid action");
-    return;
+    gate_travel_direction_t direction;
+    stop_after_ms = gate_travel_time_to(pct * GATE_TRAVEL_OPEN / 100,
+                                        gpio_now_us(), &direction);
+    action = (direction == GATE_TRAVEL_OPENING) ? GATE_MQTT_OPEN
+                                                : GATE_MQTT_CLOSE;
   }
 
-  if (OBJECTIVE_STATE_OF_ACTION_ALREADY_ACHIEVED(action,
-                                                 s_gate_instance->_act_state))
+  bool achieved = partial ? stop_after_ms < GATE_PARTIAL_MIN_MS
+                          : gate_action_achieved(action,
+                                                 s_gate_instance->_act_state);
+
+  gate_command_begin(id, action, achieved ? 0 : stop_after_ms);
+
+  if (achieved)
   {
     ESP_LOGW(TAG, "Gate already is in the objective state");
 
-    char topic[MAX_MQTT_TOPIC_LEN];
-    snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
-             GATE_ACTION_TOPIC_ANSWER);
-
     char gate_state_str[3];
     snprintf(gate_state_str, sizeof(gate_state_str), "%d", -1);
 
-    mqtt5_api_publish(topic, gate_state_str, strlen(gate_state_str));
+    gate_publish(s_action_answer_topic, gate_state_str);
+    gate_command_finish(GATE_COMMAND_COMPLETED, "already");
     return;
   }
 
@@ -111,14 +521,11 @@ static void gate_mqtt_handler(char *data, int len)
       ESP_LOGI(TAG, "Gate in action (opening)");
       s_gate_instance->open(s_gate_instance);
 
-      char topic[MAX_MQTT_TOPIC_LEN];
-      snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
-               GATE_STATE_TOPIC_ANSWER);
-
       char gate_state_str[2];
-      snprintf(gate_state_str, sizeof(gate_state_str), "%d", GATE_OPENED);
+      snprintf(gate_state_str, sizeof(gate_state_str), "%d",
+               s_gate_instance->_act_state);
 
-      mqtt5_api_publish(topic, gate_state_str, strlen(gate_state_str));
+      gate_publish(s_state_answer_topic, gate_state_str);
       break;
     }
 
@@ -127,14 +534,11 @@ static void gate_mqtt_handler(char *data, int len)
       ESP_LOGI(TAG, "Gate in action (closing)");
       s_gate_instance->close(s_gate_instance);
 
-      char topic[MAX_MQTT_TOPIC_LEN];
-      snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
-               GATE_STATE_TOPIC_ANSWER);
-
       char gate_state_str[2];
-      snprintf(gate_state_str, sizeof(gate_state_str), "%d", GATE_CLOSED);
+      snprintf(gate_state_str, sizeof(gate_state_str), "%d",
+               s_gate_instance->_act_state);
 
-      mqtt5_api_publish(topic, gate_state_str, strlen(gate_state_str));
+      gate_publish(s_state_answer_topic, gate_state_str);
       break;
     }
 
@@ -143,14 +547,10 @@ static void gate_mqtt_handler(char *data, int len)
       ESP_LOGI(TAG, "Gate in action (stopped)");
       s_gate_instance->stop(s_gate_instance);
 
-      char topic[MAX_MQTT_TOPIC_LEN];
-      snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
-               GATE_STATE_TOPIC);
-
       char gate_state_str[2];
       snprintf(gate_state_str, sizeof(gate_state_str), "%d", GATE_STOPPED);
 
-      mqtt5_api_publish(topic, gate_state_str, strlen(gate_state_str));
+      gate_publish(s_state_answer_topic, gate_state_str);
       break;
     }
 
@@ -159,7 +559,58 @@ static void gate_mqtt_handler(char *data, int len)
   }
 }
 
-static void gate_state_mqtt(char *data, int len)
+/**
+ * @brief Direction an immediate action would move the gate in.
+ *
+ * @return false for a stop, which moves nothing.
+ */
+static bool gate_action_direction(gate_mqtt_action_t action, uint8_t pct,
+                                  gate_travel_direction_t *direction)
+{
+  if (action == GATE_MQTT_STOP)
+    return false;
+
+  if (action == GATE_MQTT_OPEN && pct > 0 && pct < 100)
+    gate_travel_time_to(pct * GATE_TRAVEL_OPEN / 100, gpio_now_us(),
+                        direction);
+  else
+    *direction = (action == GATE_MQTT_OPEN && pct > 0) ? GATE_TRAVEL_OPENING
+                                                       : GATE_TRAVEL_CLOSING;
+  return true;
+}
+
+/**
+ * @brief Admit a valid command, once it is known not to be a duplicate.
+ *
+ * A rejected command is only counted, not answered: the client sees no
+ * change of state, and may send it again once its rate allows.
+ */
+static bool gate_admit(uint32_t source, gate_admission_topic_t topic,
+                       const gate_command_t *cmd)
+{
+  int64_t now_us = gpio_now_us();
+  gate_admission_verdict_t verdict = GATE_ADMITTED;
+  gate_travel_direction_t direction;
+
+  if (!cmd || cmd->action != GATE_MQTT_STOP)
+    verdict = gate_admission_check(source, topic, now_us);
+  if (verdict == GATE_ADMITTED && cmd && cmd->after_s == 0 &&
+      gate_action_direction(cmd->action, cmd->pct, &direction))
+    verdict = gate_admission_direction(direction, now_us);
+
+  gate_admission_count(verdict);
+  if (verdict == GATE_ADMITTED)
+    return true;
+
+  s_gate_stats.commands_throttled++;
+  return false;
+}
+
+/**
+ * @brief Handler to MQTT subscription
+ *
+ */
+static void gate_mqtt_handler(uint32_t source, char *data, int len)
 {
   if (!s_gate_instance)
   {
@@ -167,19 +618,401 @@ static void gate_state_mqtt(char *data, int len)
     return;
   }
 
-  update_gate_state();
-  ESP_LOGI(TAG, "Gate state queried: %s",
-           s_gate_instance->_act_state == GATE_OPENED ? "OPENED" : (s_gate_instance->_act_state == GATE_CLOSED ? "CLOSED" : "STOPPED"));
+  s_gate_stats.commands_received++;
+
+  gate_command_t cmd;
+  if (gate_command_parse(data, len, &cmd) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Invalid action: '%.*s'", len, data);
+    s_gate_stats.commands_rejected++;
+    return;
+  }
+
+  // Schedules run full actions only
+  if (cmd.after_s > 0 && (cmd.options & GATE_COMMAND_OPT_PCT))
+  {
+    ESP_LOGE(TAG, "Delayed partial opening not supported: '%.*s'", len, data);
+    s_gate_stats.commands_rejected++;
+    return;
+  }
+
+  // At least once on the wire, once at the motor. A duplicate spends no
+  // admission budget
+  if (cmd.id && mqtt5_dedup_contains(&s_command_ids, cmd.id))
+  {
+    ESP_LOGW(TAG, "Command %lu already handled", (unsigned long)cmd.id);
+    s_gate_stats.commands_duplicate++;
+    return;
+  }
+
+  // A stop always goes through, to halt the gate in any storm
+  if (!gate_admit(source, GATE_ADMISSION_ACTION, &cmd))
+    return;
+
+  // Only remembered once admitted, so a throttled command can be sent again
+  if (cmd.id)
+    mqtt5_dedup_seen(&s_command_ids, cmd.id);
+
+  if (cmd.after_s > 0)
+  {
+    gate_schedule_t schedule = {
+      .type = GATE_SCHEDULE_ONCE,
+      .action = cmd.action,
+      .delay_s = cmd.after_s,
+    };
+    uint16_t id;
+    char answer[16] = "-1";
+    if (gate_scheduler_add(&schedule, s_gate_instance, &id) == ESP_OK)
+      snprintf(answer, sizeof(answer), "id=%u", id);
+    else
+      s_gate_stats.commands_rejected++;
+
+    gate_publish(s_schedule_answer_topic, answer);
+    return;
+  }
+
+  gate_execute_action(cmd.id, cmd.action, cmd.pct);
+}
+
+static void gate_state_mqtt(uint32_t source, char *data, int len)
+{
+  if (!s_gate_instance)
+  {
+    ESP_LOGE(TAG, "Gate instance is not initialized");
+    return;
+  }
 
-  char topic[MAX_MQTT_TOPIC_LEN];
-  snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
-           GATE_STATE_TOPIC_ANSWER);
+  ESP_LOGI(TAG, "Gate state queried: %d", s_gate_instance->_act_state);
 
   char gate_state_str[2];
   snprintf(gate_state_str, sizeof(gate_state_str), "%d",
            s_gate_instance->_act_state);
 
-  mqtt5_api_publish(topic, gate_state_str, strlen(gate_state_str));
+  gate_publish(s_state_answer_topic, gate_state_str);
+}
+
+static void gate_schedule_mqtt(uint32_t source, char *data, int len)
+{
+  if (!s_gate_instance)
+  {
+    ESP_LOGE(TAG, "Gate instance is not initialized");
+    return;
+  }
+
+  if (!gate_admit(source, GATE_ADMISSION_SCHEDULE, NULL))
+    return;
+
+  gate_schedule_request_t request;
+  char answer[64] = "-1";
+  if (gate_scheduler_parse(data, len, &request) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Invalid schedule: '%.*s'", len, data);
+    gate_publish(s_schedule_answer_topic, answer);
+    return;
+  }
+
+  switch (request.op)
+  {
+    case GATE_SCHEDULE_REQUEST_ADD:
+    {
+      uint16_t id;
+      if (gate_scheduler_add(&request.schedule, s_gate_instance, &id) ==
+          ESP_OK)
+        gate_scheduler_format(id, answer, sizeof(answer));
+      break;
+    }
+
+    case GATE_SCHEDULE_REQUEST_DEL:
+    {
+      if (gate_scheduler_cancel(request.id) == ESP_OK)
+        snprintf(answer, sizeof(answer), "id=%u", request.id);
+      break;
+    }
+
+    case GATE_SCHEDULE_REQUEST_LIST:
+    {
+      // One message per schedule, then their count
+      int count = 0;
+      for (int id = 1; id <= GATE_SCHEDULER_MAX_ENTRIES; id++)
+      {
+        if (gate_scheduler_format(id, answer, sizeof(answer)) != ESP_OK)
+          continue;
+
+        gate_publish(s_schedule_answer_topic, answer);
+        count++;
+      }
+      snprintf(answer, sizeof(answer), "count=%d", count);
+      break;
+    }
+
+    case GATE_SCHEDULE_REQUEST_TZ:
+    {
+      if (request.tz[0] == '\0' ||
+          gate_scheduler_set_timezone(request.tz) == ESP_OK)
+      {
+        char tz[GATE_SCHEDULER_TZ_MAX];
+        gate_scheduler_get_timezone(tz, sizeof(tz));
+        snprintf(answer, sizeof(answer), "tz=%s", tz);
+      }
+      break;
+    }
+  }
+
+  gate_publish(s_schedule_answer_topic, answer);
+}
+
+static void gate_scheduled_action(void *arg, uint16_t id,
+                                  gate_mqtt_action_t action)
+{
+  ESP_LOGI(TAG, "Scheduled action %d (schedule %u)", action, id);
+
+  gate_work_t work = {.type = GATE_WORK_SCHEDULED, .action = action};
+  xQueueSend(s_work_queue, &work, portMAX_DELAY);
+}
+
+static void gate_stats_mqtt(uint32_t source, char *data, int len)
+{
+  motor_stats_t motor_stats;
+  motor_get_stats(&motor_stats);
+
+  char stats_str[160];
+  snprintf(stats_str, sizeof(stats_str),
+           "rx=%lu,rej=%lu,dup=%lu,thr=%lu,q_drop=%lu,ans=%lu,ans_fail=%lu,"
+           "mq_drop=%lu,mq_peak=%lu",
+           (unsigned long)s_gate_stats.commands_received,
+           (unsigned long)s_gate_stats.commands_rejected,
+           (unsigned long)s_gate_stats.commands_duplicate,
+           (unsigned long)s_gate_stats.commands_throttled,
+           (unsigned long)s_gate_stats.commands_dropped,
+           (unsigned long)s_gate_stats.answers_sent,
+           (unsigned long)s_gate_stats.answers_failed,
+           (unsigned long)motor_stats.events_dropped,
+           (unsigned long)motor_stats.queue_peak);
+
+  gate_publish(s_stats_answer_topic, stats_str);
+}
+
+/**
+ * @brief Answer the wear indicators of the motor, computed on request, e.g.
+ * "open_n=12,open_ms=11980,open_sd=85,close_n=11,close_ms=11460,close_sd=70,
+ * cycles=25,cycles_day=14.2,presses=3,reversals=1,timeouts=0,powered_s=151200".
+ */
+static void gate_health_mqtt(uint32_t source, char *data, int len)
+{
+  motor_health_t health;
+  motor_get_health(&health);
+
+  const motor_running_stat_t *open = &health.travel_ms[0];
+  const motor_running_stat_t *close = &health.travel_ms[1];
+  uint32_t powered_s = gate_journal_powered_s();
+  double cycles_day = powered_s ? health.cycles * 86400.0 / powered_s : 0;
+
+  char health_str[192];
+  snprintf(health_str, sizeof(health_str),
+           "open_n=%lu,open_ms=%.0f,open_sd=%.0f,"
+           "close_n=%lu,close_ms=%.0f,close_sd=%.0f,"
+           "cycles=%lu,cycles_day=%.1f,presses=%lu,reversals=%lu,"
+           "timeouts=%lu,powered_s=%lu",
+           (unsigned long)open->count, open->mean,
+           sqrt(motor_running_stat_variance(open)),
+           (unsigned long)close->count, close->mean,
+           sqrt(motor_running_stat_variance(close)),
+           (unsigned long)health.cycles, cycles_day,
+           (unsigned long)health.button_presses,
+           (unsigned long)health.reversals,
+           (unsigned long)health.endline_timeouts, (unsigned long)powered_s);
+
+  gate_publish(s_health_answer_topic, health_str);
+}
+
+/**
+ * @brief Hand a payload over to the gate work task, from the MQTT or local
+ * control task.
+ *
+ * Never waits: the MQTT task may hold the client lock that the gate work task
+ * needs to publish.
+ */
+static void gate_post_mqtt(mqtt5_api_callback_t handler, uint32_t source,
+                           const char *data, int len)
+{
+  gate_work_t work = {
+    .type = GATE_WORK_MQTT,
+    .mqtt = {.handler = handler, .source = source, .len = len},
+  };
+  memcpy(work.mqtt.data, data,
+         len < GATE_PAYLOAD_MAX_LEN ? len : GATE_PAYLOAD_MAX_LEN);
+
+  if (xQueueSend(s_work_queue, &work, 0) != pdTRUE)
+  {
+    // Statistics only, a lost increment between tasks is acceptable
+    s_gate_stats.commands_dropped++;
+    ESP_LOGW(TAG, "Gate work queue full, payload dropped");
+  }
+}
+
+static void gate_action_received(uint32_t source, char *data, int len)
+{
+  gate_post_mqtt(gate_mqtt_handler, source, data, len);
+}
+
+static void gate_state_received(uint32_t source, char *data, int len)
+{
+  gate_post_mqtt(gate_state_mqtt, source, data, len);
+}
+
+static void gate_stats_received(uint32_t source, char *data, int len)
+{
+  gate_post_mqtt(gate_stats_mqtt, source, data, len);
+}
+
+static void gate_schedule_received(uint32_t source, char *data, int len)
+{
+  gate_post_mqtt(gate_schedule_mqtt, source, data, len);
+}
+
+static void gate_health_received(uint32_t source, char *data, int len)
+{
+  gate_post_mqtt(gate_health_mqtt, source, data, len);
+}
+
+// Motor task. Waits for room, a lost event would leave the gate state behind
+// the motor
+static void gate_motor_event(motor_t *motor, const motor_event_t *event)
+{
+  gate_work_t work = {.type = GATE_WORK_MOTOR_EVENT, .event = *event};
+  xQueueSend(s_work_queue, &work, portMAX_DELAY);
+}
+
+// Timer task, for the command the timer was running for
+static void gate_travel_timer(TimerHandle_t timer)
+{
+  taskENTER_CRITICAL(&s_command_lock);
+  uint32_t seq = s_command.seq;
+  taskEXIT_CRITICAL(&s_command_lock);
+
+  gate_work_t work = {.type = GATE_WORK_TRAVEL, .seq = seq};
+  xQueueSend(s_work_queue, &work, portMAX_DELAY);
+}
+
+/**
+ * @brief Work task of the gate, the only one that runs actions and changes
+ * the state.
+ *
+ * Commands from MQTT and local control, schedules, the travel timer and motor
+ * events all come through `s_work_queue`, so an action, the state changes it
+ * causes and the statistics are never interleaved with another one. It never
+ * blocks on the tasks that wait for room in the queue: the motor and the
+ * timers are only sent commands without waiting, and the MQTT and local
+ * control tasks, which it may wait for to publish, do not wait for room.
+ */
+static void gate_work_task(void *arg)
+{
+  gate_work_t work;
+  while (1)
+  {
+    if (xQueueReceive(s_work_queue, &work, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    switch (work.type)
+    {
+      case GATE_WORK_MQTT:
+        if (work.mqtt.len > GATE_PAYLOAD_MAX_LEN)
+        {
+          ESP_LOGE(TAG, "Payload of %d bytes too long", work.mqtt.len);
+          s_gate_stats.commands_rejected++;
+          break;
+        }
+        work.mqtt.handler(work.mqtt.source, work.mqtt.data, work.mqtt.len);
+        break;
+      case GATE_WORK_MOTOR_EVENT:
+        gate_handle_motor_event(&work.event);
+        break;
+      case GATE_WORK_SCHEDULED:
+        gate_execute_action(0, work.action, 100);
+        break;
+      case GATE_WORK_TRAVEL:
+        gate_travel_expired(work.seq);
+        break;
+    }
+  }
+}
+
+void gate_get_stats(gate_stats_t *stats)
+{
+  *stats = s_gate_stats;
+}
+
+uint32_t gate_work_stack_free()
+{
+  if (s_work_task_handle == NULL)
+    return 0;
+
+  return uxTaskGetStackHighWaterMark(s_work_task_handle);
+}
+
+static void gate_journal_snapshot(gate_journal_record_t *record)
+{
+  motor_state_t motor_state = s_motor_instance->_act_state;
+
+  record->gate_state = s_gate_instance->_act_state;
+  record->motor_last_state = (motor_state != STATE_MOTOR_STOPPED)
+                               ? motor_state
+                               : s_motor_instance->_last_state;
+  record->position = gate_travel_position(gpio_now_us());
+  gate_travel_get_model(&record->model);
+  motor_get_health(&record->health);
+}
+
+/**
+ * @brief Resume the state of the gate from the journal, before the motor task
+ * starts.
+ *
+ * The endline sensors win over the journal: a gate that is at no endline was
+ * either stopped halfway, moved by hand or cut by the reboot while moving, so
+ * it resumes stopped at the last known position.
+ */
+static void gate_resume(gate_t *self, motor_t *motor,
+                        const gate_journal_record_t *record)
+{
+  // Without a journal, the gate is assumed closed as before
+  gate_state_t state = GATE_CLOSED;
+  int position = 0;
+  motor_state_t last_state = STATE_MOTOR_STOPPED;
+  if (record)
+  {
+    state = GATE_STOPPED;
+    position = record->position;
+    last_state = record->motor_last_state;
+  }
+
+  motor_event_type_t endline = motor_read_endline();
+  if (endline == MOTOR_EVENT_OPENED)
+  {
+    state = GATE_OPENED;
+    position = GATE_TRAVEL_OPEN;
+    last_state = STATE_MOTOR_IN_CLOCKWISE;
+  }
+  else if (endline == MOTOR_EVENT_CLOSED)
+  {
+    state = GATE_CLOSED;
+    position = 0;
+    last_state = STATE_MOTOR_IN_COUNTERCLOCKWISE;
+  }
+
+  motor_restore(motor, last_state, record ? &record->health : NULL);
+  gate_travel_init(record ? &record->model : NULL, position,
+                   endline != MOTOR_EVENT_ACTION);
+
+  self->_act_state = state;
+  s_published_state = state;
+
+  ESP_LOGI(TAG, "Resumed %s: state %d at %d%%",
+           record ? "from the journal" : "without journal", state,
+           position / 10);
+  if (record && record->gate_state != state)
+    ESP_LOGW(TAG, "Journal had state %d", record->gate_state);
+
+  gate_journal_touch();
 }
 
 /**
@@ -196,16 +1029,65 @@ esp_err_t gate_init_impl(gate_t *self, motor_t *motor)
   // Initialize the gate instance
   gate_init_instances(self);
 
+  // Last state written before the reboot, if any
+  gate_journal_record_t record;
+  esp_err_t journal = gate_journal_init(gate_journal_snapshot, &record);
+  if (journal == ESP_ERR_NO_MEM)
+    return journal;
+
+  gate_admission_init();
+
+  // Before the motor, whose events go to the gate work task
+  s_work_queue = xQueueCreate(GATE_QUEUE_LEN, sizeof(gate_work_t));
+  if (!s_work_queue)
+    return ESP_ERR_NO_MEM;
+
   // Initialize the motor
   s_motor_instance = motor;
   motor_init(motor);
+  motor->on_event = &gate_motor_event;
+
+  gate_resume(self, motor, (journal == ESP_OK) ? &record : NULL);
+
+  s_travel_timer = xTimerCreate("gate_travel",
+                                pdMS_TO_TICKS(GATE_TRAVEL_TIMEOUT_MS), pdFALSE,
+                                NULL, gate_travel_timer);
+  if (!s_travel_timer)
+    return ESP_ERR_NO_MEM;
+
+  if (xTaskCreate(gate_work_task, "gate_work", 4096, NULL, 9,
+                  &s_work_task_handle) != pdPASS)
+    return ESP_ERR_NO_MEM;
+
   motor_start_task();
 
+  snprintf(s_state_answer_topic, sizeof(s_state_answer_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_STATE_TOPIC_ANSWER);
+  snprintf(s_state_event_topic, sizeof(s_state_event_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_STATE_TOPIC_EVENT);
+  snprintf(s_action_answer_topic, sizeof(s_action_answer_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_ACTION_TOPIC_ANSWER);
+  snprintf(s_action_status_topic, sizeof(s_action_status_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_ACTION_TOPIC_STATUS);
+  snprintf(s_stats_answer_topic, sizeof(s_stats_answer_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_STATS_TOPIC_ANSWER);
+  snprintf(s_schedule_answer_topic, sizeof(s_schedule_answer_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_SCHEDULE_TOPIC_ANSWER);
+  snprintf(s_health_answer_topic, sizeof(s_health_answer_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_HEALTH_TOPIC_ANSWER);
+
   // Subscribe to MQTT topics
   esp_err_t ret;
 
+  ret = gate_scheduler_init(gate_scheduled_action, self);
+  if (ret != ESP_OK)
+    return ret;
+  gate_scheduler_notify_open(self, self->_act_state != GATE_CLOSED);
+
+  // Commands are acknowledged, and de-duplicated by their ID
   mqtt5_api_subscription_t sub_gate_action = {
-    .callback = &gate_mqtt_handler,
+    .callback = &gate_action_received,
+    .qos = 1,
   };
   snprintf(sub_gate_action.topic, MAX_MQTT_TOPIC_LEN, "%s/%s", BASE_MQTT_TOPIC,
            GATE_ACTION_TOPIC);
@@ -215,7 +1097,7 @@ esp_err_t gate_init_impl(gate_t *self, motor_t *motor)
     return ret;
 
   mqtt5_api_subscription_t sub_gate_state = {
-    .callback = &gate_state_mqtt,
+    .callback = &gate_state_received,
   };
   snprintf(sub_gate_state.topic, MAX_MQTT_TOPIC_LEN, "%s/%s", BASE_MQTT_TOPIC,
            GATE_STATE_TOPIC);
@@ -224,13 +1106,60 @@ esp_err_t gate_init_impl(gate_t *self, motor_t *motor)
   if (ret != ESP_OK)
     return ret;
 
-  // Set initial state
-  self->_act_state = GATE_CLOSED;
+  mqtt5_api_subscription_t sub_gate_stats = {
+    .callback = &gate_stats_received,
+  };
+  snprintf(sub_gate_stats.topic, MAX_MQTT_TOPIC_LEN, "%s/%s", BASE_MQTT_TOPIC,
+           GATE_STATS_TOPIC);
+
+  ret = mqtt5_api_subscribe(&sub_gate_stats);
+  if (ret != ESP_OK)
+    return ret;
+
+  mqtt5_api_subscription_t sub_gate_schedule = {
+    .callback = &gate_schedule_received,
+    .qos = 1,
+  };
+  snprintf(sub_gate_schedule.topic, MAX_MQTT_TOPIC_LEN, "%s/%s",
+           BASE_MQTT_TOPIC, GATE_SCHEDULE_TOPIC);
+
+  ret = mqtt5_api_subscribe(&sub_gate_schedule);
+  if (ret != ESP_OK)
+    return ret;
+
+  mqtt5_api_subscription_t sub_gate_health = {
+    .callback = &gate_health_received,
+  };
+  snprintf(sub_gate_health.topic, MAX_MQTT_TOPIC_LEN, "%s/%s", BASE_MQTT_TOPIC,
+           GATE_HEALTH_TOPIC);
+
+  ret = mqtt5_api_subscribe(&sub_gate_health);
+  if (ret != ESP_OK)
+    return ret;
 
   ESP_LOGI(TAG, "Gate initialized successfully");
   return ESP_OK;
 }
 
+esp_err_t gate_prepare_sleep(uint32_t *wake_in_s)
+{
+  if (!s_gate_instance || !s_motor_instance)
+    return ESP_ERR_INVALID_STATE;
+
+  taskENTER_CRITICAL(&s_command_lock);
+  bool active = s_command.active;
+  taskEXIT_CRITICAL(&s_command_lock);
+  if (active || s_motor_instance->_act_state != STATE_MOTOR_STOPPED)
+    return ESP_ERR_INVALID_STATE;
+
+  esp_err_t ret = gate_scheduler_next_wake(wake_in_s);
+  if (ret != ESP_OK)
+    return ret;
+
+  gate_journal_park();
+  return ESP_OK;
+}
+
 // TODO: Implement using GPIO driver
 static esp_err_t gate_open_impl(gate_t *self)
 {
@@ -240,8 +1169,7 @@ static esp_err_t gate_open_impl(gate_t *self)
   ESP_LOGI(TAG, "Gate opening");
 
   s_motor_instance->in_action(ACTION_CLOCKWISE_MOTOR);
-
-  s_gate_instance->_act_state = GATE_OPENED;
+  gate_set_state(GATE_OPENING);
 
   return ESP_OK;
 }
@@ -255,8 +1183,7 @@ static esp_err_t gate_close_impl(gate_t *self)
   ESP_LOGI(TAG, "Gate closing");
 
   s_motor_instance->in_action(ACTION_COUNTERCLOCKWISE_MOTOR);
-
-  s_gate_instance->_act_state = GATE_CLOSED;
+  gate_set_state(GATE_CLOSING);
 
   return ESP_OK;
 }
@@ -270,8 +1197,7 @@ static esp_err_t gate_stop_impl(gate_t *self)
   ESP_LOGI(TAG, "Gate stopped");
 
   s_motor_instance->in_action(ACTION_STOP_MOTOR);
-
-  s_gate_instance->_act_state = GATE_STOPPED;
+  gate_set_state(GATE_STOPPED);
 
   return ESP_OK;
 }
@@ -284,8 +1210,7 @@ static esp_err_t gate_stop_impl(gate_t *self)
  */
 static gate_state_t gate_get_state_impl(gate_t *self)
 {
-  ESP_LOGI(TAG, "Gate state queried: %s",
-           self->_act_state == GATE_OPENED ? "OPENED" : "CLOSED");
+  ESP_LOGI(TAG, "Gate state queried: %d", self->_act_state);
   return self->_act_state;
 }
 
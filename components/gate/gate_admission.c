@@ -0,0 +1,227 @@
+/**
+ * @file gate_admission.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Admission control of the gate commands
+ *
+ * Buckets count the milli-tokens taken and not refilled yet, so a zeroed
+ * bucket is full and a new source starts with its whole burst.
+ *
+ * @version 0.1
+ * @date 2024-12-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_admission.h"
+
+#include <freertos/FreeRTOS.h>
+#include <metrics.h>
+#include <string.h>
+
+#define TOKEN_MILLI 1000
+
+typedef struct
+{
+  uint32_t taken;       ///< Milli-tokens taken, 0 when full.
+  int64_t refilled_us;  ///< Time of the last refill.
+} gate_admission_tokens_t;
+
+typedef struct
+{
+  uint32_t source;
+  bool used;
+  int64_t seen_us;  ///< Last command, to forget the oldest source.
+  gate_admission_tokens_t tokens;
+} gate_admission_source_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static gate_admission_config_t s_config = GATE_ADMISSION_DEFAULT_CONFIG;
+static gate_admission_source_t s_sources[GATE_ADMISSION_MAX_SOURCES];
+static gate_admission_tokens_t s_topics[GATE_ADMISSION_TOPICS];
+
+static bool s_moved = false;
+static gate_travel_direction_t s_direction = GATE_TRAVEL_OPENING;
+static int64_t s_moved_us = 0;  ///< Last start, `gpio_now_us`.
+
+static metrics_metric_t s_counts[GATE_ADMISSION_VERDICTS] = {
+  [GATE_ADMITTED] = {
+    .name = "gate_commands_admitted_total",
+    .help = "Gate commands admitted.",
+    .type = METRICS_COUNTER,
+  },
+  [GATE_REJECTED_SOURCE] = {
+    .name = "gate_commands_rejected_total",
+    .help = "Gate commands rejected by the admission control.",
+    .labels = "reason=\"source\"",
+    .type = METRICS_COUNTER,
+  },
+  [GATE_REJECTED_TOPIC] = {
+    .name = "gate_commands_rejected_total",
+    .help = "Gate commands rejected by the admission control.",
+    .labels = "reason=\"topic\"",
+    .type = METRICS_COUNTER,
+  },
+  [GATE_REJECTED_REVERSAL] = {
+    .name = "gate_commands_rejected_total",
+    .help = "Gate commands rejected by the admission control.",
+    .labels = "reason=\"reversal\"",
+    .type = METRICS_COUNTER,
+  },
+};
+
+/**
+ * @brief Refill a bucket up to now, with the lock held.
+ *
+ * @return true if it holds a whole token.
+ */
+static bool gate_admission_refill(gate_admission_tokens_t *tokens,
+                                  const gate_admission_bucket_t *bucket,
+                                  int64_t now_us)
+{
+  if (bucket->burst == 0)
+    return true;
+
+  int64_t elapsed_us = now_us - tokens->refilled_us;
+  if (elapsed_us > 0)
+  {
+    // rate_per_min tokens a minute is rate_per_min milli-tokens per 60 ms
+    int64_t refill = elapsed_us * bucket->rate_per_min / 60000;
+    if (refill >= tokens->taken)
+      tokens->taken = 0;
+    else
+      tokens->taken -= (uint32_t)refill;
+    // Keep the remainder, so slow rates still refill
+    tokens->refilled_us =
+      bucket->rate_per_min
+        ? now_us - (elapsed_us - refill * 60000 / bucket->rate_per_min)
+        : now_us;
+  }
+
+  uint32_t capacity = (uint32_t)bucket->burst * TOKEN_MILLI;
+  if (tokens->taken > capacity)
+    tokens->taken = capacity;
+  return capacity - tokens->taken >= TOKEN_MILLI;
+}
+
+static inline void gate_admission_take(gate_admission_tokens_t *tokens,
+                                       const gate_admission_bucket_t *bucket)
+{
+  if (bucket->burst)
+    tokens->taken += TOKEN_MILLI;
+}
+
+/**
+ * @brief Find the entry of a source, or reuse the least recently seen one.
+ */
+static gate_admission_source_t *gate_admission_source(uint32_t source,
+                                                      int64_t now_us)
+{
+  gate_admission_source_t *oldest = &s_sources[0];
+  for (size_t i = 0; i < GATE_ADMISSION_MAX_SOURCES; i++)
+  {
+    gate_admission_source_t *entry = &s_sources[i];
+    if (entry->used && entry->source == source)
+      return entry;
+    if (!entry->used)
+    {
+      if (oldest->used)
+        oldest = entry;
+    }
+    else if (oldest->used && entry->seen_us < oldest->seen_us)
+    {
+      oldest = entry;
+    }
+  }
+
+  memset(oldest, 0, sizeof(*oldest));
+  oldest->source = source;
+  oldest->used = true;
+  oldest->tokens.refilled_us = now_us;
+  return oldest;
+}
+
+void gate_admission_init(void)
+{
+  for (size_t i = 0; i < GATE_ADMISSION_VERDICTS; i++)
+    metrics_register(&s_counts[i]);
+}
+
+void gate_admission_configure(const gate_admission_config_t *config)
+{
+  taskENTER_CRITICAL(&s_lock);
+  s_config = *config;
+  memset(s_sources, 0, sizeof(s_sources));
+  memset(s_topics, 0, sizeof(s_topics));
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+gate_admission_verdict_t gate_admission_check(uint32_t source,
+                                              gate_admission_topic_t topic,
+                                              int64_t now_us)
+{
+  if (topic >= GATE_ADMISSION_TOPICS)
+    return GATE_REJECTED_TOPIC;
+
+  gate_admission_verdict_t verdict = GATE_ADMITTED;
+
+  taskENTER_CRITICAL(&s_lock);
+  gate_admission_source_t *entry = gate_admission_source(source, now_us);
+  entry->seen_us = now_us;
+
+  // Both buckets must hold a token, or neither is taken from
+  if (!gate_admission_refill(&entry->tokens, &s_config.source, now_us))
+  {
+    verdict = GATE_REJECTED_SOURCE;
+  }
+  else if (!gate_admission_refill(&s_topics[topic], &s_config.topic, now_us))
+  {
+    verdict = GATE_REJECTED_TOPIC;
+  }
+  else
+  {
+    gate_admission_take(&entry->tokens, &s_config.source);
+    gate_admission_take(&s_topics[topic], &s_config.topic);
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  return verdict;
+}
+
+gate_admission_verdict_t gate_admission_direction(
+  gate_travel_direction_t direction, int64_t now_us)
+{
+  gate_admission_verdict_t verdict = GATE_ADMITTED;
+
+  taskENTER_CRITICAL(&s_lock);
+  if (s_moved && direction != s_direction &&
+      now_us - s_moved_us < (int64_t)s_config.reversal_dwell_ms * 1000)
+    verdict = GATE_REJECTED_REVERSAL;
+  taskEXIT_CRITICAL(&s_lock);
+
+  return verdict;
+}
+
+void gate_admission_moved(gate_travel_direction_t direction,
+                          int64_t timestamp_us)
+{
+  taskENTER_CRITICAL(&s_lock);
+  s_moved = true;
+  s_direction = direction;
+  s_moved_us = timestamp_us;
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void gate_admission_count(gate_admission_verdict_t verdict)
+{
+  if (verdict < GATE_ADMISSION_VERDICTS)
+    metrics_counter_add(&s_counts[verdict], 1);
+}
+
+void gate_admission_get_counts(uint32_t counts[GATE_ADMISSION_VERDICTS])
+{
+  for (size_t i = 0; i < GATE_ADMISSION_VERDICTS; i++)
+    counts[i] = (uint32_t)atomic_load_explicit(&s_counts[i].value,
+                                               memory_order_relaxed);
+}
@@ -0,0 +1,108 @@
+/**
+ * @file gate_command.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Parser of the gate commands received over MQTT
+ *
+ * @version 0.1
+ * @date 2024-12-02
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_command.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "gate_parse.h"
+
+bool gate_command_parse_action(const char *token, int len,
+                               gate_mqtt_action_t *action)
+{
+  uint32_t number;
+  if (gate_parse_uint(token, len, GATE_MQTT_INVALID_ACTION - 1, &number))
+    *action = (gate_mqtt_action_t)number;
+  else if (gate_parse_equals(token, len, "open"))
+    *action = GATE_MQTT_OPEN;
+  else if (gate_parse_equals(token, len, "close"))
+    *action = GATE_MQTT_CLOSE;
+  else if (gate_parse_equals(token, len, "stop"))
+    *action = GATE_MQTT_STOP;
+  else
+    return false;
+
+  return true;
+}
+
+static bool gate_command_parse_option(gate_command_t *cmd, const char *key,
+                                      int key_len, const char *value,
+                                      int value_len)
+{
+  uint8_t option;
+  if (gate_parse_equals(key, key_len, "pct"))
+    option = GATE_COMMAND_OPT_PCT;
+  else if (gate_parse_equals(key, key_len, "after"))
+    option = GATE_COMMAND_OPT_AFTER;
+  else if (gate_parse_equals(key, key_len, "id"))
+    option = GATE_COMMAND_OPT_ID;
+  else
+    return false;
+
+  // Each option at most once
+  if (cmd->options & option)
+    return false;
+  cmd->options |= option;
+
+  uint32_t number;
+  switch (option)
+  {
+    case GATE_COMMAND_OPT_PCT:
+      if (cmd->action != GATE_MQTT_OPEN ||
+          !gate_parse_uint(value, value_len, 100, &number))
+        return false;
+      cmd->pct = number;
+      return true;
+    case GATE_COMMAND_OPT_AFTER:
+      return gate_parse_duration(value, value_len, GATE_COMMAND_MAX_AFTER_S,
+                                 &cmd->after_s);
+    default:
+      return gate_parse_uint(value, value_len, UINT32_MAX, &cmd->id);
+  }
+}
+
+esp_err_t gate_command_parse(const char *data, int len, gate_command_t *cmd)
+{
+  if (data == NULL || cmd == NULL || len <= 0)
+    return ESP_ERR_INVALID_ARG;
+
+  *cmd = (gate_command_t){
+    .action = GATE_MQTT_INVALID_ACTION,
+    .pct = 100,
+  };
+
+  gate_parse_t parse;
+  const char *verb;
+  int verb_len;
+  gate_parse_begin(&parse, data, len, &verb, &verb_len);
+  if (gate_parse_equals(verb, verb_len, "pedestrian"))
+  {
+    cmd->action = GATE_MQTT_OPEN;
+    cmd->options = GATE_COMMAND_OPT_PCT;
+    cmd->pct = GATE_COMMAND_PEDESTRIAN_PCT;
+  }
+  else if (!gate_command_parse_action(verb, verb_len, &cmd->action))
+    return ESP_ERR_INVALID_ARG;
+
+  const char *key, *value;
+  int key_len, value_len;
+  bool ok = true;
+  while (gate_parse_next(&parse, &key, &key_len, &value, &value_len, &ok))
+  {
+    if (!gate_command_parse_option(cmd, key, key_len, value, value_len))
+      return ESP_ERR_INVALID_ARG;
+  }
+
+  return ok ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
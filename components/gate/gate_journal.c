@@ -0,0 +1,186 @@
+/**
+ * @file gate_journal.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Persisted state of the gate, to resume it after a reboot
+ *
+ * The record lives in a single NVS key. NVS is itself an append-only log: each
+ * write is appended to the active page and the previous copy is only marked
+ * erased, with pages rotated over the whole partition. What limits flash wear
+ * is therefore the number of writes, which the coalescing keeps to about one
+ * per motion.
+ *
+ * Before deep sleep the record is also parked in RTC memory, which survives
+ * the sleep but not a power loss. A wake resumes from it, without waiting on
+ * NVS, and with the time powered of the last wake that NVS did not get.
+ *
+ * @version 0.1
+ * @date 2024-12-06
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_journal.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+#include <nvs.h>
+#include <string.h>
+
+static const char *TAG = "GATE JOURNAL";
+static const char *NVS_NAMESPACE = "gate_journal";
+static const char *NVS_KEY_RECORD = "record";
+
+static gate_journal_snapshot_cb_t s_snapshot = NULL;
+static TimerHandle_t s_timer = NULL;
+static SemaphoreHandle_t s_flush_mutex = NULL;
+
+static bool s_dirty = false;
+static int64_t s_dirty_since_us = 0;  ///< First change not written yet.
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static gate_journal_record_t s_written;  ///< Last record written.
+static uint32_t s_powered_base_s = 0;    ///< Time powered before this boot.
+static uint32_t s_writes = 0;
+
+// Reloaded by the bootloader on every boot but a wake from deep sleep
+RTC_DATA_ATTR static gate_journal_record_t s_parked;
+RTC_DATA_ATTR static bool s_parked_valid = false;
+
+static void gate_journal_expired(TimerHandle_t timer)
+{
+  gate_journal_flush();
+}
+
+esp_err_t gate_journal_init(gate_journal_snapshot_cb_t snapshot,
+                            gate_journal_record_t *restored)
+{
+  s_snapshot = snapshot;
+
+  if (!s_timer)
+    s_timer = xTimerCreate("gate_journal", pdMS_TO_TICKS(GATE_JOURNAL_QUIET_MS),
+                           pdFALSE, NULL, gate_journal_expired);
+  if (!s_flush_mutex)
+    s_flush_mutex = xSemaphoreCreateMutex();
+  if (!s_timer || !s_flush_mutex)
+    return ESP_ERR_NO_MEM;
+
+  size_t size = sizeof(s_written);
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+  if (ret == ESP_OK)
+  {
+    ret = nvs_get_blob(handle, NVS_KEY_RECORD, &s_written, &size);
+    nvs_close(handle);
+  }
+  bool written = ret == ESP_OK && size == sizeof(s_written) &&
+                 s_written.version == GATE_JOURNAL_VERSION;
+  if (!written)
+    memset(&s_written, 0, sizeof(s_written));
+
+  // Taken once, so a later sleep without parking does not resume it again
+  bool parked = s_parked_valid && s_parked.version == GATE_JOURNAL_VERSION;
+  s_parked_valid = false;
+
+  if (parked)
+    *restored = s_parked;
+  else if (written)
+    *restored = s_written;
+  else
+    return ESP_ERR_NOT_FOUND;
+
+  ESP_LOGD(TAG, "Resumed from %s", parked ? "RTC memory" : "NVS");
+  s_powered_base_s = restored->powered_s;
+  return ESP_OK;
+}
+
+void gate_journal_park(void)
+{
+  gate_journal_flush();
+  if (!s_snapshot)
+    return;
+
+  memset(&s_parked, 0, sizeof(s_parked));
+  s_snapshot(&s_parked);
+  s_parked.version = GATE_JOURNAL_VERSION;
+  s_parked.powered_s = gate_journal_powered_s();
+  s_parked_valid = true;
+}
+
+void gate_journal_touch(void)
+{
+  int64_t now_us = gpio_now_us();
+  bool restart = true;
+
+  taskENTER_CRITICAL(&s_lock);
+  if (!s_dirty)
+  {
+    s_dirty = true;
+    s_dirty_since_us = now_us;
+  }
+  // Past the longest delay, let the running timer write it
+  else if (now_us - s_dirty_since_us >= GATE_JOURNAL_MAX_DELAY_MS * 1000LL)
+  {
+    restart = false;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (restart)
+    xTimerReset(s_timer, 0);
+}
+
+void gate_journal_flush(void)
+{
+  if (!s_snapshot || xSemaphoreTake(s_flush_mutex, portMAX_DELAY) != pdTRUE)
+    return;
+
+  taskENTER_CRITICAL(&s_lock);
+  s_dirty = false;
+  taskEXIT_CRITICAL(&s_lock);
+
+  gate_journal_record_t record;
+  memset(&record, 0, sizeof(record));  // Padding is compared too
+  s_snapshot(&record);
+  record.version = GATE_JOURNAL_VERSION;
+
+  // Powered time alone does not make the record worth a write
+  record.powered_s = s_written.powered_s;
+  if (memcmp(&record, &s_written, sizeof(record)) == 0)
+  {
+    xSemaphoreGive(s_flush_mutex);
+    return;
+  }
+  record.powered_s = gate_journal_powered_s();
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret == ESP_OK)
+  {
+    ret = nvs_set_blob(handle, NVS_KEY_RECORD, &record, sizeof(record));
+    if (ret == ESP_OK)
+      ret = nvs_commit(handle);
+    nvs_close(handle);
+  }
+
+  if (ret == ESP_OK)
+  {
+    s_written = record;
+    s_writes++;
+    ESP_LOGD(TAG, "Record %lu written", (unsigned long)s_writes);
+  }
+  else
+  {
+    ESP_LOGW(TAG, "Failed to write the record: %s", esp_err_to_name(ret));
+  }
+
+  xSemaphoreGive(s_flush_mutex);
+}
+
+uint32_t gate_journal_powered_s(void)
+{
+  return s_powered_base_s + gpio_now_us() / 1000000;
+}
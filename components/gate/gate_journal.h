@@ -0,0 +1,101 @@
+/**
+ * @file gate_journal.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Persisted state of the gate, to resume it after a reboot
+ *
+ * Private to the gate component. Changes are coalesced: `gate_journal_touch`
+ * only (re)arms a timer, and the record is written once the gate has been
+ * quiet for `GATE_JOURNAL_QUIET_MS`, or `GATE_JOURNAL_MAX_DELAY_MS` after the
+ * first change at the latest. A record equal to the last one written is not
+ * written again.
+ *
+ * @version 0.1
+ * @date 2024-12-06
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_JOURNAL_H
+#define GATE_JOURNAL_H
+
+#include <esp_err.h>
+#include <stdint.h>
+
+#include "gate_travel.h"
+#include "motor.h"
+
+/**
+ * @brief Quiet time after a change before the record is written.
+ */
+#define GATE_JOURNAL_QUIET_MS 3000
+
+/**
+ * @brief Longest a change waits to be written while changes keep coming.
+ */
+#define GATE_JOURNAL_MAX_DELAY_MS 60000
+
+/**
+ * @brief Layout version of `gate_journal_record_t`, records of other versions
+ * are ignored.
+ */
+#define GATE_JOURNAL_VERSION 1
+
+/**
+ * @brief Persisted state of the gate.
+ */
+typedef struct
+{
+  uint16_t version;           ///< `GATE_JOURNAL_VERSION`.
+  uint8_t gate_state;         ///< `gate_state_t`.
+  uint8_t motor_last_state;   ///< `motor_state_t` of the last motion.
+  int16_t position;           ///< Position, see `gate_travel.h`.
+  uint32_t powered_s;         ///< Time powered, over all boots.
+  gate_travel_model_t model;  ///< Learned travel model.
+  motor_health_t health;      ///< Wear indicators of the motor.
+} gate_journal_record_t;
+
+/**
+ * @brief Fill a record with the current state, `version` and `powered_s` are
+ * set by the journal.
+ */
+typedef void (*gate_journal_snapshot_cb_t)(gate_journal_record_t *record);
+
+/**
+ * @brief Initialize the journal and read the last record.
+ *
+ * @param snapshot Callback filling the records to write.
+ * @param restored Record parked before a deep sleep, or else the last record
+ * written.
+ * @return ESP_OK if `restored` was read, ESP_ERR_NOT_FOUND if there is none,
+ * ESP_ERR_NO_MEM if the journal could not be created.
+ */
+esp_err_t gate_journal_init(gate_journal_snapshot_cb_t snapshot,
+                            gate_journal_record_t *restored);
+
+/**
+ * @brief Note that the state changed, the record is written later.
+ */
+void gate_journal_touch(void);
+
+/**
+ * @brief Write the record now, if it changed.
+ */
+void gate_journal_flush(void);
+
+/**
+ * @brief Write the record, and park a copy in RTC memory for a deep sleep.
+ *
+ * The next `gate_journal_init` after a wake restores the parked copy.
+ */
+void gate_journal_park(void);
+
+/**
+ * @brief Time powered, over all boots.
+ *
+ * @return Seconds powered, including this boot.
+ */
+uint32_t gate_journal_powered_s(void);
+
+#endif  // GATE_JOURNAL_H
@@ -0,0 +1,128 @@
+/**
+ * @file gate_parse.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Tokenizer shared by the parsers of the gate payloads
+ *
+ * @version 0.1
+ * @date 2024-12-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_parse.h"
+
+#include <string.h>
+
+static inline bool gate_parse_is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+void gate_parse_begin(gate_parse_t *parse, const char *data, int len,
+                      const char **verb, int *verb_len)
+{
+  const char *p = data;
+  const char *end = data + (len > 0 ? len : 0);
+  while (p < end && gate_parse_is_space(*p))
+    p++;
+  while (end > p && gate_parse_is_space(end[-1]))
+    end--;
+
+  *verb = p;
+  while (p < end && *p != ':')
+    p++;
+  *verb_len = p - *verb;
+
+  parse->p = p;
+  parse->end = end;
+}
+
+bool gate_parse_next(gate_parse_t *parse, const char **key, int *key_len,
+                     const char **value, int *value_len, bool *ok)
+{
+  const char *p = parse->p;
+  if (p == parse->end)
+    return false;
+
+  // Skip the ':' after the verb or the ',' after the last option, then an
+  // option must follow
+  p++;
+  *key = p;
+  while (p < parse->end && *p != '=' && *p != ',')
+    p++;
+  if (p == parse->end || *p != '=' || p == *key)
+  {
+    *ok = false;
+    return false;
+  }
+  *key_len = p - *key;
+
+  *value = ++p;
+  while (p < parse->end && *p != ',')
+    p++;
+  *value_len = p - *value;
+
+  parse->p = p;
+  return true;
+}
+
+bool gate_parse_equals(const char *token, int len, const char *word)
+{
+  return strlen(word) == len && memcmp(token, word, len) == 0;
+}
+
+bool gate_parse_uint(const char *token, int len, uint32_t max,
+                     uint32_t *value)
+{
+  if (len <= 0)
+    return false;
+
+  uint32_t result = 0;
+  for (int i = 0; i < len; i++)
+  {
+    if (token[i] < '0' || token[i] > '9')
+      return false;
+
+    uint32_t digit = token[i] - '0';
+    if (digit > max || result > (max - digit) / 10)
+      return false;
+    result = result * 10 + digit;
+  }
+
+  *value = result;
+  return true;
+}
+
+bool gate_parse_duration(const char *token, int len, uint32_t max_s,
+                         uint32_t *value_s)
+{
+  uint32_t unit_s = 1;
+  if (len > 0)
+  {
+    switch (token[len - 1])
+    {
+      case 's':
+        len--;
+        break;
+      case 'm':
+        unit_s = 60;
+        len--;
+        break;
+      case 'h':
+        unit_s = 60 * 60;
+        len--;
+        break;
+      default:
+        break;
+    }
+  }
+
+  uint32_t value;
+  if (!gate_parse_uint(token, len, max_s / unit_s, &value))
+    return false;
+
+  *value_s = value * unit_s;
+  return true;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file gate_parse.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Tokenizer shared by the parsers of the gate payloads
+ *
+ * Private to the gate component. Payloads have the form
+ * `verb[:key=value{,key=value}]`, are bounded by their length and are never
+ * copied.
+ *
+ * @version 0.1
+ * @date 2024-12-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_PARSE_H
+#define GATE_PARSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Position in a payload being parsed.
+ */
+typedef struct
+{
+  const char *p;    ///< Next character to read.
+  const char *end;  ///< End of the payload.
+} gate_parse_t;
+
+/**
+ * @brief Start parsing a payload, dropping surrounding whitespace.
+ *
+ * @param parse Parser state.
+ * @param data Payload, not NUL-terminated.
+ * @param len Length of the payload.
+ * @param verb Verb of the payload.
+ * @param verb_len Length of the verb, may be 0.
+ */
+void gate_parse_begin(gate_parse_t *parse, const char *data, int len,
+                      const char **verb, int *verb_len);
+
+/**
+ * @brief Read the next `key=value` option.
+ *
+ * @param parse Parser state.
+ * @param key Key of the option.
+ * @param key_len Length of the key.
+ * @param value Value of the option.
+ * @param value_len Length of the value, may be 0.
+ * @param ok Set to false if the options are malformed, untouched otherwise.
+ * @return true if an option was read, false at the end of the payload or on
+ * error.
+ */
+bool gate_parse_next(gate_parse_t *parse, const char **key, int *key_len,
+                     const char **value, int *value_len, bool *ok);
+
+/**
+ * @brief Whether a token is exactly `word`.
+ */
+bool gate_parse_equals(const char *token, int len, const char *word);
+
+/**
+ * @brief Parse an unsigned decimal, with no sign and at most `max`.
+ */
+bool gate_parse_uint(const char *token, int len, uint32_t max,
+                     uint32_t *value);
+
+/**
+ * @brief Parse a duration in `s` (default), `m` or `h`, at most `max_s`.
+ */
+bool gate_parse_duration(const char *token, int len, uint32_t max_s,
+                         uint32_t *value_s);
+
+#endif  // GATE_PARSE_H
@@ -0,0 +1,966 @@
+/**
+ * @file gate_scheduler.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Scheduled and delayed gate actions, on a hierarchical timer wheel
+ *
+ * The wheel has `WHEEL_LEVELS` levels of `WHEEL_SLOTS` slots. Level 0 holds
+ * the schedules due in the next 64 seconds, one slot per second, and every
+ * next level covers 64 times the span of the previous one. When level 0 wraps,
+ * the matching slot of level 1 is spread over level 0, and so on. Each slot is
+ * an intrusive list of entries of a fixed pool, so adding and cancelling only
+ * link and unlink one entry.
+ *
+ * Idle entries of the pool are on a free list. The ONCE and LEFT_OPEN entries
+ * of a gate are also on lists of that gate, which `cancel_once` and
+ * `notify_open` walk instead of the pool.
+ *
+ * @version 0.1
+ * @date 2024-12-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_scheduler.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include <nvs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gate_parse.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/**
+ * @brief Longest a WEEKLY schedule sleeps before checking the clock again, so
+ * clock corrections are followed.
+ */
+#define WEEKLY_CHECKPOINT_S (60 * 60)
+
+/**
+ * @brief Retry period of WEEKLY schedules while the clock is not set.
+ */
+#define CLOCK_UNSET_RETRY_S 60
+
+/**
+ * @brief Earliest year taken as a set clock.
+ */
+#define CLOCK_VALID_YEAR 2024
+
+/**
+ * @brief Most entries a tick runs in one critical section, and most actions
+ * it copies to its stack at once.
+ */
+#define TICK_BATCH 16
+
+#define DAY_S (24 * 60 * 60)
+#define WEEK_S (7 * DAY_S)
+
+static const char *TAG = "GATE SCHEDULER";
+static const char *NVS_NAMESPACE = "gate_sched";
+static const char *NVS_KEY_SCHEDULES = "schedules";
+static const char *NVS_KEY_TZ = "tz";
+
+typedef struct gate_scheduler_entry
+{
+  struct gate_scheduler_entry *next;         ///< Next of the slot or free list.
+  struct gate_scheduler_entry **pprev;       ///< Link to it, NULL if idle.
+  struct gate_scheduler_entry *gate_next;    ///< Next entry of the gate.
+  struct gate_scheduler_entry **gate_pprev;  ///< NULL if on no gate list.
+  uint32_t expires;                          ///< Wheel time it is due at.
+  gate_schedule_t schedule;                  ///< Schedule of the entry.
+  void *arg;                                 ///< Argument of the callback.
+  bool used;                                 ///< The entry holds a schedule.
+  bool checkpoint;  ///< WEEKLY only, due to check the clock, not to run.
+  int32_t due_s;    ///< WEEKLY only, run it is due for, seconds of the week.
+} gate_scheduler_entry_t;
+
+/**
+ * @brief Entries of a gate that its events act on.
+ */
+typedef struct
+{
+  void *arg;                          ///< Argument of the gate.
+  bool used;                          ///< The lists belong to `arg`.
+  gate_scheduler_entry_t *once;       ///< Pending ONCE entries.
+  gate_scheduler_entry_t *left_open;  ///< LEFT_OPEN entries.
+} gate_scheduler_gate_t;
+
+/**
+ * @brief Persisted form of a schedule.
+ */
+typedef struct
+{
+  uint16_t id;               ///< ID of the schedule.
+  gate_schedule_t schedule;  ///< The schedule.
+} gate_scheduler_record_t;
+
+static gate_scheduler_entry_t s_entries[GATE_SCHEDULER_MAX_ENTRIES];
+static gate_scheduler_entry_t *s_free = NULL;
+static gate_scheduler_gate_t s_gates[GATE_SCHEDULER_MAX_GATES];
+static gate_scheduler_entry_t *s_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t s_now = 0;  ///< Wheel time, seconds since init.
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t s_tick_timer = NULL;
+static gate_scheduler_action_cb_t s_callback = NULL;
+
+static inline uint16_t gate_scheduler_id(const gate_scheduler_entry_t *entry)
+{
+  return (entry - s_entries) + 1;
+}
+
+static inline bool gate_scheduler_persistent(const gate_schedule_t *schedule)
+{
+  return schedule->type != GATE_SCHEDULE_ONCE;
+}
+
+// Must hold `s_lock`. An entry due now goes to the slot of level 0 being run
+static void gate_scheduler_link_at(gate_scheduler_entry_t *entry,
+                                   uint32_t expires)
+{
+  uint32_t delay = expires - s_now;
+  entry->expires = expires;
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delay >= (1u << (WHEEL_BITS * (level + 1))))
+    level++;
+
+  gate_scheduler_entry_t **head =
+    &s_wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  entry->next = *head;
+  if (*head)
+    (*head)->pprev = &entry->next;
+  *head = entry;
+  entry->pprev = head;
+}
+
+// Must hold `s_lock`
+static void gate_scheduler_link(gate_scheduler_entry_t *entry, uint32_t delay)
+{
+  // Due in the next tick at the earliest, at the span of the wheel at most
+  if (delay == 0)
+    delay = 1;
+  if (delay >= (1u << (WHEEL_BITS * WHEEL_LEVELS)))
+    delay = (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+  gate_scheduler_link_at(entry, s_now + delay);
+}
+
+// Must hold `s_lock`
+static void gate_scheduler_unlink(gate_scheduler_entry_t *entry)
+{
+  if (entry->pprev == NULL)
+    return;
+
+  *entry->pprev = entry->next;
+  if (entry->next)
+    entry->next->pprev = entry->pprev;
+  entry->next = NULL;
+  entry->pprev = NULL;
+}
+
+// Must hold `s_lock`. Lists of the gate of `arg`, taken if `create` is set
+static gate_scheduler_gate_t *gate_scheduler_gate(void *arg, bool create)
+{
+  gate_scheduler_gate_t *unused = NULL;
+  for (int i = 0; i < GATE_SCHEDULER_MAX_GATES; i++)
+  {
+    if (s_gates[i].used && s_gates[i].arg == arg)
+      return &s_gates[i];
+    if (!s_gates[i].used && unused == NULL)
+      unused = &s_gates[i];
+  }
+
+  if (!create || unused == NULL)
+    return NULL;
+
+  unused->used = true;
+  unused->arg = arg;
+  return unused;
+}
+
+// Must hold `s_lock`. Only ONCE and LEFT_OPEN entries go on a gate list
+static void gate_scheduler_gate_link(gate_scheduler_gate_t *gate,
+                                     gate_scheduler_entry_t *entry)
+{
+  gate_scheduler_entry_t **head = entry->schedule.type == GATE_SCHEDULE_ONCE
+                                    ? &gate->once
+                                    : &gate->left_open;
+  entry->gate_next = *head;
+  if (*head)
+    (*head)->gate_pprev = &entry->gate_next;
+  *head = entry;
+  entry->gate_pprev = head;
+}
+
+// Must hold `s_lock`
+static void gate_scheduler_gate_unlink(gate_scheduler_entry_t *entry)
+{
+  if (entry->gate_pprev == NULL)
+    return;
+
+  *entry->gate_pprev = entry->gate_next;
+  if (entry->gate_next)
+    entry->gate_next->gate_pprev = entry->gate_pprev;
+  entry->gate_next = NULL;
+  entry->gate_pprev = NULL;
+}
+
+// Must hold `s_lock`
+static gate_scheduler_entry_t *gate_scheduler_alloc(void)
+{
+  gate_scheduler_entry_t *entry = s_free;
+  if (entry)
+  {
+    s_free = entry->next;
+    entry->next = NULL;
+  }
+  return entry;
+}
+
+// Must hold `s_lock`. Unlink an entry from the wheel and its gate and free it
+static void gate_scheduler_release(gate_scheduler_entry_t *entry)
+{
+  gate_scheduler_unlink(entry);
+  gate_scheduler_gate_unlink(entry);
+  entry->used = false;
+  entry->next = s_free;
+  s_free = entry;
+}
+
+static bool gate_scheduler_clock(struct tm *now)
+{
+  time_t t = time(NULL);
+  localtime_r(&t, now);
+  return now->tm_year + 1900 >= CLOCK_VALID_YEAR;
+}
+
+// Local time as seconds since Sunday 00:00
+static inline int32_t gate_scheduler_week_s(const struct tm *tm)
+{
+  return tm->tm_wday * DAY_S + tm->tm_hour * 3600 + tm->tm_min * 60 +
+         tm->tm_sec;
+}
+
+// Seconds from `from_s`, seconds of the week, until the next run of a WEEKLY
+// schedule, strictly after it
+static uint32_t gate_scheduler_weekly_delay(const gate_schedule_t *schedule,
+                                            int32_t from_s)
+{
+  int wday = from_s / DAY_S;
+  int32_t day_s = from_s % DAY_S;
+  int32_t at_s = schedule->hour * 3600 + schedule->minute * 60;
+
+  for (int day = 0; day <= 7; day++)
+  {
+    if (!(schedule->weekdays & (1 << ((wday + day) % 7))))
+      continue;
+
+    int32_t delay = day * DAY_S + at_s - day_s;
+    if (delay > 0)
+      return delay;
+  }
+
+  return UINT32_MAX;
+}
+
+/**
+ * @brief Arm a WEEKLY entry for its next run, with `s_lock` held.
+ *
+ * After a run the next one is found from the run that was due, not from the
+ * clock: the tick may read the clock a second early, which would find the
+ * same run again a second later.
+ */
+static void gate_scheduler_arm_weekly(gate_scheduler_entry_t *entry,
+                                      const struct tm *now, bool clock_valid,
+                                      bool ran)
+{
+  uint32_t delay = CLOCK_UNSET_RETRY_S;
+  entry->checkpoint = true;
+  if (clock_valid)
+  {
+    int32_t now_s = gate_scheduler_week_s(now);
+    int32_t next = 0;
+    if (ran)
+    {
+      // Seconds since the due run, a few either way
+      int32_t late_s = (now_s - entry->due_s + WEEK_S + WEEK_S / 2) % WEEK_S -
+                       WEEK_S / 2;
+      next = gate_scheduler_weekly_delay(&entry->schedule, entry->due_s) -
+             late_s;
+    }
+    // Not after a run, or the clock jumped past the next run meanwhile
+    if (next <= 0)
+      next = gate_scheduler_weekly_delay(&entry->schedule, now_s);
+
+    delay = next;
+    entry->due_s = (now_s + next) % WEEK_S;
+    entry->checkpoint = delay > WEEKLY_CHECKPOINT_S;
+    if (entry->checkpoint)
+      delay = WEEKLY_CHECKPOINT_S;
+  }
+
+  gate_scheduler_link(entry, delay);
+}
+
+static void gate_scheduler_store()
+{
+  // Up to a record per entry, too many for the stack of the caller
+  gate_scheduler_record_t *records =
+    malloc(GATE_SCHEDULER_MAX_ENTRIES * sizeof(*records));
+  if (records == NULL)
+  {
+    ESP_LOGW(TAG, "Schedules not persisted, no memory");
+    return;
+  }
+  size_t count = 0;
+
+  taskENTER_CRITICAL(&s_lock);
+  for (int i = 0; i < GATE_SCHEDULER_MAX_ENTRIES; i++)
+  {
+    gate_scheduler_entry_t *entry = &s_entries[i];
+    if (!entry->used || !gate_scheduler_persistent(&entry->schedule))
+      continue;
+
+    records[count].id = gate_scheduler_id(entry);
+    records[count].schedule = entry->schedule;
+    count++;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Schedules not persisted, NVS not available");
+    free(records);
+    return;
+  }
+
+  esp_err_t ret = count ? nvs_set_blob(handle, NVS_KEY_SCHEDULES, records,
+                                       count * sizeof(records[0]))
+                        : nvs_erase_key(handle, NVS_KEY_SCHEDULES);
+  if (ret == ESP_OK || ret == ESP_ERR_NVS_NOT_FOUND)
+    ret = nvs_commit(handle);
+  nvs_close(handle);
+  free(records);
+
+  if (ret != ESP_OK)
+    ESP_LOGW(TAG, "Failed to persist schedules: %s", esp_err_to_name(ret));
+}
+
+static void gate_scheduler_restore(void *arg)
+{
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return;
+
+  // The zone first, WEEKLY schedules are armed in local time
+  char tz[GATE_SCHEDULER_TZ_MAX];
+  size_t tz_size = sizeof(tz);
+  if (nvs_get_str(handle, NVS_KEY_TZ, tz, &tz_size) == ESP_OK)
+  {
+    setenv("TZ", tz, 1);
+    tzset();
+  }
+
+  size_t size = 0;
+  if (nvs_get_blob(handle, NVS_KEY_SCHEDULES, NULL, &size) != ESP_OK)
+    size = 0;
+
+  // On the heap, the pool is too large for the caller's stack
+  gate_scheduler_record_t *records = size ? malloc(size) : NULL;
+  esp_err_t ret = ESP_ERR_NOT_FOUND;
+  if (records)
+    ret = nvs_get_blob(handle, NVS_KEY_SCHEDULES, records, &size);
+  nvs_close(handle);
+
+  if (ret != ESP_OK || size % sizeof(records[0]) != 0)
+  {
+    free(records);
+    return;
+  }
+
+  struct tm now;
+  bool clock_valid = gate_scheduler_clock(&now);
+
+  taskENTER_CRITICAL(&s_lock);
+  for (size_t i = 0; i < size / sizeof(records[0]); i++)
+  {
+    uint16_t id = records[i].id;
+    const gate_schedule_t *schedule = &records[i].schedule;
+    if (id == GATE_SCHEDULE_NONE || id > GATE_SCHEDULER_MAX_ENTRIES ||
+        s_entries[id - 1].used)
+      continue;
+
+    gate_scheduler_gate_t *gate = NULL;
+    if (schedule->type == GATE_SCHEDULE_LEFT_OPEN)
+    {
+      gate = gate_scheduler_gate(arg, true);
+      if (gate == NULL)
+        continue;
+    }
+
+    gate_scheduler_entry_t *entry = &s_entries[id - 1];
+    entry->used = true;
+    entry->arg = arg;
+    entry->schedule = *schedule;
+    if (gate)
+      gate_scheduler_gate_link(gate, entry);
+    if (entry->schedule.type == GATE_SCHEDULE_WEEKLY)
+      gate_scheduler_arm_weekly(entry, &now, clock_valid, false);
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  free(records);
+}
+
+static void gate_scheduler_tick(TimerHandle_t timer)
+{
+  // Actions due in this tick, copied so the entries can be reused meanwhile
+  struct
+  {
+    uint16_t id;
+    gate_mqtt_action_t action;
+    void *arg;
+  } due[TICK_BATCH];
+
+  struct tm now;
+  bool clock_valid = gate_scheduler_clock(&now);
+
+  taskENTER_CRITICAL(&s_lock);
+  s_now++;
+
+  // Spread the next slot of each upper level that wrapped over the levels
+  // below
+  for (int level = 1; level < WHEEL_LEVELS; level++)
+  {
+    if (s_now & ((1u << (WHEEL_BITS * level)) - 1))
+      break;
+
+    gate_scheduler_entry_t **head =
+      &s_wheel[level][(s_now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    gate_scheduler_entry_t *entry = *head;
+    *head = NULL;
+    while (entry)
+    {
+      gate_scheduler_entry_t *next = entry->next;
+      gate_scheduler_link_at(entry, entry->expires);
+      entry = next;
+    }
+  }
+
+  // A batch at a time, the rest of the slot stays linked so the callbacks
+  // can cancel it meanwhile. Entries armed again are due in later slots
+  gate_scheduler_entry_t **head = &s_wheel[0][s_now & WHEEL_MASK];
+  bool more;
+  do
+  {
+    int due_count = 0;
+    for (int taken = 0; *head && taken < TICK_BATCH; taken++)
+    {
+      gate_scheduler_entry_t *entry = *head;
+      gate_scheduler_unlink(entry);
+
+      bool run = true;
+      if (entry->schedule.type == GATE_SCHEDULE_WEEKLY)
+      {
+        run = !entry->checkpoint && clock_valid;
+        gate_scheduler_arm_weekly(entry, &now, clock_valid, run);
+      }
+      // LEFT_OPEN stays idle until the gate is left open again
+
+      if (run)
+      {
+        due[due_count].id = gate_scheduler_id(entry);
+        due[due_count].action = entry->schedule.action;
+        due[due_count].arg = entry->arg;
+        due_count++;
+      }
+      if (entry->schedule.type == GATE_SCHEDULE_ONCE)
+        gate_scheduler_release(entry);
+    }
+    more = *head != NULL;
+    taskEXIT_CRITICAL(&s_lock);
+
+    // Outside the lock, so the callback can add and cancel schedules
+    for (int i = 0; i < due_count; i++)
+    {
+      ESP_LOGI(TAG, "Schedule %u runs action %d", due[i].id, due[i].action);
+      if (s_callback)
+        s_callback(due[i].arg, due[i].id, due[i].action);
+    }
+
+    if (more)
+      taskENTER_CRITICAL(&s_lock);
+  } while (more);
+}
+
+esp_err_t gate_scheduler_init(gate_scheduler_action_cb_t callback, void *arg)
+{
+  s_callback = callback;
+  if (s_tick_timer != NULL)
+    return ESP_OK;
+
+  gate_scheduler_restore(arg);
+
+  // Free in order, so the lowest IDs are handed out first
+  taskENTER_CRITICAL(&s_lock);
+  for (int i = GATE_SCHEDULER_MAX_ENTRIES - 1; i >= 0; i--)
+  {
+    if (s_entries[i].used)
+      continue;
+    s_entries[i].next = s_free;
+    s_free = &s_entries[i];
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  s_tick_timer = xTimerCreate("gate_scheduler", pdMS_TO_TICKS(1000), pdTRUE,
+                              NULL, gate_scheduler_tick);
+  if (s_tick_timer == NULL || xTimerStart(s_tick_timer, 0) != pdPASS)
+    return ESP_ERR_NO_MEM;
+
+  ESP_LOGI(TAG, "Scheduler started");
+  return ESP_OK;
+}
+
+esp_err_t gate_scheduler_add(const gate_schedule_t *schedule, void *arg,
+                             uint16_t *id)
+{
+  if (!schedule || schedule->action >= GATE_MQTT_INVALID_ACTION)
+    return ESP_ERR_INVALID_ARG;
+
+  switch (schedule->type)
+  {
+    case GATE_SCHEDULE_ONCE:
+    case GATE_SCHEDULE_LEFT_OPEN:
+      if (schedule->delay_s == 0)
+        return ESP_ERR_INVALID_ARG;
+      break;
+    case GATE_SCHEDULE_WEEKLY:
+      if (schedule->hour > 23 || schedule->minute > 59 ||
+          (schedule->weekdays & GATE_SCHEDULE_EVERY_DAY) == 0)
+        return ESP_ERR_INVALID_ARG;
+      break;
+    default:
+      return ESP_ERR_INVALID_ARG;
+  }
+
+  struct tm now;
+  bool clock_valid = false;
+  if (schedule->type == GATE_SCHEDULE_WEEKLY)
+    clock_valid = gate_scheduler_clock(&now);
+
+  gate_scheduler_entry_t *entry = NULL;
+  taskENTER_CRITICAL(&s_lock);
+  gate_scheduler_gate_t *gate = NULL;
+  if (schedule->type != GATE_SCHEDULE_WEEKLY)
+    gate = gate_scheduler_gate(arg, true);
+  if (gate || schedule->type == GATE_SCHEDULE_WEEKLY)
+    entry = gate_scheduler_alloc();
+
+  if (entry)
+  {
+    entry->used = true;
+    entry->arg = arg;
+    entry->schedule = *schedule;
+    entry->checkpoint = false;
+    if (gate)
+      gate_scheduler_gate_link(gate, entry);
+    if (schedule->type == GATE_SCHEDULE_ONCE)
+      gate_scheduler_link(entry, schedule->delay_s);
+    else if (schedule->type == GATE_SCHEDULE_WEEKLY)
+      gate_scheduler_arm_weekly(entry, &now, clock_valid, false);
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!entry)
+    return ESP_ERR_NO_MEM;
+
+  if (id)
+    *id = gate_scheduler_id(entry);
+  if (gate_scheduler_persistent(schedule))
+    gate_scheduler_store();
+
+  return ESP_OK;
+}
+
+esp_err_t gate_scheduler_cancel(uint16_t id)
+{
+  if (id == GATE_SCHEDULE_NONE || id > GATE_SCHEDULER_MAX_ENTRIES)
+    return ESP_ERR_NOT_FOUND;
+
+  gate_scheduler_entry_t *entry = &s_entries[id - 1];
+  taskENTER_CRITICAL(&s_lock);
+  bool used = entry->used;
+  bool persistent = used && gate_scheduler_persistent(&entry->schedule);
+  if (used)
+    gate_scheduler_release(entry);
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!used)
+    return ESP_ERR_NOT_FOUND;
+
+  if (persistent)
+    gate_scheduler_store();
+
+  return ESP_OK;
+}
+
+int gate_scheduler_cancel_once(void *arg)
+{
+  int cancelled = 0;
+
+  taskENTER_CRITICAL(&s_lock);
+  gate_scheduler_gate_t *gate = gate_scheduler_gate(arg, false);
+  while (gate && gate->once)
+  {
+    gate_scheduler_release(gate->once);
+    cancelled++;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  return cancelled;
+}
+
+void gate_scheduler_notify_open(void *arg, bool open)
+{
+  taskENTER_CRITICAL(&s_lock);
+  gate_scheduler_gate_t *gate = gate_scheduler_gate(arg, false);
+  for (gate_scheduler_entry_t *entry = gate ? gate->left_open : NULL; entry;
+       entry = entry->gate_next)
+  {
+    // Counted from when the gate was first left open, not from the last call
+    if (open && entry->pprev == NULL)
+      gate_scheduler_link(entry, entry->schedule.delay_s);
+    else if (!open)
+      gate_scheduler_unlink(entry);
+  }
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+esp_err_t gate_scheduler_set_timezone(const char *tz)
+{
+  size_t len = tz ? strlen(tz) : 0;
+  if (len == 0 || len >= GATE_SCHEDULER_TZ_MAX)
+    return ESP_ERR_INVALID_ARG;
+  for (size_t i = 0; i < len; i++)
+  {
+    if ((unsigned char)tz[i] <= ' ' || (unsigned char)tz[i] > '~')
+      return ESP_ERR_INVALID_ARG;
+  }
+
+  setenv("TZ", tz, 1);
+  tzset();
+  ESP_LOGI(TAG, "Time zone set to %s", tz);
+
+  // The WEEKLY schedules were armed in the old local time
+  struct tm now;
+  bool clock_valid = gate_scheduler_clock(&now);
+  taskENTER_CRITICAL(&s_lock);
+  for (int i = 0; i < GATE_SCHEDULER_MAX_ENTRIES; i++)
+  {
+    gate_scheduler_entry_t *entry = &s_entries[i];
+    if (!entry->used || entry->schedule.type != GATE_SCHEDULE_WEEKLY)
+      continue;
+
+    gate_scheduler_unlink(entry);
+    gate_scheduler_arm_weekly(entry, &now, clock_valid, false);
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret == ESP_OK)
+  {
+    ret = nvs_set_str(handle, NVS_KEY_TZ, tz);
+    if (ret == ESP_OK)
+      ret = nvs_commit(handle);
+    nvs_close(handle);
+  }
+  if (ret != ESP_OK)
+    ESP_LOGW(TAG, "Time zone not persisted: %s", esp_err_to_name(ret));
+
+  return ESP_OK;
+}
+
+esp_err_t gate_scheduler_get_timezone(char *buf, size_t size)
+{
+  const char *tz = getenv("TZ");
+  int n = snprintf(buf, size, "%s", tz ? tz : "UTC0");
+  return n >= 0 && n < size ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t gate_scheduler_next_wake(uint32_t *wake_in_s)
+{
+  esp_err_t ret = ESP_OK;
+  uint32_t next = UINT32_MAX;
+
+  taskENTER_CRITICAL(&s_lock);
+  for (int i = 0; i < GATE_SCHEDULER_MAX_ENTRIES; i++)
+  {
+    gate_scheduler_entry_t *entry = &s_entries[i];
+    if (!entry->used || entry->pprev == NULL)
+      continue;
+
+    // Only WEEKLY schedules are armed again from the wall clock after a wake
+    if (entry->schedule.type != GATE_SCHEDULE_WEEKLY)
+    {
+      ret = ESP_ERR_INVALID_STATE;
+      break;
+    }
+    if (entry->expires - s_now < next)
+      next = entry->expires - s_now;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  *wake_in_s = next;
+  return ret;
+}
+
+esp_err_t gate_scheduler_get(uint16_t id, gate_schedule_t *schedule,
+                             uint32_t *remaining_s)
+{
+  if (id == GATE_SCHEDULE_NONE || id > GATE_SCHEDULER_MAX_ENTRIES)
+    return ESP_ERR_NOT_FOUND;
+
+  gate_scheduler_entry_t *entry = &s_entries[id - 1];
+  uint32_t remaining = UINT32_MAX;
+  bool used;
+
+  taskENTER_CRITICAL(&s_lock);
+  used = entry->used;
+  if (used)
+  {
+    *schedule = entry->schedule;
+    if (entry->pprev != NULL)
+      remaining = entry->expires - s_now;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!used)
+    return ESP_ERR_NOT_FOUND;
+
+  // A WEEKLY entry may only be due to check the clock, ask the clock instead
+  struct tm now;
+  if (schedule->type == GATE_SCHEDULE_WEEKLY)
+    remaining = gate_scheduler_clock(&now)
+                  ? gate_scheduler_weekly_delay(schedule,
+                                                gate_scheduler_week_s(&now))
+                  : UINT32_MAX;
+
+  if (remaining_s)
+    *remaining_s = remaining;
+  return ESP_OK;
+}
+
+// `HH:MM`, 24-hour clock
+static bool gate_scheduler_parse_at(const char *token, int len,
+                                    gate_schedule_t *schedule)
+{
+  uint32_t hour, minute;
+  if (len != 5 || token[2] != ':' || !gate_parse_uint(token, 2, 23, &hour) ||
+      !gate_parse_uint(token + 3, 2, 59, &minute))
+    return false;
+
+  schedule->hour = hour;
+  schedule->minute = minute;
+  return true;
+}
+
+static bool gate_scheduler_parse_days(const char *token, int len,
+                                      uint8_t *weekdays)
+{
+  if (gate_parse_equals(token, len, "daily"))
+    *weekdays = GATE_SCHEDULE_EVERY_DAY;
+  else if (gate_parse_equals(token, len, "weekdays"))
+    *weekdays = GATE_SCHEDULE_WEEKDAYS;
+  else if (gate_parse_equals(token, len, "weekend"))
+    *weekdays = GATE_SCHEDULE_EVERY_DAY & ~GATE_SCHEDULE_WEEKDAYS;
+  else
+  {
+    *weekdays = 0;
+    for (int i = 0; i < len; i++)
+    {
+      if (token[i] < '0' || token[i] > '6')
+        return false;
+      *weekdays |= 1 << (token[i] - '0');
+    }
+  }
+
+  return *weekdays != 0;
+}
+
+esp_err_t gate_scheduler_parse(const char *data, int len,
+                               gate_schedule_request_t *request)
+{
+  if (data == NULL || request == NULL || len <= 0)
+    return ESP_ERR_INVALID_ARG;
+
+  *request = (gate_schedule_request_t){
+    .schedule.action = GATE_MQTT_INVALID_ACTION,
+    .schedule.weekdays = GATE_SCHEDULE_EVERY_DAY,
+  };
+
+  gate_parse_t parse;
+  const char *verb;
+  int verb_len;
+  gate_parse_begin(&parse, data, len, &verb, &verb_len);
+  if (gate_parse_equals(verb, verb_len, "add"))
+    request->op = GATE_SCHEDULE_REQUEST_ADD;
+  else if (gate_parse_equals(verb, verb_len, "del"))
+    request->op = GATE_SCHEDULE_REQUEST_DEL;
+  else if (gate_parse_equals(verb, verb_len, "list"))
+    request->op = GATE_SCHEDULE_REQUEST_LIST;
+  else if (gate_parse_equals(verb, verb_len, "tz"))
+    request->op = GATE_SCHEDULE_REQUEST_TZ;
+  else
+    return ESP_ERR_INVALID_ARG;
+
+  // The zone is the rest of the payload, POSIX zones have commas
+  if (request->op == GATE_SCHEDULE_REQUEST_TZ)
+  {
+    if (parse.p == parse.end)
+      return ESP_OK;
+
+    int tz_len = parse.end - parse.p - 1;
+    if (tz_len <= 0 || tz_len >= sizeof(request->tz))
+      return ESP_ERR_INVALID_ARG;
+    memcpy(request->tz, parse.p + 1, tz_len);
+    request->tz[tz_len] = '\0';
+    return ESP_OK;
+  }
+
+  gate_schedule_t *schedule = &request->schedule;
+  bool has_when = false;
+  bool has_days = false;
+  bool has_id = false;
+
+  const char *key, *value;
+  int key_len, value_len;
+  bool ok = true;
+  while (ok && gate_parse_next(&parse, &key, &key_len, &value, &value_len, &ok))
+  {
+    bool add = request->op == GATE_SCHEDULE_REQUEST_ADD;
+    uint32_t number;
+
+    if (add && gate_parse_equals(key, key_len, "do"))
+    {
+      ok = schedule->action == GATE_MQTT_INVALID_ACTION &&
+           gate_command_parse_action(value, value_len, &schedule->action);
+    }
+    else if (add && gate_parse_equals(key, key_len, "after"))
+    {
+      schedule->type = GATE_SCHEDULE_ONCE;
+      ok = !has_when && gate_parse_duration(value, value_len,
+                                            GATE_COMMAND_MAX_AFTER_S,
+                                            &schedule->delay_s);
+      has_when = true;
+    }
+    else if (add && gate_parse_equals(key, key_len, "open_for"))
+    {
+      schedule->type = GATE_SCHEDULE_LEFT_OPEN;
+      ok = !has_when && gate_parse_duration(value, value_len,
+                                            GATE_COMMAND_MAX_AFTER_S,
+                                            &schedule->delay_s);
+      has_when = true;
+    }
+    else if (add && gate_parse_equals(key, key_len, "at"))
+    {
+      schedule->type = GATE_SCHEDULE_WEEKLY;
+      ok = !has_when && gate_scheduler_parse_at(value, value_len, schedule);
+      has_when = true;
+    }
+    else if (add && gate_parse_equals(key, key_len, "days"))
+    {
+      ok = !has_days &&
+           gate_scheduler_parse_days(value, value_len, &schedule->weekdays);
+      has_days = true;
+    }
+    else if (request->op == GATE_SCHEDULE_REQUEST_DEL &&
+             gate_parse_equals(key, key_len, "id"))
+    {
+      ok = !has_id &&
+           gate_parse_uint(value, value_len, GATE_SCHEDULER_MAX_ENTRIES,
+                           &number) &&
+           number != GATE_SCHEDULE_NONE;
+      if (ok)
+        request->id = number;
+      has_id = true;
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+  if (!ok)
+    return ESP_ERR_INVALID_ARG;
+
+  switch (request->op)
+  {
+    case GATE_SCHEDULE_REQUEST_ADD:
+      if (!has_when || schedule->action == GATE_MQTT_INVALID_ACTION ||
+          (has_days && schedule->type != GATE_SCHEDULE_WEEKLY))
+        return ESP_ERR_INVALID_ARG;
+      break;
+    case GATE_SCHEDULE_REQUEST_DEL:
+      if (!has_id)
+        return ESP_ERR_INVALID_ARG;
+      break;
+    default:
+      break;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t gate_scheduler_format(uint16_t id, char *buf, size_t size)
+{
+  static const char *const ACTIONS[] = {"open", "close", "stop"};
+
+  gate_schedule_t schedule;
+  uint32_t remaining_s;
+  esp_err_t ret = gate_scheduler_get(id, &schedule, &remaining_s);
+  if (ret != ESP_OK)
+    return ret;
+
+  int n = snprintf(buf, size, "id=%u,do=%s,", id, ACTIONS[schedule.action]);
+  if (n < 0 || n >= size)
+    return ESP_ERR_INVALID_SIZE;
+
+  switch (schedule.type)
+  {
+    case GATE_SCHEDULE_ONCE:
+      n += snprintf(buf + n, size - n, "after=%lus",
+                    (unsigned long)schedule.delay_s);
+      break;
+    case GATE_SCHEDULE_LEFT_OPEN:
+      n += snprintf(buf + n, size - n, "open_for=%lus",
+                    (unsigned long)schedule.delay_s);
+      break;
+    default:
+    {
+      n += snprintf(buf + n, size - n, "at=%02u:%02u,days=", schedule.hour,
+                    schedule.minute);
+      for (int day = 0; day < 7 && n < size; day++)
+        if (schedule.weekdays & (1 << day))
+          n += snprintf(buf + n, size - n, "%d", day);
+      break;
+    }
+  }
+
+  if (n < size && remaining_s != UINT32_MAX)
+    n += snprintf(buf + n, size - n, ",in=%lu", (unsigned long)remaining_s);
+
+  return n < size ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file gate_travel.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Travel-time model and position estimate of the gate
+ *
+ * Only travels between both endlines, with no stop on the way, are learned:
+ * the position after a stop is itself an estimate, and the one assumed at boot
+ * may be wrong. The average moves a quarter of the way to each sample, with
+ * integer math only.
+ *
+ * @version 0.1
+ * @date 2024-12-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "gate_travel.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+
+/**
+ * @brief Weight of a new sample, as a power of two: 1/4.
+ */
+#define EWMA_SHIFT 2
+
+static const char *TAG = "GATE TRAVEL";
+
+static gate_travel_model_t s_model = {
+  .full_ms = {GATE_TRAVEL_DEFAULT_MS, GATE_TRAVEL_DEFAULT_MS},
+};
+
+// Current or last motion
+static bool s_moving = false;
+static gate_travel_direction_t s_direction = GATE_TRAVEL_OPENING;
+static int64_t s_start_us = 0;  ///< When the motion started.
+static int s_start_position = 0;
+static bool s_from_endline = false;  ///< The start position was measured.
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Must be called with the lock held
+static int gate_travel_position_locked(int64_t now_us)
+{
+  if (!s_moving)
+    return s_start_position;
+
+  // permille = elapsed_us * 1000 / (full_ms * 1000)
+  int64_t moved = (now_us - s_start_us) / s_model.full_ms[s_direction];
+  int64_t position = (s_direction == GATE_TRAVEL_OPENING)
+                       ? s_start_position + moved
+                       : s_start_position - moved;
+
+  if (position < 0)
+    return 0;
+  if (position > GATE_TRAVEL_OPEN)
+    return GATE_TRAVEL_OPEN;
+  return position;
+}
+
+void gate_travel_init(const gate_travel_model_t *model, int position,
+                      bool at_endline)
+{
+  taskENTER_CRITICAL(&s_lock);
+  if (model && model->full_ms[0] > 0 && model->full_ms[1] > 0)
+    s_model = *model;
+  s_start_position = (position < 0)                  ? 0
+                     : (position > GATE_TRAVEL_OPEN) ? GATE_TRAVEL_OPEN
+                                                     : position;
+  s_moving = false;
+  s_from_endline = at_endline;
+  taskEXIT_CRITICAL(&s_lock);
+
+  ESP_LOGI(TAG, "Travel model: open %lu ms (%u), close %lu ms (%u)",
+           (unsigned long)s_model.full_ms[GATE_TRAVEL_OPENING],
+           s_model.samples[GATE_TRAVEL_OPENING],
+           (unsigned long)s_model.full_ms[GATE_TRAVEL_CLOSING],
+           s_model.samples[GATE_TRAVEL_CLOSING]);
+}
+
+void gate_travel_start(gate_travel_direction_t direction, int64_t timestamp_us)
+{
+  taskENTER_CRITICAL(&s_lock);
+  // A reversal starts from wherever the gate was
+  if (s_moving && s_direction != direction)
+    s_from_endline = false;
+
+  if (!s_moving || s_direction != direction)
+  {
+    s_start_position = gate_travel_position_locked(timestamp_us);
+    s_start_us = timestamp_us;
+    s_direction = direction;
+    s_moving = true;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void gate_travel_stop(int64_t timestamp_us)
+{
+  taskENTER_CRITICAL(&s_lock);
+  if (s_moving)
+  {
+    s_start_position = gate_travel_position_locked(timestamp_us);
+    s_moving = false;
+    s_from_endline = false;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void gate_travel_endline(gate_travel_direction_t direction,
+                         int64_t timestamp_us)
+{
+  int origin = (direction == GATE_TRAVEL_OPENING) ? 0 : GATE_TRAVEL_OPEN;
+  bool full_travel = false;
+  bool learned = false;
+  uint32_t sample = 0;
+  uint32_t full_ms = 0;
+
+  taskENTER_CRITICAL(&s_lock);
+  if (s_moving && s_direction == direction && s_from_endline &&
+      s_start_position == origin)
+  {
+    full_travel = true;
+    sample = (timestamp_us - s_start_us) / 1000;
+    uint32_t average = s_model.full_ms[direction];
+    uint16_t samples = s_model.samples[direction];
+
+    learned = samples < GATE_TRAVEL_TRUSTED_SAMPLES ||
+              (sample > average / 2 && sample < average * 2);
+    if (samples == 0)
+      average = sample;
+    else
+      average += ((int32_t)sample - (int32_t)average) / (1 << EWMA_SHIFT);
+
+    learned = learned && average > 0;
+    if (learned)
+    {
+      s_model.full_ms[direction] = average;
+      if (samples < UINT16_MAX)
+        s_model.samples[direction]++;
+      full_ms = average;
+    }
+  }
+
+  s_start_position = (direction == GATE_TRAVEL_OPENING) ? GATE_TRAVEL_OPEN : 0;
+  s_moving = false;
+  s_from_endline = true;
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!learned)
+  {
+    if (full_travel)
+      ESP_LOGW(TAG, "Travel of %lu ms discarded", (unsigned long)sample);
+    return;
+  }
+
+  ESP_LOGI(TAG, "Full %s travel: %lu ms",
+           (direction == GATE_TRAVEL_OPENING) ? "open" : "close",
+           (unsigned long)full_ms);
+}
+
+int gate_travel_position(int64_t now_us)
+{
+  taskENTER_CRITICAL(&s_lock);
+  int position = gate_travel_position_locked(now_us);
+  taskEXIT_CRITICAL(&s_lock);
+  return position;
+}
+
+uint32_t gate_travel_time_to(int target, int64_t now_us,
+                             gate_travel_direction_t *direction)
+{
+  taskENTER_CRITICAL(&s_lock);
+  int position = gate_travel_position_locked(now_us);
+  *direction = (target >= position) ? GATE_TRAVEL_OPENING : GATE_TRAVEL_CLOSING;
+  int distance = (target >= position) ? target - position : position - target;
+  uint32_t full_ms = s_model.full_ms[*direction];
+  taskEXIT_CRITICAL(&s_lock);
+
+  return (uint64_t)full_ms * distance / GATE_TRAVEL_OPEN;
+}
+
+void gate_travel_get_model(gate_travel_model_t *model)
+{
+  taskENTER_CRITICAL(&s_lock);
+  *model = s_model;
+  taskEXIT_CRITICAL(&s_lock);
+}
@@ -16,37 +16,71 @@
 
 #include <esp_err.h>
 
+#include "gate_command.h"
 #include "motor.h"
 
 #define BASE_MQTT_TOPIC "Inatel/C115/2024/Semester/02"
 #define GATE_ACTION_TOPIC "gate/action"
 #define GATE_STATE_TOPIC "gate/state"
 #define GATE_STATE_TOPIC_ANSWER "gate/state/answer"
+#define GATE_STATE_TOPIC_EVENT "gate/state/event"
 #define GATE_ACTION_TOPIC_ANSWER "gate/action/answer"
+#define GATE_ACTION_TOPIC_STATUS "gate/action/status"
+#define GATE_STATS_TOPIC "gate/stats"
+#define GATE_STATS_TOPIC_ANSWER "gate/stats/answer"
+#define GATE_SCHEDULE_TOPIC "gate/schedule"
+#define GATE_SCHEDULE_TOPIC_ANSWER "gate/schedule/answer"
+#define GATE_HEALTH_TOPIC "gate/health"
+#define GATE_HEALTH_TOPIC_ANSWER "gate/health/answer"
+
+/**
+ * @brief Time an open or close command may take to reach its endline before
+ * the motor is stopped and the command reported as timed out.
+ */
+#define GATE_TRAVEL_TIMEOUT_MS 60000
+
+/**
+ * @brief Counters of the MQTT commands handled by the gate.
+ */
+typedef struct
+{
+  uint32_t commands_received;   ///< Messages received on the action topic.
+  uint32_t commands_rejected;   ///< Actions that were not valid.
+  uint32_t commands_duplicate;  ///< Actions whose `id` was already handled.
+  uint32_t commands_throttled;  ///< Commands the admission control rejected.
+  uint32_t commands_dropped;    ///< Payloads lost to a full work queue.
+  uint32_t answers_sent;        ///< Answers published successfully.
+  uint32_t answers_failed;      ///< Answers the client failed to publish.
+} gate_stats_t;
 
 /**
  * @brief Enum representing the possible states of the gate.
  *
- * @note It's a objective state of each gate action, i.e, the gate receives a
- * action to close then it will be in the state GATE_CLOSED.
+ * @note The state follows the motor: GATE_OPENED and GATE_CLOSED are only
+ * reached when the endline sensor is hit, in between the gate is moving or
+ * stopped halfway.
  */
 typedef enum
 {
   GATE_OPENED = 0,  ///< The gate is open.
   GATE_CLOSED,      ///< The gate is closed.
-  GATE_STOPPED,     ///< The gate is stopped.
+  GATE_STOPPED,     ///< The gate is stopped halfway.
+  GATE_OPENING,     ///< The gate is moving to open.
+  GATE_CLOSING,     ///< The gate is moving to close.
 } gate_state_t;
 
 /**
- * @brief Enum representing the possible actions received od MQTT.
+ * @brief Stages of a command, published on `GATE_ACTION_TOPIC_STATUS` with the
+ * command's `id`.
  */
 typedef enum
 {
-  GATE_MQTT_OPEN = 0,
-  GATE_MQTT_CLOSE,
-  GATE_MQTT_STOP,
-  GATE_MQTT_INVALID_ACTION,  // Invalid action
-} gate_mqtt_action_t;
+  GATE_COMMAND_ACCEPTED = 0,  ///< The command was accepted.
+  GATE_COMMAND_IN_MOTION,     ///< The motor started moving for it.
+  GATE_COMMAND_COMPLETED,     ///< The gate reached the objective state.
+  GATE_COMMAND_FAILED,        ///< Superseded or interrupted by another action.
+  GATE_COMMAND_TIMEOUT,       ///< No endline within `GATE_TRAVEL_TIMEOUT_MS`.
+} gate_command_stage_t;
 
 /**
  * @brief Structure representing a gate object.
@@ -96,4 +130,31 @@ typedef struct gate
  */
 esp_err_t gate_init_impl(gate_t *self, motor_t *motor);
 
+/**
+ * @brief Get the counters of the MQTT commands handled by the gate.
+ *
+ * @param stats Where to copy the counters.
+ */
+void gate_get_stats(gate_stats_t *stats);
+
+/**
+ * @brief Smallest amount of stack the gate work task has had left, in bytes.
+ *
+ * @return The stack high water mark, 0 if the task is not started.
+ */
+uint32_t gate_work_stack_free();
+
+/**
+ * @brief Get the gate ready for deep sleep.
+ *
+ * Writes the journal and parks its record in RTC memory, where the next
+ * `gate_init_impl` resumes from.
+ *
+ * @param wake_in_s Seconds until a WEEKLY schedule needs the chip awake,
+ * UINT32_MAX if none.
+ * @return ESP_OK if the gate may sleep, ESP_ERR_INVALID_STATE while a command
+ * runs, the motor moves, or a ONCE or LEFT_OPEN schedule is armed.
+ */
+esp_err_t gate_prepare_sleep(uint32_t *wake_in_s);
+
 #endif  // GATE_H
@@ -0,0 +1,157 @@
+/**
+ * @file gate_admission.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Admission control of the gate commands
+ *
+ * Commands are admitted by two token buckets, one of their source and one of
+ * their topic, so a client that floods the gate is throttled without locking
+ * the others out, and all of them together still cannot wear the motor. A
+ * bucket holds up to `burst` commands and refills at `rate_per_min`. On top,
+ * a command that would reverse the motor within `reversal_dwell_ms` of its
+ * last start in the other direction is rejected.
+ *
+ * A stop is always admitted, and scheduled actions are not commands. A
+ * rejected command costs a few comparisons: it is dropped with no publish, so
+ * a storm is not echoed back to the broker, and counted.
+ *
+ * @version 0.1
+ * @date 2024-12-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_ADMISSION_H
+#define GATE_ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gate_travel.h"
+
+/**
+ * @brief Sources followed, the least recently seen one is forgotten.
+ */
+#define GATE_ADMISSION_MAX_SOURCES 8
+
+/**
+ * @brief Default admission, a few commands in a row, then one every 2 s from
+ * a source and one a second in total.
+ */
+#define GATE_ADMISSION_DEFAULT_CONFIG \
+  {                                   \
+    .source = {                       \
+      .burst = 5,                     \
+      .rate_per_min = 30,             \
+    },                                \
+    .topic = {                        \
+      .burst = 10,                    \
+      .rate_per_min = 60,             \
+    },                                \
+    .reversal_dwell_ms = 1500,        \
+  }
+
+/**
+ * @brief Token bucket.
+ */
+typedef struct
+{
+  uint16_t burst;         ///< Commands admitted in a row, 0 for no limit.
+  uint16_t rate_per_min;  ///< Commands admitted per minute, past the burst.
+} gate_admission_bucket_t;
+
+/**
+ * @brief Admission of the commands.
+ */
+typedef struct
+{
+  gate_admission_bucket_t source;  ///< Bucket of each source.
+  gate_admission_bucket_t topic;   ///< Bucket of each topic, all sources.
+  uint32_t reversal_dwell_ms;      ///< Least time between opposite starts.
+} gate_admission_config_t;
+
+/**
+ * @brief Command topics, each with its bucket.
+ */
+typedef enum
+{
+  GATE_ADMISSION_ACTION = 0,  ///< `GATE_ACTION_TOPIC`.
+  GATE_ADMISSION_SCHEDULE,    ///< `GATE_SCHEDULE_TOPIC`.
+  GATE_ADMISSION_TOPICS,
+} gate_admission_topic_t;
+
+/**
+ * @brief Outcome of the admission of a command.
+ */
+typedef enum
+{
+  GATE_ADMITTED = 0,       ///< Carry it out.
+  GATE_REJECTED_SOURCE,    ///< Its source is over its rate.
+  GATE_REJECTED_TOPIC,     ///< Its topic is over its rate.
+  GATE_REJECTED_REVERSAL,  ///< It would reverse the motor too soon.
+  GATE_ADMISSION_VERDICTS,
+} gate_admission_verdict_t;
+
+/**
+ * @brief Register the counters on `/metrics`, once.
+ */
+void gate_admission_init(void);
+
+/**
+ * @brief Set the admission, and refill every bucket.
+ *
+ * `GATE_ADMISSION_DEFAULT_CONFIG` applies until then.
+ *
+ * @param config Admission, copied.
+ */
+void gate_admission_configure(const gate_admission_config_t *config);
+
+/**
+ * @brief Admit a command by its source and topic, taking a token of both.
+ *
+ * Any task. A stop does not go through this.
+ *
+ * @param source Source given to the subscription callback.
+ * @param topic Topic of the command.
+ * @param now_us Current time, `gpio_now_us`.
+ * @return `GATE_ADMITTED`, or why the command is rejected.
+ */
+gate_admission_verdict_t gate_admission_check(uint32_t source,
+                                              gate_admission_topic_t topic,
+                                              int64_t now_us);
+
+/**
+ * @brief Admit a motion by its direction, against the last start.
+ *
+ * @param direction Direction the command would move the gate in.
+ * @param now_us Current time, `gpio_now_us`.
+ * @return `GATE_ADMITTED` or `GATE_REJECTED_REVERSAL`.
+ */
+gate_admission_verdict_t gate_admission_direction(
+  gate_travel_direction_t direction, int64_t now_us);
+
+/**
+ * @brief The gate started moving, whatever the cause (command, button).
+ *
+ * @param direction Direction of the motion.
+ * @param timestamp_us When the motion started, `gpio_now_us`.
+ */
+void gate_admission_moved(gate_travel_direction_t direction,
+                          int64_t timestamp_us);
+
+/**
+ * @brief Count a command admitted or rejected.
+ *
+ * @param verdict Outcome of its admission.
+ */
+void gate_admission_count(gate_admission_verdict_t verdict);
+
+/**
+ * @brief Get the commands counted, by outcome.
+ *
+ * @param counts Where to copy the counts, indexed by verdict.
+ */
+void gate_admission_get_counts(uint32_t counts[GATE_ADMISSION_VERDICTS]);
+
+#endif  // GATE_ADMISSION_H
@@ -0,0 +1,108 @@
+/**
+ * @file gate_command.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Parser of the gate commands received over MQTT
+ *
+ * A command is either the numeric action (`0`, `1`, `2`) or a verb followed by
+ * optional comma-separated options:
+ *
+ *     verb [ ':' key '=' value { ',' key '=' value } ]
+ *     verb = open | close | stop | pedestrian
+ *
+ * `pedestrian` is an open to `GATE_COMMAND_PEDESTRIAN_PCT`.
+ *
+ * | Key     | Value                                   | Example          |
+ * |---------|-----------------------------------------|------------------|
+ * | `pct`   | Opening percentage, 0 to 100, open only | `open:pct=50`    |
+ * | `after` | Delay, in `s` (default), `m` or `h`     | `close:after=30s`|
+ * | `id`    | Correlation ID echoed in the answers    | `stop:id=42`     |
+ *
+ * A command with an `id` is carried out once: the same `id` again, e.g. a
+ * retry of the client or a copy sent again by the broker, is dropped. Clients
+ * should use a new `id` for every command.
+ *
+ * @version 0.1
+ * @date 2024-12-02
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_COMMAND_H
+#define GATE_COMMAND_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Largest delay accepted by the `after` option, one day.
+ */
+#define GATE_COMMAND_MAX_AFTER_S (24 * 60 * 60)
+
+/**
+ * @brief Opening percentage of the `pedestrian` verb.
+ */
+#define GATE_COMMAND_PEDESTRIAN_PCT 30
+
+/**
+ * @brief Enum representing the possible actions received od MQTT.
+ */
+typedef enum
+{
+  GATE_MQTT_OPEN = 0,
+  GATE_MQTT_CLOSE,
+  GATE_MQTT_STOP,
+  GATE_MQTT_INVALID_ACTION,  // Invalid action
+} gate_mqtt_action_t;
+
+/**
+ * @brief Options present in a gate command, see `gate_command_t::options`.
+ */
+typedef enum
+{
+  GATE_COMMAND_OPT_PCT = 1 << 0,    ///< `pct` was given.
+  GATE_COMMAND_OPT_AFTER = 1 << 1,  ///< `after` was given.
+  GATE_COMMAND_OPT_ID = 1 << 2,     ///< `id` was given.
+} gate_command_option_t;
+
+/**
+ * @brief Gate command, as parsed from an MQTT payload.
+ */
+typedef struct
+{
+  gate_mqtt_action_t action;  ///< Requested action.
+  uint8_t options;            ///< Given options, `gate_command_option_t` bits.
+  uint8_t pct;                ///< Opening percentage, 100 if not given.
+  uint32_t after_s;           ///< Delay in seconds, 0 if not given.
+  uint32_t id;                ///< Correlation ID, 0 if not given.
+} gate_command_t;
+
+/**
+ * @brief Parse a gate command.
+ *
+ * Reads at most `len` bytes of `data`, which does not need to be
+ * NUL-terminated, in a single pass and without allocating. Surrounding
+ * whitespace is ignored.
+ *
+ * @param data Payload of the command.
+ * @param len Length of the payload.
+ * @param cmd Parsed command, only valid if ESP_OK is returned.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the command is malformed,
+ * has an unknown or repeated option or a value out of range.
+ */
+esp_err_t gate_command_parse(const char *data, int len, gate_command_t *cmd);
+
+/**
+ * @brief Parse an action alone, numeric (`0`) or verb (`open`).
+ *
+ * @param token Action, not NUL-terminated.
+ * @param len Length of the action.
+ * @param action Parsed action.
+ * @return true on success, false if it is not an action.
+ */
+bool gate_command_parse_action(const char *token, int len,
+                               gate_mqtt_action_t *action);
+
+#endif  // GATE_COMMAND_H
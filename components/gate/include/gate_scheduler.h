@@ -0,0 +1,254 @@
+/**
+ * @file gate_scheduler.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Scheduled and delayed gate actions
+ *
+ * Schedules live in a hierarchical timer wheel with a resolution of one
+ * second, advanced by a single FreeRTOS timer. Entries come from a pool
+ * through a free list, and the ONCE and LEFT_OPEN entries of each gate are
+ * also kept on lists of that gate. Adding and cancelling a schedule is
+ * constant-time, and the events of a gate only visit the entries of that
+ * gate, whatever the number of schedules.
+ *
+ * WEEKLY schedules run in the local time of the zone set with
+ * `gate_scheduler_set_timezone`, UTC until one is set.
+ *
+ * @version 0.1
+ * @date 2024-12-03
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_SCHEDULER_H
+#define GATE_SCHEDULER_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gate_command.h"
+
+/**
+ * @brief Number of schedules, of all gates, that can exist at once. Each one
+ * takes about 48 bytes of RAM, and 20 bytes of NVS if it is persisted.
+ */
+#ifndef GATE_SCHEDULER_MAX_ENTRIES
+#define GATE_SCHEDULER_MAX_ENTRIES 256
+#endif
+
+/**
+ * @brief Number of gates that can have ONCE or LEFT_OPEN schedules.
+ */
+#ifndef GATE_SCHEDULER_MAX_GATES
+#define GATE_SCHEDULER_MAX_GATES 4
+#endif
+
+/**
+ * @brief Size of a time zone, with the terminating NUL.
+ */
+#define GATE_SCHEDULER_TZ_MAX 48
+
+/**
+ * @brief ID of no schedule.
+ */
+#define GATE_SCHEDULE_NONE 0
+
+/**
+ * @brief Weekday bits of `gate_schedule_t::weekdays`, as `tm_wday`.
+ */
+#define GATE_SCHEDULE_SUNDAY (1 << 0)
+#define GATE_SCHEDULE_WEEKDAYS (0x3E)  ///< Monday to Friday.
+#define GATE_SCHEDULE_EVERY_DAY (0x7F)
+
+/**
+ * @brief Kinds of schedule.
+ */
+typedef enum
+{
+  GATE_SCHEDULE_ONCE = 0,   ///< Once, `delay_s` after it is added.
+  GATE_SCHEDULE_WEEKLY,     ///< At `hour`:`minute` local time on `weekdays`.
+  GATE_SCHEDULE_LEFT_OPEN,  ///< When the gate stays open for `delay_s`.
+} gate_schedule_type_t;
+
+/**
+ * @brief Schedule of a gate action.
+ */
+typedef struct
+{
+  gate_schedule_type_t type;  ///< Kind of schedule.
+  gate_mqtt_action_t action;  ///< Action to run.
+  uint32_t delay_s;           ///< Delay, for ONCE and LEFT_OPEN.
+  uint8_t hour;               ///< Hour, 0 to 23, for WEEKLY.
+  uint8_t minute;             ///< Minute, 0 to 59, for WEEKLY.
+  uint8_t weekdays;           ///< Days to run on, for WEEKLY.
+} gate_schedule_t;
+
+/**
+ * @brief Operations of the schedule payloads.
+ */
+typedef enum
+{
+  GATE_SCHEDULE_REQUEST_ADD = 0,  ///< Add `schedule`.
+  GATE_SCHEDULE_REQUEST_DEL,      ///< Cancel the schedule `id`.
+  GATE_SCHEDULE_REQUEST_LIST,     ///< List the schedules.
+  GATE_SCHEDULE_REQUEST_TZ,       ///< Set `tz`, or get the zone if empty.
+} gate_schedule_op_t;
+
+/**
+ * @brief Schedule payload, as parsed by `gate_scheduler_parse`.
+ */
+typedef struct
+{
+  gate_schedule_op_t op;           ///< Requested operation.
+  uint16_t id;                     ///< Schedule to cancel, for DEL.
+  gate_schedule_t schedule;        ///< Schedule to add, for ADD.
+  char tz[GATE_SCHEDULER_TZ_MAX];  ///< Zone to set, for TZ.
+} gate_schedule_request_t;
+
+/**
+ * @brief Runs a scheduled action, in the timer service task.
+ *
+ * @param arg Argument given when the schedule was added.
+ * @param id ID of the schedule.
+ * @param action Action to run.
+ */
+typedef void (*gate_scheduler_action_cb_t)(void *arg, uint16_t id,
+                                           gate_mqtt_action_t action);
+
+/**
+ * @brief Start the scheduler and restore the persisted schedules.
+ *
+ * WEEKLY and LEFT_OPEN schedules and the time zone are kept in NVS, ONCE
+ * schedules are lost on reset. Restored schedules are bound to `arg`.
+ *
+ * @param callback Runs the actions of all schedules.
+ * @param arg Argument of the restored schedules.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the timer can not be created.
+ */
+esp_err_t gate_scheduler_init(gate_scheduler_action_cb_t callback, void *arg);
+
+/**
+ * @brief Add a schedule.
+ *
+ * @param schedule Schedule to add, copied.
+ * @param arg Argument passed to the callback when it runs.
+ * @param id ID of the new schedule, may be NULL.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the schedule is not valid,
+ * ESP_ERR_NO_MEM if all the entries are in use, or a ONCE or LEFT_OPEN
+ * schedule is added for more than `GATE_SCHEDULER_MAX_GATES` gates.
+ */
+esp_err_t gate_scheduler_add(const gate_schedule_t *schedule, void *arg,
+                             uint16_t *id);
+
+/**
+ * @brief Cancel a schedule.
+ *
+ * @param id ID of the schedule.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such schedule.
+ */
+esp_err_t gate_scheduler_cancel(uint16_t id);
+
+/**
+ * @brief Cancel the pending ONCE schedules of a gate.
+ *
+ * @param arg Argument the schedules were added with.
+ * @return Number of schedules cancelled.
+ */
+int gate_scheduler_cancel_once(void *arg);
+
+/**
+ * @brief Tell the scheduler whether a gate is open, to arm or disarm its
+ * LEFT_OPEN schedules.
+ *
+ * @param arg Argument the schedules were added with.
+ * @param open Whether the gate is open.
+ */
+void gate_scheduler_notify_open(void *arg, bool open);
+
+/**
+ * @brief Set the time zone of the WEEKLY schedules, and keep it in NVS.
+ *
+ * Sets `TZ` for the whole application and arms the WEEKLY schedules again in
+ * the new local time.
+ *
+ * @param tz Zone in the POSIX `TZ` format, e.g. `WET0WEST,M3.5.0/1,M10.5.0`.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if it is empty, too long or
+ * has spaces or control characters.
+ */
+esp_err_t gate_scheduler_set_timezone(const char *tz);
+
+/**
+ * @brief Get the time zone of the WEEKLY schedules.
+ *
+ * @param buf Buffer for the zone, `UTC0` if none is set.
+ * @param size Size of the buffer.
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if it does not fit.
+ */
+esp_err_t gate_scheduler_get_timezone(char *buf, size_t size);
+
+/**
+ * @brief Find when a deep sleep must end for the schedules to run.
+ *
+ * The wheel stops in deep sleep. WEEKLY schedules are armed again from the
+ * wall clock after the wake, but an armed ONCE or LEFT_OPEN schedule would be
+ * lost or restarted.
+ *
+ * @param wake_in_s Seconds until the next WEEKLY schedule or clock check,
+ * UINT32_MAX if none is armed.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if a ONCE or LEFT_OPEN schedule is
+ * armed.
+ */
+esp_err_t gate_scheduler_next_wake(uint32_t *wake_in_s);
+
+/**
+ * @brief Get a schedule.
+ *
+ * @param id ID of the schedule.
+ * @param schedule Copy of the schedule.
+ * @param remaining_s Seconds until it runs, UINT32_MAX if it is not armed. May
+ * be NULL.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such schedule.
+ */
+esp_err_t gate_scheduler_get(uint16_t id, gate_schedule_t *schedule,
+                             uint32_t *remaining_s);
+
+/**
+ * @brief Parse a schedule payload.
+ *
+ * | Payload                                   | Schedule                    |
+ * |-------------------------------------------|-----------------------------|
+ * | `add:do=close,after=30s`                  | ONCE in 30 seconds          |
+ * | `add:do=open,at=07:00,days=weekdays`      | WEEKLY, Monday to Friday    |
+ * | `add:do=close,open_for=10m`               | LEFT_OPEN for 10 minutes    |
+ * | `del:id=3`                                | Cancel schedule 3           |
+ * | `list`                                    | List all schedules          |
+ * | `tz:WET0WEST,M3.5.0/1,M10.5.0`            | Set the time zone           |
+ * | `tz`                                      | Get the time zone           |
+ *
+ * `days` is `daily` (default), `weekdays`, `weekend` or the day digits, `0`
+ * being Sunday, e.g. `days=135`. Durations are as in `gate_command.h`. The
+ * zone is everything after `tz:`, since POSIX zones have commas.
+ *
+ * @param data Payload, not NUL-terminated.
+ * @param len Length of the payload.
+ * @param request Parsed request, only valid if ESP_OK is returned.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the payload is malformed.
+ */
+esp_err_t gate_scheduler_parse(const char *data, int len,
+                               gate_schedule_request_t *request);
+
+/**
+ * @brief Describe a schedule in the syntax of `gate_scheduler_parse`, with
+ * its ID and the seconds until it runs, e.g. `id=3,do=close,after=30s,in=12`.
+ *
+ * @param id ID of the schedule.
+ * @param buf Buffer for the description.
+ * @param size Size of the buffer.
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no such schedule.
+ */
+esp_err_t gate_scheduler_format(uint16_t id, char *buf, size_t size);
+
+#endif  // GATE_SCHEDULER_H
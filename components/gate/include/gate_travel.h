@@ -0,0 +1,124 @@
+/**
+ * @file gate_travel.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Travel-time model and position estimate of the gate
+ *
+ * The full travel time of each direction is learned from the motions that go
+ * from one endline sensor to the other, as an exponentially weighted moving
+ * average. While the gate moves, its position is estimated from that time
+ * assuming a constant speed. The gate journal persists both.
+ *
+ * Positions are in permille: 0 is closed and `GATE_TRAVEL_OPEN` is open.
+ *
+ * @version 0.1
+ * @date 2024-12-05
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef GATE_TRAVEL_H
+#define GATE_TRAVEL_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Position of the open gate, in permille.
+ */
+#define GATE_TRAVEL_OPEN 1000
+
+/**
+ * @brief Full travel time assumed until a direction is learned.
+ */
+#define GATE_TRAVEL_DEFAULT_MS 15000
+
+/**
+ * @brief Samples after which travels far from the model are discarded, e.g.
+ * when something blocked the gate.
+ */
+#define GATE_TRAVEL_TRUSTED_SAMPLES 3
+
+/**
+ * @brief Directions of a travel, index of `gate_travel_model_t::full_ms`.
+ */
+typedef enum
+{
+  GATE_TRAVEL_OPENING = 0,  ///< Towards the open endline.
+  GATE_TRAVEL_CLOSING,      ///< Towards the close endline.
+} gate_travel_direction_t;
+
+/**
+ * @brief Learned travel-time model, as persisted.
+ */
+typedef struct
+{
+  uint32_t full_ms[2];  ///< Time of a full travel, by direction.
+  uint16_t samples[2];  ///< Full travels learned, by direction.
+} gate_travel_model_t;
+
+/**
+ * @brief Restore the model and the position.
+ *
+ * @param model Learned model, NULL to start from the defaults.
+ * @param position Position of the stopped gate.
+ * @param at_endline The position was read from an endline sensor.
+ */
+void gate_travel_init(const gate_travel_model_t *model, int position,
+                      bool at_endline);
+
+/**
+ * @brief The gate started moving.
+ *
+ * @param direction Direction of the motion.
+ * @param timestamp_us When the motion started, `gpio_now_us`.
+ */
+void gate_travel_start(gate_travel_direction_t direction, int64_t timestamp_us);
+
+/**
+ * @brief The gate stopped before an endline.
+ *
+ * @param timestamp_us When the motion stopped, `gpio_now_us`.
+ */
+void gate_travel_stop(int64_t timestamp_us);
+
+/**
+ * @brief The gate hit an endline sensor.
+ *
+ * Learns the travel if it started at the other endline.
+ *
+ * @param direction Direction that reached its endline.
+ * @param timestamp_us When the sensor was hit, `gpio_now_us`.
+ */
+void gate_travel_endline(gate_travel_direction_t direction,
+                         int64_t timestamp_us);
+
+/**
+ * @brief Estimate the position of the gate.
+ *
+ * @param now_us Current time, `gpio_now_us`.
+ * @return Position, 0 to `GATE_TRAVEL_OPEN`.
+ */
+int gate_travel_position(int64_t now_us);
+
+/**
+ * @brief Time to move the gate to a position.
+ *
+ * @param target Position to reach, 0 to `GATE_TRAVEL_OPEN`.
+ * @param now_us Current time, `gpio_now_us`.
+ * @param direction Direction to move in.
+ * @return Travel time in ms, 0 if the gate is already there.
+ */
+uint32_t gate_travel_time_to(int target, int64_t now_us,
+                             gate_travel_direction_t *direction);
+
+/**
+ * @brief Get the learned model.
+ *
+ * @param model Where to copy the model.
+ */
+void gate_travel_get_model(gate_travel_model_t *model);
+
+#endif  // GATE_TRAVEL_H
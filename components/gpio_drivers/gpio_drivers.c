@@ -11,63 +11,254 @@
 
 #include "gpio_drivers.h"
 
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
-#define GPIO_ISR_SERVICE_DEFAULT_FLAGS 0
+#include "gpio_port.h"
+#include "metrics.h"
+
+/**
+ * @brief Maximum CPU cycles the latency probe waits for each edge.
+ */
+#define GPIO_PROBE_TIMEOUT_CYCLES 2400000
+
+/**
+ * @brief Input pins whose ISR count is exported as a metric.
+ */
+#define GPIO_METRICS_MAX_PINS 8
 
 static const char *TAG = "GPIO";
 
-static bool isr_service_installed = false;
+/**
+ * @brief Per-pin descriptor table, indexed by GPIO number.
+ */
+static gpio_t *s_gpio_table[GPIO_NUM_MAX] = {NULL};
+
+/**
+ * @brief Input pins attached to the dispatcher, sorted by `isr_priority`.
+ */
+static DRAM_ATTR gpio_num_t s_isr_order[GPIO_NUM_MAX];
+static DRAM_ATTR volatile uint8_t s_isr_order_len = 0;
+
+static portMUX_TYPE s_isr_order_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_isr_installed = false;
+
+static metrics_metric_t s_isr_metrics[GPIO_METRICS_MAX_PINS];
+static char s_isr_labels[GPIO_METRICS_MAX_PINS][12];
+static uint8_t s_isr_metrics_len = 0;
 
-static gpio_t *s_gpio_instance = NULL;
+/**
+ * @brief Pin measured by `gpio_isr_latency_probe`, or GPIO_NUM_NC.
+ */
+static DRAM_ATTR volatile gpio_num_t s_probe_pin = GPIO_NUM_NC;
+static DRAM_ATTR volatile uint32_t s_probe_entry_cycles = 0;
+static DRAM_ATTR volatile bool s_probe_hit = false;
+
+/**
+ * @brief Shared GPIO interrupt, dispatches each pending pin to its descriptor.
+ *
+ * Pins are visited in priority order, and each status bit is cleared after its
+ * handler runs so level-triggered pins are not lost. The clock is read once at
+ * entry, so all pins pending in the same interrupt share the edge timestamp.
+ */
+static void IRAM_ATTR gpio_dispatch_isr(void *arg)
+{
+  uint32_t entry_cycles = gpio_port_cycles();
+  int64_t entry_us = gpio_port_now_us();
+  uint64_t pending = gpio_port_get_intr_status();
+
+  for (uint8_t i = 0; i < s_isr_order_len && pending; i++)
+  {
+    gpio_num_t pin = s_isr_order[i];
+    uint64_t bit = 1ULL << pin;
+    if (!(pending & bit))
+      continue;
+    pending &= ~bit;
+
+    gpio_t *gpio = s_gpio_table[pin];
+    gpio->_isr_stats.count++;
+    gpio->_isr_stats.last_entry_cycles = entry_cycles;
+    if (gpio->timestamp_edges)
+      gpio->_edge_time_us = entry_us;
+
+    if (pin == s_probe_pin)
+    {
+      s_probe_entry_cycles = entry_cycles;
+      s_probe_hit = true;
+    }
+    else if (gpio->isr_handler)
+    {
+      gpio->isr_handler(gpio->isr_handler_arg);
+    }
+
+    gpio_port_clear_intr_status(bit);
+  }
+
+  // Pins without a descriptor, should not happen
+  if (pending)
+    gpio_port_clear_intr_status(pending);
+}
+
+/**
+ * @brief Install the shared GPIO interrupt.
+ *
+ * Must run before any pin interrupt is enabled, otherwise an early edge would
+ * find no handler.
+ */
+static esp_err_t gpio_install_dispatch()
+{
+  if (s_isr_installed)
+  {
+    ESP_LOGI(TAG, "ISR dispatcher already installed");
+    return ESP_OK;
+  }
+
+  esp_err_t ret = gpio_port_isr_register(&gpio_dispatch_isr, NULL);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to install ISR dispatcher: %s",
+             esp_err_to_name(ret));
+    return ret;
+  }
+
+  s_isr_installed = true;
+  ESP_LOGI(TAG, "ISR dispatcher installed in IRAM");
+  return ESP_OK;
+}
+
+/**
+ * @brief Attach an input pin to the dispatcher, keeping the priority order.
+ */
+static void gpio_attach_dispatch(gpio_t *self)
+{
+  taskENTER_CRITICAL(&s_isr_order_lock);
+
+  uint8_t len = s_isr_order_len;
+  uint8_t pos = 0;
+
+  // Drop a previous registration of the same pin
+  for (uint8_t i = 0; i < len; i++)
+  {
+    if (s_isr_order[i] == (gpio_num_t)self->pin)
+    {
+      memmove(&s_isr_order[i], &s_isr_order[i + 1],
+              (len - i - 1) * sizeof(s_isr_order[0]));
+      len--;
+      break;
+    }
+  }
+
+  while (pos < len &&
+         s_gpio_table[s_isr_order[pos]]->isr_priority >= self->isr_priority)
+    pos++;
+
+  memmove(&s_isr_order[pos + 1], &s_isr_order[pos],
+          (len - pos) * sizeof(s_isr_order[0]));
+  s_isr_order[pos] = (gpio_num_t)self->pin;
+  s_isr_order_len = len + 1;
+
+  taskEXIT_CRITICAL(&s_isr_order_lock);
+}
+
+static int64_t gpio_read_isr_count(void *arg)
+{
+  return ((const gpio_t *)arg)->_isr_stats.count;
+}
+
+// Sampled from the dispatcher statistics, nothing is added to the ISR
+static void gpio_register_isr_metric(gpio_t *self)
+{
+  for (uint8_t i = 0; i < s_isr_metrics_len; i++)
+    if (s_isr_metrics[i].read_arg == self)
+      return;
+  if (s_isr_metrics_len == GPIO_METRICS_MAX_PINS)
+    return;
+
+  uint8_t i = s_isr_metrics_len++;
+  snprintf(s_isr_labels[i], sizeof(s_isr_labels[i]), "pin=\"%d\"", self->pin);
+  s_isr_metrics[i] = (metrics_metric_t){
+    .name = "gpio_isr_dispatches_total",
+    .help = "Interrupts dispatched to the handler of an input pin.",
+    .labels = s_isr_labels[i],
+    .type = METRICS_COUNTER,
+    .read = gpio_read_isr_count,
+    .read_arg = self,
+  };
+  metrics_register(&s_isr_metrics[i]);
+}
 
-esp_err_t gpio_set_config_output(gpio_pinout_t pin)
+static esp_err_t gpio_set_config_output(gpio_t *self)
 {
-  gpio_config_t io_conf = {.pin_bit_mask = (1ULL << pin),
+  gpio_config_t io_conf = {.pin_bit_mask = (1ULL << self->pin),
                            .mode = GPIO_MODE_OUTPUT,
                            .pull_up_en = GPIO_PULLUP_DISABLE,
                            .pull_down_en = GPIO_PULLDOWN_DISABLE,
                            .intr_type = GPIO_INTR_DISABLE};
 
-  ESP_ERROR_CHECK(gpio_config(&io_conf));
+  ESP_ERROR_CHECK(gpio_port_config(&io_conf));
 
-  ESP_LOGI(TAG, "Configured pin %d as output", pin);
+  ESP_LOGI(TAG, "Configured pin %d as output", self->pin);
 
   return ESP_OK;
 }
 
-esp_err_t gpio_set_config_input(gpio_pinout_t pin, void isr_handler(void *),
-                                void *isr_handler_arg)
+static esp_err_t gpio_set_config_input(gpio_t *self)
 {
-  gpio_config_t io_conf = {.pin_bit_mask = (1ULL << (uint8_t)pin),
-                           .mode = GPIO_MODE_INPUT,
-                           .pull_up_en = GPIO_PULLUP_ENABLE,
-                           .pull_down_en = GPIO_PULLDOWN_DISABLE,
-                           .intr_type = GPIO_INTR_NEGEDGE};
+  // Zero-initialized objects keep the historical negative edge
+  if (self->_intr_type == GPIO_INTR_DISABLE && self->isr_handler)
+    self->_intr_type = GPIO_INTR_NEGEDGE;
 
-  ESP_ERROR_CHECK(gpio_config(&io_conf));
-  ESP_LOGI(TAG, "Configured pin %d as input", pin);
+  bool pull_up =
+    self->_pull == GPIO_PULLUP_ONLY || self->_pull == GPIO_PULLUP_PULLDOWN;
+  bool pull_down =
+    self->_pull == GPIO_PULLDOWN_ONLY || self->_pull == GPIO_PULLUP_PULLDOWN;
 
-  if (isr_handler == NULL)
-    return ESP_OK;
+  gpio_config_t io_conf = {
+    .pin_bit_mask = (1ULL << (uint8_t)self->pin),
+    .mode = GPIO_MODE_INPUT,
+    .pull_up_en = pull_up ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE,
+    .pull_down_en = pull_down ? GPIO_PULLDOWN_ENABLE : GPIO_PULLDOWN_DISABLE,
+    .intr_type = self->_intr_type};
+
+  // Attach before `gpio_config` enables the pin interrupt
+  if (self->_intr_type != GPIO_INTR_DISABLE)
+  {
+    ESP_ERROR_CHECK(gpio_install_dispatch());
+    gpio_attach_dispatch(self);
+  }
 
-  ESP_ERROR_CHECK(gpio_isr_handler_add(pin, isr_handler, isr_handler_arg));
-  ESP_LOGI(TAG, "Configured ISR handler for pin %d", pin);
+  ESP_ERROR_CHECK(gpio_port_config(&io_conf));
+  ESP_LOGI(TAG, "Configured pin %d as input", self->pin);
+
+  if (self->_intr_type != GPIO_INTR_DISABLE)
+  {
+    ESP_LOGI(TAG, "Configured ISR for pin %d (type %d, priority %d)",
+             self->pin, self->_intr_type, self->isr_priority);
+    gpio_register_isr_metric(self);
+  }
 
   return ESP_OK;
 }
 
-esp_err_t gpio_write(gpio_t *self, gpio_state_t state)
+esp_err_t IRAM_ATTR gpio_write(gpio_t *self, gpio_state_t state)
 {
-  gpio_set_level(self->pin, (uint32_t)state);
+  uint64_t bit = 1ULL << self->pin;
+  if (state == GPIO_STATE_HIGH)
+    gpio_port_write(bit, 0);
+  else
+    gpio_port_write(0, bit);
   return ESP_OK;
 }
 
-gpio_state_t gpio_read(gpio_t *self)
+gpio_state_t IRAM_ATTR gpio_read(gpio_t *self)
 {
-  return gpio_get_level(self->pin);
+  return gpio_port_get_level(self->pin);
 }
 
 void gpio_toggle(gpio_t *self)
@@ -79,23 +270,28 @@ void gpio_toggle(gpio_t *self)
 // TODO: Finish GPIO driver implementation
 void gpio_init_impl(gpio_t *self)
 {
-  s_gpio_instance = self;
-  s_gpio_instance->get_state = &gpio_read;
-  s_gpio_instance->set_state = &gpio_write;
-  //s_gpio_instance->toggle = &gpio_toggle;
+  if (!self || !GPIO_IS_VALID_GPIO(self->pin))
+  {
+    ESP_LOGE(TAG, "Invalid GPIO");
+    return;
+  }
+
+  s_gpio_table[self->pin] = self;
+  self->get_state = &gpio_read;
+  self->set_state = &gpio_write;
+  //self->toggle = &gpio_toggle;
 
-  switch (s_gpio_instance->_mode)
+  switch (self->_mode)
   {
     case GPIO_MODE_INPUT:
     {
-      gpio_set_config_input(s_gpio_instance->pin, s_gpio_instance->isr_handler,
-                            NULL);
+      gpio_set_config_input(self);
       break;
     }
     case GPIO_MODE_OUTPUT:
     {
-      gpio_set_config_output(s_gpio_instance->pin);
-      gpio_write(s_gpio_instance, s_gpio_instance->_act_state);
+      gpio_set_config_output(self);
+      gpio_write(self, self->_act_state);
       break;
     }
     default:
@@ -104,22 +300,156 @@ void gpio_init_impl(gpio_t *self)
       break;
     }
   }
+}
+
+gpio_t *gpio_get_descriptor(gpio_pinout_t pin)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return NULL;
+
+  return s_gpio_table[pin];
+}
+
+esp_err_t IRAM_ATTR gpio_disable_isr(gpio_t *self)
+{
+  return gpio_port_intr_disable(self->pin);
+}
+
+esp_err_t IRAM_ATTR gpio_enable_isr(gpio_t *self)
+{
+  return gpio_port_intr_enable(self->pin);
+}
+
+esp_err_t gpio_enable_wakeup(gpio_t *self, gpio_state_t level)
+{
+  return gpio_port_wakeup_enable(self->pin, level);
+}
+
+esp_err_t gpio_enable_deep_wakeup(gpio_t *self, gpio_state_t level)
+{
+  return gpio_port_deep_wakeup_enable(self->pin, level);
+}
+
+int64_t IRAM_ATTR gpio_now_us()
+{
+  return gpio_port_now_us();
+}
+
+int64_t IRAM_ATTR gpio_get_edge_time_us(const gpio_t *self)
+{
+  return self->_edge_time_us;
+}
 
-  if (!isr_service_installed)
+esp_err_t gpio_isr_latency_probe(gpio_t *output, gpio_t *input,
+                                 uint16_t samples, gpio_isr_latency_t *result)
+{
+  if (!output || !input || !result || samples == 0 ||
+      output->_mode != GPIO_MODE_OUTPUT || s_gpio_table[input->pin] != input)
+    return ESP_ERR_INVALID_ARG;
+
+  // Level interrupts would keep firing while the probe holds the level
+  gpio_state_t idle;
+  switch (input->_intr_type)
   {
-    ESP_ERROR_CHECK(gpio_install_isr_service(GPIO_ISR_SERVICE_DEFAULT_FLAGS));
-    isr_service_installed = true;
+    case GPIO_INTR_POSEDGE:
+      idle = GPIO_STATE_LOW;
+      break;
+    case GPIO_INTR_NEGEDGE:
+    case GPIO_INTR_ANYEDGE:
+      idle = GPIO_STATE_HIGH;
+      break;
+    default:
+      return ESP_ERR_INVALID_ARG;
   }
+  gpio_state_t active =
+    (idle == GPIO_STATE_LOW) ? GPIO_STATE_HIGH : GPIO_STATE_LOW;
+
+  memset(result, 0, sizeof(*result));
+  result->min_cycles = UINT32_MAX;
+  uint64_t total_cycles = 0;
+
+  s_probe_pin = (gpio_num_t)input->pin;
+  gpio_enable_isr(input);
+
+  for (uint16_t i = 0; i < samples; i++)
+  {
+    // Let other tasks, e.g. the flash writer, run between samples
+    gpio_write(output, idle);
+    vTaskDelay(1);
+    s_probe_hit = false;
+
+    uint32_t start_cycles = gpio_port_cycles();
+    gpio_write(output, active);
+
+    while (!s_probe_hit &&
+           (gpio_port_cycles() - start_cycles) < GPIO_PROBE_TIMEOUT_CYCLES)
+      ;
+
+    if (!s_probe_hit)
+    {
+      result->missed++;
+      continue;
+    }
+
+    uint32_t cycles = s_probe_entry_cycles - start_cycles;
+    result->samples++;
+    total_cycles += cycles;
+    if (cycles < result->min_cycles)
+      result->min_cycles = cycles;
+    if (cycles > result->max_cycles)
+      result->max_cycles = cycles;
+  }
+
+  s_probe_pin = GPIO_NUM_NC;
+  gpio_write(output, idle);
+
+  if (result->samples)
+    result->avg_cycles = (uint32_t)(total_cycles / result->samples);
   else
-    ESP_LOGI(TAG, "ISR service already installed");
+    result->min_cycles = 0;
+
+  ESP_LOGI(TAG,
+           "ISR latency on pin %d: min %lu, avg %lu, max %lu cycles "
+           "(%lu samples, %lu missed)",
+           input->pin, (unsigned long)result->min_cycles,
+           (unsigned long)result->avg_cycles, (unsigned long)result->max_cycles,
+           (unsigned long)result->samples, (unsigned long)result->missed);
+
+  return ESP_OK;
 }
 
-esp_err_t gpio_disable_isr(gpio_t *self)
+void gpio_group_reset(gpio_group_t *group)
 {
-  return gpio_intr_disable(self->pin);
+  group->set_mask = 0;
+  group->clear_mask = 0;
 }
 
-esp_err_t gpio_enable_isr(gpio_t *self)
+esp_err_t gpio_group_stage(gpio_group_t *group, gpio_t *gpio,
+                           gpio_state_t state)
 {
-  return gpio_intr_enable(self->pin);
+  if (!group || !gpio || !GPIO_IS_VALID_OUTPUT_GPIO(gpio->pin))
+    return ESP_ERR_INVALID_ARG;
+
+  uint64_t bit = 1ULL << gpio->pin;
+  if (state == GPIO_STATE_HIGH)
+  {
+    group->set_mask |= bit;
+    group->clear_mask &= ~bit;
+  }
+  else
+  {
+    group->clear_mask |= bit;
+    group->set_mask &= ~bit;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t IRAM_ATTR gpio_group_apply(const gpio_group_t *group)
+{
+  if (!group)
+    return ESP_ERR_INVALID_ARG;
+
+  gpio_port_write(group->set_mask, group->clear_mask);
+  return ESP_OK;
 }
@@ -0,0 +1,108 @@
+/**
+ * @file gpio_port.h
+ * @author Marcos Henrique Silveira Barbosa
+ * @brief Hardware backend of the GPIO driver.
+ *
+ * Private to the GPIO driver. It's the only interface that touches the GPIO
+ * peripheral, the interrupt controller and the edge clock. `gpio_port_esp32.c`
+ * implements it on the chip and `gpio_port_sim.c` on the Linux target, where
+ * pins, interrupts and the clock are simulated.
+ *
+ * @version 0.1
+ * @date 2024-11-26
+ */
+
+#ifndef GPIO_PORT_H
+#define GPIO_PORT_H
+
+#include <esp_err.h>
+#include <stdint.h>
+
+#include "gpio_drivers.h"
+
+/**
+ * @brief Apply a pin configuration.
+ *
+ * @param config Configuration, as for `gpio_config`.
+ * @return ESP_OK on success, an error from the backend otherwise.
+ */
+esp_err_t gpio_port_config(const gpio_config_t *config);
+
+/**
+ * @brief Install the function serving the shared GPIO interrupt.
+ *
+ * @param fn Interrupt function, must be placed in IRAM.
+ * @param arg Argument of the interrupt function.
+ * @return ESP_OK on success, an error from the backend otherwise.
+ */
+esp_err_t gpio_port_isr_register(void (*fn)(void *), void *arg);
+
+/**
+ * @brief Get the pending pin interrupts of the current core.
+ *
+ * @return Pending pins, bit N is GPIO N.
+ */
+uint64_t gpio_port_get_intr_status();
+
+/**
+ * @brief Acknowledge pin interrupts.
+ *
+ * @param mask Pins to acknowledge, bit N is GPIO N.
+ */
+void gpio_port_clear_intr_status(uint64_t mask);
+
+/**
+ * @brief Enable the interrupt of a pin.
+ */
+esp_err_t gpio_port_intr_enable(gpio_num_t pin);
+
+/**
+ * @brief Disable the interrupt of a pin.
+ */
+esp_err_t gpio_port_intr_disable(gpio_num_t pin);
+
+/**
+ * @brief Wake the chip from light sleep while a pin is at a level.
+ *
+ * On the ESP32 this also makes the pin interrupt level-triggered.
+ */
+esp_err_t gpio_port_wakeup_enable(gpio_num_t pin, int level);
+
+/**
+ * @brief Wake the chip from deep sleep while a pin is at a level.
+ *
+ * On the ESP32 the pin must be an RTC GPIO and goes to the ext1 source, whose
+ * single mask holds this pin only.
+ */
+esp_err_t gpio_port_deep_wakeup_enable(gpio_num_t pin, int level);
+
+/**
+ * @brief Read the input level of a pin.
+ */
+int gpio_port_get_level(gpio_num_t pin);
+
+/**
+ * @brief Drive several output pins at once.
+ *
+ * Each 32-bit half of the masks takes a single write to the W1TS (set) or
+ * W1TC (clear) register, so all pins of a half change in the same cycle and
+ * no read-modify-write is involved. Safe to call from ISRs.
+ *
+ * @param set_mask Pins to drive high, bit N is GPIO N.
+ * @param clear_mask Pins to drive low, bit N is GPIO N.
+ */
+void gpio_port_write(uint64_t set_mask, uint64_t clear_mask);
+
+/**
+ * @brief Read the free-running clock used to timestamp edges.
+ *
+ * @return Microseconds since boot, with 1 µs resolution.
+ */
+int64_t gpio_port_now_us();
+
+/**
+ * @brief Read the CPU cycle counter, used to measure ISR latency.
+ */
+uint32_t gpio_port_cycles();
+
+#endif  // GPIO_PORT_H
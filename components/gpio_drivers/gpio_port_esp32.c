@@ -0,0 +1,133 @@
+/**
+ * @file gpio_port_esp32.c
+ * @author Marcos Henrique Silveira Barbosa
+ * @brief GPIO driver backend for the ESP32 GPIO peripheral.
+ * @version 0.1
+ * @date 2024-11-26
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <driver/rtc_io.h>
+#include <esp_attr.h>
+#include <esp_cpu.h>
+#include <esp_intr_alloc.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <hal/gpio_ll.h>
+#include <soc/gpio_struct.h>
+
+#include "gpio_port.h"
+
+/**
+ * @brief Allocation flags of the shared GPIO interrupt.
+ *
+ * `ESP_INTR_FLAG_IRAM` keeps the dispatcher running while the flash cache is
+ * disabled (e.g. during NVS writes), instead of deferring it until the write
+ * ends.
+ */
+#define GPIO_DISPATCH_INTR_FLAGS (ESP_INTR_FLAG_IRAM | ESP_INTR_FLAG_LOWMED)
+
+static gpio_isr_handle_t s_isr_handle = NULL;
+
+esp_err_t gpio_port_config(const gpio_config_t *config)
+{
+  return gpio_config(config);
+}
+
+esp_err_t gpio_port_isr_register(void (*fn)(void *), void *arg)
+{
+  if (s_isr_handle)
+    return ESP_ERR_INVALID_STATE;
+
+  return gpio_isr_register(fn, arg, GPIO_DISPATCH_INTR_FLAGS, &s_isr_handle);
+}
+
+uint64_t IRAM_ATTR gpio_port_get_intr_status()
+{
+  uint32_t core_id = esp_cpu_get_core_id();
+  uint32_t status_low = 0;
+  uint32_t status_high = 0;
+
+  gpio_ll_get_intr_status(&GPIO, core_id, &status_low);
+  gpio_ll_get_intr_status_high(&GPIO, core_id, &status_high);
+
+  return ((uint64_t)status_high << 32) | status_low;
+}
+
+void IRAM_ATTR gpio_port_clear_intr_status(uint64_t mask)
+{
+  if ((uint32_t)mask)
+    gpio_ll_clear_intr_status(&GPIO, (uint32_t)mask);
+  if (mask >> 32)
+    gpio_ll_clear_intr_status_high(&GPIO, (uint32_t)(mask >> 32));
+}
+
+esp_err_t IRAM_ATTR gpio_port_intr_enable(gpio_num_t pin)
+{
+  return gpio_intr_enable(pin);
+}
+
+esp_err_t IRAM_ATTR gpio_port_intr_disable(gpio_num_t pin)
+{
+  return gpio_intr_disable(pin);
+}
+
+esp_err_t gpio_port_wakeup_enable(gpio_num_t pin, int level)
+{
+  return gpio_wakeup_enable(pin,
+                            level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+}
+
+esp_err_t gpio_port_deep_wakeup_enable(gpio_num_t pin, int level)
+{
+  if (!rtc_gpio_is_valid_gpio(pin))
+    return ESP_ERR_INVALID_ARG;
+
+  // The digital pulls are off in deep sleep, the RTC ones keep the idle level
+  // as long as the RTC peripherals stay powered
+  esp_err_t ret = level ? rtc_gpio_pulldown_en(pin) : rtc_gpio_pullup_en(pin);
+  if (ret == ESP_OK)
+    ret = level ? rtc_gpio_pullup_dis(pin) : rtc_gpio_pulldown_dis(pin);
+  if (ret == ESP_OK)
+    ret = esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON);
+  if (ret != ESP_OK)
+    return ret;
+
+  return esp_sleep_enable_ext1_wakeup(
+    1ULL << pin, level ? ESP_EXT1_WAKEUP_ANY_HIGH : ESP_EXT1_WAKEUP_ALL_LOW);
+}
+
+int IRAM_ATTR gpio_port_get_level(gpio_num_t pin)
+{
+  return gpio_get_level(pin);
+}
+
+void IRAM_ATTR gpio_port_write(uint64_t set_mask, uint64_t clear_mask)
+{
+  uint32_t set_low = (uint32_t)set_mask;
+  uint32_t clear_low = (uint32_t)clear_mask;
+  uint32_t set_high = (uint32_t)(set_mask >> 32);
+  uint32_t clear_high = (uint32_t)(clear_mask >> 32);
+
+  if (set_low)
+    GPIO.out_w1ts = set_low;
+  if (clear_low)
+    GPIO.out_w1tc = clear_low;
+  if (set_high)
+    GPIO.out1_w1ts.data = set_high;
+  if (clear_high)
+    GPIO.out1_w1tc.data = clear_high;
+}
+
+int64_t IRAM_ATTR gpio_port_now_us()
+{
+  // Reads the 64-bit system timer, independently of the FreeRTOS tick
+  return esp_timer_get_time();
+}
+
+uint32_t IRAM_ATTR gpio_port_cycles()
+{
+  return esp_cpu_get_cycle_count();
+}
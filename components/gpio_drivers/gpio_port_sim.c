@@ -0,0 +1,250 @@
+/**
+ * @file gpio_port_sim.c
+ * @author Marcos Henrique Silveira Barbosa
+ * @brief GPIO driver backend of the Linux target, on a simulated port.
+ * @version 0.1
+ * @date 2024-11-26
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#include "gpio_port.h"
+#include "gpio_sim.h"
+
+/**
+ * @brief Number of output writes the simulator keeps until they are taken.
+ */
+#define GPIO_SIM_MAX_WRITES 256
+
+static struct
+{
+  uint64_t level;                           ///< Level of every pin.
+  uint64_t intr_enabled;                    ///< Pins with enabled interrupt.
+  uint64_t pending;                         ///< Pending pin interrupts.
+  gpio_int_type_t intr_type[GPIO_NUM_MAX];  ///< Interrupt type of each pin.
+  void (*isr)(void *);                      ///< Shared interrupt function.
+  void *isr_arg;                            ///< Argument of `isr`.
+  int64_t now_us;                           ///< Simulated clock.
+  gpio_sim_write_t writes[GPIO_SIM_MAX_WRITES];  ///< Recorded writes.
+  size_t write_head;                        ///< Oldest recorded write.
+  size_t write_count;                       ///< Number of recorded writes.
+  uint32_t dropped_writes;                  ///< Writes lost, ring was full.
+} s_sim = {0};
+
+static bool gpio_sim_triggers(gpio_int_type_t type, int old_level, int level)
+{
+  switch (type)
+  {
+    case GPIO_INTR_POSEDGE:
+      return !old_level && level;
+    case GPIO_INTR_NEGEDGE:
+      return old_level && !level;
+    case GPIO_INTR_ANYEDGE:
+      return old_level != level;
+    case GPIO_INTR_LOW_LEVEL:
+      return !level;
+    case GPIO_INTR_HIGH_LEVEL:
+      return level;
+    default:
+      return false;
+  }
+}
+
+// Run the shared interrupt, nothing else runs meanwhile as on a single core
+static void gpio_sim_raise()
+{
+  if (!s_sim.isr || !(s_sim.pending & s_sim.intr_enabled))
+    return;
+
+  vTaskSuspendAll();
+  s_sim.isr(s_sim.isr_arg);
+  xTaskResumeAll();
+}
+
+esp_err_t gpio_port_config(const gpio_config_t *config)
+{
+  for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+  {
+    uint64_t bit = 1ULL << pin;
+    if (!(config->pin_bit_mask & bit))
+      continue;
+
+    if (config->mode == GPIO_MODE_INPUT)
+    {
+      // Idle level of an unconnected input is set by its pull resistor
+      if (config->pull_up_en == GPIO_PULLUP_ENABLE)
+        s_sim.level |= bit;
+      else if (config->pull_down_en == GPIO_PULLDOWN_ENABLE)
+        s_sim.level &= ~bit;
+    }
+
+    s_sim.intr_type[pin] = config->intr_type;
+    if (config->intr_type != GPIO_INTR_DISABLE)
+      s_sim.intr_enabled |= bit;
+    else
+      s_sim.intr_enabled &= ~bit;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_port_isr_register(void (*fn)(void *), void *arg)
+{
+  if (s_sim.isr)
+    return ESP_ERR_INVALID_STATE;
+
+  s_sim.isr = fn;
+  s_sim.isr_arg = arg;
+  return ESP_OK;
+}
+
+uint64_t gpio_port_get_intr_status()
+{
+  return s_sim.pending & s_sim.intr_enabled;
+}
+
+void gpio_port_clear_intr_status(uint64_t mask)
+{
+  s_sim.pending &= ~mask;
+}
+
+esp_err_t gpio_port_intr_enable(gpio_num_t pin)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return ESP_ERR_INVALID_ARG;
+
+  s_sim.intr_enabled |= 1ULL << pin;
+  return ESP_OK;
+}
+
+esp_err_t gpio_port_intr_disable(gpio_num_t pin)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return ESP_ERR_INVALID_ARG;
+
+  s_sim.intr_enabled &= ~(1ULL << pin);
+  return ESP_OK;
+}
+
+// The simulation never sleeps
+esp_err_t gpio_port_wakeup_enable(gpio_num_t pin, int level)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return ESP_ERR_INVALID_ARG;
+
+  return ESP_OK;
+}
+
+esp_err_t gpio_port_deep_wakeup_enable(gpio_num_t pin, int level)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return ESP_ERR_INVALID_ARG;
+
+  return ESP_OK;
+}
+
+int gpio_port_get_level(gpio_num_t pin)
+{
+  return (s_sim.level >> pin) & 1;
+}
+
+void gpio_port_write(uint64_t set_mask, uint64_t clear_mask)
+{
+  s_sim.level = (s_sim.level | set_mask) & ~clear_mask;
+
+  if (s_sim.write_count == GPIO_SIM_MAX_WRITES)
+  {
+    s_sim.dropped_writes++;
+    return;
+  }
+
+  size_t index = (s_sim.write_head + s_sim.write_count) % GPIO_SIM_MAX_WRITES;
+  s_sim.writes[index] = (gpio_sim_write_t){
+    .time_us = s_sim.now_us,
+    .set_mask = set_mask,
+    .clear_mask = clear_mask,
+  };
+  s_sim.write_count++;
+}
+
+int64_t gpio_port_now_us()
+{
+  return s_sim.now_us;
+}
+
+uint32_t gpio_port_cycles()
+{
+  // One simulated cycle per microsecond
+  return (uint32_t)s_sim.now_us;
+}
+
+void gpio_sim_set_input(gpio_num_t pin, int level)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return;
+
+  uint64_t bit = 1ULL << pin;
+  int old_level = (s_sim.level & bit) ? 1 : 0;
+  level = level ? 1 : 0;
+
+  if (level)
+    s_sim.level |= bit;
+  else
+    s_sim.level &= ~bit;
+
+  if (gpio_sim_triggers(s_sim.intr_type[pin], old_level, level))
+  {
+    s_sim.pending |= bit;
+    gpio_sim_raise();
+  }
+}
+
+int gpio_sim_get_level(gpio_num_t pin)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return 0;
+
+  return gpio_port_get_level(pin);
+}
+
+bool gpio_sim_intr_enabled(gpio_num_t pin)
+{
+  if (!GPIO_IS_VALID_GPIO(pin))
+    return false;
+
+  return (s_sim.intr_enabled >> pin) & 1;
+}
+
+size_t gpio_sim_take_writes(gpio_sim_write_t *writes, size_t max_writes)
+{
+  size_t count = 0;
+  while (count < max_writes && s_sim.write_count > 0)
+  {
+    writes[count++] = s_sim.writes[s_sim.write_head];
+    s_sim.write_head = (s_sim.write_head + 1) % GPIO_SIM_MAX_WRITES;
+    s_sim.write_count--;
+  }
+
+  return count;
+}
+
+uint32_t gpio_sim_dropped_writes()
+{
+  return s_sim.dropped_writes;
+}
+
+void gpio_sim_advance_us(int64_t us)
+{
+  if (us > 0)
+    s_sim.now_us += us;
+}
+
+int64_t gpio_sim_now_us()
+{
+  return s_sim.now_us;
+}
@@ -13,8 +13,16 @@
 #ifndef GPIO_DRIVERS_H
 #define GPIO_DRIVERS_H
 
-#include <driver/gpio.h>
 #include <esp_err.h>
+#include <sdkconfig.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+#include "gpio_sim.h"
+#else
+#include <driver/gpio.h>
+#endif
 
 /**
  * @brief Enumeration of GPIO pin definitions.
@@ -145,8 +153,33 @@ typedef enum
   GPIO_STATE_HIGH = 1,
 } gpio_state_t;
 
+/**
+ * @brief ISR statistics of an input GPIO, updated by the dispatcher.
+ */
+typedef struct
+{
+  uint32_t count;             /**< Number of times the handler was dispatched */
+  uint32_t last_entry_cycles; /**< CPU cycle count at the last dispatch */
+} gpio_isr_stats_t;
+
+/**
+ * @brief Result of `gpio_isr_latency_probe`, in CPU cycles.
+ */
+typedef struct
+{
+  uint32_t samples;    /**< Number of edges measured */
+  uint32_t missed;     /**< Edges that were not dispatched in time */
+  uint32_t min_cycles; /**< Fastest edge-to-dispatch latency */
+  uint32_t avg_cycles; /**< Average edge-to-dispatch latency */
+  uint32_t max_cycles; /**< Slowest edge-to-dispatch latency */
+} gpio_isr_latency_t;
+
 /**
  * @brief Structure representing a GPIO object.
+ *
+ * @note Input pins are dispatched from a single IRAM-resident interrupt, so
+ * their `isr_handler` must be placed in IRAM (`IRAM_ATTR`) and only call
+ * ISR-safe functions that are also in IRAM.
  */
 typedef struct gpio
 {
@@ -156,6 +189,13 @@ typedef struct gpio
   gpio_config_t _config;   /**< Configuration of the GPIO pin */
   gpio_mode_t _mode;       /**< Mode of the GPIO pin */
 
+  gpio_int_type_t _intr_type;  /**< Edge/level of the ISR, default negedge */
+  gpio_pull_mode_t _pull;      /**< Pull resistor of an input, default up */
+  uint8_t isr_priority;        /**< Dispatch order, higher runs first */
+  bool timestamp_edges;        /**< Timestamp each edge in the dispatcher */
+  int64_t _edge_time_us;       /**< Timestamp of the last edge, in µs */
+  gpio_isr_stats_t _isr_stats; /**< ISR statistics of the GPIO pin */
+
   void (*isr_handler)(void *); /**< ISR handler function */
   void *isr_handler_arg;       /**< Argument to the ISR handler function */
 
@@ -203,16 +243,90 @@ typedef struct gpio
   esp_err_t (*toggle)(struct gpio *self);
 } gpio_t;
 
+/**
+ * @brief Group of output pins changed together.
+ *
+ * The masks are built once with `gpio_group_stage` and applied with
+ * `gpio_group_apply`, which costs a single register write per direction
+ * whatever the number of pins in the group.
+ */
+typedef struct gpio_group
+{
+  uint64_t set_mask;   /**< Pins driven high, bit N is GPIO N */
+  uint64_t clear_mask; /**< Pins driven low, bit N is GPIO N */
+} gpio_group_t;
+
 /**
  * @brief Initialize the GPIO implementation.
  *
+ * The GPIO object is registered in a per-pin descriptor table, so it must
+ * outlive the driver (e.g. a static object). Input pins with an interrupt type
+ * are attached to the shared IRAM dispatcher, which is installed on the first
+ * call.
+ *
  * @param self Pointer to the GPIO object.
  */
 void gpio_init_impl(gpio_t *self);
 
+/**
+ * @brief Get the GPIO object registered for a pin.
+ *
+ * @param pin GPIO pin number.
+ * @return The GPIO object, or NULL if the pin was not initialized.
+ */
+gpio_t *gpio_get_descriptor(gpio_pinout_t pin);
+
+/**
+ * @brief Read the clock used to timestamp GPIO edges.
+ *
+ * @note It's placed in IRAM and safe to call from ISRs.
+ *
+ * @return Microseconds since boot, with 1 µs resolution.
+ */
+int64_t gpio_now_us();
+
+/**
+ * @brief Get the timestamp of the last edge of an input GPIO.
+ *
+ * The dispatcher reads the clock once at its entry, before any handler runs,
+ * so the timestamp does not include the time spent in handlers of higher
+ * priority pins. Only updated when `timestamp_edges` is set.
+ *
+ * @note It's placed in IRAM and safe to call from ISRs, typically from the
+ * handler of the GPIO itself.
+ *
+ * @param self Pointer to the GPIO object.
+ * @return Microseconds since boot, or 0 if no edge was timestamped yet.
+ */
+int64_t gpio_get_edge_time_us(const gpio_t *self);
+
+/**
+ * @brief Measure the ISR entry latency of the GPIO dispatcher.
+ *
+ * Needs a jumper between `output` and `input`. For each sample the output
+ * drives the edge `input` triggers on, and the CPU cycles until the dispatcher
+ * enters for `input` are measured. Run a flash-writing workload (e.g. NVS
+ * commits) in another task meanwhile to check the latency stays bounded while
+ * the cache is disabled, as `tools/isr_latency` does.
+ *
+ * @note The handler of `input` is not called while probing.
+ *
+ * @param output Initialized output GPIO object.
+ * @param input Initialized input GPIO object with an edge interrupt type.
+ * @param samples Number of edges to measure.
+ * @param result Pointer to the result.
+ * @return
+ * - **ESP_OK** on success
+ * - **ESP_ERR_INVALID_ARG** if the parameters are invalid
+ */
+esp_err_t gpio_isr_latency_probe(gpio_t *output, gpio_t *input,
+                                 uint16_t samples, gpio_isr_latency_t *result);
+
 /**
  * @brief Disable the ISR for the specified GPIO.
  *
+ * @note It's placed in IRAM and safe to call from ISRs.
+ *
  * @param self Pointer to the GPIO object.
  * @return
  * - **ESP_OK** on success
@@ -224,6 +338,8 @@ esp_err_t gpio_disable_isr(gpio_t *self);
 /**
  * @brief Enable the ISR for the specified GPIO.
  *
+ * @note It's placed in IRAM and safe to call from ISRs.
+ *
  * @param self Pointer to the GPIO object.
  * @return
  * - **ESP_OK** on success
@@ -232,4 +348,66 @@ esp_err_t gpio_disable_isr(gpio_t *self);
  */
 esp_err_t gpio_enable_isr(gpio_t *self);
 
+/**
+ * @brief Wake the chip from light sleep while an input is at a level.
+ *
+ * @note On the ESP32 the pin interrupt becomes level-triggered: while the
+ * level lasts, the ISR is dispatched again each time it is enabled.
+ *
+ * @param self Pointer to the GPIO object, an input.
+ * @param level Level that wakes the chip.
+ * @return
+ * - **ESP_OK** on success
+ * - **ESP_ERR_INVALID_ARG** if the parameters are invalid
+ */
+esp_err_t gpio_enable_wakeup(gpio_t *self, gpio_state_t level);
+
+/**
+ * @brief Wake the chip from deep sleep while an input is at a level.
+ *
+ * On the ESP32 only RTC GPIOs can, through the ext1 source, and only one pin
+ * is armed at a time: a later call replaces it.
+ *
+ * @param self Pointer to the GPIO object, an input.
+ * @param level Level that wakes the chip.
+ * @return
+ * - **ESP_OK** on success
+ * - **ESP_ERR_INVALID_ARG** if the pin is not an RTC GPIO
+ */
+esp_err_t gpio_enable_deep_wakeup(gpio_t *self, gpio_state_t level);
+
+/**
+ * @brief Remove all pins from a GPIO group.
+ *
+ * @param group Pointer to the GPIO group.
+ */
+void gpio_group_reset(gpio_group_t *group);
+
+/**
+ * @brief Add an output pin to a GPIO group with the state it must be driven to.
+ *
+ * Staging a pin again replaces its previous state in the group.
+ *
+ * @param group Pointer to the GPIO group.
+ * @param gpio Pointer to the output GPIO object.
+ * @param state State the pin is driven to when the group is applied.
+ * @return
+ * - **ESP_OK** on success
+ * - **ESP_ERR_INVALID_ARG** if the parameters are invalid
+ */
+esp_err_t gpio_group_stage(gpio_group_t *group, gpio_t *gpio,
+                           gpio_state_t state);
+
+/**
+ * @brief Drive all pins of a GPIO group at once.
+ *
+ * @note It's placed in IRAM and safe to call from ISRs.
+ *
+ * @param group Pointer to the GPIO group.
+ * @return
+ * - **ESP_OK** on success
+ * - **ESP_ERR_INVALID_ARG** if the parameters are invalid
+ */
+esp_err_t gpio_group_apply(const gpio_group_t *group);
+
 #endif  // GPIO_DRIVERS_H
\ No newline at end of file
@@ -0,0 +1,179 @@
+/**
+ * @file gpio_sim.h
+ * @brief Simulated GPIO backend of the Linux target.
+ *
+ * On the Linux target the GPIO driver runs on a simulated port: inputs are
+ * driven with `gpio_sim_set_input`, which raises the shared interrupt exactly
+ * like an edge on the chip would, output writes are recorded with the time of
+ * the simulated clock, and the clock only moves with `gpio_sim_advance_us`, so
+ * runs are deterministic.
+ *
+ * It also provides the subset of `driver/gpio.h` types used by the driver.
+ *
+ * @version 0.1
+ * @date 2024-11-26
+ */
+
+#ifndef GPIO_SIM_H
+#define GPIO_SIM_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+  GPIO_NUM_NC = -1,
+  GPIO_NUM_0 = 0,
+  GPIO_NUM_1,
+  GPIO_NUM_2,
+  GPIO_NUM_3,
+  GPIO_NUM_4,
+  GPIO_NUM_5,
+  GPIO_NUM_6,
+  GPIO_NUM_7,
+  GPIO_NUM_8,
+  GPIO_NUM_9,
+  GPIO_NUM_10,
+  GPIO_NUM_11,
+  GPIO_NUM_12,
+  GPIO_NUM_13,
+  GPIO_NUM_14,
+  GPIO_NUM_15,
+  GPIO_NUM_16,
+  GPIO_NUM_17,
+  GPIO_NUM_18,
+  GPIO_NUM_19,
+  GPIO_NUM_20,
+  GPIO_NUM_21,
+  GPIO_NUM_22,
+  GPIO_NUM_23,
+  GPIO_NUM_25 = 25,
+  GPIO_NUM_26,
+  GPIO_NUM_27,
+  GPIO_NUM_32 = 32,
+  GPIO_NUM_33,
+  GPIO_NUM_34,
+  GPIO_NUM_35,
+  GPIO_NUM_36,
+  GPIO_NUM_37,
+  GPIO_NUM_38,
+  GPIO_NUM_39,
+  GPIO_NUM_MAX,
+} gpio_num_t;
+
+typedef enum
+{
+  GPIO_MODE_DISABLE = 0,
+  GPIO_MODE_INPUT,
+  GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+typedef enum
+{
+  GPIO_INTR_DISABLE = 0,
+  GPIO_INTR_POSEDGE,
+  GPIO_INTR_NEGEDGE,
+  GPIO_INTR_ANYEDGE,
+  GPIO_INTR_LOW_LEVEL,
+  GPIO_INTR_HIGH_LEVEL,
+  GPIO_INTR_MAX,
+} gpio_int_type_t;
+
+typedef enum
+{
+  GPIO_PULLUP_ONLY = 0,
+  GPIO_PULLDOWN_ONLY,
+  GPIO_PULLUP_PULLDOWN,
+  GPIO_FLOATING,
+} gpio_pull_mode_t;
+
+typedef enum
+{
+  GPIO_PULLUP_DISABLE = 0,
+  GPIO_PULLUP_ENABLE,
+} gpio_pullup_t;
+
+typedef enum
+{
+  GPIO_PULLDOWN_DISABLE = 0,
+  GPIO_PULLDOWN_ENABLE,
+} gpio_pulldown_t;
+
+typedef struct
+{
+  uint64_t pin_bit_mask;
+  gpio_mode_t mode;
+  gpio_pullup_t pull_up_en;
+  gpio_pulldown_t pull_down_en;
+  gpio_int_type_t intr_type;
+} gpio_config_t;
+
+#define GPIO_IS_VALID_GPIO(gpio_num) \
+  ((int)(gpio_num) >= 0 && (int)(gpio_num) < (int)GPIO_NUM_MAX)
+#define GPIO_IS_VALID_OUTPUT_GPIO(gpio_num) \
+  (GPIO_IS_VALID_GPIO(gpio_num) && (int)(gpio_num) < (int)GPIO_NUM_34)
+
+/**
+ * @brief Output write recorded by the simulated port.
+ */
+typedef struct
+{
+  int64_t time_us;     /**< Simulated time of the write */
+  uint64_t set_mask;   /**< Pins driven high by the write */
+  uint64_t clear_mask; /**< Pins driven low by the write */
+} gpio_sim_write_t;
+
+/**
+ * @brief Drive the level of a simulated input pin.
+ *
+ * If the change matches the interrupt type of the pin and its interrupt is
+ * enabled, the GPIO dispatcher runs before this function returns, with the
+ * scheduler suspended as if it were an interrupt.
+ *
+ * @param pin GPIO pin number.
+ * @param level New level, 0 or 1.
+ */
+void gpio_sim_set_input(gpio_num_t pin, int level);
+
+/**
+ * @brief Get the level of a simulated pin, input or output.
+ */
+int gpio_sim_get_level(gpio_num_t pin);
+
+/**
+ * @brief Whether the interrupt of a simulated pin is enabled.
+ */
+bool gpio_sim_intr_enabled(gpio_num_t pin);
+
+/**
+ * @brief Copy and drop the output writes recorded so far, oldest first.
+ *
+ * @param writes Buffer of recorded writes.
+ * @param max_writes Capacity of the buffer.
+ * @return Number of writes copied. Writes beyond the record capacity of the
+ * simulator are lost, see `gpio_sim_dropped_writes`.
+ */
+size_t gpio_sim_take_writes(gpio_sim_write_t *writes, size_t max_writes);
+
+/**
+ * @brief Number of writes lost because the record buffer was full.
+ */
+uint32_t gpio_sim_dropped_writes();
+
+/**
+ * @brief Move the simulated clock forward.
+ *
+ * @param us Microseconds to advance.
+ */
+void gpio_sim_advance_us(int64_t us);
+
+/**
+ * @brief Read the simulated clock.
+ *
+ * @return Simulated microseconds since start.
+ */
+int64_t gpio_sim_now_us();
+
+#endif  // GPIO_SIM_H
@@ -0,0 +1,104 @@
+/**
+ * @file local_ctrl.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Local control endpoint, authenticated UDP on the LAN
+ *
+ * Carries the MQTT messages of the gate without the broker: requests are
+ * handed to the MQTT 5 API subscriptions, so they reach the same handlers, and
+ * every message the device publishes is also sent to the clients heard from in
+ * the last `LOCAL_CTRL_PEER_TTL_S`. The packet format is in the README.
+ *
+ * @version 0.1
+ * @date 2024-12-07
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LOCAL_CTRL_H
+#define LOCAL_CTRL_H
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOCAL_CTRL_DEFAULT_PORT 4210
+
+/**
+ * @brief Length of the truncated HMAC-SHA256 closing each packet.
+ */
+#define LOCAL_CTRL_TAG_LEN 16
+
+/**
+ * @brief Largest packet sent or received.
+ */
+#define LOCAL_CTRL_MAX_PACKET 512
+
+/**
+ * @brief Clients that receive the published messages at once.
+ */
+#define LOCAL_CTRL_MAX_PEERS 4
+
+/**
+ * @brief Time after its last request that a client still receives messages.
+ */
+#define LOCAL_CTRL_PEER_TTL_S 120
+
+/**
+ * @brief Largest difference between a request sequence and the wall clock,
+ * once it is set, see the README.
+ */
+#define LOCAL_CTRL_SEQ_WINDOW_MS 30000
+
+/**
+ * @brief Source of the messages of a client, see `mqtt5_api_dispatch`.
+ *
+ * The client ID with the top bit set, apart from `MQTT5_API_SOURCE_BROKER`.
+ */
+#define LOCAL_CTRL_SOURCE(client_id) (0x80000000u | (uint32_t)(client_id))
+
+/**
+ * @brief Configuration of the endpoint.
+ */
+typedef struct
+{
+  uint16_t port;       ///< UDP port, `LOCAL_CTRL_DEFAULT_PORT` if 0.
+  const uint8_t *key;  ///< Pre-shared key of the HMAC.
+  size_t key_len;      ///< Length of the key, at least 16 bytes.
+} local_ctrl_config_t;
+
+/**
+ * @brief Counters of the endpoint.
+ */
+typedef struct
+{
+  uint32_t requests;     ///< Requests handed to the subscriptions.
+  uint32_t malformed;    ///< Packets dropped for their format.
+  uint32_t auth_failed;  ///< Packets dropped for their tag.
+  uint32_t replayed;     ///< Packets dropped for their sequence.
+  uint32_t unrouted;     ///< Requests to a topic nobody subscribed to.
+  uint32_t sent;         ///< Messages sent to the clients.
+  uint32_t send_failed;  ///< Messages the socket failed to send.
+} local_ctrl_stats_t;
+
+/**
+ * @brief Open the socket and start the endpoint task.
+ *
+ * The key is copied.
+ *
+ * @param config Configuration of the endpoint.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for a short key,
+ * ESP_ERR_INVALID_STATE if already started, ESP_FAIL if the socket could not
+ * be opened.
+ */
+esp_err_t local_ctrl_start(const local_ctrl_config_t *config);
+
+/**
+ * @brief Get the counters of the endpoint.
+ *
+ * @param stats Where to copy the counters.
+ */
+void local_ctrl_get_stats(local_ctrl_stats_t *stats);
+
+#endif  // LOCAL_CTRL_H
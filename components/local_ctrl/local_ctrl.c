@@ -0,0 +1,367 @@
+/**
+ * @file local_ctrl.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Local control endpoint, authenticated UDP on the LAN
+ *
+ * Plain BSD sockets: lwIP on the chip, the host sockets on the Linux target.
+ *
+ * @version 0.1
+ * @date 2024-12-07
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "local_ctrl.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <mbedtls/md.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "device_clock.h"
+#include "mqtt5_api.h"
+
+#define LOCAL_CTRL_VERSION 1
+#define LOCAL_CTRL_HEADER_LEN 17
+#define LOCAL_CTRL_MAX_KEY_LEN 64
+
+/**
+ * @brief Types of packet.
+ */
+typedef enum
+{
+  LOCAL_CTRL_REQUEST = 1,  ///< Client to device, handed to a subscription.
+  LOCAL_CTRL_MESSAGE = 2,  ///< Device to client, a published message.
+} local_ctrl_type_t;
+
+/**
+ * @brief Client heard from recently.
+ */
+typedef struct
+{
+  bool used;                ///< The slot holds a client.
+  uint32_t client_id;       ///< ID chosen by the client.
+  uint64_t last_seq;        ///< Last sequence accepted from it.
+  TickType_t last_seen;     ///< When its last request was accepted.
+  struct sockaddr_in addr;  ///< Where its messages are sent.
+} local_ctrl_peer_t;
+
+static const char *TAG = "LOCAL CTRL";
+
+static int s_socket = -1;
+static uint8_t s_key[LOCAL_CTRL_MAX_KEY_LEN];
+static size_t s_key_len = 0;
+
+static local_ctrl_peer_t s_peers[LOCAL_CTRL_MAX_PEERS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Messages are built in a single buffer, whatever task publishes them
+static uint8_t s_tx_packet[LOCAL_CTRL_MAX_PACKET];
+static SemaphoreHandle_t s_tx_mutex = NULL;
+static uint64_t s_tx_seq = 0;
+
+static local_ctrl_stats_t s_stats = {0};
+
+static inline uint32_t local_ctrl_get_u32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t local_ctrl_get_u64(const uint8_t *p)
+{
+  return ((uint64_t)local_ctrl_get_u32(p) << 32) | local_ctrl_get_u32(p + 4);
+}
+
+static inline void local_ctrl_put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline void local_ctrl_put_u64(uint8_t *p, uint64_t v)
+{
+  local_ctrl_put_u32(p, v >> 32);
+  local_ctrl_put_u32(p + 4, v);
+}
+
+// Wall clock in ms, false while it is not set
+static bool local_ctrl_clock_ms(uint64_t *now_ms)
+{
+  int64_t now_us = device_clock_now_us();
+  if (now_us == 0)
+    return false;
+
+  *now_ms = now_us / 1000;
+  return true;
+}
+
+static bool local_ctrl_tag(const uint8_t *data, size_t len,
+                           uint8_t tag[LOCAL_CTRL_TAG_LEN])
+{
+  uint8_t mac[32];
+  const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  if (mbedtls_md_hmac(info, s_key, s_key_len, data, len, mac) != 0)
+    return false;
+
+  memcpy(tag, mac, LOCAL_CTRL_TAG_LEN);
+  return true;
+}
+
+// Constant time, so the tag cannot be guessed byte by byte
+static bool local_ctrl_tag_equal(const uint8_t *a, const uint8_t *b)
+{
+  uint8_t diff = 0;
+  for (int i = 0; i < LOCAL_CTRL_TAG_LEN; i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+/**
+ * @brief Accept a request sequence and remember its client.
+ *
+ * Sequences of a client must increase. Once the wall clock is set, they must
+ * also be within `LOCAL_CTRL_SEQ_WINDOW_MS` of it, which bounds replays to
+ * clients the table does not hold (first request, evicted, reboot).
+ */
+static bool local_ctrl_admit(uint32_t client_id, uint64_t seq,
+                             const struct sockaddr_in *from)
+{
+  uint64_t now_ms;
+  if (local_ctrl_clock_ms(&now_ms) &&
+      (seq + LOCAL_CTRL_SEQ_WINDOW_MS < now_ms ||
+       seq > now_ms + LOCAL_CTRL_SEQ_WINDOW_MS))
+    return false;
+
+  TickType_t now = xTaskGetTickCount();
+  bool admitted = true;
+
+  taskENTER_CRITICAL(&s_lock);
+  local_ctrl_peer_t *peer = NULL;
+  local_ctrl_peer_t *oldest = &s_peers[0];
+  for (int i = 0; i < LOCAL_CTRL_MAX_PEERS; i++)
+  {
+    if (s_peers[i].used && s_peers[i].client_id == client_id)
+    {
+      peer = &s_peers[i];
+      break;
+    }
+    if (!s_peers[i].used ||
+        (oldest->used && now - s_peers[i].last_seen > now - oldest->last_seen))
+      oldest = &s_peers[i];
+  }
+
+  if (peer && seq <= peer->last_seq)
+  {
+    admitted = false;
+  }
+  else
+  {
+    if (!peer)
+    {
+      peer = oldest;
+      peer->used = true;
+      peer->client_id = client_id;
+    }
+    peer->last_seq = seq;
+    peer->last_seen = now;
+    peer->addr = *from;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  return admitted;
+}
+
+static void local_ctrl_handle(uint8_t *packet, int len,
+                              const struct sockaddr_in *from)
+{
+  if (len < LOCAL_CTRL_HEADER_LEN + LOCAL_CTRL_TAG_LEN || packet[0] != 'G' ||
+      packet[1] != 'C' || packet[2] != LOCAL_CTRL_VERSION ||
+      packet[3] != LOCAL_CTRL_REQUEST)
+  {
+    s_stats.malformed++;
+    return;
+  }
+
+  int body_len = len - LOCAL_CTRL_HEADER_LEN - LOCAL_CTRL_TAG_LEN;
+  int topic_len = packet[16];
+  if (topic_len == 0 || topic_len > body_len)
+  {
+    s_stats.malformed++;
+    return;
+  }
+
+  uint8_t tag[LOCAL_CTRL_TAG_LEN];
+  int signed_len = len - LOCAL_CTRL_TAG_LEN;
+  if (!local_ctrl_tag(packet, signed_len, tag) ||
+      !local_ctrl_tag_equal(tag, packet + signed_len))
+  {
+    s_stats.auth_failed++;
+    return;
+  }
+
+  uint32_t client_id = local_ctrl_get_u32(packet + 4);
+  if (!local_ctrl_admit(client_id, local_ctrl_get_u64(packet + 8), from))
+  {
+    s_stats.replayed++;
+    return;
+  }
+
+  char *topic = (char *)packet + LOCAL_CTRL_HEADER_LEN;
+  s_stats.requests++;
+  if (!mqtt5_api_dispatch(LOCAL_CTRL_SOURCE(client_id), topic, topic_len,
+                          topic + topic_len, body_len - topic_len))
+  {
+    ESP_LOGW(TAG, "No subscription for '%.*s'", topic_len, topic);
+    s_stats.unrouted++;
+  }
+}
+
+/**
+ * @brief Send a published message to the recent clients, on the publishing
+ * task.
+ */
+static void local_ctrl_forward(const char *topic, const char *data, int len)
+{
+  struct sockaddr_in addrs[LOCAL_CTRL_MAX_PEERS];
+  int count = 0;
+  TickType_t now = xTaskGetTickCount();
+  TickType_t ttl = pdMS_TO_TICKS(LOCAL_CTRL_PEER_TTL_S * 1000);
+
+  taskENTER_CRITICAL(&s_lock);
+  for (int i = 0; i < LOCAL_CTRL_MAX_PEERS; i++)
+  {
+    if (s_peers[i].used && now - s_peers[i].last_seen < ttl)
+      addrs[count++] = s_peers[i].addr;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+
+  // Nobody listening, no need to sign anything
+  size_t topic_len = strlen(topic);
+  if (count == 0 || topic_len > UINT8_MAX ||
+      LOCAL_CTRL_HEADER_LEN + topic_len + len + LOCAL_CTRL_TAG_LEN >
+        LOCAL_CTRL_MAX_PACKET)
+    return;
+
+  xSemaphoreTake(s_tx_mutex, portMAX_DELAY);
+
+  uint8_t *packet = s_tx_packet;
+  packet[0] = 'G';
+  packet[1] = 'C';
+  packet[2] = LOCAL_CTRL_VERSION;
+  packet[3] = LOCAL_CTRL_MESSAGE;
+  local_ctrl_put_u32(packet + 4, 0);
+  local_ctrl_put_u64(packet + 8, ++s_tx_seq);
+  packet[16] = topic_len;
+  memcpy(packet + LOCAL_CTRL_HEADER_LEN, topic, topic_len);
+  memcpy(packet + LOCAL_CTRL_HEADER_LEN + topic_len, data, len);
+
+  int signed_len = LOCAL_CTRL_HEADER_LEN + topic_len + len;
+  if (local_ctrl_tag(packet, signed_len, packet + signed_len))
+  {
+    for (int i = 0; i < count; i++)
+    {
+      if (sendto(s_socket, packet, signed_len + LOCAL_CTRL_TAG_LEN, 0,
+                 (struct sockaddr *)&addrs[i], sizeof(addrs[i])) < 0)
+        s_stats.send_failed++;
+      else
+        s_stats.sent++;
+    }
+  }
+
+  xSemaphoreGive(s_tx_mutex);
+}
+
+static void local_ctrl_task(void *pvParameters)
+{
+  static uint8_t packet[LOCAL_CTRL_MAX_PACKET];
+  while (1)
+  {
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(s_socket, packet, sizeof(packet), 0,
+                       (struct sockaddr *)&from, &from_len);
+    if (len < 0)
+    {
+      ESP_LOGE(TAG, "Failed to receive: errno %d", errno);
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
+    }
+
+    local_ctrl_handle(packet, len, &from);
+  }
+}
+
+esp_err_t local_ctrl_start(const local_ctrl_config_t *config)
+{
+  if (s_socket >= 0)
+    return ESP_ERR_INVALID_STATE;
+  if (!config || !config->key || config->key_len < 16 ||
+      config->key_len > LOCAL_CTRL_MAX_KEY_LEN)
+    return ESP_ERR_INVALID_ARG;
+
+  memcpy(s_key, config->key, config->key_len);
+  s_key_len = config->key_len;
+
+  s_tx_mutex = xSemaphoreCreateMutex();
+  if (!s_tx_mutex)
+    return ESP_ERR_NO_MEM;
+
+  // Sequences of the messages keep increasing across reboots once the clock
+  // is set
+  uint64_t now_ms;
+  if (local_ctrl_clock_ms(&now_ms))
+    s_tx_seq = now_ms;
+
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0)
+  {
+    ESP_LOGE(TAG, "Failed to create the socket: errno %d", errno);
+    return ESP_FAIL;
+  }
+
+  uint16_t port = config->port ? config->port : LOCAL_CTRL_DEFAULT_PORT;
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    ESP_LOGE(TAG, "Failed to bind port %u: errno %d", port, errno);
+    close(sock);
+    return ESP_FAIL;
+  }
+
+  s_socket = sock;
+  mqtt5_api_set_publish_hook(&local_ctrl_forward);
+
+  if (xTaskCreate(local_ctrl_task, "local_ctrl", 6144, NULL,
+                  tskIDLE_PRIORITY + 2, NULL) != pdPASS)
+  {
+    mqtt5_api_set_publish_hook(NULL);
+    s_socket = -1;
+    close(sock);
+    return ESP_ERR_NO_MEM;
+  }
+
+  ESP_LOGI(TAG, "Local control on UDP port %u", port);
+  return ESP_OK;
+}
+
+void local_ctrl_get_stats(local_ctrl_stats_t *stats)
+{
+  *stats = s_stats;
+}
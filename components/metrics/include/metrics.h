@@ -0,0 +1,147 @@
+/**
+ * @file metrics.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Registry of runtime metrics, rendered in the Prometheus text format
+ *
+ * Components own their `metrics_metric_t` objects, usually static, and link
+ * them into the registry once. Updates are single relaxed atomic operations,
+ * so they are safe from any task and from ISRs, and never block. Values that a
+ * component already keeps (e.g. the ISR count of a GPIO) are registered with a
+ * `read` callback instead, sampled when the metrics are rendered.
+ *
+ * Values are 32 bits wide: a counter that wraps looks like a reset to
+ * Prometheus, which handles it.
+ *
+ * @version 0.1
+ * @date 2024-12-08
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <esp_err.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Longest line rendered, longer lines are dropped.
+ */
+#define METRICS_MAX_LINE 160
+
+/**
+ * @brief Port of the HTTP endpoint when none is given.
+ */
+#define METRICS_HTTP_DEFAULT_PORT 80
+
+/**
+ * @brief Types of metric.
+ */
+typedef enum
+{
+  METRICS_COUNTER = 0,  ///< Only increases.
+  METRICS_GAUGE,        ///< Goes up and down.
+  METRICS_HISTOGRAM,    ///< Samples counted in buckets.
+} metrics_type_t;
+
+/**
+ * @brief Sample a value owned elsewhere.
+ */
+typedef int64_t (*metrics_read_cb_t)(void *arg);
+
+/**
+ * @brief Sink of the rendered text, called once per line.
+ *
+ * @return ESP_OK to go on, any error stops the rendering.
+ */
+typedef esp_err_t (*metrics_write_cb_t)(void *ctx, const char *text,
+                                        size_t len);
+
+/**
+ * @brief Series of a metric.
+ *
+ * Series with the same `name` form a family and must share `help` and `type`,
+ * they differ by their `labels`.
+ */
+typedef struct metrics_metric
+{
+  const char *name;     ///< Name, e.g. `mqtt_messages_received_total`.
+  const char *help;     ///< Description.
+  const char *labels;   ///< Labels, e.g. `topic="gate/action"`, or NULL.
+  metrics_type_t type;  ///< Type of the metric.
+
+  metrics_read_cb_t read;  ///< Counters and gauges: sampled value, or NULL.
+  void *read_arg;          ///< Argument of `read`.
+
+  atomic_int_least32_t value;  ///< Counters and gauges without `read`.
+
+  const uint32_t *bounds;          ///< Histograms: upper bounds, increasing.
+  uint8_t bucket_count;            ///< Histograms: number of `bounds`.
+  atomic_uint_least32_t *buckets;  ///< Histograms: `bucket_count` + 1 counts.
+  atomic_uint_least32_t sum;       ///< Histograms: sum of the samples.
+
+  struct metrics_metric *next;  ///< Next registered series.
+} metrics_metric_t;
+
+/**
+ * @brief Link a series into the registry.
+ *
+ * The object must outlive the registry, series are never removed.
+ *
+ * @param metric Series to register, with its name, help and type set.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an incomplete series,
+ * ESP_ERR_INVALID_STATE if it is already registered.
+ */
+esp_err_t metrics_register(metrics_metric_t *metric);
+
+/**
+ * @brief Add to a counter.
+ */
+static inline void metrics_counter_add(metrics_metric_t *metric, uint32_t n)
+{
+  atomic_fetch_add_explicit(&metric->value, n, memory_order_relaxed);
+}
+
+/**
+ * @brief Set a gauge.
+ */
+static inline void metrics_gauge_set(metrics_metric_t *metric, int32_t value)
+{
+  atomic_store_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+/**
+ * @brief Count a sample in its bucket of a histogram.
+ *
+ * Buckets are stored as they are hit, and accumulated when rendered. The last
+ * one, past every bound, is `+Inf`.
+ */
+void metrics_histogram_observe(metrics_metric_t *metric, uint32_t sample);
+
+/**
+ * @brief Render every registered series, line by line.
+ *
+ * Nothing is allocated: each line is formatted on the stack and handed to
+ * `write`, so the body is never held in RAM.
+ *
+ * @param write Sink of the lines.
+ * @param ctx Argument of `write`.
+ * @return ESP_OK, or the error returned by `write`.
+ */
+esp_err_t metrics_render(metrics_write_cb_t write, void *ctx);
+
+/**
+ * @brief Serve the metrics on `GET /metrics`.
+ *
+ * Not available on the Linux target, which has no HTTP server.
+ *
+ * @param port TCP port, `METRICS_HTTP_DEFAULT_PORT` if 0.
+ * @return ESP_OK on success, otherwise the error of the HTTP server.
+ */
+esp_err_t metrics_http_start(uint16_t port);
+
+#endif  // METRICS_H
@@ -0,0 +1,176 @@
+/**
+ * @file metrics.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Registry of runtime metrics, rendered in the Prometheus text format
+ *
+ * @version 0.1
+ * @date 2024-12-08
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "metrics.h"
+
+#include <freertos/FreeRTOS.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TYPE_NAMES[] = {"counter", "gauge", "histogram"};
+
+// Series of a family are kept next to each other, so HELP and TYPE are
+// rendered once. The list is only appended to, and rendered without the lock.
+static metrics_metric_t *s_head = NULL;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t metrics_register(metrics_metric_t *metric)
+{
+  if (!metric || !metric->name || !metric->help ||
+      metric->type > METRICS_HISTOGRAM)
+    return ESP_ERR_INVALID_ARG;
+  if (metric->type == METRICS_HISTOGRAM &&
+      (!metric->bounds || !metric->buckets))
+    return ESP_ERR_INVALID_ARG;
+
+  esp_err_t ret = ESP_OK;
+  taskENTER_CRITICAL(&s_lock);
+
+  metrics_metric_t **link = &s_head;
+  metrics_metric_t **after_family = NULL;
+  for (metrics_metric_t *it = s_head; it; it = it->next)
+  {
+    if (it == metric)
+    {
+      ret = ESP_ERR_INVALID_STATE;
+      break;
+    }
+    if (strcmp(it->name, metric->name) == 0)
+      after_family = &it->next;
+    link = &it->next;
+  }
+
+  if (ret == ESP_OK)
+  {
+    if (after_family)
+      link = after_family;
+    // Complete before it is reachable, the renderer does not take the lock
+    metric->next = *link;
+    *link = metric;
+  }
+
+  taskEXIT_CRITICAL(&s_lock);
+  return ret;
+}
+
+void metrics_histogram_observe(metrics_metric_t *metric, uint32_t sample)
+{
+  uint8_t i = 0;
+  while (i < metric->bucket_count && sample > metric->bounds[i])
+    i++;
+
+  atomic_fetch_add_explicit(&metric->buckets[i], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metric->sum, sample, memory_order_relaxed);
+}
+
+static esp_err_t metrics_line(metrics_write_cb_t write, void *ctx,
+                              const char *format, ...)
+{
+  char line[METRICS_MAX_LINE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  // A truncated line would be malformed, leave it out
+  if (len < 0 || len >= (int)sizeof(line))
+    return ESP_OK;
+  return write(ctx, line, len);
+}
+
+// `{labels}` and `{labels,le="x"}`, as the separators around the labels
+static inline const char *metrics_open(const metrics_metric_t *metric)
+{
+  return metric->labels ? "{" : "";
+}
+
+static inline const char *metrics_close(const metrics_metric_t *metric)
+{
+  return metric->labels ? "}" : "";
+}
+
+static esp_err_t metrics_render_histogram(const metrics_metric_t *metric,
+                                          metrics_write_cb_t write, void *ctx)
+{
+  const char *labels = metric->labels ? metric->labels : "";
+  const char *comma = metric->labels ? "," : "";
+  uint32_t count = 0;
+  esp_err_t ret = ESP_OK;
+
+  for (uint8_t i = 0; i <= metric->bucket_count && ret == ESP_OK; i++)
+  {
+    count += atomic_load_explicit(&metric->buckets[i], memory_order_relaxed);
+    if (i < metric->bucket_count)
+      ret = metrics_line(write, ctx,
+                         "%s_bucket{%s%sle=\"%" PRIu32 "\"} %" PRIu32 "\n",
+                         metric->name, labels, comma, metric->bounds[i], count);
+    else
+      ret = metrics_line(write, ctx, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu32 "\n",
+                         metric->name, labels, comma, count);
+  }
+  if (ret != ESP_OK)
+    return ret;
+
+  // Sum read after the buckets, so it may include a few more samples
+  uint32_t sum = atomic_load_explicit(&metric->sum, memory_order_relaxed);
+  ret = metrics_line(write, ctx, "%s_sum%s%s%s %" PRIu32 "\n", metric->name,
+                     metrics_open(metric), labels, metrics_close(metric), sum);
+  if (ret != ESP_OK)
+    return ret;
+  return metrics_line(write, ctx, "%s_count%s%s%s %" PRIu32 "\n", metric->name,
+                      metrics_open(metric), labels, metrics_close(metric),
+                      count);
+}
+
+esp_err_t metrics_render(metrics_write_cb_t write, void *ctx)
+{
+  const char *family = NULL;
+  esp_err_t ret = ESP_OK;
+
+  for (metrics_metric_t *it = s_head; it && ret == ESP_OK; it = it->next)
+  {
+    if (!family || strcmp(family, it->name) != 0)
+    {
+      family = it->name;
+      ret = metrics_line(write, ctx, "# HELP %s %s\n", it->name, it->help);
+      if (ret == ESP_OK)
+        ret = metrics_line(write, ctx, "# TYPE %s %s\n", it->name,
+                           TYPE_NAMES[it->type]);
+      if (ret != ESP_OK)
+        break;
+    }
+
+    if (it->type == METRICS_HISTOGRAM)
+    {
+      ret = metrics_render_histogram(it, write, ctx);
+      continue;
+    }
+
+    int64_t value;
+    if (it->read)
+      value = it->read(it->read_arg);
+    else if (it->type == METRICS_COUNTER)
+      value = (uint32_t)atomic_load_explicit(&it->value, memory_order_relaxed);
+    else
+      value = atomic_load_explicit(&it->value, memory_order_relaxed);
+
+    ret = metrics_line(write, ctx, "%s%s%s%s %lld\n", it->name,
+                       metrics_open(it), it->labels ? it->labels : "",
+                       metrics_close(it), (long long)value);
+  }
+
+  return ret;
+}
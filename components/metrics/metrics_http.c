@@ -0,0 +1,116 @@
+/**
+ * @file metrics_http.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief HTTP endpoint of the metrics, on esp_http_server
+ *
+ * @version 0.1
+ * @date 2024-12-08
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/**
+ * @brief Size of the chunks sent, lines are gathered up to it.
+ */
+#define METRICS_HTTP_CHUNK 512
+
+static const char *TAG = "METRICS";
+
+static httpd_handle_t s_server = NULL;
+
+/**
+ * @brief Chunk being gathered for a request.
+ */
+typedef struct
+{
+  httpd_req_t *req;
+  size_t len;
+  char data[METRICS_HTTP_CHUNK];
+} metrics_http_chunk_t;
+
+static esp_err_t metrics_http_flush(metrics_http_chunk_t *chunk)
+{
+  if (chunk->len == 0)
+    return ESP_OK;
+
+  esp_err_t ret = httpd_resp_send_chunk(chunk->req, chunk->data, chunk->len);
+  chunk->len = 0;
+  return ret;
+}
+
+// Whole lines only, a few TCP segments per scrape instead of one per line
+static esp_err_t metrics_http_write(void *ctx, const char *text, size_t len)
+{
+  metrics_http_chunk_t *chunk = ctx;
+  if (chunk->len + len > sizeof(chunk->data))
+  {
+    esp_err_t ret = metrics_http_flush(chunk);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  memcpy(chunk->data + chunk->len, text, len);
+  chunk->len += len;
+  return ESP_OK;
+}
+
+static esp_err_t metrics_http_get(httpd_req_t *req)
+{
+  // Static, the HTTP server task has a small stack and serves one at a time
+  static metrics_http_chunk_t chunk;
+  chunk.req = req;
+  chunk.len = 0;
+
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  esp_err_t ret = metrics_render(&metrics_http_write, &chunk);
+  if (ret == ESP_OK)
+    ret = metrics_http_flush(&chunk);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Scrape aborted: %s", esp_err_to_name(ret));
+    return ret;
+  }
+
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+esp_err_t metrics_http_start(uint16_t port)
+{
+  if (s_server)
+    return ESP_ERR_INVALID_STATE;
+
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = port ? port : METRICS_HTTP_DEFAULT_PORT;
+  config.max_uri_handlers = 1;
+
+  esp_err_t ret = httpd_start(&s_server, &config);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to start the HTTP server: %s", esp_err_to_name(ret));
+    return ret;
+  }
+
+  static const httpd_uri_t uri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metrics_http_get,
+  };
+  ret = httpd_register_uri_handler(s_server, &uri);
+  if (ret != ESP_OK)
+  {
+    httpd_stop(s_server);
+    s_server = NULL;
+    return ret;
+  }
+
+  ESP_LOGI(TAG, "Metrics served on port %u", config.server_port);
+  return ESP_OK;
+}
@@ -37,16 +37,102 @@ typedef enum
   ACTION_COUNTERCLOCKWISE_MOTOR,  ///< Closed the gate.
 } motor_action_t;
 
+/**
+ * @brief Enumeration of events handled by the motor task.
+ */
+typedef enum
+{
+  MOTOR_EVENT_ACTION = 0,  ///< An action was requested (button or remote).
+  MOTOR_EVENT_OPENED,      ///< The open endline sensor was hit.
+  MOTOR_EVENT_CLOSED,      ///< The close endline sensor was hit.
+} motor_event_type_t;
+
+/**
+ * @brief Where an event of the motor came from.
+ */
+typedef enum
+{
+  MOTOR_SOURCE_REMOTE = 0,  ///< Requested through `in_action` (MQTT, schedule).
+  MOTOR_SOURCE_BUTTON,      ///< The control button.
+  MOTOR_SOURCE_SENSOR,      ///< An endline sensor.
+} motor_event_source_t;
+
+/**
+ * @brief Event deferred from the motor ISRs (or the gate) to the motor task.
+ */
+typedef struct
+{
+  motor_event_type_t type;      ///< Type of the event.
+  motor_action_t action;        ///< Requested action, for `MOTOR_EVENT_ACTION`.
+  motor_event_source_t source;  ///< Where the event came from.
+  int64_t timestamp_us;  ///< When the edge/request happened, `gpio_now_us`.
+  /**
+   * @brief When the outputs were driven for an action, 0 for other events.
+   *
+   * Set by the motor task, on the same monotonic clock as `timestamp_us`,
+   * which `device_clock_wall_us` turns into wall clock time.
+   */
+  int64_t actuated_us;
+} motor_event_t;
+
+/**
+ * @brief Counters of the motor event queue.
+ */
+typedef struct
+{
+  uint32_t events_posted;   ///< Events queued to the motor task.
+  uint32_t events_dropped;  ///< Events lost because the queue was full.
+  uint32_t queue_peak;      ///< Most events ever waiting in the queue.
+} motor_stats_t;
+
+/**
+ * @brief Running mean and variance of a series, Welford's method.
+ */
+typedef struct
+{
+  uint32_t count;  ///< Samples added.
+  double mean;     ///< Mean of the samples.
+  double m2;       ///< Sum of squared differences from the mean.
+} motor_running_stat_t;
+
+/**
+ * @brief Wear indicators of the motor, in constant memory.
+ *
+ * They start from zero at boot, unless restored with `motor_restore`.
+ */
+typedef struct
+{
+  /**
+   * @brief Time of the travels from one endline to the other, in ms, indexed
+   * by `ACTION_CLOCKWISE_MOTOR - 1` (opening) and
+   * `ACTION_COUNTERCLOCKWISE_MOTOR - 1` (closing).
+   */
+  motor_running_stat_t travel_ms[2];
+  uint32_t cycles;            ///< Motions that reached an endline.
+  uint32_t button_presses;    ///< Actions from the control button.
+  uint32_t reversals;         ///< Direction changes with no stop between.
+  uint32_t endline_timeouts;  ///< Motions stopped for missing the endline.
+} motor_health_t;
+
 typedef struct motor
 {
   gpio_pinout_t gpio_pinout;  ///< GPIO pin for the motor.
   motor_state_t _act_state;   ///< Current state of the motor.
   motor_state_t _last_state;  ///< Last state of the motor.
   motor_action_t _action;     ///< Current action of the motor.
+  int64_t _motion_start_us;   ///< When the current/last motion started.
+  int64_t _last_travel_us;    ///< Duration of the last motion to an endline.
 
   void (*in_action)(motor_state_t next_state);
 
   motor_state_t (*get_state)(struct motor *self);
+
+  /**
+   * @brief Called by the motor task after it handles each event, may be NULL.
+   *
+   * Set by the owner of the motor after `motor_init`.
+   */
+  void (*on_event)(struct motor *self, const motor_event_t *event);
 } motor_t;
 
 /**
@@ -54,9 +140,86 @@ typedef struct motor
  */
 void motor_init(motor_t *self);
 
+/**
+ * @brief Restore what the motor knew before a reboot.
+ *
+ * Called between `motor_init` and `motor_start_task`.
+ *
+ * @param self Motor initialized with `motor_init`.
+ * @param last_state Direction of the last motion, the button goes the other
+ * way next.
+ * @param health Wear indicators to continue from, may be NULL.
+ */
+void motor_restore(motor_t *self, motor_state_t last_state,
+                   const motor_health_t *health);
+
+/**
+ * @brief Read the levels of the endline sensors.
+ *
+ * @return MOTOR_EVENT_OPENED or MOTOR_EVENT_CLOSED if the gate is at that
+ * endline, MOTOR_EVENT_ACTION if it is at none.
+ */
+motor_event_type_t motor_read_endline();
+
+/**
+ * @brief Wake the chip from light sleep when the control button is pressed.
+ *
+ * @return ESP_OK on success, otherwise the error of the GPIO driver.
+ */
+esp_err_t motor_enable_wakeup();
+
+/**
+ * @brief Wake the chip from deep sleep when the control button is pressed.
+ *
+ * @return ESP_OK on success, otherwise the error of the GPIO driver.
+ */
+esp_err_t motor_enable_deep_wakeup();
+
+/**
+ * @brief Run the action of a button press that happened before the boot,
+ * i.e. the one that woke the chip from deep sleep.
+ *
+ * Called once the motor is initialized. The button ISR stays off until the
+ * button is released.
+ */
+void motor_replay_button();
+
 /**
  * @brief Start the motor task.
  */
 void motor_start_task();
 
+/**
+ * @brief Smallest amount of stack the motor task has had left, in bytes.
+ *
+ * @return The stack high water mark, 0 if the task is not started.
+ */
+uint32_t motor_task_stack_free();
+
+/**
+ * @brief Get the counters of the motor event queue.
+ *
+ * @param stats Where to copy the counters.
+ */
+void motor_get_stats(motor_stats_t *stats);
+
+/**
+ * @brief Get the wear indicators of the motor.
+ *
+ * @param health Where to copy the indicators.
+ */
+void motor_get_health(motor_health_t *health);
+
+/**
+ * @brief Count a motion stopped because its endline was not hit in time.
+ */
+void motor_count_endline_timeout();
+
+/**
+ * @brief Variance of a running statistic.
+ *
+ * @return The sample variance, 0 with less than two samples.
+ */
+double motor_running_stat_variance(const motor_running_stat_t *stat);
+
 #endif  // MOTOR_H
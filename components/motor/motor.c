@@ -11,11 +11,18 @@
 
 #include "motor.h"
 
+#include <esp_attr.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <stddef.h>
 
+#include "device_clock.h"
 #include "gpio_drivers.h"
+#include "metrics.h"
+#include "power_manager.h"
 
 #define MOTOR_CONTROL_PIN D14
 
@@ -28,6 +35,8 @@
 
 #define MAX_QUEUE_SIZE 10
 
+#define LATENCY_BUCKETS 5
+
 static const char *TAG = "MOTOR";
 
 static QueueHandle_t s_motor_event_queue;
@@ -38,6 +47,69 @@ static motor_t *s_motor_instance = NULL;
 
 static TimerHandle_t s_motor_timer_enable_isr = NULL;
 
+static TaskHandle_t s_motor_task_handle = NULL;
+
+static motor_stats_t s_motor_stats = {0};
+
+// Wear indicators, written by the motor task only
+static motor_health_t s_motor_health = {0};
+static portMUX_TYPE s_motor_health_lock = portMUX_INITIALIZER_UNLOCKED;
+static motor_action_t s_health_direction = ACTION_STOP_MOTOR;
+static motor_event_type_t s_health_endline = MOTOR_EVENT_ACTION;  ///< None.
+static int64_t s_health_start_us = 0;
+
+// Busy lock of the power manager, held by the motor task while moving
+static bool s_power_held = false;
+
+// Delay from the edge/request to the motor task, in us
+static const uint32_t s_latency_bounds[LATENCY_BUCKETS] = {100, 500, 1000,
+                                                           5000, 20000};
+static atomic_uint_least32_t s_latency_buckets[LATENCY_BUCKETS + 1];
+static metrics_metric_t s_latency_metric = {
+  .name = "motor_event_latency_us",
+  .help = "Delay from an edge or request to its handling by the motor task.",
+  .type = METRICS_HISTOGRAM,
+  .bounds = s_latency_bounds,
+  .bucket_count = LATENCY_BUCKETS,
+  .buckets = s_latency_buckets,
+};
+
+// Reads the `uint32_t` field of the record filled by `read_cb`
+#define MOTOR_METRIC(metric_name, metric_type, metric_help, read_cb, record, \
+                     field)                                                  \
+  {                                                                          \
+    .name = metric_name, .help = metric_help, .type = metric_type,           \
+    .read = read_cb, .read_arg = (void *)offsetof(record, field),            \
+  }
+
+static int64_t motor_read_stat(void *arg);
+static int64_t motor_read_health(void *arg);
+
+// Sampled from the statistics the motor keeps anyway
+static metrics_metric_t s_metrics[] = {
+  MOTOR_METRIC("motor_events_posted_total", METRICS_COUNTER,
+               "Events queued to the motor task.", motor_read_stat,
+               motor_stats_t, events_posted),
+  MOTOR_METRIC("motor_events_dropped_total", METRICS_COUNTER,
+               "Events lost because the motor queue was full.",
+               motor_read_stat, motor_stats_t, events_dropped),
+  MOTOR_METRIC("motor_queue_peak", METRICS_GAUGE,
+               "Most events ever waiting in the motor queue.", motor_read_stat,
+               motor_stats_t, queue_peak),
+  MOTOR_METRIC("motor_cycles_total", METRICS_COUNTER,
+               "Motions that reached an endline.", motor_read_health,
+               motor_health_t, cycles),
+  MOTOR_METRIC("motor_reversals_total", METRICS_COUNTER,
+               "Direction changes with no stop between.", motor_read_health,
+               motor_health_t, reversals),
+  MOTOR_METRIC("motor_button_presses_total", METRICS_COUNTER,
+               "Actions from the control button.", motor_read_health,
+               motor_health_t, button_presses),
+  MOTOR_METRIC("motor_endline_timeouts_total", METRICS_COUNTER,
+               "Motions stopped for missing the endline.", motor_read_health,
+               motor_health_t, endline_timeouts),
+};
+
 static void motor_control(void *arg);
 static void motor_opened(void *arg);
 static void motor_closed(void *arg);
@@ -45,18 +117,21 @@ static void motor_closed(void *arg);
 static gpio_t s_motor_control = {
   .pin = MOTOR_CONTROL_PIN,
   ._mode = GPIO_MODE_INPUT,
+  .timestamp_edges = true,
   .isr_handler = motor_control,
   .isr_handler_arg = (void *)MOTOR_CONTROL_PIN,
 };
 static gpio_t s_open_endline_sensor = {
   .pin = OPEN_ENDLINE_SENSOR_PIN,
   ._mode = GPIO_MODE_INPUT,
+  .timestamp_edges = true,
   .isr_handler = motor_opened,
   .isr_handler_arg = (void *)OPEN_ENDLINE_SENSOR_PIN,
 };
 static gpio_t s_close_endline_sensor = {
   .pin = CLOSE_ENDLINE_SENSOR_PIN,
   ._mode = GPIO_MODE_INPUT,
+  .timestamp_edges = true,
   .isr_handler = motor_closed,
   .isr_handler_arg = (void *)CLOSE_ENDLINE_SENSOR_PIN,
 };
@@ -83,35 +158,78 @@ static gpio_t s_led_stopping = {
   .isr_handler_arg = NULL,
 };
 
-static void update_state(motor_t *self, motor_state_t state)
+/**
+ * @brief LED pattern of each motor state, indexed by `motor_state_t`.
+ *
+ * Built once in `motor_init` so a transition only applies a precomputed mask.
+ */
+static gpio_group_t s_led_patterns[3];
+
+static void IRAM_ATTR update_state(motor_t *self, motor_state_t state)
 {
   self->_last_state = self->_act_state;
   // Convert the motor action to the motor state
   self->_act_state = state;
 }
 
-// TODO: (0) Implement the motor in action to put it in `gate.c`
-// Modularize this function to be used with each motor instance, i.e., pass the
-// motor instance as an argument
-void motor_in_action(motor_state_t next_state)
+// Helper function to defer an event to the motor task, from ISRs or tasks
+static void IRAM_ATTR motor_post_event(motor_event_type_t type,
+                                       motor_action_t action,
+                                       motor_event_source_t source,
+                                       int64_t timestamp_us)
+{
+  motor_event_t event = {
+    .type = type,
+    .action = action,
+    .source = source,
+    .timestamp_us = timestamp_us,
+  };
+
+  BaseType_t sent;
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  bool in_isr = xPortInIsrContext();
+  if (!in_isr)
+    sent = xQueueSend(s_motor_event_queue, &event, 0);
+  else
+    sent = xQueueSendFromISR(s_motor_event_queue, &event,
+                             &xHigherPriorityTaskWoken);
+
+  // Statistics only, a lost increment between cores is acceptable
+  if (sent == pdTRUE)
+    s_motor_stats.events_posted++;
+  else
+    s_motor_stats.events_dropped++;
+
+  if (in_isr)
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+static void IRAM_ATTR motor_in_action_at(motor_state_t next_state,
+                                         motor_event_source_t source,
+                                         int64_t timestamp_us)
 {
   s_motor_instance->_action = (motor_action_t)next_state;
   update_state(s_motor_instance, next_state);
 
-  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-  xQueueSendFromISR(s_motor_event_queue, &s_motor_instance->_action,
-                    &xHigherPriorityTaskWoken);
+  if (next_state != STATE_MOTOR_STOPPED)
+    s_motor_instance->_motion_start_us = timestamp_us;
+
+  motor_post_event(MOTOR_EVENT_ACTION, s_motor_instance->_action, source,
+                   timestamp_us);
 }
 
-//* Callback function of motor INTERRUPT
-static void motor_control(void *arg)
+// TODO: (0) Implement the motor in action to put it in `gate.c`
+// Modularize this function to be used with each motor instance, i.e., pass the
+// motor instance as an argument
+void IRAM_ATTR motor_in_action(motor_state_t next_state)
 {
-  gpio_pinout_t pin = (gpio_pinout_t)arg;
-  // Unused variable
-  (void)pin;
-
-  motor_interrupt_count++;
+  motor_in_action_at(next_state, MOTOR_SOURCE_REMOTE, gpio_now_us());
+}
 
+// Helper function to run the button action: stop when moving, otherwise move
+// the other way than the last motion
+static bool IRAM_ATTR motor_button_action(int64_t timestamp_us)
+{
   motor_state_t next_state;
   switch (s_motor_instance->_act_state)
   {
@@ -130,47 +248,182 @@ static void motor_control(void *arg)
     }
     default:
     {
-      return;
+      return false;
     }
   }
 
-  motor_in_action(next_state);
+  motor_in_action_at(next_state, MOTOR_SOURCE_BUTTON, timestamp_us);
+  return true;
+}
 
+//* Callback function of motor INTERRUPT
+static void IRAM_ATTR motor_control(void *arg)
+{
+  gpio_pinout_t pin = (gpio_pinout_t)arg;
+  // Unused variable
+  (void)pin;
+
+  motor_interrupt_count++;
+
+  if (!motor_button_action(gpio_get_edge_time_us(&s_motor_control)))
+    return;
+
+  // Debounce: the timer re-enables the button ISR
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
   gpio_disable_isr(&s_motor_control);
-  xTimerStart(s_motor_timer_enable_isr, 0);
+  xTimerStartFromISR(s_motor_timer_enable_isr, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
-// Helper function to set LED states
-static esp_err_t set_led_states(gpio_state_t opening, gpio_state_t closing,
-                                gpio_state_t stopping)
+// Helper function to build the LED pattern of a motor state
+static esp_err_t build_led_pattern(motor_state_t state, gpio_state_t opening,
+                                   gpio_state_t closing, gpio_state_t stopping)
 {
+  gpio_group_t *pattern = &s_led_patterns[state];
   esp_err_t ret;
 
-  ret = s_led_opening.set_state(&s_led_opening, opening);
+  gpio_group_reset(pattern);
+
+  ret = gpio_group_stage(pattern, &s_led_opening, opening);
   if (ret != ESP_OK)
     return ret;
 
-  ret = s_led_closing.set_state(&s_led_closing, closing);
+  ret = gpio_group_stage(pattern, &s_led_closing, closing);
   if (ret != ESP_OK)
     return ret;
 
-  ret = s_led_stopping.set_state(&s_led_stopping, stopping);
+  ret = gpio_group_stage(pattern, &s_led_stopping, stopping);
   if (ret != ESP_OK)
     return ret;
 
   return ESP_OK;
 }
 
+// Helper function to set LED states, all LEDs change at once
+static inline esp_err_t IRAM_ATTR set_led_states(motor_state_t state)
+{
+  return gpio_group_apply(&s_led_patterns[state]);
+}
+
+// Helper function to log the end of a motion at an endline sensor
+static void motor_log_travel(motor_t *self, const motor_event_t *event)
+{
+  if (self->_motion_start_us == 0)
+    return;
+
+  self->_last_travel_us = event->timestamp_us - self->_motion_start_us;
+  ESP_LOGI(TAG, "Gate %s after %lld us of travel",
+           (event->type == MOTOR_EVENT_OPENED) ? "opened" : "closed",
+           (long long)self->_last_travel_us);
+}
+
+static void motor_running_stat_add(motor_running_stat_t *stat, double x)
+{
+  stat->count++;
+  double delta = x - stat->mean;
+  stat->mean += delta / stat->count;
+  stat->m2 += delta * (x - stat->mean);
+}
+
+/**
+ * @brief Update the wear indicators with an event, on the motor task.
+ *
+ * Only travels that start at one endline and reach the other with no stop or
+ * reversal go into the travel times.
+ */
+static void motor_health_record(const motor_event_t *event)
+{
+  taskENTER_CRITICAL(&s_motor_health_lock);
+  if (event->type == MOTOR_EVENT_ACTION)
+  {
+    if (event->source == MOTOR_SOURCE_BUTTON)
+      s_motor_health.button_presses++;
+
+    if (event->action == ACTION_STOP_MOTOR)
+    {
+      if (s_health_direction != ACTION_STOP_MOTOR)
+        s_health_endline = MOTOR_EVENT_ACTION;
+    }
+    else if (s_health_direction == ACTION_STOP_MOTOR)
+    {
+      s_health_start_us = event->timestamp_us;
+    }
+    else if (s_health_direction != event->action)
+    {
+      s_motor_health.reversals++;
+      s_health_endline = MOTOR_EVENT_ACTION;
+    }
+    s_health_direction = event->action;
+  }
+  else
+  {
+    motor_action_t direction = (event->type == MOTOR_EVENT_OPENED)
+                                 ? ACTION_CLOCKWISE_MOTOR
+                                 : ACTION_COUNTERCLOCKWISE_MOTOR;
+    motor_event_type_t origin = (event->type == MOTOR_EVENT_OPENED)
+                                  ? MOTOR_EVENT_CLOSED
+                                  : MOTOR_EVENT_OPENED;
+
+    s_motor_health.cycles++;
+    if (s_health_direction == direction && s_health_endline == origin)
+      motor_running_stat_add(
+        &s_motor_health.travel_ms[direction - 1],
+        (event->timestamp_us - s_health_start_us) / 1000.0);
+
+    s_health_endline = event->type;
+    s_health_direction = ACTION_STOP_MOTOR;
+  }
+  taskEXIT_CRITICAL(&s_motor_health_lock);
+}
+
+// Full clock and no light sleep while moving, so the endline edges are handled
+// as fast as with the power management off
+static void motor_hold_power(bool moving)
+{
+  if (moving == s_power_held)
+    return;
+
+  s_power_held = moving;
+  if (moving)
+    power_manager_acquire();
+  else
+    power_manager_release();
+}
+
 //* (Motor task) to update the LED states based on received QUEUE
 //* It will be used in MQTT implementation to control the motor
 static void motor_task(void *pvParameters)
 {
-  motor_action_t rcv_action;
+  motor_event_t event;
   while (1)
   {
-    if (xQueueReceive(s_motor_event_queue, &rcv_action, portMAX_DELAY) ==
-        pdTRUE)
+    if (xQueueReceive(s_motor_event_queue, &event, portMAX_DELAY) == pdTRUE)
     {
+      uint32_t depth = uxQueueMessagesWaiting(s_motor_event_queue) + 1;
+      if (depth > s_motor_stats.queue_peak)
+        s_motor_stats.queue_peak = depth;
+
+      // Time between the edge/request and its handling in task context
+      int64_t latency_us = gpio_now_us() - event.timestamp_us;
+      ESP_LOGD(TAG, "Motor event %d handled after %lld us", event.type,
+               (long long)latency_us);
+      metrics_histogram_observe(&s_latency_metric,
+                                latency_us > 0 ? (uint32_t)latency_us : 0);
+
+      motor_health_record(&event);
+
+      motor_hold_power(event.type == MOTOR_EVENT_ACTION &&
+                       event.action != ACTION_STOP_MOTOR);
+
+      if (event.type != MOTOR_EVENT_ACTION)
+      {
+        motor_log_travel(s_motor_instance, &event);
+        if (s_motor_instance->on_event)
+          s_motor_instance->on_event(s_motor_instance, &event);
+        continue;
+      }
+
+      motor_action_t rcv_action = event.action;
       ESP_LOGI(TAG, "Motor receive action: %s",
                (rcv_action == ACTION_STOP_MOTOR) ? "ACTION_STOP_MOTOR"
                : (rcv_action == ACTION_CLOCKWISE_MOTOR)
@@ -181,7 +434,7 @@ static void motor_task(void *pvParameters)
       {
         case ACTION_STOP_MOTOR:
         {
-          set_led_states(GPIO_STATE_LOW, GPIO_STATE_LOW, GPIO_STATE_HIGH);
+          set_led_states(STATE_MOTOR_STOPPED);
 
           gpio_disable_isr(&s_open_endline_sensor);
           gpio_disable_isr(&s_close_endline_sensor);
@@ -190,7 +443,7 @@ static void motor_task(void *pvParameters)
         }
         case ACTION_CLOCKWISE_MOTOR:
         {
-          set_led_states(GPIO_STATE_HIGH, GPIO_STATE_LOW, GPIO_STATE_LOW);
+          set_led_states(STATE_MOTOR_IN_CLOCKWISE);
 
           gpio_enable_isr(&s_open_endline_sensor);
           gpio_disable_isr(&s_close_endline_sensor);
@@ -199,7 +452,7 @@ static void motor_task(void *pvParameters)
         }
         case ACTION_COUNTERCLOCKWISE_MOTOR:
         {
-          set_led_states(GPIO_STATE_LOW, GPIO_STATE_HIGH, GPIO_STATE_LOW);
+          set_led_states(STATE_MOTOR_IN_COUNTERCLOCKWISE);
 
           gpio_enable_isr(&s_close_endline_sensor);
           gpio_disable_isr(&s_open_endline_sensor);
@@ -209,36 +462,50 @@ static void motor_task(void *pvParameters)
         default:
           return;
       }
+
+      // Outputs driven, the end of a button wake
+      event.actuated_us = device_clock_mono_us();
+      power_manager_mark_actuated();
+
+      if (s_motor_instance->on_event)
+        s_motor_instance->on_event(s_motor_instance, &event);
     }
   }
 }
 
-static void motor_opened(void *arg)
+static void IRAM_ATTR motor_opened(void *arg)
 {
   motor_interrupt_count++;
-  s_led_opening.set_state(&s_led_opening, GPIO_STATE_LOW);
-  s_led_stopping.set_state(&s_led_stopping, GPIO_STATE_HIGH);
+  set_led_states(STATE_MOTOR_STOPPED);
 
   gpio_disable_isr(&s_open_endline_sensor);
   gpio_disable_isr(&s_close_endline_sensor);
 
   update_state(s_motor_instance, STATE_MOTOR_STOPPED);
+  motor_post_event(MOTOR_EVENT_OPENED, ACTION_STOP_MOTOR, MOTOR_SOURCE_SENSOR,
+                   gpio_get_edge_time_us(&s_open_endline_sensor));
 }
 
-static void motor_closed(void *arg)
+static void IRAM_ATTR motor_closed(void *arg)
 {
   motor_interrupt_count++;
-  s_led_closing.set_state(&s_led_closing, GPIO_STATE_LOW);
-  s_led_stopping.set_state(&s_led_stopping, GPIO_STATE_HIGH);
+  set_led_states(STATE_MOTOR_STOPPED);
 
   gpio_disable_isr(&s_open_endline_sensor);
   gpio_disable_isr(&s_close_endline_sensor);
 
   update_state(s_motor_instance, STATE_MOTOR_STOPPED);
+  motor_post_event(MOTOR_EVENT_CLOSED, ACTION_STOP_MOTOR, MOTOR_SOURCE_SENSOR,
+                   gpio_get_edge_time_us(&s_close_endline_sensor));
 }
 
 static void motor_enable_isr(TimerHandle_t xTimer)
 {
+  // Still pressed: with the level-triggered wakeup of the light sleep, the ISR
+  // would take it as another press. The timer retries.
+  if (s_motor_control.get_state(&s_motor_control) == GPIO_STATE_LOW)
+    return;
+
   gpio_enable_isr(&s_motor_control);
 }
 
@@ -252,18 +519,28 @@ void motor_init(motor_t *self)
   s_motor_instance = self;
   s_motor_instance->_act_state = STATE_MOTOR_STOPPED;
   s_motor_instance->_last_state = STATE_MOTOR_IN_COUNTERCLOCKWISE;
+  s_motor_instance->_motion_start_us = 0;
+  s_motor_instance->_last_travel_us = 0;
   s_motor_instance->in_action = &motor_in_action;
   s_motor_instance->get_state = &get_state;
+  s_motor_instance->on_event = NULL;
 
   // TODO: Implement the toggle function
 
-  s_motor_event_queue = xQueueCreate(MAX_QUEUE_SIZE, sizeof(motor_state_t));
+  s_motor_event_queue = xQueueCreate(MAX_QUEUE_SIZE, sizeof(motor_event_t));
 
   // Initialize the output GPIOs
   gpio_init_impl(&s_led_closing);
   gpio_init_impl(&s_led_opening);
   gpio_init_impl(&s_led_stopping);
 
+  build_led_pattern(STATE_MOTOR_STOPPED, GPIO_STATE_LOW, GPIO_STATE_LOW,
+                    GPIO_STATE_HIGH);
+  build_led_pattern(STATE_MOTOR_IN_CLOCKWISE, GPIO_STATE_HIGH, GPIO_STATE_LOW,
+                    GPIO_STATE_LOW);
+  build_led_pattern(STATE_MOTOR_IN_COUNTERCLOCKWISE, GPIO_STATE_LOW,
+                    GPIO_STATE_HIGH, GPIO_STATE_LOW);
+
   // Initialize the input GPIOs
   gpio_init_impl(&s_motor_control);
 
@@ -281,7 +558,113 @@ void motor_init(motor_t *self)
                  motor_enable_isr);
 }
 
+void motor_restore(motor_t *self, motor_state_t last_state,
+                   const motor_health_t *health)
+{
+  if (last_state != STATE_MOTOR_STOPPED)
+    self->_last_state = last_state;
+
+  if (health)
+  {
+    taskENTER_CRITICAL(&s_motor_health_lock);
+    s_motor_health = *health;
+    taskEXIT_CRITICAL(&s_motor_health_lock);
+  }
+}
+
+esp_err_t motor_enable_wakeup()
+{
+  // The endline sensors need no wakeup, the motor keeps the chip awake while
+  // it moves. The button is active low.
+  return gpio_enable_wakeup(&s_motor_control, GPIO_STATE_LOW);
+}
+
+esp_err_t motor_enable_deep_wakeup()
+{
+  // The endline sensors (GPIO 22 and 23) are no RTC GPIOs, they can not wake
+  // the chip from deep sleep
+  return gpio_enable_deep_wakeup(&s_motor_control, GPIO_STATE_LOW);
+}
+
+void motor_replay_button()
+{
+  // Pressed before the boot, at the wake. Debounced as from the ISR, the timer
+  // enables the ISR again once the button is released.
+  gpio_disable_isr(&s_motor_control);
+  if (motor_button_action(gpio_now_us()))
+    xTimerStart(s_motor_timer_enable_isr, 0);
+  else
+    gpio_enable_isr(&s_motor_control);
+}
+
+motor_event_type_t motor_read_endline()
+{
+  // Sensors are active low
+  if (s_open_endline_sensor.get_state(&s_open_endline_sensor) == GPIO_STATE_LOW)
+  {
+    s_health_endline = MOTOR_EVENT_OPENED;
+    return MOTOR_EVENT_OPENED;
+  }
+  if (s_close_endline_sensor.get_state(&s_close_endline_sensor) ==
+      GPIO_STATE_LOW)
+  {
+    s_health_endline = MOTOR_EVENT_CLOSED;
+    return MOTOR_EVENT_CLOSED;
+  }
+  return MOTOR_EVENT_ACTION;
+}
+
+static int64_t motor_read_stat(void *arg)
+{
+  motor_stats_t stats;
+  motor_get_stats(&stats);
+  return *(uint32_t *)((uint8_t *)&stats + (size_t)arg);
+}
+
+static int64_t motor_read_health(void *arg)
+{
+  motor_health_t health;
+  motor_get_health(&health);
+  return *(uint32_t *)((uint8_t *)&health + (size_t)arg);
+}
+
 void motor_start_task()
 {
-  xTaskCreate(motor_task, "motor_task", 2048, NULL, 10, NULL);
+  metrics_register(&s_latency_metric);
+  for (size_t i = 0; i < sizeof(s_metrics) / sizeof(s_metrics[0]); i++)
+    metrics_register(&s_metrics[i]);
+
+  xTaskCreate(motor_task, "motor_task", 4096, NULL, 10, &s_motor_task_handle);
+}
+
+uint32_t motor_task_stack_free()
+{
+  if (s_motor_task_handle == NULL)
+    return 0;
+
+  return uxTaskGetStackHighWaterMark(s_motor_task_handle);
+}
+
+void motor_get_stats(motor_stats_t *stats)
+{
+  *stats = s_motor_stats;
+}
+
+void motor_get_health(motor_health_t *health)
+{
+  taskENTER_CRITICAL(&s_motor_health_lock);
+  *health = s_motor_health;
+  taskEXIT_CRITICAL(&s_motor_health_lock);
+}
+
+void motor_count_endline_timeout()
+{
+  taskENTER_CRITICAL(&s_motor_health_lock);
+  s_motor_health.endline_timeouts++;
+  taskEXIT_CRITICAL(&s_motor_health_lock);
+}
+
+double motor_running_stat_variance(const motor_running_stat_t *stat)
+{
+  return (stat->count < 2) ? 0 : stat->m2 / (stat->count - 1);
 }
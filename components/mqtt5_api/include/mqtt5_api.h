@@ -15,6 +15,8 @@
 #define MQTT5_API_H
 
 #include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define DEFAULT_QOS 0
@@ -22,11 +24,31 @@
 
 #define MAX_MQTT_TOPIC_LEN 128
 
+/**
+ * @brief Longest list of brokers, see `mqtt5_api_start_brokers`.
+ */
+#define MQTT5_API_MAX_BROKERS 4
+
+/**
+ * @brief Source of the messages from the broker.
+ *
+ * MQTT does not tell the publishers apart, other transports give their own
+ * sources (e.g. `LOCAL_CTRL_SOURCE`).
+ */
+#define MQTT5_API_SOURCE_BROKER 0
+
 /**
  * @brief New type is for a function pointer.
  *
+ * @param source Who sent the message, e.g. `MQTT5_API_SOURCE_BROKER`.
  */
-typedef void (*mqtt5_api_callback_t)(char *data, int len);
+typedef void (*mqtt5_api_callback_t)(uint32_t source, char *data, int len);
+
+/**
+ * @brief Observer of the published messages, see `mqtt5_api_set_publish_hook`.
+ */
+typedef void (*mqtt5_api_publish_hook_t)(const char *topic, const char *data,
+                                         int len);
 
 /**
  * @brief Structure to hold MQTT 5.0 API subscription information.
@@ -38,8 +60,57 @@ typedef struct
 {
   char topic[MAX_MQTT_TOPIC_LEN];  // Fixed-size array for the topic
   mqtt5_api_callback_t callback;   // Callback function
+  uint8_t qos;                     // QoS of the subscription, 0 by default
 } mqtt5_api_subscription_t;
 
+/**
+ * @brief How the broker is authenticated over `mqtts`.
+ *
+ * A PSK takes precedence and needs `CONFIG_MBEDTLS_PSK_MODES`: no certificate
+ * is sent nor checked, the cheapest handshake. Otherwise the broker must chain
+ * to `ca_pem` if given, or to the certificate bundle. Every buffer must outlive
+ * the client.
+ */
+typedef struct
+{
+  const char *ca_pem;        ///< Pinned CA in PEM, or NULL for the bundle.
+  const uint8_t *psk;        ///< Pre-shared key, or NULL.
+  size_t psk_len;            ///< Length of `psk`.
+  const char *psk_identity;  ///< Identity of `psk`.
+} mqtt5_api_tls_t;
+
+/**
+ * @brief A broker to connect to.
+ */
+typedef struct
+{
+  const char *host;      ///< Host name or address, without the scheme.
+  uint16_t port;         ///< TCP port.
+  bool tls;              ///< Over TLS, authenticated as set by `set_tls`.
+  const char *username;  ///< Username, NULL or empty for none.
+  const char *password;  ///< Password, NULL or empty for none.
+} mqtt5_api_broker_t;
+
+/**
+ * @brief Set how the broker is authenticated, before `mqtt5_api_start`.
+ *
+ * Without it, `mqtts` checks the broker against the certificate bundle.
+ *
+ * @param tls Authentication of the broker, copied.
+ */
+void mqtt5_api_set_tls(const mqtt5_api_tls_t *tls);
+
+/**
+ * @brief Set the topic the messages of the client itself go under, e.g. the
+ * probes of the link, before `mqtt5_api_start`.
+ *
+ * They are followed by the client ID, so devices sharing a base topic do not
+ * share them. Without a base topic, they start with the client ID.
+ *
+ * @param base_topic Base topic, copied.
+ */
+void mqtt5_api_set_base_topic(const char *base_topic);
+
 /**
  * @brief Start the MQTT client.
  *
@@ -50,11 +121,41 @@ typedef struct
  * @param username The username for MQTT authentication.
  * @param password The password for MQTT authentication.
  * @param port The port for MQTT connection (1883 for MQTT, 8883 for MQTT over
- * SSL).
+ * SSL). Over SSL, the TLS session is resumed across reconnections and deep
+ * sleep.
  */
 void mqtt5_api_start(char *broker_url, char *username, char *password,
                      uint16_t port);
 
+/**
+ * @brief Start the MQTT client on a list of brokers, in order of preference.
+ *
+ * The client connects to the first broker. A broker that fails or is lost
+ * backs off, and the next one of the list is tried at once, e.g. a site-local
+ * broker first and a cloud one as a fallback. While on a fallback, the
+ * preferred brokers are checked every 30 s and moved back to once they accept
+ * connections. The subscriptions are sent again to every broker connected,
+ * unless it resumed a session that has them.
+ *
+ * On the Linux target, the simulated broker stands for all of them.
+ *
+ * @param brokers Brokers, copied, their strings must outlive the client.
+ * @param count Number of brokers, from 1 to `MQTT5_API_MAX_BROKERS`.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for a bad list, an error of
+ * the client otherwise.
+ */
+esp_err_t mqtt5_api_start_brokers(const mqtt5_api_broker_t *brokers,
+                                  size_t count);
+
+/**
+ * @brief Disconnect from the broker and stop the client, e.g. before a deep
+ * sleep.
+ *
+ * The broker keeps the session, and sends no last will for a clean
+ * disconnection.
+ */
+void mqtt5_api_stop(void);
+
 /**
  * @brief Publish a message to an MQTT topic.
  *
@@ -71,11 +172,46 @@ esp_err_t mqtt5_api_publish(const char *topic, const char *data, int len);
 /**
  * @brief Subscribe to an MQTT topic.
  *
- * This function subscribes to the specified MQTT topic.
+ * This function subscribes to the specified MQTT topic. The subscription
+ * is kept and sent again on every connection, so it may be made before the
+ * client is started or connected. A resumed session keeps the subscriptions
+ * the broker acknowledged in it, kept track of through deep sleep, and is only
+ * sent the others, e.g. one deferred or refused.
+ *
+ * With QoS 1, a message the broker sends again because its acknowledgement was
+ * lost is handed over again: subscribers that must act only once recognize
+ * their messages themselves, e.g. with `mqtt5_dedup.h`.
  *
  * @param topic The MQTT topic to subscribe to.
- * @return ESP_OK on success, ESP_FAIL on failure.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for a QoS over 2, ESP_FAIL if
+ * there is no room for it.
  */
 esp_err_t mqtt5_api_subscribe(mqtt5_api_subscription_t *subscription);
 
+/**
+ * @brief Hand a received message to the subscription of its topic.
+ *
+ * Called by the broker backend, and by other transports (e.g. the local
+ * control endpoint) so their messages reach the same handlers.
+ *
+ * @param source Who sent the message, handed to the callback.
+ * @param topic Topic of the message, not NUL-terminated.
+ * @param topic_len Length of the topic.
+ * @param data Payload of the message, not NUL-terminated.
+ * @param data_len Length of the payload.
+ * @return true if a subscription took the message, false otherwise.
+ */
+bool mqtt5_api_dispatch(uint32_t source, const char *topic, int topic_len,
+                        char *data, int data_len);
+
+/**
+ * @brief Observe every message published, before it goes to the broker.
+ *
+ * The hook runs on the publishing task, and also when the broker is not
+ * reachable.
+ *
+ * @param hook Observer, NULL to remove it.
+ */
+void mqtt5_api_set_publish_hook(mqtt5_api_publish_hook_t hook);
+
 #endif  // MQTT5_API_H
@@ -0,0 +1,86 @@
+/**
+ * @file mqtt5_dedup.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Fixed-size cache of the messages already handled
+ *
+ * QoS 1 delivers a message at least once: the broker sends it again when its
+ * PUBACK is lost, and a client may retry a command it got no answer for. The
+ * cache remembers the last `MQTT5_DEDUP_CAPACITY` keys (e.g. command IDs) so
+ * a message is only acted upon once. Lookups hash into a small table,
+ * and a list in order of use evicts the least recently seen key, both in
+ * constant time, with no allocation.
+ *
+ * A zeroed cache is empty, so it can be static or kept in RTC memory. It is not
+ * thread-safe, its users lock around it or keep it to one task.
+ *
+ * @version 0.1
+ * @date 2024-12-14
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MQTT5_DEDUP_H
+#define MQTT5_DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Keys remembered, at most 255.
+ */
+#define MQTT5_DEDUP_CAPACITY 16
+
+/**
+ * @brief Buckets of the hash table, a power of two.
+ */
+#define MQTT5_DEDUP_BUCKETS 32
+
+/**
+ * @brief Cache of keys, zeroed when empty.
+ *
+ * Entries are numbered from 1, 0 is the end of a list.
+ */
+typedef struct
+{
+  uint32_t keys[MQTT5_DEDUP_CAPACITY];
+  uint8_t chain[MQTT5_DEDUP_CAPACITY];   ///< Next entry of the bucket.
+  uint8_t newer[MQTT5_DEDUP_CAPACITY];   ///< Entry used after this one.
+  uint8_t older[MQTT5_DEDUP_CAPACITY];   ///< Entry used before this one.
+  uint8_t buckets[MQTT5_DEDUP_BUCKETS];  ///< First entry of each bucket.
+  uint8_t newest;                        ///< Entry used last.
+  uint8_t oldest;                        ///< Next entry evicted.
+  uint8_t count;                         ///< Entries in use.
+} mqtt5_dedup_t;
+
+/**
+ * @brief Check a key without remembering it, nor changing its order.
+ *
+ * For messages that may still be refused: a key is only remembered once its
+ * message is acted upon, with `mqtt5_dedup_seen`.
+ *
+ * @param cache Cache of keys.
+ * @param key Key of the message.
+ * @return true if the key is in the cache.
+ */
+bool mqtt5_dedup_contains(const mqtt5_dedup_t *cache, uint32_t key);
+
+/**
+ * @brief Check a key, and remember it.
+ *
+ * A key seen before becomes the most recently seen. A new one is added, in
+ * place of the least recently seen one if the cache is full.
+ *
+ * @param cache Cache of keys.
+ * @param key Key of the message.
+ * @return true if the key was in the cache, i.e. the message is a duplicate.
+ */
+bool mqtt5_dedup_seen(mqtt5_dedup_t *cache, uint32_t key);
+
+/**
+ * @brief Forget every key.
+ */
+void mqtt5_dedup_clear(mqtt5_dedup_t *cache);
+
+#endif  // MQTT5_DEDUP_H
@@ -0,0 +1,73 @@
+/**
+ * @file mqtt5_sim.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Simulated broker of the MQTT 5 API on the Linux target
+ *
+ * The simulated transport never touches the network. Publishes are recorded
+ * until taken with `mqtt5_sim_take_published` and inbound messages are
+ * injected with `mqtt5_sim_inject`, which runs the matching subscription
+ * callback in the calling task, as esp-mqtt runs it in its own task.
+ *
+ * @version 0.1
+ * @date 2024-11-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MQTT5_SIM_H
+#define MQTT5_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt5_api.h"
+
+/**
+ * @brief Largest payload the simulated broker records, longer ones are cut.
+ */
+#define MQTT5_SIM_MAX_PAYLOAD 128
+
+/**
+ * @brief Message published through the simulated broker.
+ */
+typedef struct
+{
+  char topic[MAX_MQTT_TOPIC_LEN];      /**< Topic, NUL-terminated */
+  char data[MQTT5_SIM_MAX_PAYLOAD];    /**< Payload, NUL-terminated */
+  int len;                             /**< Length of the payload */
+} mqtt5_sim_message_t;
+
+/**
+ * @brief Deliver a message as if it came from the broker.
+ *
+ * @param topic Topic of the message.
+ * @param data Payload of the message.
+ * @param len Length of the payload.
+ * @return true if a subscription took the message, false otherwise.
+ */
+bool mqtt5_sim_inject(const char *topic, const char *data, int len);
+
+/**
+ * @brief Copy and drop the messages published so far, oldest first.
+ *
+ * @param messages Buffer of published messages.
+ * @param max_messages Capacity of the buffer.
+ * @return Number of messages copied.
+ */
+size_t mqtt5_sim_take_published(mqtt5_sim_message_t *messages,
+                                size_t max_messages);
+
+/**
+ * @brief Number of publishes lost because the record buffer was full.
+ */
+uint32_t mqtt5_sim_dropped_published();
+
+/**
+ * @brief Whether the simulated client is started.
+ */
+bool mqtt5_sim_connected();
+
+#endif  // MQTT5_SIM_H
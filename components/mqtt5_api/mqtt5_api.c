@@ -13,21 +13,128 @@
 
 #include "mqtt5_api.h"
 
-#include <esp_event.h>
+#include <esp_attr.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
+#include <stdio.h>
 #include <string.h>
 
-#include "mqtt5_properties.h"
+#include "metrics.h"
+#include "mqtt5_transport.h"
 
 #define MAX_TOPICS_SUBSCRIBED 10
 
+/**
+ * @brief Published topics counted apart, the others share `topic="other"`.
+ */
+#define METRICS_PUBLISHED_TOPICS 8
+
+/**
+ * @brief Longest `topic="..."` label, topics that do not fit count as other.
+ */
+#define METRICS_LABEL_LEN 64
+
 static const char *TAG = "MQTT5 API";
-static esp_mqtt_client_handle_t client = NULL;
 
 static mqtt5_api_subscription_t s_subscriptions[MAX_TOPICS_SUBSCRIBED];
+// Topic lengths, so dispatch rejects most topics without comparing them
+static int s_topic_lens[MAX_TOPICS_SUBSCRIBED];
+// Subscriptions are packed at the start of the table
+static int s_subscription_count = 0;
+
+// Hash of each subscription the broker acknowledged in the open session, 0
+// if none. Kept through deep sleep with the session, so a resumed one is only
+// sent the subscriptions it lacks.
+RTC_DATA_ATTR static uint32_t s_acked[MAX_TOPICS_SUBSCRIBED];
+// Message ID of each subscription waiting for its SUBACK, 0 if none
+static volatile int s_pending_ids[MAX_TOPICS_SUBSCRIBED];
+
+static mqtt5_api_publish_hook_t s_publish_hook = NULL;
+
+static mqtt5_api_tls_t s_tls = {0};
+static char s_base_topic[MAX_MQTT_TOPIC_LEN];
+
+#define TOPIC_METRIC(metric_name, metric_help, metric_labels)          \
+  {                                                                    \
+    .name = metric_name, .help = metric_help, .labels = metric_labels, \
+    .type = METRICS_COUNTER,                                           \
+  }
+
+#define RECEIVED_METRIC(labels)                \
+  TOPIC_METRIC("mqtt_messages_received_total", \
+               "Messages handed to a subscription, by topic.", labels)
+
+#define PUBLISHED_METRIC(labels)                \
+  TOPIC_METRIC("mqtt_messages_published_total", \
+               "Messages published, by topic.", labels)
+
+// Received messages are counted by subscription, published ones by the topics
+// seen first, both lock-free once the series exists
+static metrics_metric_t s_received[MAX_TOPICS_SUBSCRIBED];
+static char s_received_labels[MAX_TOPICS_SUBSCRIBED][METRICS_LABEL_LEN];
+static metrics_metric_t s_received_other = RECEIVED_METRIC("topic=\"other\"");
+
+static metrics_metric_t s_published[METRICS_PUBLISHED_TOPICS];
+static char s_published_labels[METRICS_PUBLISHED_TOPICS][METRICS_LABEL_LEN];
+static volatile int s_published_count = 0;
+static metrics_metric_t s_published_other = PUBLISHED_METRIC("topic=\"other\"");
+static portMUX_TYPE s_published_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static metrics_metric_t s_unrouted = {
+  .name = "mqtt_messages_unrouted_total",
+  .help = "Messages received on a topic nobody subscribed to.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_publish_failed = {
+  .name = "mqtt_publish_failures_total",
+  .help = "Messages the client failed to publish.",
+  .type = METRICS_COUNTER,
+};
+
+static bool mqtt5_api_topic_labels(char labels[METRICS_LABEL_LEN],
+                                   const char *topic, int topic_len)
+{
+  int len = snprintf(labels, METRICS_LABEL_LEN, "topic=\"%.*s\"", topic_len,
+                     topic);
+  return len > 0 && len < METRICS_LABEL_LEN;
+}
+
+static metrics_metric_t *mqtt5_api_published_metric(const char *topic)
+{
+  char labels[METRICS_LABEL_LEN];
+  if (!mqtt5_api_topic_labels(labels, topic, strlen(topic)))
+    return &s_published_other;
+
+  int count = s_published_count;
+  for (int i = 0; i < count; i++)
+    if (strcmp(s_published_labels[i], labels) == 0)
+      return &s_published[i];
+
+  // First publish to the topic, seen again in case another task added it
+  metrics_metric_t *metric = &s_published_other;
+  bool added = false;
+  taskENTER_CRITICAL(&s_published_lock);
+  for (int i = count; i < s_published_count; i++)
+    if (strcmp(s_published_labels[i], labels) == 0)
+      metric = &s_published[i];
+  if (metric == &s_published_other &&
+      s_published_count < METRICS_PUBLISHED_TOPICS)
+  {
+    int i = s_published_count;
+    strcpy(s_published_labels[i], labels);
+    s_published[i] = (metrics_metric_t)PUBLISHED_METRIC(s_published_labels[i]);
+    metric = &s_published[i];
+    s_published_count = i + 1;
+    added = true;
+  }
+  taskEXIT_CRITICAL(&s_published_lock);
 
-static void _add_mqtt5_subscription(mqtt5_api_subscription_t *subscription)
+  if (added)
+    metrics_register(metric);
+  return metric;
+}
+
+static int _add_mqtt5_subscription(mqtt5_api_subscription_t *subscription)
 {
   for (int i = 0; i < MAX_TOPICS_SUBSCRIBED; i++)
   {
@@ -37,168 +144,213 @@ static void _add_mqtt5_subscription(mqtt5_api_subscription_t *subscription)
     strncpy(s_subscriptions[i].topic, subscription->topic,
             MAX_MQTT_TOPIC_LEN - 1);
     s_subscriptions[i].topic[MAX_MQTT_TOPIC_LEN - 1] = '\0';
+    s_topic_lens[i] = strlen(s_subscriptions[i].topic);
 
     s_subscriptions[i].callback = subscription->callback;
+    s_subscriptions[i].qos = subscription->qos;
+
+    if (mqtt5_api_topic_labels(s_received_labels[i], s_subscriptions[i].topic,
+                               s_topic_lens[i]))
+    {
+      s_received[i] = (metrics_metric_t)RECEIVED_METRIC(s_received_labels[i]);
+      metrics_register(&s_received[i]);
+    }
+    s_subscription_count = i + 1;
 
     ESP_LOGW(TAG, "Subscription added to index %d", i);
     ESP_LOGW(TAG, "Topic: %s", s_subscriptions[i].topic);
-    break;
+    return i;
   }
+  return -1;
+}
+
+// FNV-1a of the topic and QoS, never 0
+static uint32_t mqtt5_api_subscription_hash(int index)
+{
+  uint32_t hash = 2166136261u;
+  for (const char *c = s_subscriptions[index].topic; *c != '\0'; c++)
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  hash = (hash ^ s_subscriptions[index].qos) * 16777619u;
+  return hash ? hash : 1;
 }
+
+// A SUBACK handled before the ID is kept is missed, and the subscription is
+// only sent again on the next resumed session
+static int mqtt5_api_send_subscription(int index)
+{
+  int msg_id = mqtt5_transport_subscribe(s_subscriptions[index].topic,
+                                         s_subscriptions[index].qos);
+  s_pending_ids[index] = msg_id == -1 ? 0 : msg_id;
+  return msg_id;
+}
+
 static inline bool _is_same_subscription(mqtt5_api_subscription_t *s1,
                                          mqtt5_api_subscription_t *s2)
 {
   return (strcmp(s1->topic, s2->topic) == 0) && (s1->callback == s2->callback);
 }
 
-/**
- * @brief Event handler for MQTT events.
- *
- * This function handles various MQTT events such as connection, disconnection,
- * subscription, unsubscription, message publication, message reception, and
- * errors.
- *
- * @param handler_args User-defined argument (not used).
- * @param base Event base.
- * @param event_id Event ID.
- * @param event_data Event-specific data.
- */
-static void mqtt5_api_event_handler(void *handler_args, esp_event_base_t base,
-                                    int32_t event_id, void *event_data)
+bool mqtt5_api_dispatch(uint32_t source, const char *topic, int topic_len,
+                        char *data, int data_len)
 {
-  esp_mqtt_event_handle_t event = event_data;
-  esp_mqtt_client_handle_t client = event->client;
-  int msg_id;
-  switch ((esp_mqtt_event_id_t)event_id)
+  for (int i = 0; i < s_subscription_count; i++)
   {
-    case MQTT_EVENT_CONNECTED:
-      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-      // msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-      // ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-      break;
-
-    case MQTT_EVENT_DISCONNECTED:
-      ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-      break;
-
-    case MQTT_EVENT_SUBSCRIBED:
-      ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-      break;
-
-    case MQTT_EVENT_UNSUBSCRIBED:
-      ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-      break;
-
-    case MQTT_EVENT_PUBLISHED:
-      ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-      break;
-
-    case MQTT_EVENT_DATA:
-      ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-      printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-      printf("DATA=%.*s\r\n", event->data_len, event->data);
-      for (int i = 0; i < MAX_TOPICS_SUBSCRIBED; i++)
-      {
-        if (s_subscriptions[i].topic[0] == '\0' ||
-            s_subscriptions[i].callback == NULL)
-          continue;
-
-        ESP_LOGW(TAG, "Comparing '%.*s' with '%s'", event->topic_len,
-                 event->topic, s_subscriptions[i].topic);
-
-        if (strncmp(event->topic, s_subscriptions[i].topic, event->topic_len) ==
-              0 &&
-            strlen(s_subscriptions[i].topic) == event->topic_len)
-        {
-          s_subscriptions[i].callback(event->data, event->data_len);
-          break;
-        }
-      }
-      break;
-
-    case MQTT_EVENT_ERROR:
-      ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
-      if (event->error_handle->error_type == MQTT_ERROR_TYPE_ESP_TLS)
-      {
-        ESP_LOGI(TAG, "Last error code reported from esp-tls: 0x%x",
-                 event->error_handle->esp_tls_last_esp_err);
-        ESP_LOGI(TAG, "Last tls stack error number: 0x%x",
-                 event->error_handle->esp_tls_stack_err);
-        ESP_LOGI(TAG, "Last captured errno : %d (%s)",
-                 event->error_handle->esp_transport_sock_errno,
-                 strerror(event->error_handle->esp_transport_sock_errno));
-      }
-      else if (event->error_handle->error_type ==
-               MQTT_ERROR_TYPE_CONNECTION_REFUSED)
-      {
-        ESP_LOGI(TAG, "Connection refused error: 0x%x",
-                 event->error_handle->connect_return_code);
-      }
-      else
-      {
-        ESP_LOGW(TAG, "Unknown error type: 0x%x",
-                 event->error_handle->error_type);
-      }
-      break;
-
-    default:
-      ESP_LOGI(TAG, "Other event id:%d", event->event_id);
-      break;
+    if (s_topic_lens[i] != topic_len || s_subscriptions[i].callback == NULL)
+      continue;
+
+    if (memcmp(topic, s_subscriptions[i].topic, topic_len) == 0)
+    {
+      // Registered with the subscription, unless its label did not fit
+      metrics_metric_t *received =
+        s_received[i].name ? &s_received[i] : &s_received_other;
+      metrics_counter_add(received, 1);
+      s_subscriptions[i].callback(source, data, data_len);
+      return true;
+    }
   }
+  metrics_counter_add(&s_unrouted, 1);
+  return false;
 }
 
 esp_err_t mqtt5_api_publish(const char *topic, const char *data, int len)
 {
-  // esp_mqtt5_client_set_publish_property(client, &publish_property);
-  // ESP_LOGI(TAG, "Publish properties configured.");
-  int msg_id = esp_mqtt_client_publish(client, topic, data, len, DEFAULT_QOS,
-                                       DEFAULT_RETAIN);
+  mqtt5_api_publish_hook_t hook = s_publish_hook;
+  if (hook)
+    hook(topic, data, len);
+
+  int msg_id =
+    mqtt5_transport_publish(topic, data, len, DEFAULT_QOS, DEFAULT_RETAIN);
   if (msg_id == -1)
   {
     ESP_LOGE(TAG, "Failed to publish message");
+    metrics_counter_add(&s_publish_failed, 1);
     return ESP_FAIL;
   }
-  ESP_LOGI(TAG, "Message published, msg_id=%d", msg_id);
+  metrics_counter_add(mqtt5_api_published_metric(topic), 1);
+  ESP_LOGD(TAG, "Message published, msg_id=%d", msg_id);
   return ESP_OK;
 }
 
 esp_err_t mqtt5_api_subscribe(mqtt5_api_subscription_t *subscription)
 {
-  int msg_id =
-    esp_mqtt_client_subscribe(client, subscription->topic, DEFAULT_QOS);
-  if (msg_id == -1)
+  if (subscription->qos > 2)
+    return ESP_ERR_INVALID_ARG;
+
+  int index = _add_mqtt5_subscription(subscription);
+  if (index == -1)
   {
-    ESP_LOGE(TAG, "Failed to subscribe to topic %s", subscription->topic);
+    ESP_LOGE(TAG, "No room to subscribe to topic %s", subscription->topic);
     return ESP_FAIL;
   }
-  _add_mqtt5_subscription(subscription);
-  ESP_LOGI(TAG, "Subscribed to topic %s, msg_id=%d", subscription->topic,
-           msg_id);
+
+  // Kept even when the broker is not reachable, it is sent on connection
+  int msg_id = mqtt5_api_send_subscription(index);
+  if (msg_id == -1)
+    ESP_LOGI(TAG, "Subscription to %s deferred until connected",
+             subscription->topic);
+  else
+    ESP_LOGI(TAG, "Subscribed to topic %s, msg_id=%d", subscription->topic,
+             msg_id);
   return ESP_OK;
 }
 
+void mqtt5_api_connected(bool session_present)
+{
+  // A clean session starts with no subscription
+  if (!session_present)
+    memset(s_acked, 0, sizeof(s_acked));
+
+  int kept = 0;
+  for (int i = 0; i < s_subscription_count; i++)
+  {
+    if (s_subscriptions[i].topic[0] == '\0')
+      continue;
+    // The broker keeps the subscriptions it acknowledged in a resumed session
+    if (s_acked[i] == mqtt5_api_subscription_hash(i))
+    {
+      kept++;
+      continue;
+    }
+    s_acked[i] = 0;
+    if (mqtt5_api_send_subscription(i) == -1)
+      ESP_LOGE(TAG, "Failed to subscribe to topic %s",
+               s_subscriptions[i].topic);
+  }
+
+  if (session_present)
+    ESP_LOGI(TAG, "Session resumed, %d of %d subscriptions kept", kept,
+             s_subscription_count);
+}
+
+void mqtt5_api_subscribed(int msg_id, bool granted)
+{
+  for (int i = 0; i < s_subscription_count; i++)
+  {
+    if (msg_id == 0 || s_pending_ids[i] != msg_id)
+      continue;
+
+    s_pending_ids[i] = 0;
+    if (granted)
+      s_acked[i] = mqtt5_api_subscription_hash(i);
+    else
+      ESP_LOGE(TAG, "Subscription to %s refused", s_subscriptions[i].topic);
+    return;
+  }
+}
+
+void mqtt5_api_set_publish_hook(mqtt5_api_publish_hook_t hook)
+{
+  s_publish_hook = hook;
+}
+
+void mqtt5_api_set_tls(const mqtt5_api_tls_t *tls)
+{
+  s_tls = *tls;
+}
+
+void mqtt5_api_set_base_topic(const char *base_topic)
+{
+  strncpy(s_base_topic, base_topic, sizeof(s_base_topic) - 1);
+  s_base_topic[sizeof(s_base_topic) - 1] = '\0';
+}
+
 void mqtt5_api_start(char *broker_url, char *username, char *password,
                      uint16_t port)
 {
-  char uri[64];
-  sprintf(uri, "%s://%s", (port == 1883 ? "mqtt" : "mqtts"), broker_url);
-  esp_mqtt_client_config_t mqtt5_cfg = {
-    .broker.address.uri = uri,
-    .broker.address.port = port,
-    // .credentials.username = username,
-    // .credentials.authentication.password = password,
-    .session.protocol_ver = MQTT_PROTOCOL_V_5,
-    .network.disable_auto_reconnect = true,
-    .session.last_will.qos = DEFAULT_QOS,
-    .session.last_will.topic = "c115/last_will",
-    .session.last_will.msg = "i will leave",
+  mqtt5_api_broker_t broker = {
+    .host = broker_url,
+    .port = port,
+    .tls = port != 1883,
+    .username = username,
+    .password = password,
   };
+  ESP_ERROR_CHECK(mqtt5_api_start_brokers(&broker, 1));
+}
+
+esp_err_t mqtt5_api_start_brokers(const mqtt5_api_broker_t *brokers,
+                                  size_t count)
+{
+  if (count == 0 || count > MQTT5_API_MAX_BROKERS)
+    return ESP_ERR_INVALID_ARG;
+  for (size_t i = 0; i < count; i++)
+    if (brokers[i].host == NULL || brokers[i].host[0] == '\0')
+      return ESP_ERR_INVALID_ARG;
 
-  client = esp_mqtt_client_init(&mqtt5_cfg);
+  metrics_register(&s_received_other);
+  metrics_register(&s_unrouted);
+  metrics_register(&s_published_other);
+  metrics_register(&s_publish_failed);
 
-  ESP_ERROR_CHECK(esp_mqtt_client_register_event(
-    client, ESP_EVENT_ANY_ID, mqtt5_api_event_handler, NULL));
-  ESP_ERROR_CHECK(esp_mqtt_client_start(client));
+  esp_err_t err = mqtt5_transport_start(brokers, count, &s_tls, s_base_topic);
+  if (err != ESP_OK)
+    return err;
 
-  ESP_LOGI(TAG, "MQTT client started.");
+  ESP_LOGI(TAG, "MQTT client started, %u brokers.", (unsigned)count);
+  return ESP_OK;
+}
+
+void mqtt5_api_stop(void)
+{
+  mqtt5_transport_stop();
+  ESP_LOGI(TAG, "MQTT client stopped.");
 }
@@ -0,0 +1,107 @@
+/**
+ * @file mqtt5_dedup.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Fixed-size cache of the messages already handled
+ *
+ * @version 0.1
+ * @date 2024-12-14
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "mqtt5_dedup.h"
+
+#include <string.h>
+
+// Entries are numbered from 1, slot `n - 1` of the arrays
+#define SLOT(n) ((n) - 1)
+
+static inline uint8_t mqtt5_dedup_bucket(uint32_t key)
+{
+  // Fibonacci hashing, spreads consecutive IDs over the buckets
+  return ((key * 2654435761u) >> 24) & (MQTT5_DEDUP_BUCKETS - 1);
+}
+
+static void mqtt5_dedup_unlink(mqtt5_dedup_t *cache, uint8_t entry)
+{
+  uint8_t newer = cache->newer[SLOT(entry)];
+  uint8_t older = cache->older[SLOT(entry)];
+
+  if (newer)
+    cache->older[SLOT(newer)] = older;
+  else
+    cache->newest = older;
+
+  if (older)
+    cache->newer[SLOT(older)] = newer;
+  else
+    cache->oldest = newer;
+}
+
+static void mqtt5_dedup_push_newest(mqtt5_dedup_t *cache, uint8_t entry)
+{
+  cache->newer[SLOT(entry)] = 0;
+  cache->older[SLOT(entry)] = cache->newest;
+  if (cache->newest)
+    cache->newer[SLOT(cache->newest)] = entry;
+  else
+    cache->oldest = entry;
+  cache->newest = entry;
+}
+
+bool mqtt5_dedup_contains(const mqtt5_dedup_t *cache, uint32_t key)
+{
+  for (uint8_t entry = cache->buckets[mqtt5_dedup_bucket(key)]; entry;
+       entry = cache->chain[SLOT(entry)])
+    if (cache->keys[SLOT(entry)] == key)
+      return true;
+  return false;
+}
+
+bool mqtt5_dedup_seen(mqtt5_dedup_t *cache, uint32_t key)
+{
+  uint8_t bucket = mqtt5_dedup_bucket(key);
+  for (uint8_t entry = cache->buckets[bucket]; entry;
+       entry = cache->chain[SLOT(entry)])
+  {
+    if (cache->keys[SLOT(entry)] != key)
+      continue;
+
+    if (entry != cache->newest)
+    {
+      mqtt5_dedup_unlink(cache, entry);
+      mqtt5_dedup_push_newest(cache, entry);
+    }
+    return true;
+  }
+
+  uint8_t entry;
+  if (cache->count < MQTT5_DEDUP_CAPACITY)
+  {
+    entry = ++cache->count;
+  }
+  else
+  {
+    // Evict the least recently seen key, out of its bucket too
+    entry = cache->oldest;
+    mqtt5_dedup_unlink(cache, entry);
+    uint32_t evicted = cache->keys[SLOT(entry)];
+    uint8_t *link = &cache->buckets[mqtt5_dedup_bucket(evicted)];
+    while (*link != entry)
+      link = &cache->chain[SLOT(*link)];
+    *link = cache->chain[SLOT(entry)];
+  }
+
+  cache->keys[SLOT(entry)] = key;
+  cache->chain[SLOT(entry)] = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  mqtt5_dedup_push_newest(cache, entry);
+  return false;
+}
+
+void mqtt5_dedup_clear(mqtt5_dedup_t *cache)
+{
+  memset(cache, 0, sizeof(*cache));
+}
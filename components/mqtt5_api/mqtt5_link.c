@@ -0,0 +1,710 @@
+/**
+ * @file mqtt5_link.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Health of the link to the broker, and reconnection
+ *
+ * The event handler only records what happened, under a spinlock, and wakes
+ * the monitor task, which sends the probes and drops or reopens the
+ * connection. The client is only used by the task with `s_client_mutex` held,
+ * never from the event handler, which runs with the esp-mqtt lock held.
+ *
+ * Each broker of the list has its own backoff. A reconnection goes to the
+ * first broker, in the order of the list, whose backoff is over, so losing a
+ * broker moves to the next one at once. Connected to a fallback, the task
+ * checks every `LINK_FAILBACK_MS` whether a preferred broker accepts TCP
+ * connections again, and moves back to it.
+ *
+ * @version 0.1
+ * @date 2024-12-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "mqtt5_link.h"
+
+#include <errno.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// Bounds of the time a probe waits for its PUBACK before it is late
+#define LINK_RTO_MIN_US 300000
+#define LINK_RTO_MAX_US 4000000
+// Before the first round trip is measured
+#define LINK_RTO_INITIAL_US 2000000
+
+// A late probe kills the link after this many timeouts
+#define LINK_DEAD_RTOS 3
+
+// A round trip over 4 times the smoothed one, and over 500 ms, is a spike.
+// Two in a row reopen the connection.
+#define LINK_SPIKE_FACTOR 4
+#define LINK_SPIKE_MIN_US 500000
+#define LINK_SPIKES_TO_RECONNECT 2
+
+// Probes on time before the probe interval grows by half
+#define LINK_GOOD_TO_GROW 3
+
+// Backoff of the reconnections to a broker
+#define LINK_RECONNECT_MIN_MS 500
+#define LINK_RECONNECT_MAX_MS 30000
+
+// An attempt the client never reported is given up after this
+#define LINK_ATTEMPT_MAX_MS 30000
+
+// While on a fallback, time between two checks of the preferred brokers
+#define LINK_FAILBACK_MS 30000
+// Longest wait for a preferred broker to accept a TCP connection
+#define LINK_REACH_TIMEOUT_MS 1000
+
+#define RTT_BUCKETS 7
+
+static const char *TAG = "MQTT5 LINK";
+
+/**
+ * @brief Why a connection was dropped.
+ */
+typedef enum
+{
+  LINK_HEALTHY = 0,
+  LINK_DEAD_TIMEOUT,  ///< A probe was not acknowledged.
+  LINK_DEAD_SPIKE,    ///< The round trip spiked repeatedly.
+} link_verdict_t;
+
+/**
+ * @brief State of the link, shared by the event handler and the task.
+ */
+typedef struct
+{
+  bool connected;
+  int64_t last_alive_us;   ///< Last packet from the broker.
+  uint32_t interval_ms;    ///< Idle time before a probe.
+  uint32_t good_probes;    ///< Probes on time since the interval last grew.
+  int probe_id;            ///< Message ID of the probe in flight, or -1.
+  int64_t probe_sent_us;   ///< When the probe in flight was sent.
+  bool probe_late;         ///< The probe in flight exceeded its timeout.
+  int early_ack_id;        ///< Acknowledged before its ID was known.
+  int64_t early_ack_us;    ///< When `early_ack_id` was acknowledged.
+  bool have_rtt;           ///< `srtt_us` and `rttvar_us` are measured.
+  int32_t srtt_us;         ///< Smoothed round trip, RFC 6298.
+  int32_t rttvar_us;       ///< Variation of the round trip, RFC 6298.
+  uint8_t spikes;          ///< Round trip spikes in a row.
+  link_verdict_t verdict;  ///< Set to drop the connection.
+  bool attempting;         ///< A connection to `broker` is under way.
+  uint8_t broker;          ///< Broker connected, or tried.
+  int8_t last_broker;      ///< Broker of the last connection, or -1.
+  int64_t down_us;         ///< When the last connection was lost.
+  int64_t reconnect_us;    ///< When to reconnect, while disconnected.
+  int64_t failback_us;     ///< When to check the preferred brokers.
+} link_state_t;
+
+/**
+ * @brief Health of a broker of the list.
+ */
+typedef struct
+{
+  mqtt5_api_broker_t broker;
+  uint8_t failures;  ///< Connections failed or lost in a row.
+  int64_t retry_us;  ///< Not tried before, while failing.
+} link_broker_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static link_state_t s_link = {
+  .interval_ms = MQTT5_LINK_PROBE_MIN_MS,
+  .probe_id = -1,
+  .early_ack_id = -1,
+  .last_broker = -1,
+};
+
+static link_broker_t s_brokers[MQTT5_API_MAX_BROKERS];
+static uint8_t s_broker_count = 0;
+
+static esp_mqtt_client_handle_t s_client = NULL;
+static SemaphoreHandle_t s_client_mutex = NULL;
+static TaskHandle_t s_task = NULL;
+// Topic of the probes of this device
+static char s_probe_topic[MAX_MQTT_TOPIC_LEN] = MQTT5_LINK_PROBE_TOPIC;
+
+static const uint32_t s_rtt_bounds[RTT_BUCKETS] = {20,  50,   100, 200,
+                                                   500, 1000, 2000};
+static atomic_uint_least32_t s_rtt_buckets[RTT_BUCKETS + 1];
+static metrics_metric_t s_rtt = {
+  .name = "mqtt_link_rtt_ms",
+  .help = "Round trip of the link probes, to the PUBACK.",
+  .type = METRICS_HISTOGRAM,
+  .bounds = s_rtt_bounds,
+  .bucket_count = RTT_BUCKETS,
+  .buckets = s_rtt_buckets,
+};
+static metrics_metric_t s_probes = {
+  .name = "mqtt_link_probes_total",
+  .help = "Probes sent on an idle link.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_late = {
+  .name = "mqtt_link_probe_timeouts_total",
+  .help = "Probes not acknowledged in time.",
+  .type = METRICS_COUNTER,
+};
+
+// Indexed by `link_verdict_t`
+static metrics_metric_t s_dead[] = {
+  [LINK_DEAD_TIMEOUT] =
+    {
+      .name = "mqtt_link_dead_total",
+      .help = "Connections dropped as dead, by cause.",
+      .labels = "cause=\"timeout\"",
+      .type = METRICS_COUNTER,
+    },
+  [LINK_DEAD_SPIKE] =
+    {
+      .name = "mqtt_link_dead_total",
+      .help = "Connections dropped as dead, by cause.",
+      .labels = "cause=\"rtt_spike\"",
+      .type = METRICS_COUNTER,
+    },
+};
+static metrics_metric_t s_srtt = {
+  .name = "mqtt_link_srtt_ms",
+  .help = "Smoothed round trip of the link probes.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_detect = {
+  .name = "mqtt_link_detect_ms",
+  .help = "From the last packet of the broker to a dead link dropped.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_interval = {
+  .name = "mqtt_link_probe_interval_ms",
+  .help = "Idle time before a probe.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_broker_failures = {
+  .name = "mqtt_broker_failures_total",
+  .help = "Connections to a broker failed or lost.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_switches = {
+  .name = "mqtt_broker_switches_total",
+  .help = "Connections to another broker than the last one.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_broker_index = {
+  .name = "mqtt_broker_index",
+  .help = "Position in the broker list of the broker connected.",
+  .type = METRICS_GAUGE,
+};
+static metrics_metric_t s_failover = {
+  .name = "mqtt_failover_ms",
+  .help = "From a connection lost to connected to another broker.",
+  .type = METRICS_GAUGE,
+};
+
+// Time a probe waits for its PUBACK before it is late
+static int64_t mqtt5_link_rto_us(const link_state_t *link)
+{
+  if (!link->have_rtt)
+    return LINK_RTO_INITIAL_US;
+
+  int64_t rto_us = link->srtt_us + 4 * (int64_t)link->rttvar_us;
+  return rto_us < LINK_RTO_MIN_US   ? LINK_RTO_MIN_US
+         : rto_us > LINK_RTO_MAX_US ? LINK_RTO_MAX_US
+                                    : rto_us;
+}
+
+static void mqtt5_link_trouble(link_state_t *link)
+{
+  link->interval_ms = MQTT5_LINK_PROBE_MIN_MS;
+  link->good_probes = 0;
+}
+
+// The probe in flight was acknowledged, with the spinlock held
+static void mqtt5_link_probe_acked(link_state_t *link, int64_t acked_us)
+{
+  int32_t sample_us = acked_us - link->probe_sent_us;
+  link->probe_id = -1;
+  link->probe_late = false;
+
+  bool spike = link->have_rtt &&
+               sample_us > LINK_SPIKE_FACTOR * (int64_t)link->srtt_us &&
+               sample_us > LINK_SPIKE_MIN_US;
+  link->spikes = spike ? link->spikes + 1 : 0;
+  if (link->spikes >= LINK_SPIKES_TO_RECONNECT)
+    link->verdict = LINK_DEAD_SPIKE;
+
+  if (!link->have_rtt)
+  {
+    link->srtt_us = sample_us;
+    link->rttvar_us = sample_us / 2;
+    link->have_rtt = true;
+  }
+  else
+  {
+    int32_t error_us = link->srtt_us - sample_us;
+    link->rttvar_us += ((error_us < 0 ? -error_us : error_us) -
+                        link->rttvar_us) / 4;
+    link->srtt_us += (sample_us - link->srtt_us) / 8;
+  }
+
+  if (spike)
+    mqtt5_link_trouble(link);
+  else if (++link->good_probes >= LINK_GOOD_TO_GROW)
+  {
+    link->good_probes = 0;
+    link->interval_ms += link->interval_ms / 2;
+    if (link->interval_ms > MQTT5_LINK_PROBE_MAX_MS)
+      link->interval_ms = MQTT5_LINK_PROBE_MAX_MS;
+  }
+
+  metrics_histogram_observe(&s_rtt, sample_us / 1000);
+  metrics_gauge_set(&s_srtt, link->srtt_us / 1000);
+}
+
+static inline void mqtt5_link_wake(void)
+{
+  if (s_task)
+    xTaskNotifyGive(s_task);
+}
+
+// The connection to `link->broker` failed or was lost, with the spinlock held
+static void mqtt5_link_broker_failed(link_state_t *link, int64_t now_us)
+{
+  link_broker_t *broker = &s_brokers[link->broker];
+  if (broker->failures < 16)
+    broker->failures++;
+
+  uint32_t backoff_ms = LINK_RECONNECT_MIN_MS << (broker->failures - 1);
+  if (backoff_ms > LINK_RECONNECT_MAX_MS || broker->failures > 7)
+    backoff_ms = LINK_RECONNECT_MAX_MS;
+  broker->retry_us = now_us + backoff_ms * 1000LL;
+
+  if (link->connected)
+    link->down_us = now_us;
+  link->connected = false;
+  link->attempting = false;
+  link->probe_id = -1;
+  metrics_counter_add(&s_broker_failures, 1);
+}
+
+void mqtt5_link_connected(void)
+{
+  int64_t now_us = esp_timer_get_time();
+  taskENTER_CRITICAL(&s_lock);
+  s_link.connected = true;
+  s_link.attempting = false;
+  s_link.last_alive_us = now_us;
+  s_link.probe_id = -1;
+  s_link.probe_late = false;
+  s_link.spikes = 0;
+  s_link.verdict = LINK_HEALTHY;
+  s_link.failback_us = now_us + LINK_FAILBACK_MS * 1000LL;
+  mqtt5_link_trouble(&s_link);
+
+  uint8_t broker = s_link.broker;
+  s_brokers[broker].failures = 0;
+  s_brokers[broker].retry_us = 0;
+  bool switched = s_link.last_broker >= 0 && s_link.last_broker != broker;
+  int64_t failover_ms = (now_us - s_link.down_us) / 1000;
+  s_link.last_broker = broker;
+  taskEXIT_CRITICAL(&s_lock);
+
+  ESP_LOGI(TAG, "Connected to broker %u, %s:%u", broker,
+           s_brokers[broker].broker.host, s_brokers[broker].broker.port);
+  metrics_gauge_set(&s_broker_index, broker);
+  if (switched)
+  {
+    ESP_LOGW(TAG, "Switched brokers in %lld ms", (long long)failover_ms);
+    metrics_counter_add(&s_switches, 1);
+    metrics_gauge_set(&s_failover, failover_ms);
+  }
+  mqtt5_link_wake();
+}
+
+void mqtt5_link_disconnected(void)
+{
+  int64_t now_us = esp_timer_get_time();
+  taskENTER_CRITICAL(&s_lock);
+  // Already accounted for if the monitor dropped the connection
+  if (s_link.connected || s_link.attempting)
+    mqtt5_link_broker_failed(&s_link, now_us);
+  s_link.reconnect_us = now_us;
+  taskEXIT_CRITICAL(&s_lock);
+  mqtt5_link_wake();
+}
+
+uint8_t mqtt5_link_broker(void)
+{
+  taskENTER_CRITICAL(&s_lock);
+  uint8_t broker = s_link.broker;
+  taskEXIT_CRITICAL(&s_lock);
+  return broker;
+}
+
+void mqtt5_link_alive(void)
+{
+  int64_t now_us = esp_timer_get_time();
+  taskENTER_CRITICAL(&s_lock);
+  s_link.last_alive_us = now_us;
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt5_link_acked(int msg_id)
+{
+  int64_t now_us = esp_timer_get_time();
+  taskENTER_CRITICAL(&s_lock);
+  s_link.last_alive_us = now_us;
+  if (msg_id == s_link.probe_id)
+  {
+    mqtt5_link_probe_acked(&s_link, now_us);
+  }
+  else
+  {
+    // Maybe the probe, acknowledged before the task got its ID
+    s_link.early_ack_id = msg_id;
+    s_link.early_ack_us = now_us;
+  }
+  link_verdict_t verdict = s_link.verdict;
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (verdict != LINK_HEALTHY)
+    mqtt5_link_wake();
+}
+
+/**
+ * @brief Actions of the monitor task.
+ */
+typedef enum
+{
+  LINK_IDLE = 0,
+  LINK_PROBE,
+  LINK_DROP,
+  LINK_RECONNECT,
+  LINK_FAILBACK,
+} link_action_t;
+
+/**
+ * @brief Decide what to do now, with the spinlock held.
+ *
+ * @param now_us Current time.
+ * @param wait_ms Time until the next decision, set.
+ * @return Action to take.
+ */
+static link_action_t mqtt5_link_decide(link_state_t *link, int64_t now_us,
+                                       uint32_t *wait_ms)
+{
+  *wait_ms = UINT32_MAX;
+
+  if (!link->connected)
+  {
+    if (now_us < link->reconnect_us)
+    {
+      *wait_ms = (link->reconnect_us - now_us) / 1000 + 1;
+      return LINK_IDLE;
+    }
+
+    // The first broker of the list not backing off
+    int64_t soonest_us = INT64_MAX;
+    for (uint8_t i = 0; i < s_broker_count; i++)
+    {
+      if (s_brokers[i].retry_us <= now_us)
+      {
+        link->broker = i;
+        link->attempting = true;
+        // Tried again later if the client does not report the attempt
+        link->reconnect_us = now_us + LINK_ATTEMPT_MAX_MS * 1000LL;
+        *wait_ms = LINK_ATTEMPT_MAX_MS;
+        return LINK_RECONNECT;
+      }
+      if (s_brokers[i].retry_us < soonest_us)
+        soonest_us = s_brokers[i].retry_us;
+    }
+    if (soonest_us != INT64_MAX)
+      *wait_ms = (soonest_us - now_us) / 1000 + 1;
+    return LINK_IDLE;
+  }
+
+  if (link->verdict != LINK_HEALTHY)
+    return LINK_DROP;
+
+  int64_t rto_us = mqtt5_link_rto_us(link);
+  if (link->probe_id >= 0)
+  {
+    int64_t waited_us = now_us - link->probe_sent_us;
+    if (waited_us >= LINK_DEAD_RTOS * rto_us)
+    {
+      link->verdict = LINK_DEAD_TIMEOUT;
+      return LINK_DROP;
+    }
+    if (waited_us >= rto_us && !link->probe_late)
+    {
+      link->probe_late = true;
+      mqtt5_link_trouble(link);
+      metrics_counter_add(&s_late, 1);
+    }
+    int64_t next_us = link->probe_late ? LINK_DEAD_RTOS * rto_us : rto_us;
+    *wait_ms = (next_us - waited_us) / 1000 + 1;
+    return LINK_IDLE;
+  }
+
+  if (link->broker > 0 && now_us >= link->failback_us)
+  {
+    link->failback_us = now_us + LINK_FAILBACK_MS * 1000LL;
+    *wait_ms = 0;
+    return LINK_FAILBACK;
+  }
+
+  int64_t idle_us = now_us - link->last_alive_us;
+  if (idle_us < link->interval_ms * 1000LL)
+  {
+    *wait_ms = link->interval_ms - idle_us / 1000 + 1;
+    if (link->broker > 0 && now_us + *wait_ms * 1000LL > link->failback_us)
+      *wait_ms = (link->failback_us - now_us) / 1000 + 1;
+    return LINK_IDLE;
+  }
+
+  link->probe_sent_us = now_us;
+  link->probe_late = false;
+  *wait_ms = rto_us / 1000 + 1;
+  return LINK_PROBE;
+}
+
+/**
+ * @brief Whether a broker accepts TCP connections.
+ *
+ * A cheap health check, the connection is closed as soon as it is open.
+ */
+static bool mqtt5_link_reachable(const mqtt5_api_broker_t *broker)
+{
+  char service[6];
+  snprintf(service, sizeof(service), "%u", broker->port);
+  struct addrinfo hints = {
+    .ai_family = AF_INET,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(broker->host, service, &hints, &res) != 0 || !res)
+    return false;
+
+  int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  bool reachable = false;
+  if (sock >= 0)
+  {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, res->ai_addr, res->ai_addrlen) == 0)
+    {
+      reachable = true;
+    }
+    else if (errno == EINPROGRESS)
+    {
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(sock, &writable);
+      struct timeval timeout = {
+        .tv_sec = LINK_REACH_TIMEOUT_MS / 1000,
+        .tv_usec = (LINK_REACH_TIMEOUT_MS % 1000) * 1000,
+      };
+      int error = 0;
+      socklen_t len = sizeof(error);
+      reachable =
+        select(sock + 1, NULL, &writable, NULL, &timeout) == 1 &&
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+        error == 0;
+    }
+    close(sock);
+  }
+  freeaddrinfo(res);
+  return reachable;
+}
+
+/**
+ * @brief Move back to a preferred broker, if one is reachable.
+ *
+ * @param current Broker connected.
+ * @return Whether the connection is dropped to move back.
+ */
+static bool mqtt5_link_failback(esp_mqtt_client_handle_t client,
+                                uint8_t current)
+{
+  int64_t now_us = esp_timer_get_time();
+  for (uint8_t i = 0; i < current; i++)
+  {
+    taskENTER_CRITICAL(&s_lock);
+    bool backing_off = s_brokers[i].retry_us > now_us;
+    taskEXIT_CRITICAL(&s_lock);
+    if (backing_off || !mqtt5_link_reachable(&s_brokers[i].broker))
+      continue;
+
+    ESP_LOGI(TAG, "Broker %u is back, leaving broker %u", i, current);
+    taskENTER_CRITICAL(&s_lock);
+    // Not a failure of the broker left, the next attempt goes to `i`
+    s_link.connected = false;
+    s_link.attempting = false;
+    s_link.probe_id = -1;
+    s_link.down_us = esp_timer_get_time();
+    s_link.reconnect_us = s_link.down_us;
+    s_brokers[i].retry_us = 0;
+    taskEXIT_CRITICAL(&s_lock);
+    esp_mqtt_client_disconnect(client);
+    return true;
+  }
+  return false;
+}
+
+static void mqtt5_link_task(void *pvParameters)
+{
+  while (1)
+  {
+    int64_t now_us = esp_timer_get_time();
+    uint32_t wait_ms;
+
+    xSemaphoreTake(s_client_mutex, portMAX_DELAY);
+    esp_mqtt_client_handle_t client = s_client;
+
+    taskENTER_CRITICAL(&s_lock);
+    link_action_t action = client ? mqtt5_link_decide(&s_link, now_us, &wait_ms)
+                                   : LINK_IDLE;
+    link_verdict_t verdict = s_link.verdict;
+    int64_t silent_ms = (now_us - s_link.last_alive_us) / 1000;
+    uint8_t broker = s_link.broker;
+    if (action == LINK_DROP)
+    {
+      mqtt5_link_broker_failed(&s_link, now_us);
+      // Or as soon as the client reports the disconnection
+      s_link.reconnect_us = now_us + LINK_RECONNECT_MIN_MS * 1000LL;
+      wait_ms = LINK_RECONNECT_MIN_MS;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    if (!client)
+      wait_ms = UINT32_MAX;
+
+    switch (action)
+    {
+      case LINK_PROBE:
+      {
+        // Queued, so a dead socket never blocks the monitor
+        int msg_id =
+          esp_mqtt_client_enqueue(client, s_probe_topic, "", 0, 1, 0, true);
+        taskENTER_CRITICAL(&s_lock);
+        s_link.probe_id = msg_id;
+        if (msg_id >= 0 && msg_id == s_link.early_ack_id)
+          mqtt5_link_probe_acked(&s_link, s_link.early_ack_us);
+        uint32_t interval_ms = s_link.interval_ms;
+        taskEXIT_CRITICAL(&s_lock);
+
+        metrics_counter_add(&s_probes, 1);
+        metrics_gauge_set(&s_interval, interval_ms);
+        if (msg_id < 0)
+          ESP_LOGW(TAG, "Probe not queued");
+        break;
+      }
+      case LINK_DROP:
+        ESP_LOGW(TAG, "Link dead (%s), %lld ms after the last packet",
+                 verdict == LINK_DEAD_SPIKE ? "round trip spikes" : "timeout",
+                 (long long)silent_ms);
+        metrics_counter_add(&s_dead[verdict], 1);
+        metrics_gauge_set(&s_detect, silent_ms);
+        esp_mqtt_client_disconnect(client);
+        break;
+      case LINK_RECONNECT:
+        ESP_LOGI(TAG, "Reconnecting to broker %u, %s:%u", broker,
+                 s_brokers[broker].broker.host, s_brokers[broker].broker.port);
+        esp_mqtt_client_reconnect(client);
+        break;
+      case LINK_FAILBACK:
+        wait_ms = mqtt5_link_failback(client, broker) ? LINK_RECONNECT_MIN_MS
+                                                      : 0;
+        break;
+      default:
+        break;
+    }
+    xSemaphoreGive(s_client_mutex);
+
+    ulTaskNotifyTake(pdTRUE, wait_ms == UINT32_MAX ? portMAX_DELAY
+                                                   : pdMS_TO_TICKS(wait_ms));
+  }
+}
+
+void mqtt5_link_set_probe_topic(const char *base_topic, const char *client_id)
+{
+  if (base_topic && base_topic[0])
+    snprintf(s_probe_topic, sizeof(s_probe_topic), "%s/%s/%s", base_topic,
+             MQTT5_LINK_PROBE_TOPIC, client_id);
+  else
+    snprintf(s_probe_topic, sizeof(s_probe_topic), "%s/%s", client_id,
+             MQTT5_LINK_PROBE_TOPIC);
+}
+
+void mqtt5_link_set_brokers(const mqtt5_api_broker_t *brokers, size_t count)
+{
+  if (count > MQTT5_API_MAX_BROKERS)
+    count = MQTT5_API_MAX_BROKERS;
+
+  taskENTER_CRITICAL(&s_lock);
+  for (size_t i = 0; i < count; i++)
+    s_brokers[i] = (link_broker_t){.broker = brokers[i]};
+  s_broker_count = count;
+  // The client starts with the first one
+  s_link.connected = false;
+  s_link.attempting = true;
+  s_link.broker = 0;
+  s_link.reconnect_us = esp_timer_get_time() + LINK_ATTEMPT_MAX_MS * 1000LL;
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void mqtt5_link_start(esp_mqtt_client_handle_t client)
+{
+  if (s_client_mutex == NULL)
+  {
+    s_client_mutex = xSemaphoreCreateMutex();
+    if (s_client_mutex == NULL)
+      return;
+
+    metrics_register(&s_rtt);
+    metrics_register(&s_probes);
+    metrics_register(&s_late);
+    metrics_register(&s_dead[LINK_DEAD_TIMEOUT]);
+    metrics_register(&s_dead[LINK_DEAD_SPIKE]);
+    metrics_register(&s_srtt);
+    metrics_register(&s_detect);
+    metrics_register(&s_interval);
+    metrics_register(&s_broker_failures);
+    metrics_register(&s_switches);
+    metrics_register(&s_broker_index);
+    metrics_register(&s_failover);
+  }
+
+  xSemaphoreTake(s_client_mutex, portMAX_DELAY);
+  s_client = client;
+  xSemaphoreGive(s_client_mutex);
+
+  // Also resolves and connects to the brokers to check them
+  if (s_task == NULL &&
+      xTaskCreate(mqtt5_link_task, "mqtt5_link", 4096, NULL,
+                  tskIDLE_PRIORITY + 3, &s_task) != pdPASS)
+    ESP_LOGE(TAG, "Monitor not started, the link is not supervised");
+  mqtt5_link_wake();
+}
+
+void mqtt5_link_stop(void)
+{
+  if (s_client_mutex == NULL)
+    return;
+
+  xSemaphoreTake(s_client_mutex, portMAX_DELAY);
+  s_client = NULL;
+  xSemaphoreGive(s_client_mutex);
+}
@@ -0,0 +1,125 @@
+/**
+ * @file mqtt5_link.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Health of the link to the broker, and reconnection
+ *
+ * Private to the MQTT 5 API, on the chip. A half-open TCP connection looks
+ * alive to esp-mqtt until its keepalive runs out twice, minutes later. Instead,
+ * any packet from the broker proves the link alive, and a link idle for the
+ * probe interval is probed with a QoS 1 publish, whose PUBACK gives the round
+ * trip. A probe not acknowledged in a few round trips, or repeated spikes of
+ * the round trip, drop the connection, which is then reopened with backoff.
+ *
+ * The probe interval adapts: it grows while probes come back on time, up to
+ * `MQTT5_LINK_PROBE_MAX_MS`, and falls back to `MQTT5_LINK_PROBE_MIN_MS` at the
+ * first sign of trouble. Busy links are never probed.
+ *
+ * Reconnections go to the first broker of the list that is not backing off,
+ * and a preferred broker back up is moved back to.
+ *
+ * @version 0.1
+ * @date 2024-12-13
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MQTT5_LINK_H
+#define MQTT5_LINK_H
+
+#include <mqtt_client.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt5_api.h"
+
+/**
+ * @brief Idle time before a probe, after a connection or any trouble.
+ */
+#define MQTT5_LINK_PROBE_MIN_MS 5000
+
+/**
+ * @brief Longest idle time before a probe, on a steady link.
+ */
+#define MQTT5_LINK_PROBE_MAX_MS 20000
+
+/**
+ * @brief MQTT keepalive, for the broker to notice a dead device.
+ *
+ * The probes keep the link busy, so esp-mqtt itself never has to ping.
+ */
+#define MQTT5_LINK_KEEPALIVE_S 45
+
+/**
+ * @brief Longest time a network operation of esp-mqtt may block.
+ */
+#define MQTT5_LINK_NETWORK_TIMEOUT_MS 5000
+
+/**
+ * @brief Topic of the probes under the base topic, followed by the client ID.
+ * Nobody needs to subscribe to it.
+ */
+#define MQTT5_LINK_PROBE_TOPIC "link/probe"
+
+/**
+ * @brief Set the brokers, in order of preference, before the client starts.
+ *
+ * The list is copied, its strings must outlive the client. The client is
+ * expected to start with the first broker.
+ *
+ * @param brokers Brokers, at most `MQTT5_API_MAX_BROKERS`.
+ * @param count Number of brokers.
+ */
+void mqtt5_link_set_brokers(const mqtt5_api_broker_t *brokers, size_t count);
+
+/**
+ * @brief Set the topic of the probes, before the client starts.
+ *
+ * @param base_topic Base topic of the client, may be empty.
+ * @param client_id ID of the client, so each device probes its own topic.
+ */
+void mqtt5_link_set_probe_topic(const char *base_topic, const char *client_id);
+
+/**
+ * @brief Broker the client must connect to, from the MQTT event handler.
+ *
+ * @return Index in the list of `mqtt5_link_set_brokers`.
+ */
+uint8_t mqtt5_link_broker(void);
+
+/**
+ * @brief Start following a client, and the monitor task on the first call.
+ */
+void mqtt5_link_start(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Stop following the client, before it is destroyed.
+ *
+ * Returns once the monitor no longer uses it.
+ */
+void mqtt5_link_stop(void);
+
+/**
+ * @brief The client connected, from the MQTT event handler.
+ */
+void mqtt5_link_connected(void);
+
+/**
+ * @brief The client lost its connection, from the MQTT event handler.
+ */
+void mqtt5_link_disconnected(void);
+
+/**
+ * @brief A packet came from the broker, from the MQTT event handler.
+ */
+void mqtt5_link_alive(void);
+
+/**
+ * @brief A QoS 1 publish was acknowledged, from the MQTT event handler.
+ *
+ * @param msg_id Message ID of the publish.
+ */
+void mqtt5_link_acked(int msg_id);
+
+#endif  // MQTT5_LINK_H
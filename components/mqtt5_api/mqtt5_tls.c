@@ -0,0 +1,520 @@
+/**
+ * @file mqtt5_tls.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief TLS transport of the broker connection, with session resumption
+ *
+ * @version 0.1
+ * @date 2024-12-11
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// The state of the handshake tells a resumption from a full handshake
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include "mqtt5_tls.h"
+
+#include <errno.h>
+#include <esp_attr.h>
+#include <esp_crt_bundle.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ciphersuites.h>
+#include <mbedtls/x509_crt.h>
+#include <netdb.h>
+#include <sdkconfig.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define MQTT5_TLS_DEFAULT_PORT 8883
+
+#define HANDSHAKE_BUCKETS 6
+
+static const char *TAG = "MQTT5 TLS";
+
+/**
+ * @brief State of the transport, a single connection at a time.
+ */
+typedef struct
+{
+  mqtt5_api_tls_t config;    ///< How the broker is authenticated.
+  mbedtls_ssl_config conf;   ///< Shared by the connections.
+  mbedtls_x509_crt ca;       ///< Pinned CA, if any.
+  mbedtls_ssl_context ssl;   ///< Current connection.
+  int fd;                    ///< Socket of the connection, -1 if none.
+} mqtt5_tls_t;
+
+static mqtt5_tls_t s_tls = {.fd = -1};
+static bool s_created = false;
+
+// Session of the last handshake, kept through deep sleep
+RTC_DATA_ATTR static uint8_t s_session[MQTT5_TLS_SESSION_MAX];
+RTC_DATA_ATTR static size_t s_session_len = 0;
+RTC_DATA_ATTR static char s_session_host[64];
+
+#ifdef CONFIG_MBEDTLS_PSK_MODES
+// With a PSK, only suites that need no certificate
+static const int s_psk_suites[] = {
+  MBEDTLS_TLS_ECDHE_PSK_WITH_AES_128_CBC_SHA256,
+  MBEDTLS_TLS_PSK_WITH_AES_128_GCM_SHA256,
+  MBEDTLS_TLS_PSK_WITH_AES_128_CBC_SHA256,
+  0,
+};
+#endif
+
+static const uint32_t s_handshake_bounds[HANDSHAKE_BUCKETS] = {
+  100, 250, 500, 1000, 2000, 5000};
+static atomic_uint_least32_t s_handshake_buckets[HANDSHAKE_BUCKETS + 1];
+static metrics_metric_t s_handshake_ms = {
+  .name = "mqtt_tls_handshake_ms",
+  .help = "Time of the TLS handshakes with the broker.",
+  .type = METRICS_HISTOGRAM,
+  .bounds = s_handshake_bounds,
+  .bucket_count = HANDSHAKE_BUCKETS,
+  .buckets = s_handshake_buckets,
+};
+
+// Indexed by whether the session was resumed
+static metrics_metric_t s_handshakes[2] = {
+  {
+    .name = "mqtt_tls_handshakes_total",
+    .help = "TLS handshakes with the broker.",
+    .labels = "resumed=\"false\"",
+    .type = METRICS_COUNTER,
+  },
+  {
+    .name = "mqtt_tls_handshakes_total",
+    .help = "TLS handshakes with the broker.",
+    .labels = "resumed=\"true\"",
+    .type = METRICS_COUNTER,
+  },
+};
+
+static metrics_metric_t s_handshake_failures = {
+  .name = "mqtt_tls_handshake_failures_total",
+  .help = "TLS handshakes with the broker that failed.",
+  .type = METRICS_COUNTER,
+};
+
+static metrics_metric_t s_heap_peak = {
+  .name = "mqtt_tls_heap_peak_bytes",
+  .help = "Heap taken by the last TLS connection, at its peak.",
+  .type = METRICS_GAUGE,
+};
+
+static int mqtt5_tls_random(void *ctx, unsigned char *buf, size_t len)
+{
+  esp_fill_random(buf, len);
+  return 0;
+}
+
+static int mqtt5_tls_send(void *ctx, const unsigned char *buf, size_t len)
+{
+  int ret = send(*(int *)ctx, buf, len, 0);
+  if (ret >= 0)
+    return ret;
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+static int mqtt5_tls_recv(void *ctx, unsigned char *buf, size_t len)
+{
+  int ret = recv(*(int *)ctx, buf, len, 0);
+  if (ret >= 0)
+    return ret;
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  return MBEDTLS_ERR_NET_RECV_FAILED;
+}
+
+// Wait for the socket, >0 when ready, 0 on timeout, -1 on error
+static int mqtt5_tls_wait(int fd, bool write, int timeout_ms)
+{
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(fd, &set);
+  struct timeval tv = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+  return select(fd + 1, write ? NULL : &set, write ? &set : NULL, NULL,
+                timeout_ms < 0 ? NULL : &tv);
+}
+
+static int mqtt5_tls_tcp_connect(const char *host, int port, int timeout_ms)
+{
+  char service[8];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints = {
+    .ai_family = AF_INET,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(host, service, &hints, &res) != 0 || !res)
+  {
+    ESP_LOGE(TAG, "Failed to resolve %s", host);
+    return -1;
+  }
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd < 0)
+  {
+    freeaddrinfo(res);
+    return -1;
+  }
+
+  // Non-blocking only for the timeout of the connection
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int ret = connect(fd, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  if (ret < 0 && errno == EINPROGRESS &&
+      mqtt5_tls_wait(fd, true, timeout_ms) > 0)
+  {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+      ret = 0;
+  }
+  if (ret < 0)
+  {
+    ESP_LOGE(TAG, "Failed to connect to %s:%d", host, port);
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, flags);
+
+  // Bounds a read or write blocked in the middle of a record
+  struct timeval tv = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+// Offer the session of the last handshake with the same broker
+static bool mqtt5_tls_offer_session(const char *host)
+{
+  if (s_session_len == 0 || strcmp(host, s_session_host) != 0)
+    return false;
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  bool offered =
+    mbedtls_ssl_session_load(&session, s_session, s_session_len) == 0 &&
+    mbedtls_ssl_set_session(&s_tls.ssl, &session) == 0;
+  mbedtls_ssl_session_free(&session);
+
+  if (!offered)
+    s_session_len = 0;
+  return offered;
+}
+
+static void mqtt5_tls_keep_session(const char *host)
+{
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t len = 0;
+  if (mbedtls_ssl_get_session(&s_tls.ssl, &session) != 0 ||
+      mbedtls_ssl_session_save(&session, s_session, sizeof(s_session),
+                               &len) != 0)
+    len = 0;
+  mbedtls_ssl_session_free(&session);
+
+  s_session_len = len;
+  strncpy(s_session_host, host, sizeof(s_session_host) - 1);
+  s_session_host[sizeof(s_session_host) - 1] = '\0';
+  if (len == 0)
+    ESP_LOGW(TAG, "Session not kept, the next handshake is a full one");
+}
+
+/**
+ * @brief Run the handshake step by step, sampling the free heap in between.
+ *
+ * @param timeout_ms Longest time for the whole handshake.
+ * @param heap_min Lowest free heap seen, updated.
+ * @param full Set if a key exchange was sent, i.e. no session was resumed.
+ * @return 0 on success, an mbedtls error otherwise.
+ */
+static int mqtt5_tls_handshake(int timeout_ms, uint32_t *heap_min, bool *full)
+{
+  int64_t deadline_us = esp_timer_get_time() + timeout_ms * 1000LL;
+  *full = false;
+
+  while (!mbedtls_ssl_is_handshake_over(&s_tls.ssl))
+  {
+    if (s_tls.ssl.MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_CLIENT_KEY_EXCHANGE)
+      *full = true;
+
+    int ret = mbedtls_ssl_handshake_step(&s_tls.ssl);
+
+    uint32_t heap = esp_get_free_heap_size();
+    if (heap < *heap_min)
+      *heap_min = heap;
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      if (esp_timer_get_time() > deadline_us)
+        return MBEDTLS_ERR_SSL_TIMEOUT;
+      continue;
+    }
+    if (ret != 0)
+      return ret;
+  }
+  return 0;
+}
+
+static int mqtt5_tls_close(esp_transport_handle_t t)
+{
+  if (s_tls.fd >= 0)
+  {
+    mbedtls_ssl_close_notify(&s_tls.ssl);
+    close(s_tls.fd);
+    s_tls.fd = -1;
+  }
+  mbedtls_ssl_free(&s_tls.ssl);
+  mbedtls_ssl_init(&s_tls.ssl);
+  return 0;
+}
+
+static int mqtt5_tls_connect(esp_transport_handle_t t, const char *host,
+                             int port, int timeout_ms)
+{
+  mqtt5_tls_close(t);
+
+  uint32_t heap_before = esp_get_free_heap_size();
+  uint32_t heap_min = heap_before;
+  int64_t start_us = esp_timer_get_time();
+
+  s_tls.fd = mqtt5_tls_tcp_connect(host, port, timeout_ms);
+  if (s_tls.fd < 0)
+    return -1;
+
+  int64_t handshake_us = esp_timer_get_time();
+  bool offered = false;
+  bool full = false;
+  int ret = mbedtls_ssl_setup(&s_tls.ssl, &s_tls.conf);
+  if (ret == 0)
+    ret = mbedtls_ssl_set_hostname(&s_tls.ssl, host);
+  if (ret == 0)
+  {
+    mbedtls_ssl_set_bio(&s_tls.ssl, &s_tls.fd, mqtt5_tls_send, mqtt5_tls_recv,
+                        NULL);
+    offered = mqtt5_tls_offer_session(host);
+    ret = mqtt5_tls_handshake(timeout_ms, &heap_min, &full);
+  }
+
+  if (ret != 0)
+  {
+    ESP_LOGE(TAG, "Handshake with %s failed: -0x%04x", host, -ret);
+    metrics_counter_add(&s_handshake_failures, 1);
+    // The broker may have dropped it, do not offer it again
+    if (offered)
+      s_session_len = 0;
+    mqtt5_tls_close(t);
+    return -1;
+  }
+
+  int64_t now_us = esp_timer_get_time();
+  uint32_t handshake_ms = (now_us - handshake_us) / 1000;
+  uint32_t heap_peak = heap_before - heap_min;
+  bool resumed = offered && !full;
+
+  mqtt5_tls_keep_session(host);
+  metrics_histogram_observe(&s_handshake_ms, handshake_ms);
+  metrics_counter_add(&s_handshakes[resumed], 1);
+  metrics_gauge_set(&s_heap_peak, heap_peak);
+
+  ESP_LOGI(TAG, "Connected to %s in %lu ms: %s handshake in %lu ms, heap peak "
+           "%lu bytes", host, (unsigned long)((now_us - start_us) / 1000),
+           resumed ? "resumed" : "full", (unsigned long)handshake_ms,
+           (unsigned long)heap_peak);
+  return 0;
+}
+
+static int mqtt5_tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+  if (s_tls.fd < 0)
+    return -1;
+
+  // Data already decrypted does not show on the socket
+  if (mbedtls_ssl_get_bytes_avail(&s_tls.ssl) > 0)
+    return 1;
+  return mqtt5_tls_wait(s_tls.fd, false, timeout_ms);
+}
+
+static int mqtt5_tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+  if (s_tls.fd < 0)
+    return -1;
+  return mqtt5_tls_wait(s_tls.fd, true, timeout_ms);
+}
+
+static int mqtt5_tls_read(esp_transport_handle_t t, char *buffer, int len,
+                          int timeout_ms)
+{
+  int ready = mqtt5_tls_poll_read(t, timeout_ms);
+  if (ready < 0)
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+  if (ready == 0)
+    return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+
+  int ret = mbedtls_ssl_read(&s_tls.ssl, (unsigned char *)buffer, len);
+  if (ret > 0)
+    return ret;
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+  if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+
+  ESP_LOGW(TAG, "Read failed: -0x%04x", -ret);
+  return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+}
+
+static int mqtt5_tls_write(esp_transport_handle_t t, const char *buffer,
+                           int len, int timeout_ms)
+{
+  if (s_tls.fd < 0)
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+
+  int64_t deadline_us = esp_timer_get_time() + timeout_ms * 1000LL;
+  int written = 0;
+  while (written < len)
+  {
+    int ret = mbedtls_ssl_write(&s_tls.ssl,
+                                (const unsigned char *)buffer + written,
+                                len - written);
+    if (ret > 0)
+    {
+      written += ret;
+      continue;
+    }
+    if ((ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
+         ret == MBEDTLS_ERR_SSL_WANT_READ) &&
+        esp_timer_get_time() < deadline_us)
+      continue;
+
+    ESP_LOGW(TAG, "Write failed: -0x%04x", -ret);
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+  }
+  return written;
+}
+
+static int mqtt5_tls_destroy(esp_transport_handle_t t)
+{
+  mqtt5_tls_close(t);
+  mbedtls_ssl_free(&s_tls.ssl);
+  mbedtls_x509_crt_free(&s_tls.ca);
+  mbedtls_ssl_config_free(&s_tls.conf);
+  s_created = false;
+  return 0;
+}
+
+static esp_err_t mqtt5_tls_configure(const mqtt5_api_tls_t *tls)
+{
+  if (mbedtls_ssl_config_defaults(&s_tls.conf, MBEDTLS_SSL_IS_CLIENT,
+                                  MBEDTLS_SSL_TRANSPORT_STREAM,
+                                  MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    return ESP_FAIL;
+  mbedtls_ssl_conf_rng(&s_tls.conf, mqtt5_tls_random, NULL);
+  mbedtls_ssl_conf_session_tickets(&s_tls.conf,
+                                   MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+  if (tls->psk)
+  {
+#ifdef CONFIG_MBEDTLS_PSK_MODES
+    // The key authenticates both sides, no certificate is involved
+    if (!tls->psk_identity ||
+        mbedtls_ssl_conf_psk(&s_tls.conf, tls->psk, tls->psk_len,
+                             (const unsigned char *)tls->psk_identity,
+                             strlen(tls->psk_identity)) != 0)
+      return ESP_ERR_INVALID_ARG;
+    mbedtls_ssl_conf_ciphersuites(&s_tls.conf, s_psk_suites);
+    mbedtls_ssl_conf_authmode(&s_tls.conf, MBEDTLS_SSL_VERIFY_NONE);
+    return ESP_OK;
+#else
+    ESP_LOGE(TAG, "A PSK needs CONFIG_MBEDTLS_PSK_MODES");
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+  }
+
+  if (tls->ca_pem)
+  {
+    // Pinned: the chain must end at this CA, the bundle is not consulted
+    int ret = mbedtls_x509_crt_parse(&s_tls.ca,
+                                     (const unsigned char *)tls->ca_pem,
+                                     strlen(tls->ca_pem) + 1);
+    if (ret != 0)
+    {
+      ESP_LOGE(TAG, "Invalid CA: -0x%04x", -ret);
+      return ESP_ERR_INVALID_ARG;
+    }
+    mbedtls_ssl_conf_ca_chain(&s_tls.conf, &s_tls.ca, NULL);
+  }
+  else
+  {
+    esp_err_t ret = esp_crt_bundle_attach(&s_tls.conf);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  mbedtls_ssl_conf_authmode(&s_tls.conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  return ESP_OK;
+}
+
+esp_transport_handle_t mqtt5_tls_create(const mqtt5_api_tls_t *tls)
+{
+  if (s_created)
+  {
+    ESP_LOGE(TAG, "Transport already created");
+    return NULL;
+  }
+
+  s_tls.config = *tls;
+  s_tls.fd = -1;
+  mbedtls_ssl_config_init(&s_tls.conf);
+  mbedtls_x509_crt_init(&s_tls.ca);
+  mbedtls_ssl_init(&s_tls.ssl);
+
+  esp_transport_handle_t t = NULL;
+  esp_err_t ret = mqtt5_tls_configure(&s_tls.config);
+  if (ret == ESP_OK)
+    t = esp_transport_init();
+  if (!t)
+  {
+    ESP_LOGE(TAG, "Transport not created: %s", esp_err_to_name(ret));
+    mbedtls_x509_crt_free(&s_tls.ca);
+    mbedtls_ssl_config_free(&s_tls.conf);
+    return NULL;
+  }
+
+  esp_transport_set_func(t, mqtt5_tls_connect, mqtt5_tls_read,
+                         mqtt5_tls_write, mqtt5_tls_close, mqtt5_tls_poll_read,
+                         mqtt5_tls_poll_write, mqtt5_tls_destroy);
+  esp_transport_set_default_port(t, MQTT5_TLS_DEFAULT_PORT);
+
+  metrics_register(&s_handshake_ms);
+  metrics_register(&s_handshakes[0]);
+  metrics_register(&s_handshakes[1]);
+  metrics_register(&s_handshake_failures);
+  metrics_register(&s_heap_peak);
+
+  s_created = true;
+  return t;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file mqtt5_tls.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief TLS transport of the broker connection, with session resumption
+ *
+ * Private to the MQTT 5 API. An esp-transport on top of mbedtls, handed to
+ * esp-mqtt for `mqtts`. Unlike the stock SSL transport, it keeps the session
+ * (ticket or ID) of the last full handshake and offers it on the next
+ * connection, so a reconnect skips the certificate chain and the key exchange.
+ * The session is kept in RTC memory and survives deep sleep.
+ *
+ * @version 0.1
+ * @date 2024-12-11
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MQTT5_TLS_H
+#define MQTT5_TLS_H
+
+#include <esp_transport.h>
+
+#include "mqtt5_api.h"
+
+/**
+ * @brief Largest serialized session kept, a larger one is not resumed.
+ */
+#define MQTT5_TLS_SESSION_MAX 640
+
+/**
+ * @brief Create the transport.
+ *
+ * Only one exists at a time, it is destroyed by esp-mqtt with the client.
+ *
+ * @param tls How to authenticate the broker, copied. The buffers it points to
+ * must outlive the transport.
+ * @return The transport, NULL if the configuration is rejected.
+ */
+esp_transport_handle_t mqtt5_tls_create(const mqtt5_api_tls_t *tls);
+
+#endif  // MQTT5_TLS_H
@@ -0,0 +1,83 @@
+/**
+ * @file mqtt5_transport.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Transport backend of the MQTT 5 API
+ *
+ * Private to the MQTT 5 API. `mqtt5_transport_esp.c` implements it with
+ * esp-mqtt on the chip and `mqtt5_transport_sim.c` with an in-memory broker on
+ * the Linux target. Received messages are handed back to the API through
+ * `mqtt5_api_dispatch`, every connection is reported with
+ * `mqtt5_api_connected` and every SUBACK with `mqtt5_api_subscribed`.
+ *
+ * @version 0.1
+ * @date 2024-11-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef MQTT5_TRANSPORT_H
+#define MQTT5_TRANSPORT_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt5_api.h"
+
+/**
+ * @brief Connect to the first broker, and fail over to the others.
+ *
+ * @param brokers Brokers in order of preference, checked by the API.
+ * @param count Number of brokers.
+ * @param tls Authentication of the brokers over TLS.
+ * @param base_topic Topic of the messages of the client itself, may be empty.
+ * @return ESP_OK on success, an error from the backend otherwise.
+ */
+esp_err_t mqtt5_transport_start(const mqtt5_api_broker_t *brokers,
+                                size_t count, const mqtt5_api_tls_t *tls,
+                                const char *base_topic);
+
+/**
+ * @brief Disconnect from the broker, the session is kept.
+ */
+void mqtt5_transport_stop(void);
+
+/**
+ * @brief Publish a message.
+ *
+ * @return The message ID, or -1 on failure.
+ */
+int mqtt5_transport_publish(const char *topic, const char *data, int len,
+                            int qos, int retain);
+
+/**
+ * @brief Subscribe to a topic.
+ *
+ * @return The message ID, or -1 on failure.
+ */
+int mqtt5_transport_subscribe(const char *topic, int qos);
+
+/**
+ * @brief Send the subscriptions again after a connection.
+ *
+ * Implemented by the MQTT 5 API, called by the backend once connected.
+ *
+ * @param session_present The broker resumed a session, which keeps the
+ * subscriptions it acknowledged. Only the others are sent again.
+ */
+void mqtt5_api_connected(bool session_present);
+
+/**
+ * @brief The broker answered a subscription.
+ *
+ * Implemented by the MQTT 5 API, called by the backend on a SUBACK.
+ *
+ * @param msg_id Message ID returned by `mqtt5_transport_subscribe`.
+ * @param granted The broker accepted the subscription.
+ */
+void mqtt5_api_subscribed(int msg_id, bool granted);
+
+#endif  // MQTT5_TRANSPORT_H
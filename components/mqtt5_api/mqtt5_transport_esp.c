@@ -0,0 +1,301 @@
+/**
+ * @file mqtt5_transport_esp.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief MQTT 5 transport backed by esp-mqtt
+ *
+ * @version 0.1
+ * @date 2024-11-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_attr.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_transport_tcp.h>
+#include <freertos/FreeRTOS.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "mqtt5_api.h"
+#include "mqtt5_link.h"
+#include "mqtt5_properties.h"
+#include "mqtt5_tls.h"
+#include "mqtt5_transport.h"
+
+/**
+ * @brief Time the broker keeps the session once disconnected, in seconds.
+ *
+ * Longer than the deep sleep between check-ins, so a woken device finds its
+ * subscriptions in place.
+ */
+#define MQTT5_SESSION_EXPIRY_S (24 * 3600)
+
+static const char *TAG = "MQTT5 API";
+static esp_mqtt_client_handle_t client = NULL;
+
+// Kept in RTC memory through deep sleep, cleared by a cold boot
+RTC_DATA_ATTR static bool s_session_open = false;
+
+static mqtt5_api_broker_t s_brokers[MQTT5_API_MAX_BROKERS];
+static char s_uris[MQTT5_API_MAX_BROKERS][80];
+// From the MAC address, as the default of esp-mqtt
+static char s_client_id[16];
+// Broker of the client configuration
+static uint8_t s_configured = 0;
+
+// Both given explicitly when the list mixes TLS and plain brokers, as
+// esp-mqtt keeps a custom transport through a new configuration
+static esp_transport_handle_t s_tls_transport = NULL;
+static esp_transport_handle_t s_tcp_transport = NULL;
+
+static metrics_metric_t s_connects = {
+  .name = "mqtt_connects_total",
+  .help = "Connections to the broker.",
+  .type = METRICS_COUNTER,
+};
+static metrics_metric_t s_disconnects = {
+  .name = "mqtt_disconnects_total",
+  .help = "Connections to the broker lost.",
+  .type = METRICS_COUNTER,
+};
+
+/**
+ * @brief Configuration of the client for a broker of the list.
+ */
+static void mqtt5_transport_config(esp_mqtt_client_config_t *mqtt5_cfg,
+                                   uint8_t index)
+{
+  const mqtt5_api_broker_t *broker = &s_brokers[index];
+  *mqtt5_cfg = (esp_mqtt_client_config_t){
+    .broker.address.uri = s_uris[index],
+    .broker.address.port = broker->port,
+    .credentials.username =
+      (broker->username && broker->username[0]) ? broker->username : NULL,
+    .credentials.authentication.password =
+      (broker->password && broker->password[0]) ? broker->password : NULL,
+    .credentials.client_id = s_client_id,
+    .session.protocol_ver = MQTT_PROTOCOL_V_5,
+    // Resume the session left by the last wake instead of a clean start
+    .session.disable_clean_session = s_session_open,
+    // Reconnections are left to the link monitor, with backoff
+    .network.disable_auto_reconnect = true,
+    .network.timeout_ms = MQTT5_LINK_NETWORK_TIMEOUT_MS,
+    .session.keepalive = MQTT5_LINK_KEEPALIVE_S,
+    .session.last_will.qos = DEFAULT_QOS,
+    .session.last_will.topic = "c115/last_will",
+    .session.last_will.msg = "i will leave",
+    // The TLS one resumes sessions, unlike the stock SSL transport
+    .network.transport = broker->tls ? s_tls_transport : s_tcp_transport,
+  };
+}
+
+/**
+ * @brief Event handler for MQTT events.
+ *
+ * This function handles various MQTT events such as connection, disconnection,
+ * subscription, unsubscription, message publication, message reception, and
+ * errors.
+ *
+ * @param handler_args User-defined argument (not used).
+ * @param base Event base.
+ * @param event_id Event ID.
+ * @param event_data Event-specific data.
+ */
+static void mqtt5_api_event_handler(void *handler_args, esp_event_base_t base,
+                                    int32_t event_id, void *event_data)
+{
+  esp_mqtt_event_handle_t event = event_data;
+  esp_mqtt_client_handle_t client = event->client;
+  switch ((esp_mqtt_event_id_t)event_id)
+  {
+    case MQTT_EVENT_BEFORE_CONNECT:
+    {
+      // The link monitor moved to another broker
+      uint8_t broker = mqtt5_link_broker();
+      if (broker == s_configured)
+        break;
+
+      esp_mqtt_client_config_t mqtt5_cfg;
+      mqtt5_transport_config(&mqtt5_cfg, broker);
+      if (esp_mqtt_set_config(client, &mqtt5_cfg) == ESP_OK)
+        s_configured = broker;
+      else
+        ESP_LOGE(TAG, "Broker %u not configured", broker);
+      break;
+    }
+
+    case MQTT_EVENT_CONNECTED:
+      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+      metrics_counter_add(&s_connects, 1);
+      s_session_open = true;
+      mqtt5_link_connected();
+      mqtt5_api_connected(event->session_present);
+      break;
+
+    case MQTT_EVENT_DISCONNECTED:
+      ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+      metrics_counter_add(&s_disconnects, 1);
+      mqtt5_link_disconnected();
+      break;
+
+    case MQTT_EVENT_SUBSCRIBED:
+      ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+      mqtt5_link_alive();
+      // One topic by SUBSCRIBE, so one reason code, refused from 0x80
+      mqtt5_api_subscribed(event->msg_id, event->data_len > 0 &&
+                                            (uint8_t)event->data[0] < 0x80);
+      break;
+
+    case MQTT_EVENT_UNSUBSCRIBED:
+      ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+      mqtt5_link_alive();
+      break;
+
+    case MQTT_EVENT_PUBLISHED:
+      ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+      mqtt5_link_acked(event->msg_id);
+      break;
+
+    case MQTT_EVENT_DATA:
+      ESP_LOGD(TAG, "MQTT_EVENT_DATA, TOPIC=%.*s, DATA=%.*s", event->topic_len,
+               event->topic, event->data_len, event->data);
+      mqtt5_link_alive();
+      mqtt5_api_dispatch(MQTT5_API_SOURCE_BROKER, event->topic,
+                         event->topic_len, event->data, event->data_len);
+      break;
+
+    case MQTT_EVENT_ERROR:
+      ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+      if (event->error_handle->error_type == MQTT_ERROR_TYPE_ESP_TLS)
+      {
+        ESP_LOGI(TAG, "Last error code reported from esp-tls: 0x%x",
+                 event->error_handle->esp_tls_last_esp_err);
+        ESP_LOGI(TAG, "Last tls stack error number: 0x%x",
+                 event->error_handle->esp_tls_stack_err);
+        ESP_LOGI(TAG, "Last captured errno : %d (%s)",
+                 event->error_handle->esp_transport_sock_errno,
+                 strerror(event->error_handle->esp_transport_sock_errno));
+      }
+      else if (event->error_handle->error_type ==
+               MQTT_ERROR_TYPE_CONNECTION_REFUSED)
+      {
+        ESP_LOGI(TAG, "Connection refused error: 0x%x",
+                 event->error_handle->connect_return_code);
+      }
+      else
+      {
+        ESP_LOGW(TAG, "Unknown error type: 0x%x",
+                 event->error_handle->error_type);
+      }
+      break;
+
+    default:
+      ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+      break;
+  }
+}
+
+esp_err_t mqtt5_transport_start(const mqtt5_api_broker_t *brokers,
+                                size_t count, const mqtt5_api_tls_t *tls,
+                                const char *base_topic)
+{
+  bool any_tls = false;
+  bool any_tcp = false;
+  for (size_t i = 0; i < count; i++)
+  {
+    s_brokers[i] = brokers[i];
+    int len = snprintf(s_uris[i], sizeof(s_uris[i]), "%s://%s",
+                       brokers[i].tls ? "mqtts" : "mqtt", brokers[i].host);
+    if (len < 0 || len >= sizeof(s_uris[i]))
+      return ESP_ERR_INVALID_ARG;
+    any_tls |= brokers[i].tls;
+    any_tcp |= !brokers[i].tls;
+  }
+
+  if (any_tls)
+  {
+    s_tls_transport = mqtt5_tls_create(tls);
+    if (s_tls_transport == NULL)
+      return ESP_ERR_INVALID_ARG;
+  }
+  if (any_tls && any_tcp)
+  {
+    s_tcp_transport = esp_transport_tcp_init();
+    if (s_tcp_transport == NULL)
+      return ESP_ERR_NO_MEM;
+  }
+
+  metrics_register(&s_connects);
+  metrics_register(&s_disconnects);
+
+  uint8_t mac[6];
+  esp_err_t err = esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  if (err != ESP_OK)
+    return err;
+  snprintf(s_client_id, sizeof(s_client_id), "ESP32_%02x%02X%02X", mac[3],
+           mac[4], mac[5]);
+
+  mqtt5_link_set_brokers(brokers, count);
+  mqtt5_link_set_probe_topic(base_topic, s_client_id);
+  s_configured = 0;
+  esp_mqtt_client_config_t mqtt5_cfg;
+  mqtt5_transport_config(&mqtt5_cfg, 0);
+  client = esp_mqtt_client_init(&mqtt5_cfg);
+  if (client == NULL)
+    return ESP_FAIL;
+
+  esp_mqtt5_connection_property_config_t connect_property = {
+    .session_expiry_interval = MQTT5_SESSION_EXPIRY_S,
+  };
+  err = esp_mqtt5_client_set_connect_property(client,
+                                                        &connect_property);
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Session expiry not set: %s", esp_err_to_name(err));
+
+  err = esp_mqtt_client_register_event(
+    client, ESP_EVENT_ANY_ID, mqtt5_api_event_handler, NULL);
+  if (err != ESP_OK)
+    return err;
+
+  err = esp_mqtt_client_start(client);
+  if (err == ESP_OK)
+    mqtt5_link_start(client);
+  return err;
+}
+
+void mqtt5_transport_stop(void)
+{
+  if (client == NULL)
+    return;
+
+  mqtt5_link_stop();
+
+  // Sends the DISCONNECT while connected
+  esp_mqtt_client_stop(client);
+  esp_mqtt_client_destroy(client);
+  client = NULL;
+  s_tls_transport = NULL;
+  s_tcp_transport = NULL;
+}
+
+int mqtt5_transport_publish(const char *topic, const char *data, int len,
+                            int qos, int retain)
+{
+  // esp_mqtt5_client_set_publish_property(client, &publish_property);
+  // ESP_LOGI(TAG, "Publish properties configured.");
+  if (client == NULL)
+    return -1;
+  return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+}
+
+int mqtt5_transport_subscribe(const char *topic, int qos)
+{
+  if (client == NULL)
+    return -1;
+  return esp_mqtt_client_subscribe(client, topic, qos);
+}
@@ -0,0 +1,146 @@
+/**
+ * @file mqtt5_transport_sim.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief MQTT 5 transport of the Linux target, on a simulated broker
+ *
+ * @version 0.1
+ * @date 2024-11-17
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#include "mqtt5_api.h"
+#include "mqtt5_sim.h"
+#include "mqtt5_transport.h"
+
+/**
+ * @brief Number of publishes the simulator keeps until they are taken.
+ */
+#define MQTT5_SIM_MAX_PUBLISHED 32
+
+static const char *TAG = "MQTT5 SIM";
+
+static struct
+{
+  SemaphoreHandle_t lock;                              ///< Guards the state.
+  bool started;                                        ///< Client started.
+  int msg_id;                                          ///< Last message ID.
+  mqtt5_sim_message_t published[MQTT5_SIM_MAX_PUBLISHED];  ///< Publishes.
+  size_t head;                                         ///< Oldest publish.
+  size_t count;                                        ///< Publishes kept.
+  uint32_t dropped;                                    ///< Publishes lost.
+} s_sim = {0};
+
+esp_err_t mqtt5_transport_start(const mqtt5_api_broker_t *brokers,
+                                size_t count, const mqtt5_api_tls_t *tls,
+                                const char *base_topic)
+{
+  if (s_sim.lock == NULL)
+    s_sim.lock = xSemaphoreCreateMutex();
+  if (s_sim.lock == NULL)
+    return ESP_ERR_NO_MEM;
+
+  s_sim.started = true;
+  // Never fails, so the fallbacks are never used
+  ESP_LOGI(TAG, "Simulated broker at %s:%u, %u fallbacks", brokers[0].host,
+           brokers[0].port, (unsigned)(count - 1));
+  mqtt5_api_connected(false);
+  return ESP_OK;
+}
+
+void mqtt5_transport_stop(void)
+{
+  s_sim.started = false;
+}
+
+int mqtt5_transport_publish(const char *topic, const char *data, int len,
+                            int qos, int retain)
+{
+  if (!s_sim.started)
+    return -1;
+
+  if (len == 0 && data != NULL)
+    len = strlen(data);
+
+  xSemaphoreTake(s_sim.lock, portMAX_DELAY);
+  if (s_sim.count == MQTT5_SIM_MAX_PUBLISHED)
+  {
+    s_sim.head = (s_sim.head + 1) % MQTT5_SIM_MAX_PUBLISHED;
+    s_sim.count--;
+    s_sim.dropped++;
+  }
+
+  mqtt5_sim_message_t *msg =
+    &s_sim.published[(s_sim.head + s_sim.count) % MQTT5_SIM_MAX_PUBLISHED];
+  strncpy(msg->topic, topic, MAX_MQTT_TOPIC_LEN - 1);
+  msg->topic[MAX_MQTT_TOPIC_LEN - 1] = '\0';
+  msg->len = len < MQTT5_SIM_MAX_PAYLOAD - 1 ? len : MQTT5_SIM_MAX_PAYLOAD - 1;
+  memcpy(msg->data, data, msg->len);
+  msg->data[msg->len] = '\0';
+  s_sim.count++;
+
+  int msg_id = ++s_sim.msg_id;
+  xSemaphoreGive(s_sim.lock);
+  return msg_id;
+}
+
+int mqtt5_transport_subscribe(const char *topic, int qos)
+{
+  if (!s_sim.started)
+    return -1;
+
+  xSemaphoreTake(s_sim.lock, portMAX_DELAY);
+  int msg_id = ++s_sim.msg_id;
+  xSemaphoreGive(s_sim.lock);
+  return msg_id;
+}
+
+bool mqtt5_sim_inject(const char *topic, const char *data, int len)
+{
+  if (!s_sim.started)
+    return false;
+
+  // The callbacks may keep or change the payload, as with esp-mqtt
+  char payload[MQTT5_SIM_MAX_PAYLOAD];
+  if (len < 0 || len > sizeof(payload))
+    return false;
+  memcpy(payload, data, len);
+
+  return mqtt5_api_dispatch(MQTT5_API_SOURCE_BROKER, topic, strlen(topic),
+                            payload, len);
+}
+
+size_t mqtt5_sim_take_published(mqtt5_sim_message_t *messages,
+                                size_t max_messages)
+{
+  if (s_sim.lock == NULL)
+    return 0;
+
+  xSemaphoreTake(s_sim.lock, portMAX_DELAY);
+  size_t n = s_sim.count < max_messages ? s_sim.count : max_messages;
+  for (size_t i = 0; i < n; i++)
+  {
+    messages[i] = s_sim.published[s_sim.head];
+    s_sim.head = (s_sim.head + 1) % MQTT5_SIM_MAX_PUBLISHED;
+  }
+  s_sim.count -= n;
+  xSemaphoreGive(s_sim.lock);
+  return n;
+}
+
+uint32_t mqtt5_sim_dropped_published()
+{
+  return s_sim.dropped;
+}
+
+bool mqtt5_sim_connected()
+{
+  return s_sim.started;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file power_manager.h
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Dynamic frequency scaling, light and deep sleep of the gate
+ *
+ * While idle, the CPU runs at `min_freq_mhz` and enters light sleep whenever
+ * FreeRTOS has nothing to run, between Wi-Fi beacons and timers. Components
+ * hold the busy lock while the gate must react at full speed, i.e. while the
+ * motor moves or a command is in flight.
+ *
+ * Without `CONFIG_PM_ENABLE` (and on the Linux target), the lock is only
+ * counted and the CPU keeps its clock.
+ *
+ * Battery installs go further with `power_manager_deep_sleep`: everything but
+ * the RTC is powered down, and the chip boots again on the control button or
+ * the check-in timer. State that must survive lives in RTC memory
+ * (`RTC_DATA_ATTR`), which a wake keeps and a cold boot clears.
+ *
+ * @version 0.1
+ * @date 2024-12-09
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Configuration of the power management.
+ */
+typedef struct
+{
+  int max_freq_mhz;  ///< CPU clock while busy.
+  int min_freq_mhz;  ///< CPU clock while idle, a multiple of the XTAL clock.
+  bool light_sleep;  ///< Enter light sleep while idle.
+} power_manager_config_t;
+
+/**
+ * @brief Why the chip booted.
+ */
+typedef enum
+{
+  POWER_WAKE_COLD = 0,  ///< Power on or reset, RTC memory is cleared.
+  POWER_WAKE_BUTTON,    ///< Deep sleep ended by the input of `ext1`.
+  POWER_WAKE_TIMER,     ///< Deep sleep ended by the check-in timer.
+  POWER_WAKE_OTHER,     ///< Deep sleep ended by another source.
+} power_manager_wake_t;
+
+/**
+ * @brief Counters of the power management.
+ */
+typedef struct
+{
+  uint32_t acquisitions;    ///< Times the gate became busy.
+  uint32_t busy_ms;         ///< Time with the busy lock held.
+  uint32_t sleeps;          ///< Light sleeps entered.
+  uint32_t sleep_ms;        ///< Time in light sleep.
+  uint32_t deep_sleeps;     ///< Deep sleeps entered since the cold boot.
+  uint32_t wake_action_us;  ///< Boot to outputs driven, last button wake.
+} power_manager_stats_t;
+
+/**
+ * @brief Configure the power management and create the busy lock.
+ *
+ * The light sleep is woken by the timers, the Wi-Fi beacons and the inputs
+ * enabled with `gpio_enable_wakeup`.
+ *
+ * @param config Configuration of the power management.
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the firmware was built
+ * without `CONFIG_PM_ENABLE`, otherwise the error of `esp_pm_configure`.
+ */
+esp_err_t power_manager_init(const power_manager_config_t *config);
+
+/**
+ * @brief Hold the CPU at full clock, out of light sleep.
+ *
+ * Nested: the lock is released by the matching number of
+ * `power_manager_release`. Task context only.
+ */
+void power_manager_acquire(void);
+
+/**
+ * @brief Release a `power_manager_acquire`.
+ */
+void power_manager_release(void);
+
+/**
+ * @brief Whether the busy lock is held.
+ */
+bool power_manager_is_busy(void);
+
+/**
+ * @brief Why the chip booted, see `power_manager_wake_t`.
+ */
+power_manager_wake_t power_manager_get_wake(void);
+
+/**
+ * @brief Note that the outputs were driven for an action.
+ *
+ * After a button wake, the first call measures the wake-to-actuation latency,
+ * from the start of the application (the ROM and the bootloader excluded).
+ * Cheap, task context only.
+ */
+void power_manager_mark_actuated(void);
+
+/**
+ * @brief Enter deep sleep.
+ *
+ * Woken by the input enabled with `gpio_enable_deep_wakeup`, or after
+ * `sleep_s`. The chip boots again, only RTC memory is kept.
+ *
+ * @param sleep_s Seconds until the timer wakes the chip, 0 for no timer.
+ * @return Does not return on success. ESP_ERR_INVALID_STATE if the busy lock
+ * is held, ESP_ERR_NOT_SUPPORTED on the Linux target.
+ */
+esp_err_t power_manager_deep_sleep(uint32_t sleep_s);
+
+/**
+ * @brief Get the counters of the power management.
+ *
+ * @param stats Where to copy the counters.
+ */
+void power_manager_get_stats(power_manager_stats_t *stats);
+
+#endif  // POWER_MANAGER_H
@@ -0,0 +1,268 @@
+/**
+ * @file power_manager.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Dynamic frequency scaling, light and deep sleep of the gate
+ *
+ * @version 0.1
+ * @date 2024-12-09
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include "power_manager.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+#ifdef CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#endif
+
+static const char *TAG = "POWER";
+
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t s_busy_lock = NULL;
+#endif
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_holders = 0;
+static TickType_t s_busy_since = 0;
+static uint32_t s_busy_ticks = 0;
+static uint32_t s_acquisitions = 0;
+
+// Written by the light sleep callback, with the interrupts disabled
+static uint32_t s_sleeps = 0;
+static uint64_t s_sleep_us = 0;
+
+// Through deep sleep, cleared by a cold boot
+RTC_DATA_ATTR static uint32_t s_deep_sleeps = 0;
+RTC_DATA_ATTR static uint32_t s_wake_action_us = 0;
+
+static bool s_wake_pending = false;  ///< Button wake not actuated yet.
+
+static int64_t power_manager_read(void *arg);
+
+#define POWER_METRIC(metric_name, metric_help, field)                  \
+  {                                                                    \
+    .name = metric_name, .help = metric_help, .type = METRICS_COUNTER, \
+    .read = power_manager_read,                                        \
+    .read_arg = (void *)offsetof(power_manager_stats_t, field),        \
+  }
+
+static metrics_metric_t s_metrics[] = {
+  POWER_METRIC("power_busy_acquisitions_total",
+               "Times the gate held the CPU at full clock.", acquisitions),
+  POWER_METRIC("power_busy_ms_total",
+               "Time the gate held the CPU at full clock.", busy_ms),
+  POWER_METRIC("power_light_sleeps_total", "Light sleeps entered.", sleeps),
+  POWER_METRIC("power_light_sleep_ms_total", "Time in light sleep.", sleep_ms),
+  POWER_METRIC("power_deep_sleeps_total", "Deep sleeps entered.", deep_sleeps),
+  {
+    .name = "power_wake_action_us",
+    .help = "From boot to the outputs driven, on the last button wake.",
+    .type = METRICS_GAUGE,
+    .read = power_manager_read,
+    .read_arg = (void *)offsetof(power_manager_stats_t, wake_action_us),
+  },
+};
+
+static int64_t power_manager_read(void *arg)
+{
+  power_manager_stats_t stats;
+  power_manager_get_stats(&stats);
+  return *(uint32_t *)((uint8_t *)&stats + (size_t)arg);
+}
+
+#ifdef CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+static esp_err_t IRAM_ATTR power_manager_slept(int64_t sleep_time_us,
+                                               void *arg)
+{
+  portENTER_CRITICAL_ISR(&s_lock);
+  s_sleeps++;
+  s_sleep_us += sleep_time_us;
+  portEXIT_CRITICAL_ISR(&s_lock);
+  return ESP_OK;
+}
+#endif
+
+esp_err_t power_manager_init(const power_manager_config_t *config)
+{
+  for (size_t i = 0; i < sizeof(s_metrics) / sizeof(s_metrics[0]); i++)
+    metrics_register(&s_metrics[i]);
+
+  power_manager_wake_t wake = power_manager_get_wake();
+  s_wake_pending = wake == POWER_WAKE_BUTTON;
+  if (wake != POWER_WAKE_COLD)
+    ESP_LOGI(TAG, "Woken from deep sleep %lu by the %s",
+             (unsigned long)s_deep_sleeps,
+             wake == POWER_WAKE_BUTTON ? "button"
+             : wake == POWER_WAKE_TIMER ? "timer"
+                                        : "other source");
+
+#ifdef CONFIG_PM_ENABLE
+  esp_err_t ret = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "gate_busy",
+                                     &s_busy_lock);
+  if (ret != ESP_OK)
+    return ret;
+
+  // Holding the CPU at its maximum also keeps it out of light sleep
+  esp_pm_config_t pm_config = {
+    .max_freq_mhz = config->max_freq_mhz,
+    .min_freq_mhz = config->min_freq_mhz,
+    .light_sleep_enable = config->light_sleep,
+  };
+  ret = esp_pm_configure(&pm_config);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to configure: %s", esp_err_to_name(ret));
+    return ret;
+  }
+
+  if (config->light_sleep)
+  {
+    esp_sleep_enable_gpio_wakeup();
+#ifdef CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t cbs = {
+      .exit_cb = power_manager_slept,
+    };
+    ret = esp_pm_light_sleep_register_cbs(&cbs);
+    if (ret != ESP_OK)
+      ESP_LOGW(TAG, "Time in light sleep not counted: %s",
+               esp_err_to_name(ret));
+#else
+    ESP_LOGW(TAG, "Time in light sleep needs CONFIG_PM_LIGHT_SLEEP_CALLBACKS");
+#endif
+  }
+
+  ESP_LOGI(TAG, "CPU at %d-%d MHz, light sleep %s", config->min_freq_mhz,
+           config->max_freq_mhz, config->light_sleep ? "on" : "off");
+  return ESP_OK;
+#else
+  ESP_LOGW(TAG, "Built without CONFIG_PM_ENABLE, the clock stays fixed");
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void power_manager_acquire(void)
+{
+#ifdef CONFIG_PM_ENABLE
+  if (s_busy_lock)
+    esp_pm_lock_acquire(s_busy_lock);
+#endif
+
+  taskENTER_CRITICAL(&s_lock);
+  if (s_holders++ == 0)
+  {
+    s_busy_since = xTaskGetTickCount();
+    s_acquisitions++;
+  }
+  taskEXIT_CRITICAL(&s_lock);
+}
+
+void power_manager_release(void)
+{
+  taskENTER_CRITICAL(&s_lock);
+  bool held = s_holders > 0;
+  if (held && --s_holders == 0)
+    s_busy_ticks += xTaskGetTickCount() - s_busy_since;
+  taskEXIT_CRITICAL(&s_lock);
+
+  if (!held)
+  {
+    ESP_LOGW(TAG, "Released more than acquired");
+    return;
+  }
+
+#ifdef CONFIG_PM_ENABLE
+  if (s_busy_lock)
+    esp_pm_lock_release(s_busy_lock);
+#endif
+}
+
+bool power_manager_is_busy(void)
+{
+  taskENTER_CRITICAL(&s_lock);
+  bool busy = s_holders > 0;
+  taskEXIT_CRITICAL(&s_lock);
+  return busy;
+}
+
+power_manager_wake_t power_manager_get_wake(void)
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  return POWER_WAKE_COLD;
+#else
+  switch (esp_sleep_get_wakeup_cause())
+  {
+    case ESP_SLEEP_WAKEUP_UNDEFINED:
+      return POWER_WAKE_COLD;
+    case ESP_SLEEP_WAKEUP_EXT1:
+      return POWER_WAKE_BUTTON;
+    case ESP_SLEEP_WAKEUP_TIMER:
+      return POWER_WAKE_TIMER;
+    default:
+      return POWER_WAKE_OTHER;
+  }
+#endif
+}
+
+void power_manager_mark_actuated(void)
+{
+  if (!s_wake_pending)
+    return;
+  s_wake_pending = false;
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+  s_wake_action_us = esp_timer_get_time();
+  ESP_LOGI(TAG, "Button wake actuated %lu us after boot",
+           (unsigned long)s_wake_action_us);
+#endif
+}
+
+esp_err_t power_manager_deep_sleep(uint32_t sleep_s)
+{
+#ifdef CONFIG_IDF_TARGET_LINUX
+  return ESP_ERR_NOT_SUPPORTED;
+#else
+  if (power_manager_is_busy())
+    return ESP_ERR_INVALID_STATE;
+
+  if (sleep_s > 0)
+    esp_sleep_enable_timer_wakeup(sleep_s * 1000000ULL);
+
+  s_deep_sleeps++;
+  ESP_LOGI(TAG, "Deep sleep %lu for %lu s", (unsigned long)s_deep_sleeps,
+           (unsigned long)sleep_s);
+  esp_deep_sleep_start();
+  return ESP_OK;
+#endif
+}
+
+void power_manager_get_stats(power_manager_stats_t *stats)
+{
+  taskENTER_CRITICAL(&s_lock);
+  uint32_t busy_ticks = s_busy_ticks;
+  if (s_holders > 0)
+    busy_ticks += xTaskGetTickCount() - s_busy_since;
+
+  stats->acquisitions = s_acquisitions;
+  stats->busy_ms = pdTICKS_TO_MS(busy_ticks);
+  stats->sleeps = s_sleeps;
+  stats->sleep_ms = s_sleep_us / 1000;
+  stats->deep_sleeps = s_deep_sleeps;
+  stats->wake_action_us = s_wake_action_us;
+  taskEXIT_CRITICAL(&s_lock);
+}
@@ -16,6 +16,27 @@
 
 #include <esp_err.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <stdbool.h>
+
+/**
+ * @brief Connection metrics of the Wi-Fi station.
+ *
+ * Durations are measured from the call to `esp_wifi_connect()` that led to the
+ * current link, so a reconnect after a power blip can be compared between the
+ * fast-connect path (cached BSSID/channel) and a full scan.
+ */
+typedef struct
+{
+  uint32_t last_assoc_ms;          ///< Time until the AP association ended.
+  uint32_t last_connect_ms;        ///< Time until an IP address was obtained.
+  uint32_t connect_count;          ///< Number of successful connections.
+  uint32_t disconnect_count;       ///< Number of link losses.
+  uint32_t attempt_count;          ///< Number of connection attempts.
+  uint8_t last_disconnect_reason;  ///< Last `wifi_err_reason_t` reported.
+  bool last_fast_path;             ///< Last connection used the cached BSSID.
+  bool connected;                  ///< Station currently has an IP address.
+} wifi_api_metrics_t;
 
 /**
  * @brief Configure Wi-Fi with the given SSID and password.
@@ -23,12 +44,35 @@
  * Initializes the Wi-Fi station, sets up the event handler, and connects to the
  * specified network.
  *
+ * If a link from a previous boot is cached in NVS, the station is locked to
+ * the same BSSID and channel so no full channel scan is needed. A background
+ * supervisor keeps reconnecting with exponential backoff and never gives up,
+ * so a timeout here does not mean the station stopped trying.
+ *
  * @param[in] ssid The SSID of the Wi-Fi network.
  * @param[in] password The password for the Wi-Fi network.
- * @return ESP_OK on success, ESP_FAIL on failure.
+ * @return
+ * - **ESP_OK** if an IP address was obtained
+ * - **ESP_ERR_TIMEOUT** if no IP address was obtained in time
+ * - **ESP_FAIL** on other errors
  */
 esp_err_t wifi_api_configure(const char *ssid, const char *password);
 
+/**
+ * @brief Wait until the station has an IP address.
+ *
+ * @param[in] ticks_to_wait Maximum time to wait.
+ * @return ESP_OK if connected, ESP_ERR_TIMEOUT otherwise.
+ */
+esp_err_t wifi_api_wait_connected(TickType_t ticks_to_wait);
+
+/**
+ * @brief Get a snapshot of the connection metrics.
+ *
+ * @param[out] metrics Where to copy the metrics.
+ */
+void wifi_api_get_metrics(wifi_api_metrics_t *metrics);
+
 /**
  * @brief Disconnect from the Wi-Fi network.
  *
@@ -50,13 +94,84 @@ esp_err_t wifi_api_disconnect();
 esp_err_t wifi_api_alter_sta(const char *new_ssid, const char *new_password);
 
 /**
- * @brief Start a Wi-Fi scan.
+ * @brief Callback invoked when an asynchronous scan finishes.
+ *
+ * It runs in the context of the default event loop task, so it must not block.
+ *
+ * @param records Caller-provided buffer, ranked from the best to the worst AP.
+ * @param count Number of valid records in the buffer.
+ * @param arg User-defined argument given to `wifi_api_scan_start`.
+ */
+typedef void (*wifi_api_scan_done_cb_t)(wifi_ap_record_t *records,
+                                        uint16_t count, void *arg);
+
+/**
+ * @brief Start an asynchronous Wi-Fi scan.
+ *
+ * Returns as soon as the scan is started. When the driver reports the end of
+ * the scan, the records are streamed one by one into `records`, which keeps the
+ * best `max_records` APs ranked by `wifi_api_ap_score`, and `callback` is
+ * invoked.
+ *
+ * @note The buffer must stay valid until the callback is invoked, and only one
+ * scan can be in progress at a time.
+ *
+ * @param[in] ssid Only report APs of this SSID, or NULL for all of them.
+ * @param[out] records Buffer where the ranked records are stored.
+ * @param[in] max_records Capacity of `records`.
+ * @param[in] callback Function invoked when the scan finishes.
+ * @param[in] arg User-defined argument passed to the callback.
+ * @return
+ * - **ESP_OK** if the scan was started
+ * - **ESP_ERR_INVALID_ARG** if the parameters are invalid
+ * - **ESP_ERR_INVALID_STATE** if a scan is already in progress
+ * - Other errors from `esp_wifi_scan_start`
+ */
+esp_err_t wifi_api_scan_start(const char *ssid, wifi_ap_record_t *records,
+                              uint16_t max_records,
+                              wifi_api_scan_done_cb_t callback, void *arg);
+
+/**
+ * @brief Score an AP for the ranking of scan results.
+ *
+ * The score is the RSSI in dBm with a bonus for stronger authentication modes
+ * and a penalty for the ones below the WPA2 threshold used by the station.
+ *
+ * @param[in] ap Scanned AP record.
+ * @return The score, higher is better.
+ */
+int wifi_api_ap_score(const wifi_ap_record_t *ap);
+
+/**
+ * @brief Pick the best AP of a given SSID from ranked scan results.
+ *
+ * @param[in] records Records ranked by `wifi_api_scan_start`.
+ * @param[in] count Number of records.
+ * @param[in] ssid SSID the AP must belong to.
+ * @return The best AP, or NULL if none matches.
+ */
+const wifi_ap_record_t *wifi_api_scan_best(const wifi_ap_record_t *records,
+                                           uint16_t count, const char *ssid);
+
+/**
+ * @brief Lock the station to a given AP and reconnect.
+ *
+ * Pins the BSSID and channel of `ap` in the current STA configuration, e.g.
+ * after `wifi_api_alter_sta`, so the strongest AP of the SSID is used.
+ *
+ * @param[in] ap AP record returned by `wifi_api_scan_best`.
+ * @return ESP_OK on success, an error from the driver otherwise.
+ */
+esp_err_t wifi_api_select_ap(const wifi_ap_record_t *ap);
+
+/**
+ * @brief Start a Wi-Fi scan and log the APs found.
  *
- * This function prints the authentication mode of the Wi-Fi network based on
- * the `authmode` parameter.
+ * This function prints the SSID, RSSI, authentication mode and channel of the
+ * best APs once the scan finishes, without blocking the caller.
  *
- * @note It must be called after a successful Wi-Fi connection, i.e., after
- * `esp_wifi_start()` and `esp_wifi_connect()`.
+ * @note It must be called after `wifi_api_configure`, i.e., after
+ * `esp_wifi_start()`.
  */
 void wifi_api_scan();
 
@@ -17,8 +17,11 @@
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_netif.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
-#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <nvs.h>
 #include <nvs_flash.h>
 #include <string.h>
 
@@ -35,9 +38,62 @@ static const char *TAG = "WIFI_API";
 static const char *NETIF_DESC_STA = "STA";
 
 /**
- * @brief Maximum number of retry attempts for Wi-Fi connection.
+ * @brief NVS namespace and key of the cached link of the last connection.
  */
-static const uint8_t MAX_RETRY = 10;
+static const char *NVS_NAMESPACE = "wifi_api";
+static const char *NVS_KEY_LINK = "link";
+
+/**
+ * @brief Maximum time `wifi_api_configure` waits for an IP address.
+ *
+ * The supervisor keeps retrying after this timeout.
+ */
+static const uint32_t CONNECT_TIMEOUT_MS = 15000;
+
+/**
+ * @brief Bounds of the exponential backoff between reconnection attempts.
+ */
+static const uint32_t BACKOFF_MIN_MS = 250;
+static const uint32_t BACKOFF_MAX_MS = 30000;
+
+/**
+ * @brief Number of failed attempts on the cached BSSID before it's dropped.
+ *
+ * The AP may have been replaced or moved to another channel, so after this
+ * many failures the station falls back to a full scan by SSID.
+ */
+static const uint8_t FAST_PATH_MAX_FAILURES = 2;
+
+/**
+ * @brief Number of APs logged by `wifi_api_scan`.
+ */
+#define SCAN_LOG_MAX_RECORDS 10
+
+/**
+ * @brief Score adjustments of the authentication modes in the AP ranking.
+ *
+ * Roughly, WPA3 is worth a few dB of signal, while modes below the WPA2
+ * threshold of the station always rank below any connectable AP.
+ */
+#define SCAN_AUTH_BONUS_WPA3 5
+#define SCAN_AUTH_BONUS_WPA2_WPA3 3
+#define SCAN_AUTH_PENALTY_WEAK (-1000)
+
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_DISCONNECTED_BIT BIT1
+
+/**
+ * @brief Link of the last successful connection, persisted in NVS.
+ *
+ * The IP lease itself is restored by lwIP (`CONFIG_LWIP_DHCP_RESTORE_LAST_IP`),
+ * which asks the DHCP server for the last address instead of discovering one.
+ */
+typedef struct
+{
+  uint8_t ssid[32];  ///< SSID the cached link belongs to.
+  uint8_t bssid[6];  ///< BSSID of the AP.
+  uint8_t channel;   ///< Primary channel of the AP.
+} wifi_api_link_cache_t;
 
 /**
  * @brief Wi-Fi station network interface.
@@ -45,14 +101,59 @@ static const uint8_t MAX_RETRY = 10;
 static esp_netif_t *s_sta_netif = NULL;
 
 /**
- * @brief Semaphore to signal IP acquisition.
+ * @brief Event group signaling link state changes to the waiters and to the
+ * supervisor.
  */
-static SemaphoreHandle_t s_ip_semaphore = NULL;
+static EventGroupHandle_t s_wifi_event_group = NULL;
 
 /**
- * @brief Number of retry attempts for Wi-Fi connection.
+ * @brief Supervisor task that reconnects the station.
  */
-static int s_retry_num = 0;
+static TaskHandle_t s_supervisor_task = NULL;
+
+/**
+ * @brief Whether the supervisor must reconnect when the link is lost.
+ */
+static volatile bool s_supervise = false;
+
+/**
+ * @brief Whether the current STA configuration is locked to the cached BSSID.
+ */
+static bool s_fast_path = false;
+
+/**
+ * @brief Number of consecutive failed attempts since the last connection.
+ */
+static uint32_t s_retry_num = 0;
+
+/**
+ * @brief Link currently cached in NVS.
+ */
+static wifi_api_link_cache_t s_link_cache = {0};
+
+/**
+ * @brief Time of the last call to `esp_wifi_connect()`, in microseconds.
+ */
+static int64_t s_connect_start_us = 0;
+
+/**
+ * @brief Connection metrics.
+ */
+static wifi_api_metrics_t s_metrics = {0};
+
+/**
+ * @brief State of the asynchronous scan in progress.
+ */
+static struct
+{
+  volatile bool in_progress;         ///< A scan was started and not reported.
+  char ssid[33];                     ///< SSID filter, empty for all APs.
+  wifi_ap_record_t *records;         ///< Caller-provided ranked buffer.
+  uint16_t max_records;              ///< Capacity of `records`.
+  uint16_t count;                    ///< Valid records in `records`.
+  wifi_api_scan_done_cb_t callback;  ///< Invoked when the scan finishes.
+  void *arg;                         ///< Argument of the callback.
+} s_scan = {0};
 
 /**
  * @brief Event handler instance for any Wi-Fi event.
@@ -64,32 +165,314 @@ static esp_event_handler_instance_t instance_any_id = NULL;
  */
 static esp_event_handler_instance_t instance_got_ip = NULL;
 
-void wifi_api_scan()
+int wifi_api_ap_score(const wifi_ap_record_t *ap)
 {
-  ESP_LOGI(TAG, "Starting Wi-Fi scan...");
+  int bonus;
+  switch (ap->authmode)
+  {
+    case WIFI_AUTH_WPA3_PSK:
+      bonus = SCAN_AUTH_BONUS_WPA3;
+      break;
+    case WIFI_AUTH_WPA2_WPA3_PSK:
+      bonus = SCAN_AUTH_BONUS_WPA2_WPA3;
+      break;
+    case WIFI_AUTH_WPA2_PSK:
+    case WIFI_AUTH_WPA_WPA2_PSK:
+      bonus = 0;
+      break;
+    default:
+      // Below the authmode threshold of the station, never connectable
+      bonus = SCAN_AUTH_PENALTY_WEAK;
+      break;
+  }
+
+  return ap->rssi + bonus;
+}
+
+/**
+ * @brief Insert a record into the ranked buffer of the current scan.
+ *
+ * The buffer is kept sorted by score, so once it's full a record only gets in
+ * by evicting the worst one.
+ */
+static void wifi_api_scan_rank(const wifi_ap_record_t *record)
+{
+  int score = wifi_api_ap_score(record);
+  uint16_t pos = s_scan.count;
+
+  if (pos == s_scan.max_records)
+  {
+    if (score <= wifi_api_ap_score(&s_scan.records[pos - 1]))
+      return;
+    pos--;
+  }
+  else
+  {
+    s_scan.count++;
+  }
+
+  while (pos > 0 && wifi_api_ap_score(&s_scan.records[pos - 1]) < score)
+  {
+    s_scan.records[pos] = s_scan.records[pos - 1];
+    pos--;
+  }
+  s_scan.records[pos] = *record;
+}
+
+/**
+ * @brief Stream the records of a finished scan into the caller's buffer.
+ *
+ * Called from the event handler on `WIFI_EVENT_SCAN_DONE`.
+ */
+static void wifi_api_scan_done()
+{
+  if (!s_scan.in_progress)
+    return;
+
+  wifi_ap_record_t record;
+  while (esp_wifi_scan_get_ap_record(&record) == ESP_OK)
+  {
+    if (s_scan.ssid[0] != '\0' &&
+        strncmp((char *)record.ssid, s_scan.ssid, sizeof(record.ssid)) != 0)
+      continue;
+    wifi_api_scan_rank(&record);
+  }
+  esp_wifi_clear_ap_list();
+
+  // Allow a new scan from the callback itself
+  wifi_api_scan_done_cb_t callback = s_scan.callback;
+  s_scan.in_progress = false;
 
-  uint16_t number = 10;
-  wifi_ap_record_t ap_info[10];
-  uint16_t ap_count = 0;
-  memset(ap_info, 0, sizeof(ap_info));
+  if (callback)
+    callback(s_scan.records, s_scan.count, s_scan.arg);
+}
 
+esp_err_t wifi_api_scan_start(const char *ssid, wifi_ap_record_t *records,
+                              uint16_t max_records,
+                              wifi_api_scan_done_cb_t callback, void *arg)
+{
+  if (!records || max_records == 0 || !callback)
+    return ESP_ERR_INVALID_ARG;
+
+  if (s_scan.in_progress)
+    return ESP_ERR_INVALID_STATE;
+
+  memset(&s_scan, 0, sizeof(s_scan));
+  if (ssid)
+    strncpy(s_scan.ssid, ssid, sizeof(s_scan.ssid) - 1);
+  s_scan.records = records;
+  s_scan.max_records = max_records;
+  s_scan.callback = callback;
+  s_scan.arg = arg;
+  s_scan.in_progress = true;
+
+  // Filtering by SSID is done while streaming, the driver's filter expects a
+  // NUL-terminated buffer that must outlive the scan
   wifi_scan_config_t scan_config = {
     .ssid = NULL, .bssid = NULL, .channel = 0, .show_hidden = true};
-  ESP_ERROR_CHECK(esp_wifi_scan_start(&scan_config, true));
+  esp_err_t ret = esp_wifi_scan_start(&scan_config, false);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to start scan: %s", esp_err_to_name(ret));
+    s_scan.in_progress = false;
+  }
+
+  return ret;
+}
+
+const wifi_ap_record_t *wifi_api_scan_best(const wifi_ap_record_t *records,
+                                           uint16_t count, const char *ssid)
+{
+  for (uint16_t i = 0; i < count; i++)
+  {
+    if (strncmp((const char *)records[i].ssid, ssid,
+                sizeof(records[i].ssid)) == 0 &&
+        wifi_api_ap_score(&records[i]) > SCAN_AUTH_PENALTY_WEAK / 2)
+      return &records[i];
+  }
+
+  return NULL;
+}
+
+esp_err_t wifi_api_select_ap(const wifi_ap_record_t *ap)
+{
+  wifi_config_t wc;
+  esp_err_t ret = esp_wifi_get_config(WIFI_IF_STA, &wc);
+  if (ret != ESP_OK)
+    return ret;
+
+  ESP_LOGI(TAG, "Selecting AP " MACSTR " on channel %d (RSSI %d)",
+           MAC2STR(ap->bssid), ap->primary, ap->rssi);
 
-  ESP_LOGI(TAG, "Max AP number ap_info can hold = %u", number);
+  wc.sta.bssid_set = true;
+  memcpy(wc.sta.bssid, ap->bssid, sizeof(wc.sta.bssid));
+  wc.sta.channel = ap->primary;
+  wc.sta.scan_method = WIFI_FAST_SCAN;
+  s_fast_path = true;
 
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
+  ret = esp_wifi_set_config(WIFI_IF_STA, &wc);
+  if (ret != ESP_OK)
+    return ret;
 
-  ESP_LOGI(TAG, "Total APs scanned = %u, actual AP number ap_info holds = %u",
-           ap_count, number);
-  for (int i = 0; i < number; i++)
+  // The supervisor reconnects once the disconnection is reported
+  return esp_wifi_disconnect();
+}
+
+static void wifi_api_scan_log(wifi_ap_record_t *records, uint16_t count,
+                              void *arg)
+{
+  ESP_LOGI(TAG, "Best %u APs scanned", count);
+  for (int i = 0; i < count; i++)
+  {
+    ESP_LOGI(TAG, "SSID \t\t%s", records[i].ssid);
+    ESP_LOGI(TAG, "RSSI \t\t%d", records[i].rssi);
+    print_auth_mode(records[i].authmode);
+    ESP_LOGI(TAG, "Channel \t\t%d", records[i].primary);
+  }
+}
+
+void wifi_api_scan()
+{
+  static wifi_ap_record_t s_log_records[SCAN_LOG_MAX_RECORDS];
+
+  ESP_LOGI(TAG, "Starting Wi-Fi scan...");
+  wifi_api_scan_start(NULL, s_log_records, SCAN_LOG_MAX_RECORDS,
+                      &wifi_api_scan_log, NULL);
+}
+
+static uint32_t elapsed_ms_since(int64_t start_us)
+{
+  return (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+}
+
+static void wifi_api_start_attempt()
+{
+  s_metrics.attempt_count++;
+  s_connect_start_us = esp_timer_get_time();
+  esp_wifi_connect();
+}
+
+static esp_err_t wifi_api_load_link_cache(wifi_api_link_cache_t *cache)
+{
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+  if (ret != ESP_OK)
+    return ret;
+
+  size_t size = sizeof(*cache);
+  ret = nvs_get_blob(handle, NVS_KEY_LINK, cache, &size);
+  nvs_close(handle);
+
+  if (ret == ESP_OK && size != sizeof(*cache))
+    return ESP_ERR_INVALID_SIZE;
+
+  return ret;
+}
+
+/**
+ * @brief Persist the link of the current connection.
+ *
+ * Only writes to flash when the link changed, so reconnecting to the same AP
+ * after every power blip does not wear the NVS sectors.
+ */
+static void wifi_api_store_link_cache(const wifi_api_link_cache_t *cache)
+{
+  if (memcmp(cache, &s_link_cache, sizeof(*cache)) == 0)
+    return;
+
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return;
+
+  if (nvs_set_blob(handle, NVS_KEY_LINK, cache, sizeof(*cache)) == ESP_OK &&
+      nvs_commit(handle) == ESP_OK)
+  {
+    s_link_cache = *cache;
+    ESP_LOGI(TAG, "Cached link " MACSTR " on channel %d", MAC2STR(cache->bssid),
+             cache->channel);
+  }
+
+  nvs_close(handle);
+}
+
+static void wifi_api_erase_link_cache()
+{
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return;
+
+  nvs_erase_key(handle, NVS_KEY_LINK);
+  nvs_commit(handle);
+  nvs_close(handle);
+
+  memset(&s_link_cache, 0, sizeof(s_link_cache));
+}
+
+/**
+ * @brief Drop the cached BSSID/channel lock and scan all channels by SSID.
+ */
+static void wifi_api_leave_fast_path()
+{
+  wifi_config_t wc;
+  if (esp_wifi_get_config(WIFI_IF_STA, &wc) != ESP_OK)
+    return;
+
+  ESP_LOGW(TAG, "Cached link unreachable, falling back to a full scan");
+
+  wc.sta.bssid_set = false;
+  wc.sta.channel = 0;
+  wc.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  wc.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+  esp_wifi_set_config(WIFI_IF_STA, &wc);
+
+  wifi_api_erase_link_cache();
+  s_fast_path = false;
+}
+
+/**
+ * @brief Reconnect the station whenever the link is lost.
+ *
+ * It never gives up: the delay between attempts grows exponentially up to
+ * `BACKOFF_MAX_MS` and is reset as soon as an IP address is obtained.
+ *
+ * @param pvParameters Parameters passed to the task (not used).
+ */
+static void wifi_api_supervisor_task(void *pvParameters)
+{
+  uint32_t backoff_ms = BACKOFF_MIN_MS;
+
+  while (1)
   {
-    ESP_LOGI(TAG, "SSID \t\t%s", ap_info[i].ssid);
-    ESP_LOGI(TAG, "RSSI \t\t%d", ap_info[i].rssi);
-    print_auth_mode(ap_info[i].authmode);
-    ESP_LOGI(TAG, "Channel \t\t%d", ap_info[i].primary);
+    EventBits_t bits = xEventGroupWaitBits(
+      s_wifi_event_group, WIFI_DISCONNECTED_BIT | WIFI_CONNECTED_BIT, pdFALSE,
+      pdFALSE, portMAX_DELAY);
+
+    if (bits & WIFI_CONNECTED_BIT)
+    {
+      backoff_ms = BACKOFF_MIN_MS;
+      // Sleep until the link is lost again
+      xEventGroupWaitBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT, pdFALSE,
+                          pdFALSE, portMAX_DELAY);
+      continue;
+    }
+
+    xEventGroupClearBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
+    if (!s_supervise)
+      continue;
+
+    if (s_fast_path && s_retry_num >= FAST_PATH_MAX_FAILURES)
+      wifi_api_leave_fast_path();
+
+    ESP_LOGI(TAG, "Retry %lu to connect to the AP in %lu ms",
+             (unsigned long)s_retry_num, (unsigned long)backoff_ms);
+    vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+
+    if (!s_supervise)
+      continue;
+
+    wifi_api_start_attempt();
+    backoff_ms = (backoff_ms * 2 > BACKOFF_MAX_MS) ? BACKOFF_MAX_MS
+                                                   : backoff_ms * 2;
   }
 }
 
@@ -97,8 +480,8 @@ void wifi_api_scan()
  * @brief Event handler for Wi-Fi and IP events.
  *
  * This function handles various Wi-Fi and IP events such as station start,
- * disconnection, and IP acquisition. It attempts to reconnect on
- * disconnection and signals when an IP address is obtained.
+ * disconnection, and IP acquisition. Reconnections are left to the supervisor
+ * task, this handler only records the link state.
  *
  * @param arg User-defined argument (not used).
  * @param event_base Base ID of the event.
@@ -108,38 +491,68 @@ void wifi_api_scan()
 static void wifi_api_event_handler(void *arg, esp_event_base_t event_base,
                                    int32_t event_id, void *event_data)
 {
-  switch (event_id)
+  if (event_base == WIFI_EVENT)
   {
-    case WIFI_EVENT_STA_START:
-      esp_wifi_connect();
-      break;
-
-    case WIFI_EVENT_STA_DISCONNECTED:
-      if (s_retry_num < MAX_RETRY)
+    switch (event_id)
+    {
+      case WIFI_EVENT_STA_CONNECTED:
       {
-        esp_wifi_connect();
-        s_retry_num++;
-        ESP_LOGI(TAG, "Retry to connect to the AP");
+        wifi_event_sta_connected_t *event =
+          (wifi_event_sta_connected_t *)event_data;
+        s_metrics.last_assoc_ms = elapsed_ms_since(s_connect_start_us);
+        ESP_LOGI(TAG, "Associated to " MACSTR " on channel %d in %lu ms",
+                 MAC2STR(event->bssid), event->channel,
+                 (unsigned long)s_metrics.last_assoc_ms);
+
+        wifi_api_link_cache_t cache = {0};
+        memcpy(cache.ssid, event->ssid,
+               event->ssid_len < sizeof(cache.ssid) ? event->ssid_len
+                                                    : sizeof(cache.ssid));
+        memcpy(cache.bssid, event->bssid, sizeof(cache.bssid));
+        cache.channel = event->channel;
+        wifi_api_store_link_cache(&cache);
+        break;
       }
-      else
+
+      case WIFI_EVENT_SCAN_DONE:
+        wifi_api_scan_done();
+        break;
+
+      case WIFI_EVENT_STA_DISCONNECTED:
       {
-        // Making available to `xSemaphoreTake` in `wifi_api_configure`, i.e.,
-        // allows the application to continue execution below the
-        // `xSemaphoreTake()` call
-        xSemaphoreGive(s_ip_semaphore);
-        ESP_LOGI(TAG, "Connect to the AP fail");
+        wifi_event_sta_disconnected_t *event =
+          (wifi_event_sta_disconnected_t *)event_data;
+        s_retry_num++;
+        s_metrics.last_disconnect_reason = event->reason;
+        if (s_metrics.connected)
+          s_metrics.disconnect_count++;
+        s_metrics.connected = false;
+
+        ESP_LOGW(TAG, "Disconnected from the AP (reason %d)", event->reason);
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        xEventGroupSetBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
+        break;
       }
-      break;
-
-    case IP_EVENT_STA_GOT_IP:
-      s_retry_num = 0;
-      ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-      ESP_LOGI(TAG, "Got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-      xSemaphoreGive(s_ip_semaphore);
-      break;
 
-    default:
-      break;
+      default:
+        break;
+    }
+  }
+  else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+  {
+    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+
+    s_retry_num = 0;
+    s_metrics.last_connect_ms = elapsed_ms_since(s_connect_start_us);
+    s_metrics.last_fast_path = s_fast_path;
+    s_metrics.connect_count++;
+    s_metrics.connected = true;
+
+    ESP_LOGI(TAG, "Got ip:" IPSTR " in %lu ms (%s)", IP2STR(&event->ip_info.ip),
+             (unsigned long)s_metrics.last_connect_ms,
+             s_fast_path ? "cached link" : "full scan");
+    xEventGroupClearBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
+    xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
 
@@ -178,10 +591,10 @@ esp_err_t wifi_api_configure(const char *ssid, const char *password)
   initialize_nvs();
 
   ESP_LOGI(TAG, "Configuring Wi-Fi...");
-  s_ip_semaphore = xSemaphoreCreateBinary();
-  if (!s_ip_semaphore)
+  s_wifi_event_group = xEventGroupCreate();
+  if (!s_wifi_event_group)
   {
-    ESP_LOGE(TAG, "Failed to create semaphore");
+    ESP_LOGE(TAG, "Failed to create event group");
     return ESP_FAIL;
   }
 
@@ -201,9 +614,10 @@ esp_err_t wifi_api_configure(const char *ssid, const char *password)
 
   // --------------------------------------------------------------------
 
+  // The link is cached by this API, so the driver does not need to keep its
+  // own copy of the configuration in flash
   ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_start());
 
   // --------------------------------------------------------------------
 
@@ -218,6 +632,24 @@ esp_err_t wifi_api_configure(const char *ssid, const char *password)
   strncpy((char *)wc.sta.ssid, ssid, sizeof(wc.sta.ssid));
   strncpy((char *)wc.sta.password, password, sizeof(wc.sta.password));
 
+  // Fast-connect path: lock to the AP of the last connection so the driver
+  // probes a single channel instead of scanning all of them
+  if (wifi_api_load_link_cache(&s_link_cache) == ESP_OK &&
+      memcmp(s_link_cache.ssid, wc.sta.ssid, sizeof(wc.sta.ssid)) == 0)
+  {
+    wc.sta.bssid_set = true;
+    memcpy(wc.sta.bssid, s_link_cache.bssid, sizeof(wc.sta.bssid));
+    wc.sta.channel = s_link_cache.channel;
+    wc.sta.scan_method = WIFI_FAST_SCAN;
+    s_fast_path = true;
+    ESP_LOGI(TAG, "Using cached link " MACSTR " on channel %d",
+             MAC2STR(s_link_cache.bssid), s_link_cache.channel);
+  }
+  else
+  {
+    memset(&s_link_cache, 0, sizeof(s_link_cache));
+  }
+
   // --------------------------------------------------------------------
 
   ESP_ERROR_CHECK(esp_event_handler_instance_register(
@@ -230,34 +662,52 @@ esp_err_t wifi_api_configure(const char *ssid, const char *password)
   // --------------------------------------------------------------------
 
   ESP_LOGI(TAG, "Connecting to %s...", wc.sta.ssid);
-  ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wc));
-  ESP_ERROR_CHECK(esp_wifi_connect());
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wc));
+  ESP_ERROR_CHECK(esp_wifi_start());
+
+  s_supervise = true;
+  if (!s_supervisor_task &&
+      xTaskCreate(&wifi_api_supervisor_task, "WiFi Supervisor", 3072, NULL,
+                  tskIDLE_PRIORITY + 2, &s_supervisor_task) != pdPASS)
+  {
+    ESP_LOGE(TAG, "Failed to create supervisor task");
+    return ESP_FAIL;
+  }
+
+  wifi_api_start_attempt();
 
   // --------------------------------------------------------------------
+  ESP_ERROR_CHECK(esp_register_shutdown_handler(&wifi_api_shutdown));
 
   // Wait for IP acquisition until success or timeout
-  xSemaphoreTake(s_ip_semaphore, portMAX_DELAY);
+  return wifi_api_wait_connected(pdMS_TO_TICKS(CONNECT_TIMEOUT_MS));
+}
 
-  if (s_retry_num > MAX_RETRY)
-    return ESP_FAIL;
+esp_err_t wifi_api_wait_connected(TickType_t ticks_to_wait)
+{
+  if (!s_wifi_event_group)
+    return ESP_ERR_INVALID_STATE;
 
-  // --------------------------------------------------------------------
-  ESP_ERROR_CHECK(esp_register_shutdown_handler(&wifi_api_shutdown));
+  EventBits_t bits = xEventGroupWaitBits(
+    s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, ticks_to_wait);
 
-  return ESP_OK;
+  return (bits & WIFI_CONNECTED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+void wifi_api_get_metrics(wifi_api_metrics_t *metrics)
+{
+  *metrics = s_metrics;
 }
 
 esp_err_t wifi_api_disconnect()
 {
   ESP_LOGI(TAG, "Disconnecting Wi-Fi...");
+  s_supervise = false;
   ESP_ERROR_CHECK(esp_event_handler_instance_unregister(
     WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
   ESP_ERROR_CHECK(esp_event_handler_instance_unregister(
     IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
 
-  if (s_ip_semaphore)
-    vSemaphoreDelete(s_ip_semaphore);
-
   return esp_wifi_disconnect();
 }
 
@@ -271,9 +721,15 @@ esp_err_t wifi_api_alter_sta(const char *new_ssid, const char *new_password)
   strncpy((char *)wc.sta.ssid, new_ssid, sizeof(wc.sta.ssid) - 1);
   strncpy((char *)wc.sta.password, new_password, sizeof(wc.sta.password) - 1);
 
+  // The cached link belongs to the previous network
+  wc.sta.bssid_set = false;
+  wc.sta.channel = 0;
+  wc.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  s_fast_path = false;
+
   esp_wifi_set_config(ESP_IF_WIFI_STA, &wc);
+  // The supervisor reconnects once the disconnection is reported
   esp_wifi_disconnect();
-  esp_wifi_connect();
 
   return ESP_OK;
 }
@@ -0,0 +1,427 @@
+/**
+ * @file bench_main.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Microbenchmarks of the command and dispatch hot paths
+ *
+ * Each benchmark runs in a task of its own, after a warm-up, and reports:
+ * - `ns_per_op`: wall time of an operation, from `CLOCK_MONOTONIC`;
+ * - `allocs_per_op`: calls to malloc, calloc and realloc, counted by
+ *   wrapping them at link time, from any task;
+ * - `stack_bytes`: deepest stack the benchmark task reached, from its high
+ *   water mark. Host code is not Xtensa code, so compare it between runs, not
+ *   with the chip;
+ * - `mb_per_s`: for the parsers, bytes of payload parsed per second. The
+ *   `corpus` case parses a mix of commands, the parser throughput to track.
+ *
+ * The output is a table, or one record per benchmark with `BENCH_FORMAT` set
+ * to `json` or `csv` in the environment. `BENCH_FILTER` runs only the
+ * benchmarks whose name contains it.
+ *
+ * @version 0.1
+ * @date 2024-12-01
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gate.h"
+#include "gate_command.h"
+#include "motor.h"
+#include "mqtt5_api.h"
+
+/**
+ * @brief Stack of the benchmark tasks, in `StackType_t` units.
+ */
+#define BENCH_STACK_DEPTH 32768
+
+/**
+ * @brief Share of the iterations run before measuring, in percent.
+ */
+#define BENCH_WARMUP_PCT 10
+
+typedef struct
+{
+  const char *name;
+  void (*setup)(void);  ///< Once, before the warm-up, may be NULL.
+  void (*run)(uint32_t iterations);
+  uint32_t iterations;
+  uint32_t bytes_per_op;  ///< Payload handled by an operation, 0 if none.
+} bench_case_t;
+
+typedef struct
+{
+  const bench_case_t *bench;
+  double ns_per_op;
+  double allocs_per_op;
+  uint32_t stack_bytes;
+} bench_result_t;
+
+typedef enum
+{
+  BENCH_FORMAT_TABLE = 0,
+  BENCH_FORMAT_JSON,
+  BENCH_FORMAT_CSV,
+} bench_format_t;
+
+static atomic_uint_least64_t s_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+  atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+static inline int64_t bench_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Results the compiler must not drop as unused
+static volatile uint32_t s_sink;
+
+// ---- gate_command_parse ----
+
+static const char s_numeric_command[] = "1";
+static const char s_keyed_command[] = "open:pct=50,id=4242";
+
+static void bench_parse_numeric(uint32_t iterations)
+{
+  gate_command_t cmd;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    gate_command_parse(s_numeric_command, sizeof(s_numeric_command) - 1, &cmd);
+    s_sink = cmd.action;
+  }
+}
+
+static void bench_parse_keyed(uint32_t iterations)
+{
+  gate_command_t cmd;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    gate_command_parse(s_keyed_command, sizeof(s_keyed_command) - 1, &cmd);
+    s_sink = cmd.id;
+  }
+}
+
+// Mix of the commands clients send, one operation parses all of them
+#define BENCH_CORPUS(X)                                                  \
+  X("0")                                                                 \
+  X("1")                                                                 \
+  X("2")                                                                 \
+  X("open")                                                              \
+  X("close")                                                             \
+  X("stop")                                                              \
+  X("pedestrian")                                                        \
+  X("open:pct=50")                                                       \
+  X("close:after=30s")                                                   \
+  X("open:after=5m,pct=25,id=7")                                         \
+  X("stop:id=4294967295")                                                \
+  X(" pedestrian:id=1234,after=1h\r\n")
+
+#define BENCH_CORPUS_TEXT(cmd) cmd,
+#define BENCH_CORPUS_LEN(cmd) sizeof(cmd) - 1,
+#define BENCH_CORPUS_BYTES(cmd) +(sizeof(cmd) - 1)
+
+static const char *const s_corpus[] = {BENCH_CORPUS(BENCH_CORPUS_TEXT)};
+static const int s_corpus_len[] = {BENCH_CORPUS(BENCH_CORPUS_LEN)};
+
+static void bench_parse_corpus(uint32_t iterations)
+{
+  gate_command_t cmd;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    for (size_t j = 0; j < sizeof(s_corpus) / sizeof(s_corpus[0]); j++)
+    {
+      gate_command_parse(s_corpus[j], s_corpus_len[j], &cmd);
+      s_sink = cmd.options;
+    }
+  }
+}
+
+// ---- mqtt5_api_dispatch ----
+
+static const char *s_dispatch_topics[] = {
+  GATE_STATE_TOPIC, GATE_STATS_TOPIC, GATE_SCHEDULE_TOPIC, GATE_HEALTH_TOPIC,
+  GATE_ACTION_TOPIC,  // Last, the whole table is searched
+};
+static char s_dispatch_topic[MAX_MQTT_TOPIC_LEN];
+static char s_unrouted_topic[MAX_MQTT_TOPIC_LEN];
+static char s_dispatch_payload[] = "1";
+
+static void bench_dispatch_callback(uint32_t source, char *data, int len)
+{
+  s_sink = len;
+}
+
+static void bench_dispatch_setup(void)
+{
+  static bool subscribed = false;
+  if (subscribed)
+    return;
+  subscribed = true;
+
+  size_t count = sizeof(s_dispatch_topics) / sizeof(s_dispatch_topics[0]);
+  for (size_t i = 0; i < count; i++)
+  {
+    mqtt5_api_subscription_t subscription = {
+      .callback = &bench_dispatch_callback,
+    };
+    snprintf(subscription.topic, MAX_MQTT_TOPIC_LEN, "%s/%s", BASE_MQTT_TOPIC,
+             s_dispatch_topics[i]);
+    ESP_ERROR_CHECK(mqtt5_api_subscribe(&subscription));
+  }
+
+  snprintf(s_dispatch_topic, sizeof(s_dispatch_topic), "%s/%s",
+           BASE_MQTT_TOPIC, GATE_ACTION_TOPIC);
+  // Same length as the action topic, so it is compared in full
+  snprintf(s_unrouted_topic, sizeof(s_unrouted_topic), "%s/%s",
+           BASE_MQTT_TOPIC, "gate/xxxxxx");
+}
+
+static void bench_dispatch_match(uint32_t iterations)
+{
+  int len = strlen(s_dispatch_topic);
+  for (uint32_t i = 0; i < iterations; i++)
+    mqtt5_api_dispatch(MQTT5_API_SOURCE_BROKER, s_dispatch_topic, len,
+                       s_dispatch_payload, sizeof(s_dispatch_payload) - 1);
+}
+
+static void bench_dispatch_unrouted(uint32_t iterations)
+{
+  int len = strlen(s_unrouted_topic);
+  for (uint32_t i = 0; i < iterations; i++)
+    mqtt5_api_dispatch(MQTT5_API_SOURCE_BROKER, s_unrouted_topic, len,
+                       s_dispatch_payload, sizeof(s_dispatch_payload) - 1);
+}
+
+// ---- Topic formatting, done once by the gate since it costs this ----
+
+static void bench_topic_format(uint32_t iterations)
+{
+  char topic[MAX_MQTT_TOPIC_LEN];
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC,
+             GATE_ACTION_TOPIC_ANSWER);
+    s_sink = topic[0];
+  }
+}
+
+// ---- Motor event path ----
+
+static motor_t s_motor;
+static SemaphoreHandle_t s_motor_handled = NULL;
+
+static void bench_motor_event(motor_t *motor, const motor_event_t *event)
+{
+  xSemaphoreGive(s_motor_handled);
+}
+
+static void bench_motor_setup(void)
+{
+  if (s_motor_handled)
+    return;
+
+  s_motor_handled = xSemaphoreCreateBinary();
+  motor_init(&s_motor);
+  s_motor.on_event = &bench_motor_event;
+  motor_start_task();
+}
+
+// Request, queue, motor task, outputs and back, one action at a time
+static void bench_motor_round_trip(uint32_t iterations)
+{
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    s_motor.in_action((i & 1) ? STATE_MOTOR_STOPPED
+                              : STATE_MOTOR_IN_CLOCKWISE);
+    xSemaphoreTake(s_motor_handled, portMAX_DELAY);
+  }
+}
+
+// ---- Queue round trip, the cost of deferring an event ----
+
+static QueueHandle_t s_queue = NULL;
+
+static void bench_queue_setup(void)
+{
+  if (!s_queue)
+    s_queue = xQueueCreate(1, sizeof(motor_event_t));
+}
+
+static void bench_queue_round_trip(uint32_t iterations)
+{
+  motor_event_t event = {0};
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    xQueueSend(s_queue, &event, 0);
+    xQueueReceive(s_queue, &event, 0);
+  }
+}
+
+static const bench_case_t s_benches[] = {
+  {"gate_command_parse/numeric", NULL, bench_parse_numeric, 2000000,
+   sizeof(s_numeric_command) - 1},
+  {"gate_command_parse/keyed", NULL, bench_parse_keyed, 2000000,
+   sizeof(s_keyed_command) - 1},
+  {"gate_command_parse/corpus", NULL, bench_parse_corpus, 200000,
+   0 BENCH_CORPUS(BENCH_CORPUS_BYTES)},
+  {"mqtt5_api_dispatch/match", bench_dispatch_setup, bench_dispatch_match,
+   1000000, 0},
+  {"mqtt5_api_dispatch/unrouted", bench_dispatch_setup,
+   bench_dispatch_unrouted, 1000000, 0},
+  {"topic_format", NULL, bench_topic_format, 1000000, 0},
+  {"motor_event/round_trip", bench_motor_setup, bench_motor_round_trip, 20000,
+   0},
+  {"queue/round_trip", bench_queue_setup, bench_queue_round_trip, 1000000, 0},
+};
+
+static SemaphoreHandle_t s_done = NULL;
+
+static void bench_task(void *arg)
+{
+  bench_result_t *result = arg;
+  const bench_case_t *bench = result->bench;
+
+  if (bench->setup)
+    bench->setup();
+  bench->run(bench->iterations * BENCH_WARMUP_PCT / 100 + 1);
+
+  uint64_t allocs = atomic_load(&s_allocs);
+  int64_t start_ns = bench_now_ns();
+  bench->run(bench->iterations);
+  int64_t elapsed_ns = bench_now_ns() - start_ns;
+  allocs = atomic_load(&s_allocs) - allocs;
+
+  result->ns_per_op = (double)elapsed_ns / bench->iterations;
+  result->allocs_per_op = (double)allocs / bench->iterations;
+  result->stack_bytes =
+    (BENCH_STACK_DEPTH - uxTaskGetStackHighWaterMark(NULL)) *
+    sizeof(StackType_t);
+
+  xSemaphoreGive(s_done);
+  vTaskDelete(NULL);
+}
+
+static void bench_print(bench_format_t format, const bench_result_t *result,
+                        bool first)
+{
+  const bench_case_t *bench = result->bench;
+  double mb_per_s =
+    bench->bytes_per_op ? bench->bytes_per_op * 1000.0 / result->ns_per_op : 0;
+
+  switch (format)
+  {
+    case BENCH_FORMAT_JSON:
+      printf("%s{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f,"
+             "\"allocs_per_op\":%.3f,\"stack_bytes\":%lu,\"mb_per_s\":%.1f}",
+             first ? "" : ",\n", bench->name,
+             (unsigned long)bench->iterations, result->ns_per_op,
+             result->allocs_per_op, (unsigned long)result->stack_bytes,
+             mb_per_s);
+      break;
+
+    case BENCH_FORMAT_CSV:
+      printf("%s,%lu,%.1f,%.3f,%lu,%.1f\n", bench->name,
+             (unsigned long)bench->iterations, result->ns_per_op,
+             result->allocs_per_op, (unsigned long)result->stack_bytes,
+             mb_per_s);
+      break;
+
+    default:
+      printf("%-30s %10.1f %10.3f %10lu", bench->name, result->ns_per_op,
+             result->allocs_per_op, (unsigned long)result->stack_bytes);
+      if (bench->bytes_per_op)
+        printf(" %10.1f", mb_per_s);
+      printf("\n");
+      break;
+  }
+}
+
+void app_main(void)
+{
+  // Per-operation logs would be measured, and mixed with the output
+  esp_log_level_set("*", ESP_LOG_ERROR);
+
+  bench_format_t format = BENCH_FORMAT_TABLE;
+  const char *format_env = getenv("BENCH_FORMAT");
+  if (format_env && strcmp(format_env, "json") == 0)
+    format = BENCH_FORMAT_JSON;
+  else if (format_env && strcmp(format_env, "csv") == 0)
+    format = BENCH_FORMAT_CSV;
+  const char *filter = getenv("BENCH_FILTER");
+
+  // The dispatch path also counts messages on the metrics of mqtt5_api
+  mqtt5_api_start("localhost", NULL, NULL, 1883);
+  s_done = xSemaphoreCreateBinary();
+
+  switch (format)
+  {
+    case BENCH_FORMAT_JSON:
+      printf("{\"benchmarks\":[\n");
+      break;
+    case BENCH_FORMAT_CSV:
+      printf("name,iterations,ns_per_op,allocs_per_op,stack_bytes,mb_per_s\n");
+      break;
+    default:
+      printf("%-30s %10s %10s %10s %10s\n", "benchmark", "ns/op", "allocs/op",
+             "stack B", "MB/s");
+      break;
+  }
+
+  bool first = true;
+  for (size_t i = 0; i < sizeof(s_benches) / sizeof(s_benches[0]); i++)
+  {
+    if (filter && !strstr(s_benches[i].name, filter))
+      continue;
+
+    bench_result_t result = {.bench = &s_benches[i]};
+    // Below the motor task, so the round trip includes its wake-up
+    if (xTaskCreate(bench_task, "bench", BENCH_STACK_DEPTH, &result,
+                    tskIDLE_PRIORITY + 5, NULL) != pdPASS)
+    {
+      ESP_LOGE("BENCH", "No memory for %s", s_benches[i].name);
+      exit(1);
+    }
+    xSemaphoreTake(s_done, portMAX_DELAY);
+
+    bench_print(format, &result, first);
+    first = false;
+  }
+
+  if (format == BENCH_FORMAT_JSON)
+    printf("\n]}\n");
+  fflush(stdout);
+  exit(0);
+}
@@ -0,0 +1,293 @@
+/**
+ * @file gate_command_fuzz.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Fuzzing of `gate_command_parse`
+ *
+ * Every input is copied to a heap buffer of exactly its length, so ASan stops
+ * on any read past `len`. An accepted command must also hold the invariants of
+ * `gate_command_t`, parse the same way twice and survive a round trip through
+ * its canonical text; any violation aborts.
+ *
+ * Built with `GATE_FUZZ_LIBFUZZER` only `LLVMFuzzerTestOneInput` is defined.
+ * Otherwise `main` is a random driver: it mutates a corpus of valid commands
+ * with byte flips, insertions, deletions and tokens of the grammar.
+ *
+ *     gate_command_fuzz [-runs=N] [-seed=N] [file...]
+ *
+ * With files, each one is run once instead, e.g. to reproduce a crash.
+ *
+ * @version 0.1
+ * @date 2024-12-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gate_command.h"
+
+#define FUZZ_MAX_INPUT 256
+
+#define FUZZ_ASSERT(cond)                                               \
+  do                                                                    \
+  {                                                                     \
+    if (!(cond))                                                        \
+    {                                                                   \
+      fprintf(stderr, "%s:%d: invariant failed: %s\n", __FILE__,        \
+              __LINE__, #cond);                                         \
+      abort();                                                          \
+    }                                                                   \
+  } while (0)
+
+static const char *const s_verbs[] = {"open", "close", "stop"};
+
+static bool fuzz_command_equal(const gate_command_t *a,
+                               const gate_command_t *b)
+{
+  return a->action == b->action && a->options == b->options &&
+         a->pct == b->pct && a->after_s == b->after_s && a->id == b->id;
+}
+
+/**
+ * @brief Parse from a heap copy of exactly `len` bytes.
+ */
+static esp_err_t fuzz_parse(const char *data, size_t len, gate_command_t *cmd)
+{
+  char *copy = malloc(len ? len : 1);
+  FUZZ_ASSERT(copy != NULL);
+  memcpy(copy, data, len);
+  esp_err_t ret = gate_command_parse(copy, (int)len, cmd);
+  free(copy);
+  return ret;
+}
+
+static void fuzz_check_invariants(const gate_command_t *cmd)
+{
+  FUZZ_ASSERT(cmd->action < GATE_MQTT_INVALID_ACTION);
+  FUZZ_ASSERT((cmd->options & ~(GATE_COMMAND_OPT_PCT | GATE_COMMAND_OPT_AFTER |
+                                GATE_COMMAND_OPT_ID)) == 0);
+
+  FUZZ_ASSERT(cmd->pct <= 100);
+  if (cmd->options & GATE_COMMAND_OPT_PCT)
+    FUZZ_ASSERT(cmd->action == GATE_MQTT_OPEN);
+  else
+    FUZZ_ASSERT(cmd->pct == 100);
+
+  FUZZ_ASSERT(cmd->after_s <= GATE_COMMAND_MAX_AFTER_S);
+  if (!(cmd->options & GATE_COMMAND_OPT_AFTER))
+    FUZZ_ASSERT(cmd->after_s == 0);
+  if (!(cmd->options & GATE_COMMAND_OPT_ID))
+    FUZZ_ASSERT(cmd->id == 0);
+}
+
+/**
+ * @brief Write the canonical text of a command, every given option in order.
+ */
+static int fuzz_format(const gate_command_t *cmd, char *buf, size_t size)
+{
+  int len = snprintf(buf, size, "%s", s_verbs[cmd->action]);
+  char sep = ':';
+  if (cmd->options & GATE_COMMAND_OPT_PCT)
+  {
+    len += snprintf(buf + len, size - len, "%cpct=%u", sep, cmd->pct);
+    sep = ',';
+  }
+  if (cmd->options & GATE_COMMAND_OPT_AFTER)
+  {
+    len += snprintf(buf + len, size - len, "%cafter=%lus", sep,
+                    (unsigned long)cmd->after_s);
+    sep = ',';
+  }
+  if (cmd->options & GATE_COMMAND_OPT_ID)
+    len += snprintf(buf + len, size - len, "%cid=%lu", sep,
+                    (unsigned long)cmd->id);
+  return len;
+}
+
+static void fuzz_one(const uint8_t *data, size_t size)
+{
+  if (size > FUZZ_MAX_INPUT)
+    return;
+
+  gate_command_t cmd;
+  if (fuzz_parse((const char *)data, size, &cmd) != ESP_OK)
+    return;
+  fuzz_check_invariants(&cmd);
+
+  gate_command_t again;
+  FUZZ_ASSERT(fuzz_parse((const char *)data, size, &again) == ESP_OK);
+  FUZZ_ASSERT(fuzz_command_equal(&cmd, &again));
+
+  char text[96];
+  int len = fuzz_format(&cmd, text, sizeof(text));
+  FUZZ_ASSERT(len > 0 && len < (int)sizeof(text));
+  gate_command_t round_trip;
+  FUZZ_ASSERT(fuzz_parse(text, len, &round_trip) == ESP_OK);
+  FUZZ_ASSERT(fuzz_command_equal(&cmd, &round_trip));
+}
+
+#ifdef GATE_FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  fuzz_one(data, size);
+  return 0;
+}
+
+#else
+
+static const char *const s_seeds[] = {
+  "0",
+  "2",
+  "open",
+  " close \r\n",
+  "pedestrian",
+  "open:pct=50",
+  "close:after=30s",
+  "open:after=5m,pct=0",
+  "stop:id=42",
+  "pedestrian:id=7,after=1h",
+  "open:pct=100,after=86400,id=4294967295",
+};
+
+static const char *const s_tokens[] = {
+  "open", "close", "stop", "pedestrian", ":", ",", "=", "pct=", "after=",
+  "id=", "s", "m", "h", " ", "\t", "\r\n", "100", "101", "86400",
+  "4294967295", "4294967296", "0", "-1", "+1", "00",
+};
+
+#define FUZZ_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static uint64_t s_state;
+
+static uint32_t fuzz_rand(void)
+{
+  // xorshift64*
+  s_state ^= s_state >> 12;
+  s_state ^= s_state << 25;
+  s_state ^= s_state >> 27;
+  return (uint32_t)((s_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static size_t fuzz_insert(uint8_t *buf, size_t len, size_t at,
+                          const void *data, size_t data_len)
+{
+  if (len + data_len > FUZZ_MAX_INPUT)
+    return len;
+  memmove(buf + at + data_len, buf + at, len - at);
+  memcpy(buf + at, data, data_len);
+  return len + data_len;
+}
+
+/**
+ * @brief Apply one to four random mutations to `buf`.
+ */
+static size_t fuzz_mutate(uint8_t *buf, size_t len)
+{
+  uint32_t count = 1 + fuzz_rand() % 4;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    size_t at = len ? fuzz_rand() % (len + 1) : 0;
+    switch (fuzz_rand() % 6)
+    {
+      case 0:  // Flip a bit
+        if (len)
+          buf[at % len] ^= 1 << (fuzz_rand() % 8);
+        break;
+      case 1:  // Random byte
+        if (len)
+          buf[at % len] = (uint8_t)fuzz_rand();
+        break;
+      case 2:  // Insert a byte
+      {
+        uint8_t byte = (uint8_t)fuzz_rand();
+        len = fuzz_insert(buf, len, at, &byte, 1);
+        break;
+      }
+      case 3:  // Delete a run
+        if (len)
+        {
+          at %= len;
+          size_t run = 1 + fuzz_rand() % (len - at);
+          memmove(buf + at, buf + at + run, len - at - run);
+          len -= run;
+        }
+        break;
+      case 4:  // Insert a token of the grammar
+      {
+        const char *token = s_tokens[fuzz_rand() % FUZZ_COUNT(s_tokens)];
+        len = fuzz_insert(buf, len, at, token, strlen(token));
+        break;
+      }
+      default:  // Truncate
+        len = at;
+        break;
+    }
+  }
+  return len;
+}
+
+static int fuzz_file(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+  uint8_t buf[FUZZ_MAX_INPUT];
+  size_t len = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+  fuzz_one(buf, len);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long long runs = 1000000;
+  unsigned long long seed = 1;
+  int files = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], "-runs=", 6) == 0)
+      runs = strtoull(argv[i] + 6, NULL, 10);
+    else if (strncmp(argv[i], "-seed=", 6) == 0)
+      seed = strtoull(argv[i] + 6, NULL, 10);
+    else if (fuzz_file(argv[i]) == 0)
+      files++;
+    else
+      return 1;
+  }
+  if (files)
+  {
+    printf("Ran %d input(s)\n", files);
+    return 0;
+  }
+
+  s_state = seed ? seed : 1;
+  unsigned long long accepted = 0;
+  uint8_t buf[FUZZ_MAX_INPUT];
+  for (unsigned long long run = 0; run < runs; run++)
+  {
+    const char *seed_input = s_seeds[fuzz_rand() % FUZZ_COUNT(s_seeds)];
+    size_t len = strlen(seed_input);
+    memcpy(buf, seed_input, len);
+    len = fuzz_mutate(buf, len);
+
+    gate_command_t cmd;
+    if (fuzz_parse((const char *)buf, len, &cmd) == ESP_OK)
+      accepted++;
+    fuzz_one(buf, len);
+  }
+
+  printf("%llu runs, %llu accepted, seed %llu\n", runs, accepted, seed);
+  return 0;
+}
+
+#endif  // GATE_FUZZ_LIBFUZZER
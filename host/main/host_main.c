@@ -0,0 +1,350 @@
+/**
+ * @file host_main.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief Gate scenario on the Linux target
+ *
+ * Drives the gate through the simulated GPIO port and MQTT broker: a remote
+ * open, the open endline, a delayed remote close, the close endline and a
+ * button press. Every output write and publish is printed with its simulated
+ * time, and the metrics are rendered at the end.
+ *
+ * The writes and publishes are checked against the sequence the scenario
+ * expects: the LED patterns of the motor, and each answer, change of state and
+ * command stage. Payloads are only compared up to the fields that change
+ * between runs (timing, travel estimate). The program exits with 1 on any
+ * difference, so it runs as a test, e.g. in `tools/build_check.py`.
+ *
+ * With `GATE_HOST_SERVE` set in the environment, the gate keeps running after
+ * the scenario, serving the local control endpoint on `LOCAL_CTRL_DEFAULT_PORT`
+ * with `HOST_LOCAL_CTRL_KEY`, e.g. for `tools/local_ctrl.py`.
+ *
+ * With `GATE_HOST_NTP` set to `host[:port]`, the device clock syncs with that
+ * SNTP server, e.g. `tools/ntp_standin.py`, and the published events carry
+ * `time_ms`. The monotonic clock is the simulated one, so the drift is only
+ * measured on the chip.
+ *
+ * @version 0.1
+ * @date 2024-12-01
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device_clock.h"
+#include "gate.h"
+#include "gpio_sim.h"
+#include "local_ctrl.h"
+#include "metrics.h"
+#include "motor.h"
+#include "mqtt5_sim.h"
+#include "nvs_flash.h"
+
+#define OPEN_ENDLINE_SENSOR_PIN D23
+#define CLOSE_ENDLINE_SENSOR_PIN D22
+#define MOTOR_CONTROL_PIN D14
+
+#define LED_OPENED D27
+#define LED_CLOSED D26
+#define LED_STOPPED D25
+
+#define BIT(pin) (1ULL << (pin))
+
+/**
+ * @brief Time given to the motor task to handle each step.
+ */
+#define SETTLE_MS 50
+
+/**
+ * @brief Key of the local control endpoint, for the host only.
+ */
+#define HOST_LOCAL_CTRL_KEY "gate-host-local-ctrl-key"
+
+static const char *TAG = "HOST";
+
+/**
+ * @brief Output write expected from the scenario.
+ */
+typedef struct
+{
+  uint64_t set_mask;
+  uint64_t clear_mask;
+} host_write_t;
+
+/**
+ * @brief Publish expected from the scenario.
+ */
+typedef struct
+{
+  const char *topic;  ///< Topic under `BASE_MQTT_TOPIC`.
+  const char *data;   ///< Start of the payload.
+} host_publish_t;
+
+// LED patterns of the motor states, see `motor_init`
+#define LEDS_STOPPED {BIT(LED_STOPPED), BIT(LED_OPENED) | BIT(LED_CLOSED)}
+#define LEDS_OPENING {BIT(LED_OPENED), BIT(LED_CLOSED) | BIT(LED_STOPPED)}
+#define LEDS_CLOSING {BIT(LED_CLOSED), BIT(LED_OPENED) | BIT(LED_STOPPED)}
+
+static const host_write_t s_expected_writes[] = {
+  // Each LED set to its idle level on init
+  {0, BIT(LED_CLOSED)},
+  {0, BIT(LED_OPENED)},
+  {BIT(LED_STOPPED), 0},
+  LEDS_OPENING,  // Remote open
+  LEDS_STOPPED,  // Open endline
+  LEDS_CLOSING,  // Delayed close
+  LEDS_STOPPED,  // Close endline
+  LEDS_OPENING,  // Button
+  LEDS_STOPPED,  // Open endline
+};
+
+// The gate state is `gate_state_t`: 0 opened, 1 closed, 3 opening, 4 closing
+static const host_publish_t s_expected_publishes[] = {
+  // Remote open
+  {GATE_ACTION_TOPIC_STATUS, "id=7,stage=accepted,"},
+  {GATE_STATE_TOPIC_ANSWER, "3"},
+  {GATE_STATE_TOPIC_EVENT, "state=3,source=remote,"},
+  {GATE_ACTION_TOPIC_STATUS, "id=7,stage=in_motion,state=3,"},
+  // Open endline
+  {GATE_STATE_TOPIC_EVENT, "state=0,source=sensor,pct=100,"},
+  {GATE_ACTION_TOPIC_STATUS, "id=7,stage=completed,state=0,pct=100,"},
+  // Delayed close, scheduled then run without an id
+  {GATE_SCHEDULE_TOPIC_ANSWER, "id="},
+  {GATE_ACTION_TOPIC_STATUS, "id=0,stage=accepted,state=0,pct=100"},
+  {GATE_STATE_TOPIC_ANSWER, "4"},
+  {GATE_STATE_TOPIC_EVENT, "state=4,source=remote,"},
+  {GATE_ACTION_TOPIC_STATUS, "id=0,stage=in_motion,state=4,"},
+  // Close endline
+  {GATE_STATE_TOPIC_EVENT, "state=1,source=sensor,pct=0,"},
+  {GATE_ACTION_TOPIC_STATUS, "id=0,stage=completed,state=1,pct=0,"},
+  // Button, then the open endline, with no command to follow
+  {GATE_STATE_TOPIC_EVENT, "state=3,source=button,"},
+  {GATE_STATE_TOPIC_EVENT, "state=0,source=sensor,pct=100,"},
+};
+
+#define EXPECTED_WRITES \
+  (sizeof(s_expected_writes) / sizeof(s_expected_writes[0]))
+#define EXPECTED_PUBLISHES \
+  (sizeof(s_expected_publishes) / sizeof(s_expected_publishes[0]))
+
+// Writes and publishes seen so far, and how many differed from the scenario
+static size_t s_writes_seen = 0;
+static size_t s_publishes_seen = 0;
+static int s_mismatches = 0;
+// Set once the scenario is checked, what follows is not
+static bool s_checked = false;
+
+static void host_check_write(const gpio_sim_write_t *write)
+{
+  if (s_checked)
+    return;
+
+  size_t i = s_writes_seen++;
+  if (i < EXPECTED_WRITES &&
+      write->set_mask == s_expected_writes[i].set_mask &&
+      write->clear_mask == s_expected_writes[i].clear_mask)
+    return;
+
+  s_mismatches++;
+  if (i < EXPECTED_WRITES)
+    printf("!! write %zu: expected set=0x%010" PRIx64 " clear=0x%010" PRIx64
+           "\n",
+           i, s_expected_writes[i].set_mask, s_expected_writes[i].clear_mask);
+  else
+    printf("!! write %zu: not expected\n", i);
+}
+
+static void host_check_publish(const mqtt5_sim_message_t *msg)
+{
+  if (s_checked)
+    return;
+
+  size_t i = s_publishes_seen++;
+  if (i < EXPECTED_PUBLISHES)
+  {
+    const host_publish_t *expected = &s_expected_publishes[i];
+    char topic[MAX_MQTT_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC, expected->topic);
+    if (strcmp(msg->topic, topic) == 0 &&
+        strncmp(msg->data, expected->data, strlen(expected->data)) == 0)
+      return;
+
+    printf("!! publish %zu: expected %s = %s...\n", i, topic, expected->data);
+  }
+  else
+    printf("!! publish %zu: not expected\n", i);
+  s_mismatches++;
+}
+
+static void host_dump()
+{
+  gpio_sim_write_t writes[16];
+  size_t n;
+  while ((n = gpio_sim_take_writes(writes, 16)) > 0)
+    for (size_t i = 0; i < n; i++)
+    {
+      printf("%10" PRId64 " us  write set=0x%010" PRIx64 " clear=0x%010" PRIx64
+             "\n",
+             writes[i].time_us, writes[i].set_mask, writes[i].clear_mask);
+      host_check_write(&writes[i]);
+    }
+
+  mqtt5_sim_message_t msgs[4];
+  while ((n = mqtt5_sim_take_published(msgs, 4)) > 0)
+    for (size_t i = 0; i < n; i++)
+    {
+      printf("%10" PRId64 " us  publish %s = %s\n", gpio_sim_now_us(),
+             msgs[i].topic, msgs[i].data);
+      host_check_publish(&msgs[i]);
+    }
+}
+
+/**
+ * @brief Check that the scenario wrote and published all it was expected to,
+ * and nothing was lost.
+ *
+ * @return Number of differences.
+ */
+static int host_check()
+{
+  // The last events may still be on their way to the gate work task
+  vTaskDelay(pdMS_TO_TICKS(SETTLE_MS));
+  host_dump();
+  s_checked = true;
+
+  if (s_writes_seen < EXPECTED_WRITES)
+  {
+    printf("!! %zu writes missing\n", EXPECTED_WRITES - s_writes_seen);
+    s_mismatches++;
+  }
+  if (s_publishes_seen < EXPECTED_PUBLISHES)
+  {
+    printf("!! %zu publishes missing\n",
+           EXPECTED_PUBLISHES - s_publishes_seen);
+    s_mismatches++;
+  }
+  if (gpio_sim_dropped_writes() || mqtt5_sim_dropped_published())
+    s_mismatches++;
+
+  return s_mismatches;
+}
+
+static void host_action(const char *command)
+{
+  char topic[MAX_MQTT_TOPIC_LEN];
+  snprintf(topic, sizeof(topic), "%s/%s", BASE_MQTT_TOPIC, GATE_ACTION_TOPIC);
+
+  if (!mqtt5_sim_inject(topic, command, strlen(command)))
+    ESP_LOGE(TAG, "Nobody subscribed to %s", topic);
+  vTaskDelay(pdMS_TO_TICKS(SETTLE_MS));
+}
+
+// Endline sensors are active low, a hit is a falling edge
+static void host_endline(gpio_num_t pin, int64_t travel_us)
+{
+  gpio_sim_advance_us(travel_us);
+  gpio_sim_set_input(pin, 0);
+  vTaskDelay(pdMS_TO_TICKS(SETTLE_MS));
+  gpio_sim_set_input(pin, 1);
+}
+
+// Start the device clock on the server of `GATE_HOST_NTP`, if set
+static void host_start_clock()
+{
+  const char *ntp = getenv("GATE_HOST_NTP");
+  if (!ntp)
+    return;
+
+  static char server[64];
+  snprintf(server, sizeof(server), "%s", ntp);
+  device_clock_config_t config = {.server = server};
+  char *port = strchr(server, ':');
+  if (port)
+  {
+    *port = '\0';
+    config.port = atoi(port + 1);
+  }
+  ESP_ERROR_CHECK(device_clock_start(&config));
+
+  // The first exchange runs on the clock task
+  for (int i = 0; i < 50 && !device_clock_is_synced(); i++)
+    vTaskDelay(pdMS_TO_TICKS(100));
+}
+
+static esp_err_t host_write_metrics(void *ctx, const char *text, size_t len)
+{
+  fwrite(text, 1, len, stdout);
+  return ESP_OK;
+}
+
+void app_main(void)
+{
+  // Inputs idle high, as with the pull-ups on the board
+  gpio_sim_set_input(MOTOR_CONTROL_PIN, 1);
+  gpio_sim_set_input(OPEN_ENDLINE_SENSOR_PIN, 1);
+  gpio_sim_set_input(CLOSE_ENDLINE_SENSOR_PIN, 1);
+
+  ESP_ERROR_CHECK(nvs_flash_init());
+  host_start_clock();
+  mqtt5_api_start("localhost", NULL, NULL, 1883);
+
+  static motor_t motor;
+  static gate_t gate;
+  ESP_ERROR_CHECK(gate_init_impl(&gate, &motor));
+  host_dump();
+
+  printf("-- open\n");
+  host_action("open:id=7");
+  host_endline(OPEN_ENDLINE_SENSOR_PIN, 12000000);
+  host_dump();
+
+  // Delayed actions run on the scheduler, in real time
+  printf("-- close after 1 s\n");
+  host_action("close:after=1s");
+  vTaskDelay(pdMS_TO_TICKS(1500));
+  host_endline(CLOSE_ENDLINE_SENSOR_PIN, 11500000);
+  host_dump();
+
+  // The button is active low too, its change of state is published unasked
+  printf("-- button\n");
+  gpio_sim_set_input(MOTOR_CONTROL_PIN, 0);
+  vTaskDelay(pdMS_TO_TICKS(SETTLE_MS));
+  gpio_sim_set_input(MOTOR_CONTROL_PIN, 1);
+  host_endline(OPEN_ENDLINE_SENSOR_PIN, 12000000);
+  host_dump();
+
+  int mismatches = host_check();
+  printf("-- dropped writes %" PRIu32 ", dropped publishes %" PRIu32 "\n",
+         gpio_sim_dropped_writes(), mqtt5_sim_dropped_published());
+  printf("-- scenario %s, %d differences\n", mismatches ? "FAILED" : "passed",
+         mismatches);
+
+  printf("-- metrics\n");
+  metrics_render(&host_write_metrics, NULL);
+
+  if (getenv("GATE_HOST_SERVE"))
+  {
+    local_ctrl_config_t local_ctrl = {
+      .key = (const uint8_t *)HOST_LOCAL_CTRL_KEY,
+      .key_len = strlen(HOST_LOCAL_CTRL_KEY),
+    };
+    ESP_ERROR_CHECK(local_ctrl_start(&local_ctrl));
+
+    printf("-- serving local control on UDP %d\n", LOCAL_CTRL_DEFAULT_PORT);
+    while (1)
+    {
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      host_dump();
+    }
+  }
+  exit(mismatches ? 1 : 0);
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Build every project of the repository, failing on any warning of its code.
+
+The firmware and the ISR latency probe for the chip, the gate scenario and the
+benchmarks for the Linux target, then the fuzzer of the command parser. The
+gate scenario and the fuzzer are also run, as tests. ESP-IDF already makes most warnings errors; the ones it leaves as
+warnings (unused variables, deprecated calls...) are caught in the build logs.
+Warnings of ESP-IDF itself are not counted.
+
+Each project builds in its own directory under --build-dir, with the sdkconfig
+there too, so the tree and its build/ are left alone. Needs an ESP-IDF
+environment (`. $IDF_PATH/export.sh`, or the dev container).
+
+    tools/build_check.py [--only host] [--fuzz-runs 200000]
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Name, directory and target of each ESP-IDF project
+PROJECTS = (
+    ("firmware", ".", "esp32"),
+    ("isr_latency", "tools/isr_latency", "esp32"),
+    ("host", "host", "linux"),
+    ("bench", "host/bench", "linux"),
+)
+
+# Longest run of the gate scenario, which exits by itself in a few seconds
+SCENARIO_TIMEOUT_S = 120
+
+WARNING = re.compile(r"^(?P<path>[^:\s][^:]*):\d+(:\d+)?: warning: ")
+
+
+def own_warnings(log, build_dir):
+    """Warnings in files of the repository, outside the build directories."""
+    found = []
+    for line in log.splitlines():
+        match = WARNING.match(line)
+        if not match:
+            continue
+        path = os.path.realpath(os.path.join(build_dir, match.group("path")))
+        if (path.startswith(ROOT + os.sep) and
+                not path.startswith(os.path.dirname(build_dir) + os.sep)):
+            found.append(line)
+    return found
+
+
+def run(command, log_path, timeout=None):
+    """Run a command, its output appended to a log file.
+
+    Return its exit code, -1 if it timed out, and output.
+    """
+    with open(log_path, "a") as log:
+        start = log.tell()
+        try:
+            code = subprocess.run(command, cwd=ROOT, stdout=log,
+                                  stderr=subprocess.STDOUT,
+                                  timeout=timeout).returncode
+        except subprocess.TimeoutExpired:
+            log.write(f"\nTimed out after {timeout} s\n")
+            code = -1
+    with open(log_path, errors="replace") as log:
+        log.seek(start)
+        return code, log.read()
+
+
+def build_idf(name, directory, target, build_root):
+    build_dir = os.path.join(build_root, name)
+    project = os.path.join(ROOT, directory)
+    defaults = os.path.join(project, "sdkconfig.defaults")
+    if not os.path.exists(defaults):
+        defaults = os.path.join(project, "sdkconfig")
+
+    command = ["idf.py"]
+    if target == "linux":
+        command.append("--preview")
+    command += ["-C", project, "-B", build_dir,
+                f"-DIDF_TARGET={target}",
+                f"-DSDKCONFIG={os.path.join(build_dir, 'sdkconfig')}",
+                f"-DSDKCONFIG_DEFAULTS={defaults}", "build"]
+    os.makedirs(build_dir, exist_ok=True)
+    open(build_dir + ".log", "w").close()
+    return run(command, build_dir + ".log") + (build_dir,)
+
+
+def run_scenario(build_root):
+    """Run the gate scenario of the host build, which exits 1 when its writes
+    and publishes differ from the expected ones."""
+    build_dir = os.path.join(build_root, "host")
+    log_path = os.path.join(build_root, "scenario.log")
+    open(log_path, "w").close()
+    elf = os.path.join(build_dir, "gate_host.elf")
+    if not os.path.exists(elf):
+        with open(log_path, "a") as log:
+            log.write(f"{elf} not built\n")
+        return 1, "", os.path.join(build_root, "scenario")
+
+    code, output = run([elf], log_path, timeout=SCENARIO_TIMEOUT_S)
+    return code, output, os.path.join(build_root, "scenario")
+
+
+def build_fuzz(build_root, runs):
+    build_dir = os.path.join(build_root, "fuzz")
+    log_path = build_dir + ".log"
+    os.makedirs(build_root, exist_ok=True)
+    open(log_path, "w").close()
+
+    commands = (
+        ["cmake", "-S", os.path.join(ROOT, "host", "fuzz"), "-B", build_dir],
+        ["cmake", "--build", build_dir],
+        [os.path.join(build_dir, "gate_command_fuzz"), f"-runs={runs}"],
+    )
+    output = ""
+    for command in commands:
+        code, log = run(command, log_path)
+        output += log
+        if code != 0:
+            break
+    return code, output, build_dir
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--build-dir", default=os.path.join(ROOT,
+                                                             "build_check"),
+                        help="where the projects are built")
+    parser.add_argument("--only", action="append",
+                        help="build this project only, may be repeated")
+    parser.add_argument("--fuzz-runs", type=int, default=200000,
+                        help="inputs given to the fuzzer, 0 to skip it")
+    args = parser.parse_args()
+
+    if not os.environ.get("IDF_PATH"):
+        sys.exit("IDF_PATH is not set, export the ESP-IDF environment first")
+    build_root = os.path.abspath(args.build_dir)
+
+    jobs = [(name, build_idf, (name, directory, target, build_root))
+            for name, directory, target in PROJECTS]
+    # Right after the host build, which it runs
+    host = next(i for i, job in enumerate(jobs) if job[0] == "host")
+    jobs.insert(host + 1, ("scenario", run_scenario, (build_root,)))
+    if args.fuzz_runs:
+        jobs.append(("fuzz", build_fuzz, (build_root, args.fuzz_runs)))
+    if args.only:
+        jobs = [job for job in jobs if job[0] in args.only]
+
+    failed = 0
+    for name, build, build_args in jobs:
+        start = time.monotonic()
+        code, log, build_dir = build(*build_args)
+        warnings = own_warnings(log, build_dir)
+        ok = code == 0 and not warnings
+        failed += not ok
+        print(f"{name}: {'ok' if ok else 'FAILED'}"
+              f" (exit {code}, {len(warnings)} warnings,"
+              f" {time.monotonic() - start:.0f} s)")
+        for line in warnings:
+            print(f"  {line}")
+        if code != 0:
+            print(f"  see {build_dir}.log")
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+"""Broker failover of a gate, measured against two local Mosquitto brokers.
+
+Runs the brokers of docs/development/load_testing.md itself: the site-local
+one the gate prefers and its fallback. Each round waits for the gate on the
+local broker, then kills it (`stop`) or freezes it (`silent`), while state
+queries go to the gate through the fallback every --interval. It records:
+- outage_ms: from the kill to the first answer through the fallback;
+- failover_ms, detect_ms: `mqtt_failover_ms` and `mqtt_link_detect_ms` of
+  the gate's /metrics, its own view of the same;
+- failback_ms: from the local broker back to the gate on it again.
+
+Writes a JSON report with every round and their percentiles, like
+tools/load_test.py, to keep with the release measured.
+
+    tools/failover_test.py --gate 192.168.1.50 --rounds 10 --mode stop \\
+        --report failover-1.2.json
+"""
+
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+from load_test import DEFAULT_BASE, MqttClient, summarize
+
+REPORT_VERSION = 1
+MODES = ("stop", "silent")
+
+
+def read_metrics(gate, port):
+    """Unlabelled series of /metrics, name to value."""
+    url = f"http://{gate}:{port}/metrics"
+    with urllib.request.urlopen(url, timeout=5) as response:
+        text = response.read().decode(errors="replace")
+    metrics = {}
+    for line in text.splitlines():
+        name, _, value = line.partition(" ")
+        if line.startswith("#") or "{" in name or not value:
+            continue
+        try:
+            metrics[name] = float(value)
+        except ValueError:
+            pass
+    return metrics
+
+
+def wait_broker(gate, port, index, timeout):
+    """Wait for the gate on the broker `index`, return its metrics or None."""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            metrics = read_metrics(gate, port)
+            if metrics.get("mqtt_broker_index") == index:
+                return metrics
+        except OSError:
+            pass  # Busy reconnecting
+        time.sleep(0.2)
+    return None
+
+
+class Broker:
+    """A Mosquitto broker listening on every interface, run as a child."""
+
+    def __init__(self, mosquitto, port, directory):
+        self.command = [mosquitto, "-c", os.path.join(directory,
+                                                      f"{port}.conf")]
+        with open(self.command[2], "w") as conf:
+            conf.write(f"listener {port}\nallow_anonymous true\n")
+        self.process = None
+        self.start()
+
+    def start(self):
+        self.process = subprocess.Popen(self.command,
+                                        stdout=subprocess.DEVNULL,
+                                        stderr=subprocess.DEVNULL)
+        time.sleep(0.5)
+        if self.process.poll() is not None:
+            sys.exit(f"{' '.join(self.command)} exited at once")
+
+    def stop(self):
+        self.process.terminate()
+        self.process.wait()
+
+    def freeze(self):
+        self.process.send_signal(signal.SIGSTOP)
+
+    def thaw(self):
+        self.process.send_signal(signal.SIGCONT)
+
+
+class Prober:
+    """State queries to the gate through a broker, timing the answers."""
+
+    def __init__(self, port, base):
+        self.base = base
+        self.answered = None
+        self.client = MqttClient("localhost", port, f"failover-{os.getpid()}",
+                                 self.on_message)
+        self.client.subscribe(f"{base}/gate/state/answer")
+
+    def on_message(self, topic, payload, received):
+        if self.answered is None:
+            self.answered = time.monotonic()
+
+    def wait_answer(self, interval, timeout):
+        """Query until answered, return when it was or None."""
+        self.answered = None
+        deadline = time.monotonic() + timeout
+        while self.answered is None and time.monotonic() < deadline:
+            self.client.publish(f"{self.base}/gate/state", "")
+            time.sleep(interval)
+        return self.answered
+
+
+def run_round(args, local, prober):
+    if wait_broker(args.gate, args.metrics_port, 0, args.timeout) is None:
+        return {"error": "gate not on the local broker"}
+
+    killed = time.monotonic()
+    if args.mode == "stop":
+        local.stop()
+    else:
+        local.freeze()
+
+    answered = prober.wait_answer(args.interval, args.timeout)
+    metrics = wait_broker(args.gate, args.metrics_port, 1, args.timeout)
+
+    restored = time.monotonic()
+    if args.mode == "stop":
+        local.start()
+    else:
+        local.thaw()
+    back = wait_broker(args.gate, args.metrics_port, 0, args.timeout)
+    failback = time.monotonic()
+
+    result = {
+        "outage_ms": (answered - killed) * 1000 if answered else None,
+        "failback_ms": (failback - restored) * 1000 if back else None,
+    }
+    if metrics:
+        result["failover_ms"] = metrics.get("mqtt_failover_ms")
+        result["detect_ms"] = metrics.get("mqtt_link_detect_ms")
+    else:
+        result["error"] = "gate not on the fallback broker"
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--gate", required=True,
+                        help="address of the gate, for /metrics")
+    parser.add_argument("--metrics-port", type=int, default=80)
+    parser.add_argument("--local-port", type=int, default=1884,
+                        help="port of the preferred broker, MQTT5_LOCAL_PORT")
+    parser.add_argument("--fallback-port", type=int, default=1883,
+                        help="port of the fallback broker, of MQTT5_URL")
+    parser.add_argument("--mosquitto", default="mosquitto")
+    parser.add_argument("--base", default=DEFAULT_BASE,
+                        help="base topic of the gate")
+    parser.add_argument("--mode", choices=MODES, default="stop",
+                        help="kill the local broker, or freeze it")
+    parser.add_argument("--rounds", type=int, default=10)
+    parser.add_argument("--interval", type=float, default=0.1,
+                        help="seconds between state queries")
+    parser.add_argument("--timeout", type=float, default=120,
+                        help="seconds to wait for each step")
+    parser.add_argument("--label", default="",
+                        help="name of the run in the report, e.g. a release")
+    parser.add_argument("--report", help="write the JSON report there")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        fallback = Broker(args.mosquitto, args.fallback_port, directory)
+        local = Broker(args.mosquitto, args.local_port, directory)
+        prober = Prober(args.fallback_port, args.base)
+        rounds = []
+        try:
+            for i in range(args.rounds):
+                result = run_round(args, local, prober)
+                print(f"round {i + 1}: {result}")
+                rounds.append(result)
+        finally:
+            prober.client.close()
+            local.thaw()
+            local.stop()
+            fallback.stop()
+
+    report = {
+        "version": REPORT_VERSION,
+        "label": args.label,
+        "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "config": {"mode": args.mode, "rounds": args.rounds,
+                   "interval_s": args.interval},
+        "rounds": rounds,
+        "latency_ms": {
+            key: summarize([r[key] for r in rounds
+                            if r.get(key) is not None])
+            for key in ("outage_ms", "failover_ms", "detect_ms",
+                        "failback_ms")
+        },
+    }
+    for key, summary in report["latency_ms"].items():
+        print(f"{key}: {summary}")
+    if args.report:
+        with open(args.report, "w") as out:
+            json.dump(report, out, indent=2, sort_keys=True)
+            out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,139 @@
+/**
+ * @file isr_latency_main.c
+ * @author Pedro Luis Dionísio Fraga (pedrodfraga@hotmail.com)
+ *
+ * @brief ISR entry latency of the GPIO dispatcher, idle and while flash is
+ * written
+ *
+ * Needs a jumper between `PROBE_OUTPUT_PIN` and `PROBE_INPUT_PIN`. The probe
+ * runs twice with `gpio_isr_latency_probe`: first with nothing else running,
+ * then while a task commits NVS writes in a loop, which disables the flash
+ * cache for each page write. The dispatcher is in IRAM, so both runs should
+ * stay within a few microseconds.
+ *
+ * Each run prints a CSV line, after a header:
+ * `phase,samples,missed,min_ns,avg_ns,max_ns,commits`.
+ *
+ * @version 0.1
+ * @date 2024-12-15
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <esp_log.h>
+#include <esp_rom_sys.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gpio_drivers.h"
+
+#define PROBE_OUTPUT_PIN D25
+#define PROBE_INPUT_PIN D26
+
+/**
+ * @brief Edges measured by each run.
+ */
+#define PROBE_SAMPLES 2000
+
+/**
+ * @brief Size of each NVS write, a few flash pages worth of entries.
+ */
+#define WRITER_BLOB_LEN 1024
+
+static const char *TAG = "ISR LATENCY";
+
+static gpio_t s_output = {
+  .pin = PROBE_OUTPUT_PIN,
+  ._mode = GPIO_MODE_OUTPUT,
+  ._act_state = GPIO_STATE_HIGH,
+};
+static gpio_t s_input = {
+  .pin = PROBE_INPUT_PIN,
+  ._mode = GPIO_MODE_INPUT,
+  ._intr_type = GPIO_INTR_NEGEDGE,
+  ._pull = GPIO_PULLUP_ONLY,
+  .isr_priority = 1,
+};
+
+static atomic_bool s_writing = false;
+static atomic_uint_least32_t s_commits = 0;
+
+/**
+ * @brief Commit NVS writes in a loop while `s_writing` is set.
+ *
+ * Runs on the other core: each page write parks the probe core in IRAM with
+ * the cache disabled, when only IRAM interrupts can be serviced.
+ */
+static void isr_latency_writer(void *arg)
+{
+  nvs_handle_t nvs;
+  ESP_ERROR_CHECK(nvs_open("isr_latency", NVS_READWRITE, &nvs));
+
+  static uint8_t blob[WRITER_BLOB_LEN];
+  uint32_t round = 0;
+  while (1)
+  {
+    if (!atomic_load(&s_writing))
+    {
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+
+    memset(blob, (uint8_t)round++, sizeof(blob));
+    if (nvs_set_blob(nvs, "blob", blob, sizeof(blob)) == ESP_OK &&
+        nvs_commit(nvs) == ESP_OK)
+      atomic_fetch_add(&s_commits, 1);
+  }
+}
+
+static void isr_latency_run(const char *phase)
+{
+  atomic_store(&s_commits, 0);
+
+  gpio_isr_latency_t result;
+  ESP_ERROR_CHECK(gpio_isr_latency_probe(&s_output, &s_input, PROBE_SAMPLES,
+                                         &result));
+
+  uint32_t per_us = esp_rom_get_cpu_ticks_per_us();
+  printf("%s,%lu,%lu,%lu,%lu,%lu,%lu\n", phase,
+         (unsigned long)result.samples, (unsigned long)result.missed,
+         (unsigned long)(result.min_cycles * 1000 / per_us),
+         (unsigned long)(result.avg_cycles * 1000 / per_us),
+         (unsigned long)(result.max_cycles * 1000 / per_us),
+         (unsigned long)atomic_load(&s_commits));
+}
+
+void app_main(void)
+{
+  esp_err_t ret = nvs_flash_init();
+  if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
+      ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+  {
+    ESP_ERROR_CHECK(nvs_flash_erase());
+    ret = nvs_flash_init();
+  }
+  ESP_ERROR_CHECK(ret);
+
+  gpio_init_impl(&s_output);
+  gpio_init_impl(&s_input);
+
+  xTaskCreatePinnedToCore(isr_latency_writer, "isr_latency_writer", 3072,
+                          NULL, tskIDLE_PRIORITY + 1, NULL,
+                          (portNUM_PROCESSORS > 1) ? !xPortGetCoreID() : 0);
+
+  ESP_LOGI(TAG, "Probing %d edges, %d -> %d", PROBE_SAMPLES, PROBE_OUTPUT_PIN,
+           PROBE_INPUT_PIN);
+  printf("phase,samples,missed,min_ns,avg_ns,max_ns,commits\n");
+
+  isr_latency_run("idle");
+
+  atomic_store(&s_writing, true);
+  isr_latency_run("flash_write");
+  atomic_store(&s_writing, false);
+}
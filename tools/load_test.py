@@ -0,0 +1,398 @@
+#!/usr/bin/env python3
+"""Load and latency harness of a gate, through an MQTT broker.
+
+Sends state queries at a steady rate, then bursts of actions with an `id`, and
+matches what the gate publishes back:
+- the n-th answer on gate/state/answer to the n-th query;
+- each stage on gate/action/status to its action, by `id`.
+
+Writes a report with the latency percentiles of each, the answers lost and the
+counters of gate/stats, in a stable JSON format to compare across releases.
+Needs nothing but the standard library, it speaks MQTT 3.1.1 itself.
+
+    tools/load_test.py --host localhost --rate 20 --count 1000 \\
+        --bursts 5 --burst 10 --report release-1.2.json
+"""
+
+import argparse
+import json
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+DEFAULT_BASE = "Inatel/C115/2024/Semester/02"
+REPORT_VERSION = 1
+STAGES = ("accepted", "in_motion", "completed", "failed", "timeout")
+FINAL_STAGES = ("completed", "failed", "timeout")
+PERCENTILES = (50, 90, 99)
+
+CONNECT = 0x10
+CONNACK = 0x20
+PUBLISH = 0x30
+PUBACK = 0x40
+SUBSCRIBE = 0x82
+SUBACK = 0x90
+PINGREQ = 0xC0
+PINGRESP = 0xD0
+KEEPALIVE_S = 30
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        out.append(byte | (0x80 if length else 0))
+        if not length:
+            return bytes(out)
+
+
+def encode_string(text):
+    data = text.encode()
+    return struct.pack(">H", len(data)) + data
+
+
+class MqttClient:
+    """Just enough of MQTT 3.1.1: QoS 0/1 publish, subscribe, keepalive."""
+
+    def __init__(self, host, port, client_id, on_message):
+        self.sock = socket.create_connection((host, port), timeout=10)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.on_message = on_message
+        self.send_lock = threading.Lock()
+        self.packet_id = 0
+        self.acked = threading.Condition()
+        self.unacked = set()
+        self.closed = False
+
+        # Clean session, no will, no credentials
+        variable = encode_string("MQTT") + struct.pack(">BBH", 4, 0x02,
+                                                       KEEPALIVE_S)
+        self.send(CONNECT, variable + encode_string(client_id))
+        kind, body = self.read_packet()
+        if kind != CONNACK or body[1] != 0:
+            raise ConnectionError(f"broker refused the connection: {body!r}")
+        self.sock.settimeout(None)
+
+        threading.Thread(target=self.read_loop, daemon=True).start()
+        threading.Thread(target=self.ping_loop, daemon=True).start()
+
+    def send(self, header, body):
+        with self.send_lock:
+            self.sock.sendall(bytes([header]) + encode_length(len(body)) +
+                              body)
+
+    def read_exact(self, length):
+        data = bytearray()
+        while len(data) < length:
+            chunk = self.sock.recv(length - len(data))
+            if not chunk:
+                raise ConnectionError("broker closed the connection")
+            data += chunk
+        return bytes(data)
+
+    def read_packet(self):
+        header = self.read_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self.read_exact(1)[0]
+            length |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        return header, self.read_exact(length)
+
+    def read_loop(self):
+        try:
+            while True:
+                header, body = self.read_packet()
+                received = time.perf_counter()
+                kind = header & 0xF0
+                if kind == PUBLISH:
+                    qos = (header >> 1) & 0x03
+                    topic_len = struct.unpack_from(">H", body)[0]
+                    topic = body[2:2 + topic_len].decode()
+                    offset = 2 + topic_len
+                    if qos:
+                        packet_id = body[offset:offset + 2]
+                        offset += 2
+                        self.send(PUBACK, packet_id)
+                    payload = body[offset:].decode(errors="replace")
+                    self.on_message(topic, payload, received)
+                elif kind == PUBACK:
+                    with self.acked:
+                        self.unacked.discard(struct.unpack(">H", body)[0])
+                        self.acked.notify_all()
+        except (ConnectionError, OSError):
+            if not self.closed:
+                print("lost the connection to the broker", file=sys.stderr)
+
+    def ping_loop(self):
+        while not self.closed:
+            time.sleep(KEEPALIVE_S / 2)
+            try:
+                self.send(PINGREQ, b"")
+            except OSError:
+                return
+
+    def next_packet_id(self):
+        self.packet_id = self.packet_id % 0xFFFF + 1
+        return self.packet_id
+
+    def subscribe(self, topic):
+        self.send(SUBSCRIBE, struct.pack(">H", self.next_packet_id()) +
+                  encode_string(topic) + b"\x01")
+
+    def publish(self, topic, payload, qos=0):
+        body = encode_string(topic)
+        if qos:
+            packet_id = self.next_packet_id()
+            with self.acked:
+                self.unacked.add(packet_id)
+            body += struct.pack(">H", packet_id)
+        self.send(PUBLISH | (qos << 1), body + payload.encode())
+
+    def wait_acked(self, timeout):
+        deadline = time.monotonic() + timeout
+        with self.acked:
+            while self.unacked and time.monotonic() < deadline:
+                self.acked.wait(deadline - time.monotonic())
+        return not self.unacked
+
+    def close(self):
+        self.closed = True
+        try:
+            self.send(0xE0, b"")  # DISCONNECT
+            self.sock.close()
+        except OSError:
+            pass
+
+
+def parse_fields(payload):
+    """`key=value,...` to a dict, as the gate formats its answers."""
+    fields = {}
+    for item in payload.split(","):
+        key, sep, value = item.partition("=")
+        if sep:
+            fields[key.strip()] = value.strip()
+    return fields
+
+
+def summarize(samples_ms):
+    """Percentiles by nearest rank, in ms, None when there are no samples."""
+    if not samples_ms:
+        return None
+    ordered = sorted(samples_ms)
+    summary = {"count": len(ordered)}
+    for pct in PERCENTILES:
+        rank = max(0, min(len(ordered) - 1,
+                          -(-pct * len(ordered) // 100) - 1))
+        summary[f"p{pct}"] = round(ordered[rank], 3)
+    summary["max"] = round(ordered[-1], 3)
+    summary["mean"] = round(sum(ordered) / len(ordered), 3)
+    return summary
+
+
+class Collector:
+    """Everything the gate publishes, timestamped on arrival."""
+
+    def __init__(self, base):
+        self.base = base
+        self.lock = threading.Lock()
+        self.state_answers = []
+        # Actions publish the state too, only the query phase is counted
+        self.state_open = True
+        self.status = {}  # id -> {stage: time}
+        self.stats = None
+        self.stats_event = threading.Event()
+
+    def on_message(self, topic, payload, received):
+        with self.lock:
+            if topic == f"{self.base}/gate/state/answer":
+                if self.state_open:
+                    self.state_answers.append(received)
+            elif topic == f"{self.base}/gate/action/status":
+                fields = parse_fields(payload)
+                stages = self.status.setdefault(fields.get("id"), {})
+                stages.setdefault(fields.get("stage"), received)
+            elif topic == f"{self.base}/gate/stats/answer":
+                self.stats = {key: int(value) for key, value in
+                              parse_fields(payload).items()
+                              if value.isdigit()}
+                self.stats_event.set()
+
+
+def drive_state(client, base, rate, count):
+    """Send the state queries on a fixed schedule, return their send times."""
+    sent = []
+    start = time.perf_counter()
+    for i in range(count):
+        delay = start + i / rate - time.perf_counter()
+        if delay > 0:
+            time.sleep(delay)
+        sent.append(time.perf_counter())
+        client.publish(f"{base}/gate/state", "")
+    return sent
+
+
+def drive_actions(client, base, pattern, bursts, burst, gap_s, qos):
+    """Send bursts of actions back to back, return {id: send time}."""
+    sent = {}
+    next_id = random.randint(1, 1 << 30)
+    for b in range(bursts):
+        for i in range(burst):
+            verb = pattern[(b * burst + i) % len(pattern)]
+            sent[str(next_id)] = time.perf_counter()
+            client.publish(f"{base}/gate/action", f"{verb}:id={next_id}", qos)
+            next_id += 1
+        if b < bursts - 1:
+            time.sleep(gap_s)
+    return sent
+
+
+def report_state(sent, answers):
+    # Answered in order, so the n-th answer is the n-th query
+    latencies = [(answers[i] - sent[i]) * 1000
+                 for i in range(min(len(sent), len(answers)))]
+    return {
+        "sent": len(sent),
+        "answered": len(answers),
+        "lost": max(0, len(sent) - len(answers)),
+        # After a loss, answers are paired with later queries than their own
+        "latency_exact": len(answers) >= len(sent),
+        "latency_ms": summarize(latencies),
+    }
+
+
+def report_actions(sent, status):
+    stages = {stage: [] for stage in STAGES}
+    outcomes = {stage: 0 for stage in FINAL_STAGES}
+    accepted = 0
+    for command_id, sent_at in sent.items():
+        seen = status.get(command_id, {})
+        if "accepted" in seen:
+            accepted += 1
+        for stage, at in seen.items():
+            if stage in stages:
+                stages[stage].append((at - sent_at) * 1000)
+            if stage in outcomes:
+                outcomes[stage] += 1
+    return {
+        "sent": len(sent),
+        "accepted": accepted,
+        # Throttled by the admission control, or lost on the way
+        "unanswered": len(sent) - accepted,
+        "outcomes": outcomes,
+        "latency_ms": {stage: summarize(samples)
+                       for stage, samples in stages.items()},
+    }
+
+
+def print_summary(report):
+    def line(name, summary):
+        if not summary:
+            return f"  {name:<11} no samples"
+        return (f"  {name:<11} n={summary['count']:<6} "
+                f"p50={summary['p50']:.1f} p90={summary['p90']:.1f} "
+                f"p99={summary['p99']:.1f} max={summary['max']:.1f} ms")
+
+    state = report["state"]
+    print(f"state: {state['answered']}/{state['sent']} answered, "
+          f"{state['lost']} lost")
+    print(line("answer", state["latency_ms"]))
+    actions = report["actions"]
+    print(f"actions: {actions['accepted']}/{actions['sent']} accepted, "
+          f"{actions['unanswered']} unanswered, "
+          f"outcomes {actions['outcomes']}")
+    for stage, summary in actions["latency_ms"].items():
+        print(line(stage, summary))
+    print(f"gate: {report['gate_stats']}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--base", default=DEFAULT_BASE,
+                        help="base topic of the gate")
+    parser.add_argument("--rate", type=float, default=20,
+                        help="state queries per second")
+    parser.add_argument("--count", type=int, default=1000,
+                        help="state queries to send")
+    parser.add_argument("--bursts", type=int, default=5,
+                        help="bursts of actions, after the state queries")
+    parser.add_argument("--burst", type=int, default=10,
+                        help="actions per burst, sent back to back")
+    parser.add_argument("--gap", type=float, default=5.0,
+                        help="seconds between bursts")
+    parser.add_argument("--pattern", default="open,close",
+                        help="actions of the bursts, in turn")
+    parser.add_argument("--qos", type=int, choices=(0, 1), default=1,
+                        help="QoS of the actions")
+    parser.add_argument("--wait", type=float, default=10.0,
+                        help="seconds to collect the answers after sending")
+    parser.add_argument("--label", default="",
+                        help="name of the run in the report, e.g. a release")
+    parser.add_argument("--report", help="write the JSON report there")
+    args = parser.parse_args()
+
+    collector = Collector(args.base)
+    client = MqttClient(args.host, args.port,
+                        f"load-test-{random.getrandbits(32):08x}",
+                        collector.on_message)
+    for topic in ("gate/state/answer", "gate/action/status",
+                  "gate/stats/answer"):
+        client.subscribe(f"{args.base}/{topic}")
+    time.sleep(0.5)
+
+    state_sent = drive_state(client, args.base, args.rate, args.count)
+    deadline = time.monotonic() + args.wait
+    while (len(collector.state_answers) < len(state_sent) and
+           time.monotonic() < deadline):
+        time.sleep(0.05)
+    with collector.lock:
+        collector.state_open = False
+
+    action_sent = drive_actions(client, args.base, args.pattern.split(","),
+                                args.bursts, args.burst, args.gap, args.qos)
+    if not client.wait_acked(args.wait):
+        print("some actions were not acknowledged by the broker",
+              file=sys.stderr)
+    time.sleep(args.wait)
+
+    client.publish(f"{args.base}/gate/stats", "")
+    if not collector.stats_event.wait(5):
+        print("no answer on gate/stats", file=sys.stderr)
+    client.close()
+
+    with collector.lock:
+        report = {
+            "version": REPORT_VERSION,
+            "label": args.label,
+            "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+            "config": {
+                "rate": args.rate,
+                "count": args.count,
+                "bursts": args.bursts,
+                "burst": args.burst,
+                "gap_s": args.gap,
+                "pattern": args.pattern,
+                "qos": args.qos,
+            },
+            "state": report_state(state_sent, collector.state_answers),
+            "actions": report_actions(action_sent, collector.status),
+            "gate_stats": collector.stats,
+        }
+
+    print_summary(report)
+    if args.report:
+        with open(args.report, "w") as out:
+            json.dump(report, out, indent=2, sort_keys=True)
+            out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
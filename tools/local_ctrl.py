@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Client of the local control endpoint of the gate.
+
+Sends a signed request and prints the messages that come back, with the round
+trip of each. See components/local_ctrl/README.md for the packet format.
+
+    tools/local_ctrl.py --host 192.168.1.50 --key "$KEY" \
+        Inatel/C115/2024/Semester/02/gate/action open
+"""
+
+import argparse
+import hashlib
+import hmac
+import os
+import random
+import socket
+import statistics
+import struct
+import sys
+import time
+
+MAGIC = b"GC"
+VERSION = 1
+REQUEST = 1
+MESSAGE = 2
+HEADER = struct.Struct(">2sBBIQB")
+TAG_LEN = 16
+
+
+def sign(key, packet):
+    return packet + hmac.new(key, packet, hashlib.sha256).digest()[:TAG_LEN]
+
+
+def request(key, client_id, seq, topic, payload):
+    topic = topic.encode()
+    header = HEADER.pack(MAGIC, VERSION, REQUEST, client_id, seq, len(topic))
+    return sign(key, header + topic + payload.encode())
+
+
+def parse(key, packet):
+    """Return (topic, payload) of a valid message, None otherwise."""
+    if len(packet) < HEADER.size + TAG_LEN:
+        return None
+    body, tag = packet[:-TAG_LEN], packet[-TAG_LEN:]
+    if not hmac.compare_digest(sign(key, body)[-TAG_LEN:], tag):
+        return None
+    magic, version, kind, _, _, topic_len = HEADER.unpack_from(body)
+    if magic != MAGIC or version != VERSION or kind != MESSAGE:
+        return None
+    rest = body[HEADER.size:]
+    return rest[:topic_len].decode(), rest[topic_len:].decode()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("topic", help="full topic of the request")
+    parser.add_argument("payload", nargs="?", default="")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=4210)
+    parser.add_argument("--key", default=os.environ.get("LOCAL_CTRL_KEY"),
+                        help="pre-shared key, $LOCAL_CTRL_KEY by default")
+    parser.add_argument("--count", type=int, default=1,
+                        help="requests to send, one at a time")
+    parser.add_argument("--wait", type=float, default=1.0,
+                        help="seconds to collect the messages of a request")
+    args = parser.parse_args()
+    if not args.key:
+        parser.error("no key, pass --key or set LOCAL_CTRL_KEY")
+
+    key = args.key.encode()
+    client_id = random.getrandbits(32)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    first_rtts = []
+
+    for _ in range(args.count):
+        # Wall clock in ms, at least one more than the last request
+        seq = time.time_ns() // 1000000
+        sent = time.perf_counter()
+        sock.sendto(request(key, client_id, seq, args.topic, args.payload),
+                    (args.host, args.port))
+
+        first = None
+        deadline = sent + args.wait
+        while (left := deadline - time.perf_counter()) > 0:
+            sock.settimeout(left)
+            try:
+                packet, _ = sock.recvfrom(2048)
+            except socket.timeout:
+                break
+            message = parse(key, packet)
+            if message is None:
+                print("dropped an invalid packet", file=sys.stderr)
+                continue
+            rtt_ms = (time.perf_counter() - sent) * 1000
+            first = rtt_ms if first is None else first
+            print(f"{rtt_ms:8.2f} ms  {message[0]} = {message[1]}")
+        if first is not None:
+            first_rtts.append(first)
+        time.sleep(0.002)
+
+    if args.count > 1 and first_rtts:
+        first_rtts.sort()
+        p99 = first_rtts[min(len(first_rtts) - 1, int(len(first_rtts) * 0.99))]
+        print(f"answered {len(first_rtts)}/{args.count}, first message "
+              f"median {statistics.median(first_rtts):.2f} ms, "
+              f"p99 {p99:.2f} ms, max {first_rtts[-1]:.2f} ms")
+
+
+if __name__ == "__main__":
+    main()
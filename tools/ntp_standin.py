@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Stand-in SNTP server for the device clock.
+
+Answers SNTP requests with the time of this machine, shifted by a fixed offset
+and running fast or slow by a drift, so the offset and drift reported by the
+gate (clock_offset_us, clock_drift_ppb) can be checked against known values.
+
+    tools/ntp_standin.py --port 1123 --offset-ms 250 --drift-ppm 40
+    GATE_HOST_NTP=127.0.0.1:1123 build/gate_host.elf
+"""
+
+import argparse
+import socket
+import struct
+import time
+
+NTP_UNIX_OFFSET_S = 2208988800
+PACKET = struct.Struct(">BBbb4s4s4s8s8s8s8s")
+MODE_CLIENT = 3
+MODE_SERVER = 4
+VERSION = 4
+
+
+def ntp_timestamp(unix_s):
+    seconds = int(unix_s)
+    fraction = int((unix_s - seconds) * (1 << 32))
+    return struct.pack(">II", seconds + NTP_UNIX_OFFSET_S, fraction)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=1123)
+    parser.add_argument("--offset-ms", type=float, default=0.0,
+                        help="shift of the time served")
+    parser.add_argument("--drift-ppm", type=float, default=0.0,
+                        help="rate of the time served against this machine")
+    args = parser.parse_args()
+
+    start = time.time()
+
+    def now():
+        t = time.time()
+        return t + args.offset_ms / 1000 + (t - start) * args.drift_ppm / 1e6
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.host, args.port))
+    print(f"serving on {args.host}:{args.port}, offset {args.offset_ms} ms, "
+          f"drift {args.drift_ppm} ppm")
+
+    while True:
+        packet, client = sock.recvfrom(512)
+        received = now()
+        if len(packet) < PACKET.size or packet[0] & 0x07 != MODE_CLIENT:
+            continue
+        origin = packet[40:48]
+        reply = PACKET.pack((VERSION << 3) | MODE_SERVER, 1, 6, -20,
+                            b"\0" * 4, b"\0" * 4, b"LOCL",
+                            ntp_timestamp(received), origin,
+                            ntp_timestamp(received), ntp_timestamp(now()))
+        sock.sendto(reply, client)
+        print(f"{client[0]}:{client[1]} served {received:.6f}")
+
+
+if __name__ == "__main__":
+    main()